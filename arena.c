@@ -0,0 +1,86 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "untestable.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_CHUNK (64 * 1024)
+
+struct ArenaChunk {
+        ArenaChunk *prev;
+        size_t size;
+        _Alignas(ARENA_ALIGN) unsigned char mem[];
+};
+
+static size_t round_up(size_t n)
+{
+        return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static ArenaChunk *arena_grow(Arena *arena, size_t n)
+{
+        ArenaChunk *last = arena->chunk;
+        size_t size = last ? 2 * last->size : ARENA_MIN_CHUNK;
+        if (size < n)
+                size = n;
+
+        if (arena->limit) {
+                size_t room = arena->bytes + sizeof(ArenaChunk) < arena->limit
+                                  ? arena->limit - arena->bytes -
+                                        sizeof(ArenaChunk)
+                                  : 0;
+                if (room < n)
+                        return NULL;
+                if (size > room)
+                        size = room;
+        }
+
+        size_t total = sizeof(ArenaChunk) + size;
+
+        ArenaChunk *chunk = realloc_or_die(HERE, NULL, total);
+        *chunk = (ArenaChunk){.prev = last, .size = size};
+        arena->chunk = chunk;
+        arena->used = 0;
+        arena->bytes += total;
+        return chunk;
+}
+
+void *arena_alloc(Arena *arena, size_t n)
+{
+        n = round_up(n);
+        ArenaChunk *chunk = arena->chunk;
+        if (!chunk || chunk->size - arena->used < n) {
+                if (!(chunk = arena_grow(arena, n)))
+                        return NULL;
+        }
+
+        void *ptr = chunk->mem + arena->used;
+        arena->used += n;
+        return ptr;
+}
+
+void arena_reset(Arena *arena)
+{
+        ArenaChunk *chunk = arena->chunk;
+        if (!chunk)
+                return;
+
+        ArenaChunk *c, *pc = chunk->prev;
+        while ((c = pc)) {
+                pc = c->prev;
+                free(c);
+        }
+        chunk->prev = NULL;
+        arena->used = 0;
+        arena->bytes = sizeof(ArenaChunk) + chunk->size;
+}
+
+void arena_free(Arena *arena)
+{
+        arena_reset(arena);
+        free(arena->chunk);
+        *arena = (Arena){.limit = arena->limit};
+}
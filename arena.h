@@ -0,0 +1,31 @@
+#ifndef ARENA_2026_10_16_H
+#define ARENA_2026_10_16_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Arena is a bump allocator.  Memory is handed out from a list of chunks that
+// grow geometrically, and is only given back all at once by arena_reset() or
+// arena_free().  A zero-initialised Arena is empty and ready to use.
+typedef struct ArenaChunk ArenaChunk;
+typedef struct {
+        ArenaChunk *chunk;
+        size_t used;  // bytes handed out from the current chunk.
+        size_t bytes; // bytes held in all chunks.
+        size_t limit; // if nonzero, never hold more than this many bytes.
+} Arena;
+
+// Returns `n` bytes of memory, aligned for any of our node types, which stays
+// valid until the next arena_reset() or arena_free().  Returns NULL if the
+// allocation would take `arena` beyond its limit.  malloc() failure results in
+// abort().
+extern void *arena_alloc(Arena *arena, size_t n);
+
+// Forget everything allocated so far, but keep the newest (biggest) chunk for
+// re-use.
+extern void arena_reset(Arena *arena);
+
+// Release all memory held by the arena, leaving it empty.
+extern void arena_free(Arena *arena);
+
+#endif // ARENA_2026_10_16_H
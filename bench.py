@@ -0,0 +1,501 @@
+#!/usr/bin/env python3
+"""Benchmarks for the lambda program.
+
+    ./bench.py net [--lambda=b/lambda] [--max-threads=N] [--repeat=K]
+    ./bench.py normalize [--lambda=b/lambda] [--repeat=K]
+    ./bench.py deep [--lambda=b/lambda] [--repeat=K]
+    ./bench.py output [--lambda=b/lambda] [--max-threads=N] [--repeat=K]
+    ./bench.py parse [--lambda=b/lambda] [--max-threads=N] [--repeat=K]
+    ./bench.py type [--lambda=b/lambda] [--max-threads=N] [--repeat=K]
+    ./bench.py batch [--lambda=b/lambda] [--repeat=K]
+    ./bench.py corpus [--lambda=b/lambda] [--max-threads=N] [--repeat=K]
+    ./bench.py serve [--lambda=b/lambda] [--max-threads=N] [--requests=N]
+
+Each benchmark runs a small corpus of generated programs and prints the best
+of K wall-clock times for each.  Build with optimization first, e.g.
+
+    make B=b-opt COVERAGE=no OPTFLAGS='-O2 -DNDEBUG'
+    ./bench.py net --lambda=b-opt/lambda
+"""
+
+import argparse
+import os
+import random
+import resource
+import selectors
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+# Plenty for every program in the corpora.
+BUDGET = ['--max-steps=4000000000', '--max-bytes=4000000000']
+
+
+def church(n):
+    return '[f][x]' + '(f ' * n + 'x' + ')' * n
+
+
+MULT = '[m][n][f](m (n f))'
+EXP = '[m][n](n m)'
+
+
+def tree(leaves):
+    """A balanced tree of calls to the free variable t, so that the leaves can
+    all be reduced independently."""
+    while len(leaves) > 1:
+        leaves = ['(t %s %s)' % pair for pair in zip(leaves[::2], leaves[1::2])]
+    return leaves[0]
+
+
+def net_corpus():
+    """Programs with plenty of independent redexes for the net's workers.
+    Church numerals collapse under optimal reduction when they are applied to
+    closed functions, so they are applied to free variables here, and the
+    normal forms are kept shallow enough for the printer."""
+    product = '(%s %s %s f x)' % (MULT, church(40), church(40))
+    power = '(%s %s %s f x)' % (EXP, church(3), church(6))
+    return [
+        ('products', tree([product] * 1024)),
+        ('powers', tree([power] * 512)),
+    ]
+
+
+def normalize_corpus():
+    """Programs with deep normal forms (or lots of beta-steps), small enough
+    that the substituting evaluator finishes in a few seconds."""
+    return [
+        ('mult', '%s %s %s' % (MULT, church(150), church(150))),
+        ('exp', '%s %s %s' % (EXP, church(2), church(14))),
+        ('collapse', '%s %s %s [b]b y' % (EXP, church(3), church(10))),
+    ]
+
+
+def deep_corpus(depth):
+    """Programs nested `depth` levels deep, whose types are small enough to
+    print in linear time too (unlike those of a left-associated chain of calls,
+    or of nested lambdas, which are only unparsed)."""
+    return [
+        ('parens', '(' * depth + 'x' + ')' * depth, True),
+        ('right-calls', 'f (' * depth + 'x' + ')' * depth, True),
+        ('left-calls', 'f' + ' x' * depth, False),
+        ('lambdas', '[x]' * depth + 'x', False),
+    ]
+
+
+def output_corpus():
+    """Programs with a few hundred MB of output: the types of a long chain of
+    calls (whose output is cubic in its length), and a deep term unparsed."""
+    depth = 5 * 10**7
+    return [
+        ('chain', '--type', 'f' + ' x' * 1000),
+        ('right-calls', '--unparse', 'f (' * depth + 'x' + ')' * depth),
+    ]
+
+
+def parse_corpus():
+    """About 64MB of source each, from mostly whitespace to none, with little
+    to print, so that parsing dominates."""
+    size = 64 * 2**20
+    spaced = ' ' * 63 + 'x'
+    indented = '\n' + '\t' * 6 + '(f x)'
+    dense = '(f x)'
+    return [
+        ('spaced', 'x' + spaced * (size // len(spaced))),
+        ('indented', 'x' + indented * (size // len(indented))),
+        ('dense', 'x' + dense * (size // len(dense))),
+    ]
+
+
+# Deep programs must not need a deep C stack.
+DEEP_STACK_BYTES = 256 * 1024
+
+
+def type_corpus(nodes):
+    """Programs of about `nodes` AST nodes whose typing unifies lots of types
+    out of order: a balanced tree of calls, which merges big types late, and a
+    deep chain of calls, whose types all end up unified with each other."""
+    rng = random.Random(1)
+
+    def var():
+        return rng.choice('abcdefghijklmnopqrstuvwxyz')
+    chain = ''.join(var() + ' (' for _ in range(nodes // 2))
+    return [
+        ('tree', tree([var() for _ in range(nodes // 4)])),
+        ('chain', chain + 'x' + ')' * (nodes // 2)),
+    ]
+
+
+def batch_corpus(count):
+    """`count` small programs, one per line, for --batch: a mix of numerals,
+    combinators and calls of free variables, all with short normal forms."""
+    rng = random.Random(1)
+    programs = [church(2), '[x]x y', '(a b) (c d)', '[x][y](y x) z',
+                '%s %s' % (church(1), '[x]x'), '[f](f f) q']
+    return '\n'.join(rng.choice(programs) for _ in range(count)) + '\n'
+
+
+def limit_stack():
+    resource.setrlimit(resource.RLIMIT_STACK,
+                       (DEEP_STACK_BYTES, DEEP_STACK_BYTES))
+
+
+def run(args, src, repeat, preexec_fn=None, stdout=subprocess.PIPE):
+    best = None
+    for _ in range(repeat):
+        start = time.perf_counter()
+        cp = subprocess.run(args, input=src, stdout=stdout,
+                            stderr=subprocess.PIPE, text=True,
+                            preexec_fn=preexec_fn)
+        elapsed = time.perf_counter() - start
+        if cp.returncode:
+            sys.exit('%s failed: %s' % (' '.join(args), cp.stderr.strip()))
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+
+# A child forked from this process inherits its peak RSS (corpora and all), so
+# the program is run as the child of a fresh interpreter, which reports it.
+RSS_REPORTER = """
+import os, sys
+pid = os.fork()
+if not pid:
+    os.execv(sys.argv[1], sys.argv[1:])
+_, status, usage = os.wait4(pid, 0)
+print(usage.ru_maxrss, file=sys.stderr)
+sys.exit(os.waitstatus_to_exitcode(status))
+"""
+
+
+def peak_rss(args, src):
+    """The peak resident set size of running args on src, in MB, reading it
+    from a pipe."""
+    p = subprocess.Popen([sys.executable, '-c', RSS_REPORTER] + args,
+                         stdin=subprocess.PIPE, stdout=subprocess.DEVNULL,
+                         stderr=subprocess.PIPE, text=True)
+    _, err = p.communicate(src)
+    if p.returncode:
+        sys.exit('%s failed' % ' '.join(args))
+    return int(err.split()[-1]) / 1024
+
+
+def run_trickled(args, src, mb_per_s):
+    """The seconds from starting args to its exit, writing src to its STDIN
+    at mb_per_s, a megabyte at a time, as a slow pipe would."""
+    data = src.encode()
+    piece = 2**20
+    start = time.perf_counter()
+    p = subprocess.Popen(args, stdin=subprocess.PIPE, stdout=subprocess.DEVNULL)
+    for k in range(0, len(data), piece):
+        p.stdin.write(data[k:k + piece])
+        p.stdin.flush()
+        delay = start + (k + piece) / (mb_per_s * 1e6) - time.perf_counter()
+        if delay > 0:
+            time.sleep(delay)
+    p.stdin.close()
+    if p.wait():
+        sys.exit('%s failed' % ' '.join(args))
+    return time.perf_counter() - start
+
+
+def thread_counts(opts):
+    """1, 2, 4 ... up to --max-threads."""
+    threads = [1]
+    while threads[-1] * 2 <= opts.max_threads:
+        threads.append(threads[-1] * 2)
+    if threads[-1] != opts.max_threads:
+        threads.append(opts.max_threads)
+    return threads
+
+
+def bench_net(opts):
+    """Scaling of --eval=net from one thread up to --max-threads."""
+    threads = thread_counts(opts)
+    print('%-12s %8s' % ('program', 'threads'), end='')
+    print(' %9s %8s' % ('seconds', 'speedup'))
+    for name, src in net_corpus():
+        base = None
+        for n in threads:
+            args = [opts.zlambda, '--eval=net', '--threads=%d' % n] + BUDGET
+            t = run(args, src, opts.repeat)
+            base = base or t
+            print('%-12s %8d %9.3f %7.2fx' % (name, n, t, base / t))
+
+
+def bench_normalize(opts):
+    """--normalize against the step-by-step reducers, on the same input."""
+    evaluators = ['--eval=subst', '--eval=lazy', '--normalize']
+    print('%-12s %-14s %9s %8s' % ('program', 'evaluator', 'seconds',
+                                   'speedup'))
+    for name, src in normalize_corpus():
+        base = None
+        for e in evaluators:
+            t = run([opts.zlambda, e] + BUDGET, src, opts.repeat)
+            base = base or t
+            print('%-12s %-14s %9.3f %7.2fx' % (name, e, t, base / t))
+
+
+def bench_deep(opts):
+    """Parsing, unparsing and typing programs nested 10^6 and 10^7 levels
+    deep, with a small stack.  The time per level should stay flat."""
+    print('%-12s %-10s %9s %9s %10s' % ('program', 'action', 'depth',
+                                        'seconds', 'ns/level'))
+    for depth in [10**6, 10**7]:
+        for name, src, typed in deep_corpus(depth):
+            actions = ['--unparse'] + (['--type'] if typed else [])
+            for a in actions:
+                t = run([opts.zlambda, a], src, opts.repeat, limit_stack)
+                print('%-12s %-10s %9d %9.3f %10.1f' % (name, a, depth, t,
+                                                        1e9 * t / depth))
+
+
+def bench_output(opts):
+    """Output throughput of --type and --unparse, writing to /dev/null.  The
+    time includes parsing (and typing), so is a lower bound on the printers'
+    speed.  Then the scaling of --unparse on a balanced tree of 2^24 leaves
+    from one thread up to --max-threads."""
+    print('%-12s %-10s %9s %9s %9s' % ('program', 'action', 'MB', 'seconds',
+                                       'MB/s'))
+    for name, action, src in output_corpus():
+        with tempfile.TemporaryFile() as f:
+            run([opts.zlambda, action], src, 1, stdout=f)
+            mb = f.tell() / 1e6
+        t = run([opts.zlambda, action], src, opts.repeat,
+                stdout=subprocess.DEVNULL)
+        print('%-12s %-10s %9.1f %9.3f %9.1f' % (name, action, mb, t, mb / t))
+
+    rng = random.Random(1)
+    src = tree([rng.choice('abcdefgh') for _ in range(2**24)])
+    print()
+    print('%-12s %8s %9s %8s' % ('program', 'threads', 'seconds', 'speedup'))
+    base = None
+    for n in thread_counts(opts):
+        args = [opts.zlambda, '--unparse', '--threads=%d' % n]
+        t = run(args, src, opts.repeat, stdout=subprocess.DEVNULL)
+        base = base or t
+        print('%-12s %8d %9.3f %7.2fx' % ('tree', n, t, base / t))
+
+
+def bench_parse(opts):
+    """Parsing (and unparsing) throughput, in MB of source per second, and
+    the peak RSS, on one thread, reading the source from a pipe on STDIN (which
+    is parsed as it arrives) and from a file mapped with --file.  Then how
+    long the parse takes after the last byte arrives, if the pipe is slow.
+    Then the scaling, parsing the file, from one thread up to
+    --max-threads."""
+    print('%-12s %6s %9s %9s %9s %9s' % ('program', 'input', 'MB', 'seconds',
+                                         'MB/s', 'RSS MB'))
+    for name, src in parse_corpus():
+        mb = len(src) / 1e6
+        with tempfile.NamedTemporaryFile('w', suffix='.lam') as f:
+            f.write(src)
+            f.flush()
+            for how, input, more in [('stdin', src, []),
+                                     ('file', '', ['--file=' + f.name])]:
+                args = [opts.zlambda, '--unparse', '--threads=1'] + more
+                t = run(args, input, opts.repeat, stdout=subprocess.DEVNULL)
+                rss = peak_rss(args, input)
+                print('%-12s %6s %9.1f %9.3f %9.1f %9.1f' %
+                      (name, how, mb, t, mb / t, rss))
+
+    rate = 50
+    print()
+    print('%-12s %9s %9s %9s' % ('program', 'MB/s', 'transfer', 'after'))
+    for name, src in parse_corpus():
+        args = [opts.zlambda, '--unparse', '--threads=1']
+        t = run_trickled(args, src, rate)
+        transfer = len(src) / (rate * 1e6)
+        print('%-12s %9d %9.3f %9.3f' % (name, rate, transfer, t - transfer))
+
+    print()
+    print('%-12s %8s %9s %8s' % ('program', 'threads', 'seconds', 'speedup'))
+    for name, src in parse_corpus():
+        with tempfile.NamedTemporaryFile('w', suffix='.lam') as f:
+            f.write(src)
+            f.flush()
+            base = None
+            for n in thread_counts(opts):
+                args = [opts.zlambda, '--unparse', '--threads=%d' % n,
+                        '--file=' + f.name]
+                t = run(args, '', opts.repeat, stdout=subprocess.DEVNULL)
+                base = base or t
+                print('%-12s %8d %9.3f %7.2fx' % (name, n, t, base / t))
+
+
+def bench_type(opts):
+    """Type inference (with parsing and printing) from 10^5 to 10^7 nodes, on
+    one thread.  The time per node should stay about flat.  Then the scaling
+    of --type=compact on 10^7 nodes from one thread up to --max-threads."""
+    print('%-12s %9s %9s %9s' % ('program', 'nodes', 'seconds', 'ns/node'))
+    for nodes in [10**5, 10**6, 10**7]:
+        for name, src in type_corpus(nodes):
+            t = run([opts.zlambda, '--type', '--threads=1'], src, opts.repeat,
+                    stdout=subprocess.DEVNULL)
+            print('%-12s %9d %9.3f %9.1f' % (name, nodes, t, 1e9 * t / nodes))
+
+    print()
+    print('%-12s %8s %9s %8s' % ('program', 'threads', 'seconds', 'speedup'))
+    for name, src in type_corpus(10**7):
+        base = None
+        for n in thread_counts(opts):
+            args = [opts.zlambda, '--type=compact', '--threads=%d' % n]
+            t = run(args, src, opts.repeat, stdout=subprocess.DEVNULL)
+            base = base or t
+            print('%-12s %8d %9.3f %7.2fx' % (name, n, t, base / t))
+
+
+def bench_batch(opts):
+    """Throughput of --batch, in programs per second, for each action on a
+    million small programs, read from a pipe.  Each is parsed into the same
+    Ast, so this is mostly the per-program overhead."""
+    count = 10**6
+    src = batch_corpus(count)
+    print('%-12s %9s %9s %12s' % ('action', 'programs', 'seconds',
+                                  'programs/s'))
+    for action in ['--unparse', '--type', '--eval', '--eval=vm',
+                   '--normalize']:
+        t = run([opts.zlambda, '--batch', action], src, opts.repeat,
+                stdout=subprocess.DEVNULL)
+        print('%-12s %9d %9.3f %12.0f' % (action, count, t, count / t))
+
+
+def bench_corpus(opts):
+    """Throughput of a corpus of files, in files per second, for --unparse and
+    --type, from one thread up to --max-threads: 20000 small files, and 200
+    of about 100K nodes each, in 50 directories."""
+    small = batch_corpus(20000).splitlines()
+    big = [type_corpus(10**5)[0][1] for _ in range(4)]
+    print('%-8s %-10s %8s %9s %9s %8s' % ('files', 'action', 'threads',
+                                          'seconds', 'files/s', 'speedup'))
+    for name, progs in [('small', small), ('big', big * 50)]:
+        with tempfile.TemporaryDirectory() as d:
+            for k, prog in enumerate(progs):
+                sub = os.path.join(d, '%02d' % (k % 50))
+                os.makedirs(sub, exist_ok=True)
+                with open(os.path.join(sub, '%06d.lam' % k), 'w') as f:
+                    f.write(prog)
+            for action in ['--unparse', '--type']:
+                base = None
+                for n in thread_counts(opts):
+                    args = [opts.zlambda, action, '--threads=%d' % n, d]
+                    t = run(args, '', opts.repeat,
+                            stdout=subprocess.DEVNULL)
+                    base = base or t
+                    print('%-8s %-10s %8d %9.3f %9.0f %7.2fx' %
+                          (name, action, n, t, len(progs) / t, base / t))
+
+
+def serve_requests(count):
+    """`count` requests for --serve: batch_corpus()'s programs, each with one
+    of a few sets of actions."""
+    rng = random.Random(1)
+    actions = ['', '--type', '--eval=vm', '--type=compact --eval']
+    return [('%s\n%s' % (rng.choice(actions), prog)).encode()
+            for prog in batch_corpus(count).splitlines()]
+
+
+def load(path, nclients, requests):
+    """Send `requests` to the server at `path` from `nclients` connections at
+    once, each sending its next request once it has the answer to the last.
+    Returns the seconds each took, from sending it to having its answer, and
+    the seconds in all."""
+    sel = selectors.DefaultSelector()
+    todo = list(reversed(requests))
+    latencies = []
+
+    def send_next(sock, state):
+        if not todo:
+            sel.unregister(sock)
+            sock.close()
+            return
+        req = todo.pop()
+        state['start'] = time.perf_counter()
+        sock.sendall(struct.pack('!I', len(req)) + req)
+
+    start = time.perf_counter()
+    for _ in range(min(nclients, len(requests))):
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.connect(path)
+        state = {'buf': b''}
+        sel.register(sock, selectors.EVENT_READ, state)
+        send_next(sock, state)
+    while sel.get_map():
+        for key, _ in sel.select():
+            sock, state = key.fileobj, key.data
+            got = sock.recv(1 << 16)
+            if not got:
+                sys.exit('The server hung up.')
+            state['buf'] += got
+            buf = state['buf']
+            if len(buf) < 4 or len(buf) < 4 + struct.unpack('!I', buf[:4])[0]:
+                continue
+            latencies.append(time.perf_counter() - state['start'])
+            state['buf'] = b''
+            send_next(sock, state)
+    return latencies, time.perf_counter() - start
+
+
+def percentile(xs, p):
+    xs = sorted(xs)
+    return xs[min(len(xs) - 1, int(len(xs) * p / 100))]
+
+
+def bench_serve(opts):
+    """Latency (p50 and p99, in microseconds) and throughput of small requests
+    to --serve, from 1 to 64 clients at once, against running the program
+    afresh for each."""
+    print('%-16s %8s %9s %9s %10s' % ('', 'clients', 'p50 us', 'p99 us',
+                                      'requests/s'))
+    requests = serve_requests(opts.requests)
+    spawned = []
+    for req in requests[:200]:
+        actions, src = req.decode().split('\n', 1)
+        start = time.perf_counter()
+        subprocess.run([opts.zlambda] + actions.split(), input=src,
+                       stdout=subprocess.DEVNULL, text=True)
+        spawned.append(time.perf_counter() - start)
+    print('%-16s %8d %9.0f %9.0f %10.0f' %
+          ('process each', 1, percentile(spawned, 50) * 1e6,
+           percentile(spawned, 99) * 1e6, len(spawned) / sum(spawned)))
+
+    with tempfile.TemporaryDirectory() as d:
+        path = os.path.join(d, 'lambda.sock')
+        server = subprocess.Popen([opts.zlambda, '--serve=' + path,
+                                   '--threads=%d' % opts.max_threads])
+        try:
+            while not os.path.exists(path):
+                time.sleep(0.01)
+            for nclients in [1, 4, 16, 64]:
+                latencies, seconds = load(path, nclients, requests)
+                print('%-16s %8d %9.0f %9.0f %10.0f' %
+                      ('--serve', nclients, percentile(latencies, 50) * 1e6,
+                       percentile(latencies, 99) * 1e6,
+                       len(latencies) / seconds))
+        finally:
+            server.terminate()
+            server.wait()
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawTextHelpFormatter)
+    parser.add_argument('benchmark', choices=['net', 'normalize', 'deep',
+                                              'output', 'parse', 'type',
+                                              'batch', 'corpus', 'serve'])
+    parser.add_argument('--lambda', dest='zlambda', default='b/lambda')
+    parser.add_argument('--max-threads', type=int, default=os.cpu_count())
+    parser.add_argument('--repeat', type=int, default=3)
+    parser.add_argument('--requests', type=int, default=20000,
+                        help='How many requests `serve` sends.')
+    opts = parser.parse_args()
+    {'net': bench_net, 'normalize': bench_normalize,
+     'deep': bench_deep, 'output': bench_output,
+     'parse': bench_parse, 'type': bench_type,
+     'batch': bench_batch, 'corpus': bench_corpus,
+     'serve': bench_serve}[opts.benchmark](opts)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,527 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lambda.h"
+#include "untestable.h"
+
+// A persistent cache of normal forms.  Each entry is a file in the cache
+// directory, named after a hash of a closed term, holding the term itself
+// (to rule out hash collisions) and its normal form.  Because bound variables
+// are de Bruijn indices, and the names of lambda params don't count, the hash
+// of a term is the same as that of any alpha-equivalent term.
+//
+// Terms are stored in a compact binary post-fix encoding: after a magic
+// number and the two node counts, each node is one varint holding
+// (val << 2 | type - 1), where `val` is arg_size for a CALL, depth for a BOUND,
+// and zero for a LAMBDA or a VAR (in closed terms, VARs are only ever the
+// names of lambda params).  Most nodes take a single byte.
+//
+// Before running an evaluator, act_cached() walks the Ast from the root down,
+// looking up each closed subterm that isn't already normal, and only looking
+// inside it if that misses.  The hits are spliced in, in one pass over the
+// post-fix array.  Entries are only ever added for whole programs, from the
+// text the evaluator printed.
+
+static const char magic[4] = "LNF1";
+
+#define NONE UINT32_MAX
+
+struct Cache {
+        char *zdir;
+        uint64_t hits;
+        uint64_t misses;
+};
+
+// What act_cached() needs to know about each subtree of a term.
+typedef struct {
+        uint32_t *first; // Index of the subtree's first node.
+        uint32_t *need;  // How many enclosing lambdas it needs to be closed.
+        uint64_t *hash;
+        uint8_t *redex; // Whether it has a beta-redex.
+} Analysis;
+
+// A term that was found in the cache.
+typedef struct {
+        uint32_t root; // Where it goes, in the original term.
+        uint32_t size;
+        AstNode *nodes;
+} Hit;
+
+typedef struct {
+        unsigned char *bytes;
+        size_t size;
+        size_t alloced;
+} Bytes;
+
+// ------------------------------------------------------------------
+
+static uint64_t mix(uint64_t h, uint64_t v)
+{
+        uint64_t z = h ^ (v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2));
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+}
+
+static uint32_t max_u32(uint32_t a, uint32_t b) { return a > b ? a : b; }
+
+// Fill in `an` for nodes[0:size], one forward pass, as post-fix order allows.
+// Returns false if the nodes aren't a well-formed term (which can only happen
+// for terms read from the cache).
+static bool analyse(const AstNode *nodes, uint32_t size, Analysis *an)
+{
+        for (uint32_t k = 0; k < size; k++) {
+                AstNode n = nodes[k];
+                uint32_t callee, body;
+                int32_t val = ast_val(n);
+                switch (ast_type(n)) {
+                case ANT_VAR:
+                        // A param's name doesn't count, and a free variable
+                        // means the term isn't closed.
+                        an->first[k] = k;
+                        an->redex[k] = 0;
+                        if (k + 1 < size &&
+                            ast_type(nodes[k + 1]) == ANT_LAMBDA) {
+                                an->need[k] = 0;
+                                an->hash[k] = mix(ANT_VAR, 0);
+                        } else {
+                                an->need[k] = NONE;
+                                an->hash[k] = mix(ANT_VAR, val + 1u);
+                        }
+                        continue;
+                case ANT_BOUND:
+                        if (val < 0 || val >= NONE - 1)
+                                return false; // LCOV_EXCL_LINE
+                        an->first[k] = k;
+                        an->redex[k] = 0;
+                        an->need[k] = val + 1;
+                        an->hash[k] = mix(ANT_BOUND, val);
+                        continue;
+                case ANT_CALL:
+                        if (val < 1 || val >= k)
+                                return false;
+                        callee = k - val - 1;
+                        if (an->first[k - 1] != callee + 1)
+                                return false;
+                        an->first[k] = an->first[callee];
+                        an->redex[k] = ast_type(nodes[callee]) == ANT_LAMBDA ||
+                                       an->redex[callee] || an->redex[k - 1];
+                        an->need[k] =
+                            max_u32(an->need[callee], an->need[k - 1]);
+                        an->hash[k] = mix(mix(ANT_CALL, an->hash[callee]),
+                                          an->hash[k - 1]);
+                        continue;
+                case ANT_LAMBDA:
+                        if (k < 2 || ast_type(nodes[k - 1]) != ANT_VAR)
+                                return false;
+                        body = ast_lambda_body(nodes, k);
+                        an->first[k] = an->first[body];
+                        an->redex[k] = an->redex[body];
+                        an->need[k] = an->need[body] == NONE ? NONE
+                                      : an->need[body] ? an->need[body] - 1
+                                                       : 0;
+                        an->hash[k] = mix(ANT_LAMBDA, an->hash[body]);
+                        continue;
+                }
+                return false; // LCOV_EXCL_LINE
+        }
+        return size && an->first[size - 1] == 0;
+}
+
+static void alloc_analysis(Analysis *an, uint32_t size)
+{
+        an->first = realloc_or_die(HERE, NULL, sizeof(uint32_t) * size);
+        an->need = realloc_or_die(HERE, NULL, sizeof(uint32_t) * size);
+        an->hash = realloc_or_die(HERE, NULL, sizeof(uint64_t) * size);
+        an->redex = realloc_or_die(HERE, NULL, size);
+}
+
+static void free_analysis(Analysis *an)
+{
+        free(an->first);
+        free(an->need);
+        free(an->hash);
+        free(an->redex);
+}
+
+// ------------------------------------------------------------------
+
+static void put_bytes(Bytes *b, const void *bytes, size_t n)
+{
+        if (b->size + n > b->alloced) {
+                b->alloced = 2 * (b->size + n);
+                b->bytes = realloc_or_die(HERE, b->bytes, b->alloced);
+        }
+        memcpy(b->bytes + b->size, bytes, n);
+        b->size += n;
+}
+
+static void put_varint(Bytes *b, uint64_t v)
+{
+        unsigned char buf[10];
+        size_t n = 0;
+        do {
+                buf[n] = v & 0x7f;
+                v >>= 7;
+                buf[n++] |= v ? 0x80 : 0;
+        } while (v);
+        put_bytes(b, buf, n);
+}
+
+static void put_nodes(Bytes *b, const AstNode *nodes, uint32_t size)
+{
+        for (uint32_t k = 0; k < size; k++) {
+                AstNode n = nodes[k];
+                uint64_t val = 0;
+                switch (ast_type(n)) {
+                case ANT_CALL:
+                case ANT_BOUND:
+                        val = ast_val(n);
+                        break;
+                case ANT_VAR:
+                case ANT_LAMBDA:
+                        break;
+                }
+                put_varint(b, val << 2 | (ast_type(n) - 1));
+        }
+}
+
+static bool get_varint(const unsigned char **pz, const unsigned char *zE,
+                       uint64_t *v)
+{
+        *v = 0;
+        for (unsigned shift = 0; *pz < zE && shift < 64; shift += 7) {
+                unsigned char c = *(*pz)++;
+                *v |= (uint64_t)(c & 0x7f) << shift;
+                if (!(c & 0x80))
+                        return true;
+        }
+        return false;
+}
+
+// Decode `size` nodes, returning false if the bytes run out or don't make
+// sense.
+static bool get_nodes(const unsigned char **pz, const unsigned char *zE,
+                      AstNode *nodes, uint32_t size)
+{
+        for (uint32_t k = 0; k < size; k++) {
+                uint64_t v;
+                if (!get_varint(pz, zE, &v) || v >> 2 > EVAL_MAX_NODES)
+                        return false;
+                int32_t val = v >> 2;
+                AstNodeType type = (v & 3) + 1;
+                switch (type) {
+                case ANT_VAR:
+                        nodes[k] = ast_node(ANT_VAR, -1);
+                        continue;
+                case ANT_LAMBDA:
+                        nodes[k] = ast_node(ANT_LAMBDA, 0);
+                        continue;
+                case ANT_CALL:
+                case ANT_BOUND:
+                        nodes[k] = ast_node(type, val);
+                        continue;
+                }
+        }
+        return true;
+}
+
+// Are a[0:n] and b[0:n] the same closed term (up to the names of params)?
+static bool same_term(const AstNode *a, const AstNode *b, uint32_t n)
+{
+        for (uint32_t k = 0; k < n; k++) {
+                AstNodeType type = ast_type(a[k]);
+                if (type != ast_type(b[k]))
+                        return false;
+                if ((type == ANT_CALL || type == ANT_BOUND) &&
+                    ast_val(a[k]) != ast_val(b[k]))
+                        return false;
+        }
+        return true;
+}
+
+// ------------------------------------------------------------------
+
+static char *entry_path(const Cache *cache, uint64_t hash)
+{
+        char *zpath;
+        DIE_IF(asprintf(&zpath, "%s/%016llx", cache->zdir,
+                        (unsigned long long)hash) < 0,
+               "Couldn't name a cache entry.");
+        return zpath;
+}
+
+static bool read_file(const char *zpath, Bytes *b)
+{
+        FILE *fin = fopen(zpath, "rb");
+        if (!fin)
+                return false;
+        unsigned char buf[8192];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), fin)))
+                put_bytes(b, buf, n);
+        bool ok = !ferror(fin);
+        fclose(fin);
+        return ok;
+}
+
+// Look up the closed term nodes[lo:lo+size] (with the given hash), and if it
+// is in the cache, fill in hit->size and hit->nodes.
+static bool lookup(Cache *cache, const AstNode *nodes, uint32_t size,
+                   uint64_t hash, Hit *hit)
+{
+        char *zpath = entry_path(cache, hash);
+        Bytes b = {0};
+        bool found = false;
+        AstNode *key = NULL, *nf = NULL;
+        Analysis an = {0};
+        if (!read_file(zpath, &b) || b.size < sizeof(magic) ||
+            memcmp(b.bytes, magic, sizeof(magic)))
+                goto done;
+
+        const unsigned char *z = b.bytes + sizeof(magic);
+        const unsigned char *zE = b.bytes + b.size;
+        uint64_t nkey, nnf;
+        // Every node takes at least a byte.
+        if (!get_varint(&z, zE, &nkey) || !get_varint(&z, zE, &nnf) ||
+            nkey != size || !nnf || nkey + nnf > (uint64_t)(zE - z))
+                goto done;
+
+        key = realloc_or_die(HERE, NULL, sizeof(AstNode) * nkey);
+        nf = realloc_or_die(HERE, NULL, sizeof(AstNode) * nnf);
+        if (!get_nodes(&z, zE, key, nkey) || !same_term(key, nodes, size) ||
+            !get_nodes(&z, zE, nf, nnf) || z != zE)
+                goto done;
+
+        // A normal form of a closed term must itself be closed.
+        alloc_analysis(&an, nnf);
+        if (!analyse(nf, nnf, &an) || an.need[nnf - 1])
+                goto done;
+
+        *hit = (Hit){.size = nnf, .nodes = nf};
+        nf = NULL;
+        found = true;
+done:
+        free_analysis(&an);
+        free(key);
+        free(nf);
+        free(b.bytes);
+        free(zpath);
+        return found;
+}
+
+// Store `nf` as the normal form of `key`.  The entry is written to a temporary
+// file first and then renamed, so that other processes never see half of it.
+static void store(Cache *cache, const AstNode *key, uint32_t nkey,
+                  uint64_t hash, const AstNode *nf, uint32_t nnf)
+{
+        Bytes b = {0};
+        put_bytes(&b, magic, sizeof(magic));
+        put_varint(&b, nkey);
+        put_varint(&b, nnf);
+        put_nodes(&b, key, nkey);
+        put_nodes(&b, nf, nnf);
+
+        char *zpath = entry_path(cache, hash), *ztmp;
+        DIE_IF(asprintf(&ztmp, "%s.%ld.tmp", zpath, (long)getpid()) < 0,
+               "Couldn't name a temporary cache entry.");
+        FILE *oot = fopen(ztmp, "wb");
+        if (oot) {
+                bool ok = fwrite(b.bytes, 1, b.size, oot) == b.size;
+                ok = !fclose(oot) && ok;
+                if (!ok || rename(ztmp, zpath))
+                        unlink(ztmp);
+        }
+        free(ztmp);
+        free(zpath);
+        free(b.bytes);
+}
+
+// Store the text `zout` printed by an evaluator, if it parses, as the normal
+// form of the closed term nodes[0:size].
+static void store_output(Cache *cache, const AstNode *nodes, uint32_t size,
+                         uint64_t hash, const char *zout)
+{
+        Ast *ast = parse("cache", zout);
+        if (!report_syntax_errors(NULL, ast)) {
+                AstIdx nnf;
+                const AstNode *nf = ast_postfix(ast, &nnf);
+                store(cache, nodes, size, hash, nf, nnf);
+        }
+        delete_ast(ast);
+}
+
+// ------------------------------------------------------------------
+
+// Look up the closed subterms of nodes[0:size] from the root down, appending
+// the hits to *hits, and returning how many there were.
+static uint32_t find_hits(Cache *cache, const AstNode *nodes, uint32_t size,
+                          const Analysis *an, Hit **hits)
+{
+        uint32_t *stack = realloc_or_die(HERE, NULL, sizeof(uint32_t) * size);
+        uint32_t sp = 0, nhits = 0;
+        uint64_t total = size;
+        stack[sp++] = size - 1;
+        while (sp) {
+                uint32_t k = stack[--sp];
+                if (!an->redex[k])
+                        continue;
+
+                Hit hit;
+                uint32_t lo = an->first[k], n = k - lo + 1;
+                if (!an->need[k]) {
+                        if (lookup(cache, nodes + lo, n, an->hash[k], &hit) &&
+                            total - n + hit.size <= EVAL_MAX_NODES) {
+                                cache->hits++;
+                                total = total - n + hit.size;
+                                hit.root = k;
+                                *hits = realloc_or_die(
+                                    HERE, *hits, sizeof(Hit) * (nhits + 1));
+                                (*hits)[nhits++] = hit;
+                                continue;
+                        }
+                        cache->misses++;
+                }
+
+                AstVal val;
+                switch (ast_unpack(nodes, k, &val)) {
+                case ANT_CALL:
+                        stack[sp++] = val;
+                        stack[sp++] = ast_arg_idx(nodes, k);
+                        continue;
+                case ANT_LAMBDA:
+                        stack[sp++] = ast_lambda_body(nodes, k);
+                        continue;
+                // LCOV_EXCL_START: they have no redex.
+                case ANT_VAR:
+                case ANT_BOUND:
+                        continue;
+                        // LCOV_EXCL_STOP
+                }
+        }
+        free(stack);
+        return nhits;
+}
+
+// Copy nodes[0:size] with each hit spliced in, fixing up the arg_size of every
+// CALL to match.
+static AstNode *splice(const AstNode *nodes, uint32_t size,
+                       const Analysis *an, const Hit *hits, uint32_t nhits,
+                       uint32_t *new_size)
+{
+        // hit_at[k] is the hit (plus one) whose subtree begins at k.
+        uint32_t *hit_at = calloc(size, sizeof(uint32_t));
+        uint32_t *opos = realloc_or_die(HERE, NULL, sizeof(uint32_t) * size);
+        DIE_IF(!hit_at, "Couldn't allocate %u hit slots.", size);
+        uint64_t total = size;
+        for (uint32_t h = 0; h < nhits; h++) {
+                hit_at[an->first[hits[h].root]] = h + 1;
+                total += hits[h].size;
+                total -= hits[h].root - an->first[hits[h].root] + 1;
+        }
+
+        AstNode *out = realloc_or_die(HERE, NULL, sizeof(AstNode) * total);
+        uint32_t o = 0;
+        for (uint32_t k = 0; k < size;) {
+                opos[k] = o;
+                if (hit_at[k]) {
+                        const Hit *hit = hits + hit_at[k] - 1;
+                        memcpy(out + o, hit->nodes,
+                               sizeof(AstNode) * hit->size);
+                        o += hit->size;
+                        k = hit->root + 1;
+                        continue;
+                }
+                out[o] = nodes[k];
+                if (ast_type(nodes[k]) == ANT_CALL)
+                        out[o] = ast_node(ANT_CALL, o - opos[an->first[k - 1]]);
+                o++;
+                k++;
+        }
+        assert(o == total);
+
+        free(hit_at);
+        free(opos);
+        *new_size = o;
+        return out;
+}
+
+// ------------------------------------------------------------------
+
+Cache *open_cache(const char *zdir)
+{
+        if (mkdir(zdir, 0777) && errno != EEXIST) {
+                fprintf(stderr, "Can't create cache directory %s: %s\n", zdir,
+                        strerror(errno));
+                fflush(stderr);
+                return NULL;
+        }
+        Cache *cache = realloc_or_die(HERE, NULL, sizeof(Cache));
+        *cache = (Cache){.zdir = strdup(zdir)};
+        DIE_IF(!cache->zdir, "Couldn't copy '%s'.", zdir);
+        return cache;
+}
+
+int act_cached(Cache *cache, EvalAction act, FILE *oot, const Ast *ast,
+               const EvalBudget *budget)
+{
+        AstIdx size;
+        const AstNode *nodes = ast_postfix(ast, &size);
+        Analysis an;
+        alloc_analysis(&an, size);
+        DIE_IF(!analyse(nodes, size, &an), "Parsed a malformed Ast.");
+
+        Hit *hits = NULL;
+        uint32_t nhits = find_hits(cache, nodes, size, &an, &hits);
+        Ast *spliced = NULL;
+        if (nhits) {
+                uint32_t new_size;
+                AstNode *out = splice(nodes, size, &an, hits, nhits, &new_size);
+                spliced = ast_from_postfix("cache", "", out, new_size);
+                free(out);
+        }
+
+        // The output is captured, so that it can be stored too.
+        char *zout = NULL;
+        size_t nout = 0;
+        FILE *mem = open_memstream(&zout, &nout);
+        DIE_IF(!mem, "Couldn't open a memstream.");
+        int nerr = act(mem, spliced ? spliced : ast, budget);
+        fclose(mem);
+        fwrite(zout, 1, nout, oot);
+        fflush(oot);
+
+        uint32_t root = size - 1;
+        bool root_hit = nhits && hits[0].root == root;
+        if (!nerr && !an.need[root] && an.redex[root] && !root_hit)
+                store_output(cache, nodes, size, an.hash[root], zout);
+
+        free(zout);
+        if (spliced)
+                delete_ast(spliced);
+        for (uint32_t h = 0; h < nhits; h++)
+                free(hits[h].nodes);
+        free(hits);
+        free_analysis(&an);
+        return nerr;
+}
+
+void close_cache(FILE *oot, Cache *cache)
+{
+        fprintf(oot, "Cache: %llu hits, %llu misses.\n",
+                (unsigned long long)cache->hits,
+                (unsigned long long)cache->misses);
+        fflush(oot);
+        free(cache->zdir);
+        free(cache);
+}
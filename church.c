@@ -0,0 +1,280 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "church.h"
+#include "eval.h"
+#include "lambda.h"
+#include "machine.h"
+#include "untestable.h"
+
+// Church encodings are recognised by their shape in the post-fix node array,
+// where a closed term is just a run of nodes: a subterm is one of the
+// templates below if its nodes are the same as the template's, except for the
+// names of lambda params.  Numerals have a template of their own size, so they
+// are matched by walking down the chain of CALLs instead.
+//
+// The natural numbers that replace the numerals are plain little-endian
+// bignums, allocated from the evaluator's heap.
+
+static const struct {
+        ChurchOp op;
+        const char *zsrc;
+} templates[] = {
+    {CHURCH_TRUE, "[a][b]a"},
+    {CHURCH_SUCC, "[n][f][x](f (n f x))"},
+    {CHURCH_SUCC, "[n][f][x](n f (f x))"},
+    {CHURCH_PLUS, "[m][n][f][x](m f (n f x))"},
+    {CHURCH_MULT, "[m][n][f](m (n f))"},
+    {CHURCH_MULT, "[m][n][f][x](m (n f) x)"},
+    {CHURCH_EXP, "[m][n](n m)"},
+    {CHURCH_ISZERO, "[n](n [x][a][b]b [a][b]a)"},
+    {CHURCH_NOT, "[p][a][b](p b a)"},
+    {CHURCH_AND, "[p][q](p q p)"},
+    {CHURCH_OR, "[p][q](p p q)"},
+};
+
+#define NTEMPLATES (sizeof(templates) / sizeof(templates[0]))
+
+uint32_t church_arity(ChurchOp op)
+{
+        switch (op) {
+        case CHURCH_SUCC:
+        case CHURCH_ISZERO:
+        case CHURCH_NOT:
+                return 1;
+        case CHURCH_PLUS:
+        case CHURCH_MULT:
+        case CHURCH_EXP:
+        case CHURCH_AND:
+        case CHURCH_OR:
+                return 2;
+        case CHURCH_NONE:
+        case CHURCH_NUM:
+        case CHURCH_TRUE:
+                break;
+        }
+        return 0;
+}
+
+// If the lambda at nodes[pc] is [f][x](f (f ... x)), set *n to the number of
+// f's.
+static bool match_numeral(const AstNode *nodes, uint32_t pc, uint32_t *n)
+{
+        if (pc < 4 || ast_type(nodes[pc - 2]) != ANT_LAMBDA)
+                return false;
+
+        uint32_t k = 0;
+        for (uint32_t idx = pc - 4;; idx = ast_arg_idx(nodes, idx), k++) {
+                AstVal val;
+                switch (ast_unpack(nodes, idx, &val)) {
+                case ANT_BOUND:
+                        *n = k;
+                        return val == 0;
+                case ANT_CALL:
+                        if (ast_type(nodes[val]) == ANT_BOUND &&
+                            ast_val(nodes[val]) == 1)
+                                continue;
+                        return false;
+                case ANT_VAR:
+                case ANT_LAMBDA:
+                        return false;
+                }
+        }
+}
+
+// Are the terms a[0:n] and b[0:n] the same, up to the names of params?  The
+// templates are closed, so all of their VARs are params.
+static bool same_term(const AstNode *a, const AstNode *b, uint32_t n)
+{
+        for (uint32_t k = 0; k < n; k++) {
+                if (ast_type(a[k]) != ast_type(b[k]))
+                        return false;
+                switch (ast_type(a[k])) {
+                case ANT_CALL:
+                case ANT_BOUND:
+                        if (ast_val(a[k]) != ast_val(b[k]))
+                                return false;
+                        continue;
+                case ANT_VAR:
+                case ANT_LAMBDA:
+                        continue;
+                }
+        }
+        return true;
+}
+
+void church_match(const AstNode *nodes, uint32_t size, ChurchTag *tags)
+{
+        Ast *asts[NTEMPLATES];
+        const AstNode *tnodes[NTEMPLATES];
+        AstIdx tsizes[NTEMPLATES];
+        for (size_t t = 0; t < NTEMPLATES; t++) {
+                asts[t] = parse("church", templates[t].zsrc);
+                DIE_IF(report_syntax_errors(stderr, asts[t]),
+                       "Bad template '%s'.", templates[t].zsrc);
+                tnodes[t] = ast_postfix(asts[t], tsizes + t);
+        }
+
+        uint32_t *first = realloc_or_die(HERE, NULL, sizeof(uint32_t) * size);
+        find_subtree_starts(nodes, size, first);
+
+        for (uint32_t pc = 0; pc < size; pc++) {
+                tags[pc] = (ChurchTag){CHURCH_NONE};
+                if (ast_type(nodes[pc]) != ANT_LAMBDA)
+                        continue;
+                if (match_numeral(nodes, pc, &tags[pc].n)) {
+                        tags[pc].op = CHURCH_NUM;
+                        continue;
+                }
+                uint32_t lo = first[pc], n = pc - lo + 1;
+                for (size_t t = 0; t < NTEMPLATES; t++) {
+                        if (n == tsizes[t] &&
+                            same_term(nodes + lo, tnodes[t], n)) {
+                                tags[pc].op = templates[t].op;
+                                break;
+                        }
+                }
+        }
+
+        free(first);
+        for (size_t t = 0; t < NTEMPLATES; t++)
+                delete_ast(asts[t]);
+}
+
+// ------------------------------------------------------------------
+
+static Nat *nat_alloc(Heap *heap, uint64_t nlimbs)
+{
+        if (nlimbs > UINT32_MAX)
+                return NULL; // LCOV_EXCL_LINE (16GB of limbs)
+        Nat *a = heap_alloc(heap, sizeof(Nat) + sizeof(uint32_t) * nlimbs);
+        if (a)
+                *a = (Nat){.pc = -1, .nlimbs = nlimbs};
+        return a;
+}
+
+static Nat *trim(Nat *a)
+{
+        while (a->nlimbs && !a->limbs[a->nlimbs - 1])
+                a->nlimbs--;
+        return a;
+}
+
+Nat *nat_from(Heap *heap, uint64_t n)
+{
+        Nat *a = nat_alloc(heap, 2);
+        if (!a)
+                return NULL;
+        a->limbs[0] = (uint32_t)n;
+        a->limbs[1] = (uint32_t)(n >> 32);
+        return trim(a);
+}
+
+Nat *nat_add(Heap *heap, const Nat *a, const Nat *b)
+{
+        if (a->nlimbs < b->nlimbs) {
+                const Nat *t = a;
+                a = b;
+                b = t;
+        }
+        Nat *c = nat_alloc(heap, a->nlimbs + 1ull);
+        if (!c)
+                return NULL; // LCOV_EXCL_LINE (too slow: needs a 64KB sum)
+
+        uint64_t carry = 0;
+        for (uint32_t k = 0; k < a->nlimbs; k++) {
+                carry += a->limbs[k];
+                if (k < b->nlimbs)
+                        carry += b->limbs[k];
+                c->limbs[k] = (uint32_t)carry;
+                carry >>= 32;
+        }
+        c->limbs[a->nlimbs] = (uint32_t)carry;
+        return trim(c);
+}
+
+Nat *nat_mul(Heap *heap, const Nat *a, const Nat *b)
+{
+        Nat *c = nat_alloc(heap, (uint64_t)a->nlimbs + b->nlimbs);
+        if (!c)
+                return NULL;
+
+        memset(c->limbs, 0, sizeof(uint32_t) * c->nlimbs);
+        for (uint32_t i = 0; i < a->nlimbs; i++) {
+                uint64_t carry = 0;
+                for (uint32_t j = 0; j < b->nlimbs; j++) {
+                        carry += (uint64_t)a->limbs[i] * b->limbs[j] +
+                                 c->limbs[i + j];
+                        c->limbs[i + j] = (uint32_t)carry;
+                        carry >>= 32;
+                }
+                c->limbs[i + b->nlimbs] = (uint32_t)carry;
+        }
+        return trim(c);
+}
+
+Nat *nat_pow(Heap *heap, const Nat *a, uint64_t n)
+{
+        Nat *c = nat_from(heap, 1);
+        const Nat *square = a;
+        while (c && n) {
+                if (n & 1)
+                        c = nat_mul(heap, c, square);
+                n >>= 1;
+                if (n && !(square = nat_mul(heap, square, square)))
+                        return NULL;
+        }
+        return c;
+}
+
+char *nat_decimal(Heap *heap, const Nat *a)
+{
+        uint32_t n = a->nlimbs;
+        // No limb has more than ten digits.
+        size_t ndigits = 10 * (size_t)n + 1;
+        uint32_t *q = heap_alloc(heap, sizeof(uint32_t) * n + 1);
+        char *z = heap_alloc(heap, ndigits + 1);
+        if (!q || !z)
+                return NULL;
+        memcpy(q, a->limbs, sizeof(uint32_t) * n);
+
+        char *p = z + ndigits;
+        *p = 0;
+        do {
+                // Divide by a billion, and write out the remainder's digits
+                // (all nine, unless these are the leading ones).
+                uint64_t r = 0;
+                for (uint32_t k = n; k--;) {
+                        uint64_t cur = r << 32 | q[k];
+                        q[k] = (uint32_t)(cur / 1000000000);
+                        r = cur % 1000000000;
+                }
+                while (n && !q[n - 1])
+                        n--;
+                for (int d = 0; d < 9 && (n || r || !d); d++) {
+                        *--p = '0' + r % 10;
+                        r /= 10;
+                }
+        } while (n);
+        return p;
+}
+
+bool nat_to_u64(const Nat *a, uint64_t *n)
+{
+        switch (a->nlimbs) {
+        case 0:
+                *n = 0;
+                return true;
+        case 1:
+                *n = a->limbs[0];
+                return true;
+        case 2:
+                *n = (uint64_t)a->limbs[1] << 32 | a->limbs[0];
+                return true;
+        }
+        return false;
+}
@@ -0,0 +1,65 @@
+#ifndef CHURCH_2026_10_16_H
+#define CHURCH_2026_10_16_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lambda.h"
+#include "machine.h"
+
+// Church encodings that act_normalize_church() recognises in the post-fix
+// node array (see church.c), and the native numbers it computes with instead.
+
+typedef enum
+{
+        CHURCH_NONE = 0,
+        CHURCH_NUM,    // [f][x](f (f ... x)).  Zero is also false.
+        CHURCH_TRUE,   // [a][b]a
+        CHURCH_SUCC,   // [n][f][x](f (n f x))
+        CHURCH_PLUS,   // [m][n][f][x](m f (n f x))
+        CHURCH_MULT,   // [m][n][f](m (n f))
+        CHURCH_EXP,    // [m][n](n m)
+        CHURCH_ISZERO, // [n](n [x][a][b]b [a][b]a)
+        CHURCH_NOT,    // [p][a][b](p b a)
+        CHURCH_AND,    // [p][q](p q p)
+        CHURCH_OR,     // [p][q](p p q)
+} ChurchOp;
+
+typedef struct {
+        uint32_t op;
+        uint32_t n; // The value of a CHURCH_NUM.
+} ChurchTag;
+
+// Tag every LAMBDA node in nodes[0:size] that is the root of one of the terms
+// above, leaving all other tags[k] as CHURCH_NONE.
+extern void church_match(const AstNode *nodes, uint32_t size, ChurchTag *tags);
+
+// How many arguments the native version of `op` takes (zero for values).
+extern uint32_t church_arity(ChurchOp op);
+
+// ------------------------------------------------------------------
+
+// A natural number, in 32-bit limbs, least significant first, with no leading
+// zero limbs (so zero has none).  `pc` is where the number has been expanded
+// back into a lambda in the code, or -1 if it hasn't been.
+struct Nat {
+        int32_t pc;
+        uint32_t nlimbs;
+        uint32_t limbs[];
+};
+
+// These return NULL if there isn't room in `heap`.
+extern Nat *nat_from(Heap *heap, uint64_t n);
+extern Nat *nat_add(Heap *heap, const Nat *a, const Nat *b);
+extern Nat *nat_mul(Heap *heap, const Nat *a, const Nat *b);
+extern Nat *nat_pow(Heap *heap, const Nat *a, uint64_t n);
+
+// Returns a NUL terminated string of the decimal digits of `a`.
+extern char *nat_decimal(Heap *heap, const Nat *a);
+
+// Sets *n to `a` if it fits.
+extern bool nat_to_u64(const Nat *a, uint64_t *n);
+
+static inline bool nat_is_zero(const Nat *a) { return !a->nlimbs; }
+
+#endif // CHURCH_2026_10_16_H
@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "deque.h"
+#include "lambda.h"
+#include "sink.h"
+#include "untestable.h"
+
+// Running a corpus of files on a pool of workers.  Each file is a task, and
+// the tasks are dealt out round-robin onto the workers' work-stealing deques,
+// so that all of the workers go through the corpus from the front, and one
+// that runs out steals from the back of another's.  Each worker reads, parses,
+// types and prints into buffers of its own (the source, the Ast, the
+// TypeBuffers and the Sinks), which grow to fit the biggest file it has seen,
+// and are reused for the next.
+//
+// Each task's output and errors are taken from the worker's sinks into a
+// result of their own, and this thread writes out the results in the order of
+// the files, as each is done, so that the output doesn't depend on which
+// worker ran what, or when.
+
+typedef struct {
+        char *out, *err;
+        size_t out_len, err_len;
+        bool failed;
+        bool done;
+} CorpusResult;
+
+typedef struct Corpus Corpus;
+
+typedef struct {
+        Corpus *corpus;
+        uint32_t id;
+        pthread_t thread;
+        Deque deque;
+
+        Ast *ast;
+        TypeBuffers *tbufs;
+        char *src;
+        size_t src_alloced;
+        char *ztag;
+        size_t tag_alloced;
+        Tagger out, err;
+} CorpusWorker;
+
+struct Corpus {
+        char **zpaths;
+        size_t npaths;
+        CorpusAction act;
+        void *arg;
+
+        CorpusWorker *workers;
+        uint32_t nworkers;
+
+        // Guarded by `lock`.  `next` is the result being waited for, and
+        // `ready` is signalled when it is done.
+        pthread_mutex_t lock;
+        pthread_cond_t ready;
+        size_t next;
+        CorpusResult *results;
+};
+
+// ------------------------------------------------------------------
+// Listing the files.
+
+static void add_path(Corpus *c, size_t *alloced, char *zpath)
+{
+        if (c->npaths == *alloced) {
+                *alloced = *alloced ? 2 * *alloced : 64;
+                c->zpaths =
+                    realloc_or_die(HERE, c->zpaths, sizeof(char *) * *alloced);
+        }
+        c->zpaths[c->npaths++] = zpath;
+}
+
+static int not_hidden(const struct dirent *d) { return d->d_name[0] != '.'; }
+
+// Add `zpath`, or if it's a directory, the files under it, in order of name
+// (leaving out those whose names start with '.').  Links to directories are
+// left out too, as they could lead round in a loop, unless `named` on the
+// command line.  Paths that can't be read are added all the same, for their
+// tasks to report.
+static void add_files(Corpus *c, size_t *alloced, const char *zpath,
+                      bool named)
+{
+        struct stat st;
+        struct dirent **names;
+        int n;
+        if (!named && lstat(zpath, &st) == 0 && S_ISLNK(st.st_mode) &&
+            stat(zpath, &st) == 0 && S_ISDIR(st.st_mode))
+                return;
+        if (stat(zpath, &st) < 0 || !S_ISDIR(st.st_mode) ||
+            (n = scandir(zpath, &names, not_hidden, alphasort)) < 0) {
+                char *zcopy = strdup(zpath);
+                DIE_IF(!zcopy, "Couldn't copy '%s'.", zpath);
+                add_path(c, alloced, zcopy);
+                return;
+        }
+        size_t len = strlen(zpath);
+        bool slash = len && zpath[len - 1] == '/';
+        for (int k = 0; k < n; k++) {
+                char *zchild;
+                DIE_IF(asprintf(&zchild, "%s%s%s", zpath, slash ? "" : "/",
+                                names[k]->d_name) < 0,
+                       "Couldn't name a file in '%s'.", zpath);
+                add_files(c, alloced, zchild, false);
+                free(zchild);
+                free(names[k]);
+        }
+        free(names);
+}
+
+// ------------------------------------------------------------------
+// The workers.
+
+// Read the file at `zpath` into w->src, returning its length, or -errno.
+static ssize_t read_file(CorpusWorker *w, const char *zpath)
+{
+        struct stat st;
+        int fd = open(zpath, O_RDONLY);
+        if (fd < 0)
+                return -errno;
+        // The size is only a hint.  A directory fails to read, with EISDIR.
+        if (fstat(fd, &st) < 0)
+                st.st_size = 0; // LCOV_EXCL_LINE
+
+        // Room for one more byte than the size, to see the end of the file
+        // in one read, unless it's growing.
+        size_t len = 0;
+        for (;;) {
+                if (len == w->src_alloced ||
+                    w->src_alloced <= (size_t)st.st_size) {
+                        size_t want = (size_t)st.st_size + 1;
+                        want = want > 2 * len ? want : 2 * len;
+                        w->src_alloced = want > 4096 ? want : 4096;
+                        w->src = realloc_or_die(HERE, w->src, w->src_alloced);
+                }
+                size_t room = w->src_alloced - len;
+                ssize_t n = read(fd, w->src + len, read_size(room));
+                if (n < 0 && errno == EINTR)
+                        continue; // LCOV_EXCL_LINE
+                int nerr = read_errnum(w->src + len, n);
+                if (nerr < 0) {
+                        close(fd);
+                        return nerr;
+                }
+                if (!n)
+                        break;
+                len += n;
+        }
+        close(fd);
+        return len;
+}
+
+// Print what `zpath` is to the tags in w->ztag: "PATH: ".
+static void set_tag(CorpusWorker *w, const char *zpath)
+{
+        size_t n = strlen(zpath) + sizeof(": ");
+        if (n > w->tag_alloced) {
+                w->tag_alloced = 2 * n;
+                w->ztag = realloc_or_die(HERE, w->ztag, w->tag_alloced);
+        }
+        snprintf(w->ztag, n, "%s: ", zpath);
+}
+
+// Read, parse and act on file k, and leave its result in c->results[k].
+static void run_task(CorpusWorker *w, size_t k)
+{
+        Corpus *c = w->corpus;
+        const char *zpath = c->zpaths[k];
+        bool failed = true;
+        // Syntax errors and the like are already tagged with the path.
+        w->err.ztag = "";
+        ssize_t len = read_file(w, zpath);
+        if (len < 0) {
+                fprintf(w->err.file, "Error reading %s: %s\n", zpath,
+                        strerror(-len));
+        } else if (len >= (AstIdx)-1) {
+                // LCOV_EXCL_START: the test would need 4GB of source.
+                fprintf(w->err.file,
+                        "%s is %lu bytes, too big to parse without WIDE_AST "
+                        "(see the Makefile).\n",
+                        zpath, (unsigned long)len);
+                // LCOV_EXCL_STOP
+        } else {
+                w->ast = reparse_len(w->ast, zpath, w->src, len);
+                if (!report_syntax_errors(w->err.file, w->ast)) {
+                        set_tag(w, zpath);
+                        w->out.ztag = w->err.ztag = w->ztag;
+                        failed = c->act(w->out.file, w->ast, w->tbufs,
+                                        c->arg) != 0;
+                }
+        }
+        tagger_end_line(&w->out);
+        tagger_end_line(&w->err);
+
+        CorpusResult r = {.failed = failed, .done = true};
+        r.out = sink_take(&w->out.sink, &r.out_len);
+        r.err = sink_take(&w->err.sink, &r.err_len);
+        pthread_mutex_lock(&c->lock);
+        c->results[k] = r;
+        if (k == c->next)
+                pthread_cond_signal(&c->ready);
+        pthread_mutex_unlock(&c->lock);
+}
+
+static int64_t steal(CorpusWorker *w)
+{
+        Corpus *c = w->corpus;
+        for (uint32_t k = 1; k < c->nworkers; k++) {
+                CorpusWorker *victim = &c->workers[(w->id + k) % c->nworkers];
+                int64_t r;
+                while ((r = deque_steal(&victim->deque)) == DEQUE_ABORT)
+                        ;
+                if (r != DEQUE_EMPTY)
+                        return r;
+        }
+        return DEQUE_EMPTY;
+}
+
+// All of the tasks are pushed before the workers start, so once every deque
+// has come up empty, there is nothing left to do.
+static void *work(void *arg)
+{
+        CorpusWorker *w = arg;
+        set_error_stream(w->err.file);
+        for (;;) {
+                int64_t k = deque_take(&w->deque);
+                if (k == DEQUE_EMPTY)
+                        k = steal(w);
+                if (k == DEQUE_EMPTY)
+                        break;
+                run_task(w, k);
+        }
+        set_error_stream(NULL);
+        return NULL;
+}
+
+static void start_worker(Corpus *c, uint32_t id)
+{
+        CorpusWorker *w = &c->workers[id];
+        *w = (CorpusWorker){.corpus = c, .id = id};
+        deque_init(&w->deque);
+        w->tbufs = new_type_buffers();
+        // Tasks id, id + n, id + 2n and so on, pushed last first, so that
+        // the owner takes them in order.
+        size_t n = c->nworkers, count = (c->npaths - id + n - 1) / n;
+        for (size_t j = count; j--;)
+                deque_push(&w->deque, id + j * n);
+        sink_open_memory(&w->out.sink);
+        sink_open_memory(&w->err.sink);
+        tagger_open(&w->out, false);
+        tagger_open(&w->err, false);
+}
+
+static void free_worker(CorpusWorker *w)
+{
+        tagger_close(&w->out);
+        tagger_close(&w->err);
+        deque_free(&w->deque);
+        if (w->ast)
+                delete_ast(w->ast);
+        delete_type_buffers(w->tbufs);
+        free(w->src);
+        free(w->ztag);
+}
+
+// ------------------------------------------------------------------
+
+int act_corpus(FILE *oot, char *const *zpaths, size_t npaths,
+               uint32_t nthreads, CorpusAction act, void *arg)
+{
+        Corpus c = {.act = act, .arg = arg};
+        size_t alloced = 0;
+        for (size_t k = 0; k < npaths; k++)
+                add_files(&c, &alloced, zpaths[k], true);
+        if (!c.npaths) {
+                free(c.zpaths);
+                return 0;
+        }
+
+        if (!nthreads) {
+                long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+                nthreads = ncpus > 0 ? ncpus : 1;
+        }
+        c.nworkers = nthreads < c.npaths ? nthreads : c.npaths;
+        c.workers = realloc_or_die(HERE, NULL,
+                                   sizeof(CorpusWorker) * c.nworkers);
+        c.results = realloc_or_die(HERE, NULL,
+                                   sizeof(CorpusResult) * c.npaths);
+        memset(c.results, 0, sizeof(CorpusResult) * c.npaths);
+        pthread_mutex_init(&c.lock, NULL);
+        pthread_cond_init(&c.ready, NULL);
+        for (uint32_t k = 0; k < c.nworkers; k++)
+                start_worker(&c, k);
+        for (uint32_t k = 0; k < c.nworkers; k++) {
+                DIE_IF(pthread_create(&c.workers[k].thread, NULL, work,
+                                      &c.workers[k]),
+                       "Can't start a corpus worker.");
+        }
+
+        // Write out the results in order, as they are done.
+        Sink out;
+        sink_open_file(&out, oot);
+        FILE *err = error_stream();
+        int nfailed = 0;
+        for (size_t k = 0; k < c.npaths; k++) {
+                pthread_mutex_lock(&c.lock);
+                c.next = k;
+                while (!c.results[k].done)
+                        pthread_cond_wait(&c.ready, &c.lock);
+                CorpusResult r = c.results[k];
+                pthread_mutex_unlock(&c.lock);
+
+                sink_write(&out, r.out, r.out_len);
+                if (r.err_len) {
+                        // In step with the output so far.
+                        sink_flush(&out);
+                        fwrite(r.err, 1, r.err_len, err);
+                        fflush(err);
+                }
+                nfailed += r.failed;
+                free(r.out);
+                free(r.err);
+                free(c.zpaths[k]);
+        }
+        nfailed += sink_close(&out);
+
+        for (uint32_t k = 0; k < c.nworkers; k++) {
+                pthread_join(c.workers[k].thread, NULL);
+                free_worker(&c.workers[k]);
+        }
+        pthread_cond_destroy(&c.ready);
+        pthread_mutex_destroy(&c.lock);
+        free(c.results);
+        free(c.workers);
+        free(c.zpaths);
+        return nfailed;
+}
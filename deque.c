@@ -0,0 +1,101 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "deque.h"
+#include "untestable.h"
+
+// Arrays replaced by bigger ones are kept until the deque is freed, since a
+// thief may still be reading them.
+struct DequeArray {
+        DequeArray *retired;
+        int64_t size;
+        _Atomic int64_t items[];
+};
+
+static DequeArray *new_deque_array(int64_t size, DequeArray *retired)
+{
+        DequeArray *a = realloc_or_die(
+            HERE, NULL, sizeof(DequeArray) + sizeof(a->items[0]) * size);
+        a->retired = retired;
+        a->size = size;
+        return a;
+}
+
+void deque_init(Deque *q)
+{
+        atomic_init(&q->top, 0);
+        atomic_init(&q->bottom, 0);
+        atomic_init(&q->array, new_deque_array(64, NULL));
+}
+
+void deque_push(Deque *q, int64_t x)
+{
+        int64_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+        int64_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+        DequeArray *a = atomic_load_explicit(&q->array, memory_order_relaxed);
+        if (b - t > a->size - 1) {
+                DequeArray *bigger = new_deque_array(2 * a->size, a);
+                for (int64_t k = t; k < b; k++) {
+                        int64_t item = atomic_load_explicit(
+                            &a->items[k % a->size], memory_order_relaxed);
+                        atomic_store_explicit(&bigger->items[k % bigger->size],
+                                              item, memory_order_relaxed);
+                }
+                atomic_store_explicit(&q->array, bigger, memory_order_release);
+                a = bigger;
+        }
+        atomic_store_explicit(&a->items[b % a->size], x, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+}
+
+int64_t deque_take(Deque *q)
+{
+        int64_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+        DequeArray *a = atomic_load_explicit(&q->array, memory_order_relaxed);
+        atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t t = atomic_load_explicit(&q->top, memory_order_relaxed);
+        if (t > b) {
+                atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+                return DEQUE_EMPTY;
+        }
+        int64_t x =
+            atomic_load_explicit(&a->items[b % a->size], memory_order_relaxed);
+        if (t == b) {
+                // The last item: race any thieves for it.
+                if (!atomic_compare_exchange_strong_explicit(
+                        &q->top, &t, t + 1, memory_order_seq_cst,
+                        memory_order_relaxed))
+                        x = DEQUE_EMPTY; // LCOV_EXCL_LINE (a lost race)
+                atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+        }
+        return x;
+}
+
+int64_t deque_steal(Deque *q)
+{
+        int64_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+        if (t >= b)
+                return DEQUE_EMPTY;
+        DequeArray *a = atomic_load_explicit(&q->array, memory_order_acquire);
+        int64_t x =
+            atomic_load_explicit(&a->items[t % a->size], memory_order_relaxed);
+        if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed))
+                return DEQUE_ABORT; // LCOV_EXCL_LINE (a lost race)
+        return x;
+}
+
+void deque_free(Deque *q)
+{
+        DequeArray *a = atomic_load(&q->array), *next;
+        for (; a; a = next) {
+                next = a->retired;
+                free(a);
+        }
+}
@@ -0,0 +1,36 @@
+#ifndef DEQUE_2026_10_17_H
+#define DEQUE_2026_10_17_H
+
+#include <stdint.h>
+
+// Chase-Lev work-stealing deques, as in "Correct and Efficient Work-Stealing
+// for Weak Memory Models" (Le, Pop, Cohen and Zappa Nardelli, 2013), of
+// non-negative int64_t items.  The owner pushes and takes at the bottom, last
+// in first out, and other threads steal from the top.
+typedef struct DequeArray DequeArray;
+
+typedef struct {
+        _Atomic int64_t top;
+        _Atomic int64_t bottom;
+        _Atomic(DequeArray *) array;
+} Deque;
+
+// What deque_take() and deque_steal() return if there's nothing to take, and
+// deque_steal() if it lost a race for the top item, when it may try again.
+#define DEQUE_EMPTY -1
+#define DEQUE_ABORT -2
+
+// Make `q` empty.  It isn't safe to share until the thieves have been told
+// about it (by pthread_create(), say).
+extern void deque_init(Deque *q);
+
+// Only the deque's owner may push or take.
+extern void deque_push(Deque *q, int64_t x);
+extern int64_t deque_take(Deque *q);
+
+extern int64_t deque_steal(Deque *q);
+
+// Free the deque, once no thread will touch it again.
+extern void deque_free(Deque *q);
+
+#endif // DEQUE_2026_10_17_H
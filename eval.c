@@ -0,0 +1,305 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "eval.h"
+#include "lambda.h"
+#include "untestable.h"
+
+// Every step copies the whole term, so the default budget is modest.
+static const EvalBudget default_budget = {
+    .max_steps = 1u << 12,
+    .max_bytes = 16u << 20,
+};
+
+// A term stored in post-fix order, with the root at nodes[size - 1].
+typedef struct {
+        const AstNode *nodes;
+        uint32_t size;
+} Term;
+
+// A beta-redex `([x]BODY ARG)`.  Because the lambda is the callee, its
+// subtree begins the redex:
+//
+//        first ... body  param-slot  lambda  arg-first ... arg  call
+//
+typedef struct {
+        uint32_t first;
+        uint32_t lambda;
+        uint32_t call;
+} Redex;
+
+// A Reducer rewrites its term one beta-step at a time.  Each step writes a new
+// copy of the whole term into one of two arenas, which is then the source for
+// the next step.  So memory use is bounded by (about) twice the largest term.
+typedef struct {
+        Arena spaces[2];
+        unsigned current;
+        uint64_t steps;
+        uint64_t max_steps;
+        Term term;
+} Reducer;
+
+// ------------------------------------------------------------------
+
+// Fill first[k] with the index of the first node of the subtree rooted at k.
+// Post-fix order means this is one forward pass: a subtree starts where its
+// leftmost child does.
+void find_subtree_starts(const AstNode *nodes, uint32_t size, uint32_t *first)
+{
+        for (uint32_t k = 0; k < size; k++) {
+                AstVal val;
+                switch (ast_unpack(nodes, k, &val)) {
+                case ANT_CALL:
+                        first[k] = first[val];
+                        continue;
+                case ANT_LAMBDA:
+                        first[k] = first[ast_lambda_body(nodes, k)];
+                        continue;
+                case ANT_VAR:
+                case ANT_BOUND:
+                        first[k] = k;
+                        continue;
+                }
+        }
+}
+
+// Find the leftmost, outermost redex.  That is the redex with the smallest
+// `first`, and amongst redexes sharing a `first`, the one with the biggest
+// root.  Returns false if the term is already in normal form.
+static bool find_redex(const AstNode *nodes, uint32_t size,
+                       const uint32_t *first, Redex *redex)
+{
+        bool found = false;
+        for (uint32_t k = 0; k < size; k++) {
+                AstVal callee;
+                if (ast_unpack(nodes, k, &callee) != ANT_CALL)
+                        continue;
+                if (ast_type(nodes[callee]) != ANT_LAMBDA)
+                        continue;
+                if (found && first[callee] > redex->first)
+                        continue;
+                *redex = (Redex){
+                    .first = first[callee],
+                    .lambda = callee,
+                    .call = k,
+                };
+                found = true;
+        }
+        return found;
+}
+
+// For each node k in the subtree nodes[lo:root+1], set depth[k - lo] to the
+// number of lambdas in the subtree whose bodies contain k.  A BOUND node with
+// depth[k - lo] <= BOUND.depth refers to a lambda outside the subtree.
+// `stack` is scratch space with room for a value per node.
+static void find_binder_depths(const AstNode *nodes, const uint32_t *first,
+                               uint32_t lo, uint32_t root, uint32_t *depth,
+                               uint32_t *stack)
+{
+        uint32_t sp = 0;
+        for (uint32_t k = root + 1; k-- > lo;) {
+                while (sp && stack[sp - 1] > k)
+                        sp--;
+                depth[k - lo] = sp;
+                if (ast_type(nodes[k]) == ANT_LAMBDA)
+                        stack[sp++] = first[k];
+        }
+}
+
+// Copy the subtree nodes[lo:lo+n] to out[o:o+n] adding `shift` to every BOUND
+// that refers to a lambda outside the subtree.  Returns o + n.
+static uint32_t copy_shifted(AstNode *out, uint32_t o, const AstNode *nodes,
+                             uint32_t lo, uint32_t n, const uint32_t *depth,
+                             int32_t shift)
+{
+        for (uint32_t k = 0; k < n; k++) {
+                AstNode node = nodes[lo + k];
+                if (ast_type(node) == ANT_BOUND && ast_val(node) >= depth[k])
+                        node = ast_node(ANT_BOUND, ast_val(node) + shift);
+                out[o++] = node;
+        }
+        return o;
+}
+
+static void *scratch(Arena *arena, uint32_t n, size_t size)
+{
+        return arena_alloc(arena, n * size);
+}
+
+// Perform one normal-order beta-step on red->term, or report that it is in
+// normal form.  The step is a linear copy: the nodes before the redex are
+// copied as is, the body is copied with the argument spliced in (shifted) at
+// each use of the parameter, and the nodes after the redex are copied with
+// the `arg_size` of each enclosing CALL adjusted for the change in size.
+static EvalStatus reduce_step(Reducer *red)
+{
+        const AstNode *nodes = red->term.nodes;
+        uint32_t size = red->term.size;
+        Arena *to = red->spaces + !red->current;
+        arena_reset(to);
+
+        uint32_t *first = scratch(to, size, sizeof(uint32_t));
+        if (!first)
+                return EVAL_OUT_OF_MEMORY;
+        find_subtree_starts(nodes, size, first);
+
+        Redex rx;
+        if (!find_redex(nodes, size, first, &rx))
+                return EVAL_NORMAL_FORM;
+        if (red->steps >= red->max_steps)
+                return EVAL_OUT_OF_STEPS;
+
+        uint32_t body = ast_lambda_body(nodes, rx.lambda);
+        uint32_t arg = ast_arg_idx(nodes, rx.call);
+        uint32_t body_lo = rx.first, arg_lo = rx.lambda + 1;
+        uint32_t nbody = body - body_lo + 1, narg = rx.call - arg_lo;
+
+        uint32_t *body_depth = scratch(to, nbody, sizeof(uint32_t));
+        uint32_t *arg_depth = scratch(to, narg, sizeof(uint32_t));
+        uint32_t *outpos = scratch(to, nbody, sizeof(uint32_t));
+        uint32_t *stack = scratch(to, nbody + narg, sizeof(uint32_t));
+        if (!body_depth || !arg_depth || !outpos || !stack)
+                return EVAL_OUT_OF_MEMORY;
+        find_binder_depths(nodes, first, body_lo, body, body_depth, stack);
+        find_binder_depths(nodes, first, arg_lo, arg, arg_depth, stack);
+
+        uint64_t nuses = 0;
+        for (uint32_t k = body_lo; k <= body; k++) {
+                AstNode n = nodes[k];
+                nuses += ast_type(n) == ANT_BOUND &&
+                         ast_val(n) == body_depth[k - body_lo];
+        }
+
+        uint64_t nredex = rx.call - rx.first + 1;
+        uint64_t nreduct = nbody + nuses * (narg - 1);
+        uint64_t new_size = size - nredex + nreduct;
+        if (new_size > EVAL_MAX_NODES)
+                return EVAL_OUT_OF_MEMORY;
+        AstNode *out = scratch(to, new_size, sizeof(AstNode));
+        if (!out)
+                return EVAL_OUT_OF_MEMORY;
+
+        memcpy(out, nodes, sizeof(AstNode) * rx.first);
+        uint32_t o = rx.first;
+        for (uint32_t k = body_lo; k <= body; k++) {
+                uint32_t d = body_depth[k - body_lo];
+                outpos[k - body_lo] = o;
+
+                AstVal val;
+                switch (ast_unpack(nodes, k, &val)) {
+                case ANT_BOUND:
+                        if (val == (int32_t)d) {
+                                o = copy_shifted(out, o, nodes, arg_lo, narg,
+                                                 arg_depth, d);
+                                continue;
+                        }
+                        out[o++] = val > (int32_t)d
+                                       ? ast_node(ANT_BOUND, val - 1)
+                                       : nodes[k];
+                        continue;
+                case ANT_CALL:
+                        val = first[ast_arg_idx(nodes, k)] - body_lo;
+                        out[o] = ast_node(ANT_CALL, o - outpos[val]);
+                        o++;
+                        continue;
+                case ANT_VAR:
+                case ANT_LAMBDA:
+                        out[o++] = nodes[k];
+                        continue;
+                }
+        }
+
+        int32_t growth = (int32_t)(nreduct - nredex);
+        for (uint32_t k = rx.call + 1; k < size; k++) {
+                AstNode n = nodes[k];
+                if (ast_type(n) == ANT_CALL && k - ast_val(n) <= rx.first)
+                        n = ast_node(ANT_CALL, ast_val(n) + growth);
+                out[o++] = n;
+        }
+        assert(o == new_size);
+
+        red->term = (Term){.nodes = out, .size = new_size};
+        red->current = !red->current;
+        red->steps++;
+        return EVAL_REDUCED;
+}
+
+static EvalStatus reduce(Reducer *red)
+{
+        EvalStatus status;
+        while ((status = reduce_step(red)) == EVAL_REDUCED)
+                ;
+        return status;
+}
+
+// ------------------------------------------------------------------
+
+EvalBudget eval_budget_or_default(const EvalBudget *budget,
+                                  EvalBudget defaults)
+{
+        EvalBudget b = budget ? *budget : (EvalBudget){0};
+        if (!b.max_steps ||
+            (b.cap_steps && b.max_steps > defaults.max_steps))
+                b.max_steps = defaults.max_steps;
+        if (!b.max_bytes ||
+            (b.cap_bytes && b.max_bytes > defaults.max_bytes))
+                b.max_bytes = defaults.max_bytes;
+        return b;
+}
+
+int report_eval_failure(EvalStatus status, const EvalBudget *budget,
+                        uint64_t steps)
+{
+        FILE *err = error_stream();
+        switch (status) {
+        // LCOV_EXCL_START
+        case EVAL_REDUCED:
+                DIE_LCOV_EXCL_LINE("Evaluation stopped while reducing.");
+        // LCOV_EXCL_STOP
+        case EVAL_NORMAL_FORM:
+                return 0;
+        case EVAL_OUT_OF_STEPS:
+                fprintf(err,
+                        "Evaluation error: no normal form within %lu steps.\n",
+                        (unsigned long)budget->max_steps);
+                break;
+        case EVAL_OUT_OF_MEMORY:
+                fprintf(err,
+                        "Evaluation error: out of memory (%lu bytes) after "
+                        "%lu steps.\n",
+                        (unsigned long)budget->max_bytes,
+                        (unsigned long)steps);
+                break;
+        case EVAL_LOST:
+                fprintf(err, "Evaluation error: lost track of the term "
+                             "while reading it back.\n");
+                break;
+        }
+        fflush(err);
+        return 1;
+}
+
+int act_eval(FILE *oot, const Ast *ast, const EvalBudget *budget)
+{
+        EvalBudget b = eval_budget_or_default(budget, default_budget);
+        Reducer red = {.max_steps = b.max_steps};
+        red.spaces[0].limit = red.spaces[1].limit = b.max_bytes / 2;
+        AstIdx size;
+        red.term.nodes = ast_postfix(ast, &size);
+        red.term.size = size;
+
+        EvalStatus status = reduce(&red);
+        if (status == EVAL_NORMAL_FORM)
+                unparse_postfix(oot, red.term.nodes, red.term.size);
+        int nerr = report_eval_failure(status, &b, red.steps);
+
+        arena_free(red.spaces + 0);
+        arena_free(red.spaces + 1);
+        return nerr;
+}
@@ -0,0 +1,66 @@
+#ifndef EVAL_2026_10_16_H
+#define EVAL_2026_10_16_H
+
+#include <stdint.h>
+
+#include "lambda.h"
+
+// Things shared by the evaluators (eval.c, lazy.c ...), but not by the rest
+// of the program.
+
+typedef enum
+{
+        EVAL_REDUCED, // Progress was made, but there is more work to do.
+        EVAL_NORMAL_FORM,
+        EVAL_OUT_OF_STEPS,
+        EVAL_OUT_OF_MEMORY,
+        EVAL_LOST, // The result can't be read back (see net.c).
+} EvalStatus;
+
+// Returns a copy of `budget` (which may be NULL) with zero fields replaced by
+// defaults, as are fields beyond them that are capped.  What counts as a "step" (and how much each costs) depends on the
+// evaluator, so each passes in its own defaults.
+extern EvalBudget eval_budget_or_default(const EvalBudget *budget,
+                                         EvalBudget defaults);
+
+// Set first[k] to the index of the first node of the subtree rooted at k, for
+// every k < size.
+extern void find_subtree_starts(const AstNode *nodes, uint32_t size,
+                                uint32_t *first);
+
+// Report to error_stream() why evaluation stopped without a normal form.
+// Returns the number of errors reported (zero for EVAL_NORMAL_FORM).
+extern int report_eval_failure(EvalStatus status, const EvalBudget *budget,
+                               uint64_t steps);
+
+// ------------------------------------------------------------------
+
+// An EvalContext is a call-by-need evaluation (see lazy.c) that can be
+// suspended after any step and resumed later, like a coroutine.  All of its
+// state, including its heap, stacks and position in the code, is in the
+// context, so any number of them can be in progress at once.  The code must
+// outlive the context.
+typedef struct EvalContext EvalContext;
+
+// Start evaluating the term in post-fix order at code[0:size], within the
+// limits of `budget` (which may be NULL for the defaults).  The limits apply
+// to this context alone.
+extern EvalContext *new_eval_context(const AstNode *code, uint32_t size,
+                                     const EvalBudget *budget);
+
+// Run for at most `fuel` more steps.  Returns EVAL_REDUCED if the evaluation
+// was suspended and should be run again, and otherwise how it finished (which
+// it will keep returning).
+extern EvalStatus eval_context_run(EvalContext *ctx, uint64_t fuel);
+
+// The normal form found by a context that returned EVAL_NORMAL_FORM, in
+// post-fix order.  The context retains ownership.
+extern const AstNode *eval_context_result(const EvalContext *ctx,
+                                          uint32_t *size);
+
+// report_eval_failure() for a finished context.
+extern int eval_context_report(const EvalContext *ctx);
+
+extern void delete_eval_context(EvalContext *ctx);
+
+#endif // EVAL_2026_10_16_H
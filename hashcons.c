@@ -0,0 +1,156 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lambda.h"
+#include "untestable.h"
+
+// Hash-consing turns the post-fix node array into a DAG with one node per
+// distinct subterm.  The nodes are numbered in the order their first
+// occurrences end, so (as in the post-fix array) every node comes after its
+// kids, and a term with no repeated subterms gets the same numbering as its
+// post-fix array.
+//
+// The distinct nodes are found with an open-addressed hash table of ids,
+// keyed by the node's type, its token or depth, and the ids of its kids.  When
+// lambdas aren't to be shared, a LAMBDA's key also has its post-fix index.
+
+struct AstDag {
+        uint32_t nnodes;  // Nodes in the post-fix array.
+        uint32_t size;    // Distinct subterms.
+        uint32_t alloced; // Room in `nodes`.
+        uint32_t *ids;    // The id of each node of the post-fix array.
+        DagNode *nodes;
+};
+
+typedef struct {
+        uint32_t mask;
+        uint32_t *slots; // Holds ids plus one, so zero is an empty slot.
+} IdTable;
+
+static uint32_t hash_node(DagNode n)
+{
+        uint64_t h =
+            (uint64_t)ast_type(n.node) << 32 | (uint32_t)ast_val(n.node);
+        h ^= ((uint64_t)n.kids[0] << 32 | n.kids[1]) * 0x9e3779b97f4a7c15ull;
+        h = (h ^ (h >> 31)) * 0xbf58476d1ce4e5b9ull;
+        return (uint32_t)(h ^ (h >> 29));
+}
+
+static bool same_node(DagNode a, DagNode b)
+{
+        return ast_type(a.node) == ast_type(b.node) &&
+               ast_val(a.node) == ast_val(b.node) &&
+               a.kids[0] == b.kids[0] && a.kids[1] == b.kids[1];
+}
+
+static uint32_t *find_slot(const IdTable *t, const DagNode *nodes, DagNode n)
+{
+        for (uint32_t h = hash_node(n);; h++) {
+                uint32_t *slot = t->slots + (h & t->mask);
+                if (!*slot || same_node(nodes[*slot - 1], n))
+                        return slot;
+        }
+}
+
+// Double the table, keeping it at most half full.
+static void grow_table(IdTable *t, const DagNode *nodes, uint32_t size)
+{
+        uint32_t nslots = 2 * (t->mask + 1);
+        DIE_IF(!nslots, "Too many distinct subterms to hash-cons.");
+        free(t->slots);
+        t->slots = calloc(nslots, sizeof(uint32_t));
+        DIE_IF(!t->slots, "Couldn't allocate %u hash slots.", nslots);
+        t->mask = nslots - 1;
+        for (uint32_t id = 0; id < size; id++)
+                *find_slot(t, nodes, nodes[id]) = id + 1;
+}
+
+// The node at nodes[k], in terms of the ids of its kids.
+static DagNode dag_node(const AstNode *nodes, const uint32_t *ids, uint32_t k,
+                        bool share_lambdas)
+{
+        AstVal val;
+        DagNode n = {.node = nodes[k]};
+        switch (ast_unpack(nodes, k, &val)) {
+        case ANT_CALL:
+                // The arg_size only makes sense in the post-fix array.
+                n.node = ast_node(ANT_CALL, 0);
+                n.kids[0] = ids[val];
+                n.kids[1] = ids[ast_arg_idx(nodes, k)];
+                break;
+        case ANT_LAMBDA:
+                if (!share_lambdas)
+                        n.node = ast_node(ANT_LAMBDA, k);
+                n.kids[0] = ids[k - 1];
+                n.kids[1] = ids[ast_lambda_body(nodes, k)];
+                break;
+        case ANT_VAR:
+        case ANT_BOUND:
+                break;
+        }
+        return n;
+}
+
+AstDag *hash_cons(const Ast *ast, bool share_lambdas)
+{
+        AstIdx nnodes;
+        const AstNode *nodes = ast_postfix(ast, &nnodes);
+
+        AstDag *dag = realloc_or_die(HERE, NULL, sizeof(AstDag));
+        *dag = (AstDag){
+            .nnodes = nnodes,
+            .ids = realloc_or_die(HERE, NULL, sizeof(uint32_t) * nnodes),
+        };
+        IdTable t = {0};
+        grow_table(&t, dag->nodes, 0);
+
+        for (uint32_t k = 0; k < nnodes; k++) {
+                DagNode n = dag_node(nodes, dag->ids, k, share_lambdas);
+                uint32_t *slot = find_slot(&t, dag->nodes, n);
+                if (*slot) {
+                        dag->ids[k] = *slot - 1;
+                        continue;
+                }
+
+                if (dag->size == dag->alloced) {
+                        dag->alloced = dag->alloced ? 2 * dag->alloced : 64;
+                        dag->nodes = realloc_or_die(
+                            HERE, dag->nodes, sizeof(DagNode) * dag->alloced);
+                }
+                uint32_t id = dag->size++;
+                dag->nodes[id] = n;
+                dag->ids[k] = id;
+                *slot = id + 1;
+                if (2 * dag->size > t.mask)
+                        grow_table(&t, dag->nodes, dag->size);
+        }
+
+        free(t.slots);
+        dag->nodes = realloc_or_die(HERE, dag->nodes,
+                                    sizeof(DagNode) * dag->size);
+        dag->alloced = dag->size;
+        return dag;
+}
+
+const DagNode *dag_nodes(const AstDag *dag, uint32_t *size)
+{
+        *size = dag->size;
+        return dag->nodes;
+}
+
+const uint32_t *dag_ids(const AstDag *dag, uint32_t *nnodes)
+{
+        *nnodes = dag->nnodes;
+        return dag->ids;
+}
+
+void delete_dag(AstDag *dag)
+{
+        free(dag->ids);
+        free(dag->nodes);
+        free(dag);
+}
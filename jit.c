@@ -0,0 +1,723 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "eval.h"
+#include "lambda.h"
+#include "machine.h"
+#include "untestable.h"
+#include "vm.h"
+
+// A JIT for the bytecode in vm.h, for x86-64 Linux.  Hosts other than that
+// use the bytecode interpreter instead.
+//
+// Each instruction is compiled to inline machine code for its common case,
+// plus a "slow path" that calls a C handler built on the same inline ops as
+// the interpreter.  The budget is checked once per basic block rather than
+// once per instruction: an instruction that can be jumped to at run time
+// starts with a guard that checks there are enough steps and enough room in
+// the heap and stacks for every instruction up to the next jump, and takes
+// the slow path if not.  The slow path runs just the one instruction, with
+// exactly the interpreter's checks, so step counts and out-of-memory errors
+// are the same as with --eval=vm.
+
+static const EvalBudget default_budget = {
+    .max_steps = 1u << 26,
+    .max_bytes = 64u << 20,
+};
+
+#if defined(__x86_64__) && defined(__linux__)
+
+typedef struct {
+        Vm vm; // First, so that a Vm * can be cast back to its Jit.
+        uint8_t *text;
+        size_t text_size;
+        uint8_t **native; // native[pc] is the guarded entry to code[pc].
+        uint8_t *exit;
+        EvalStatus status;
+} Jit;
+
+#define OFF(field) ((int32_t)offsetof(Jit, vm.field))
+
+// ------------------------------------------------------------------
+// The slow paths.  Handlers of instructions that go on to the next (or a
+// known) instruction return NULL, or the exit stub if the budget ran out.
+// The others return the machine code to jump to.
+
+typedef uint8_t *(*Handler)(Jit *jit, int32_t operand, uint32_t next);
+
+static bool jit_step(Jit *jit)
+{
+        Vm *vm = &jit->vm;
+        if (!vm_reserve(vm)) {
+                jit->status = EVAL_OUT_OF_MEMORY;
+                return false;
+        }
+        if (vm->steps >= vm->max_steps) {
+                jit->status = EVAL_OUT_OF_STEPS;
+                return false;
+        }
+        vm->steps++;
+        return true;
+}
+
+static uint8_t *jit_goto(Jit *jit) { return jit->native[jit->vm.pc]; }
+
+static uint8_t *jit_halt(Jit *jit, int32_t operand, uint32_t next)
+{
+        if (jit_step(jit))
+                jit->status = EVAL_NORMAL_FORM;
+        return jit->exit;
+}
+
+static uint8_t *jit_push_var(Jit *jit, int32_t tok, uint32_t next)
+{
+        if (!jit_step(jit))
+                return jit->exit;
+        vm_push_var(&jit->vm, tok, next);
+        return NULL;
+}
+
+static uint8_t *jit_access(Jit *jit, int32_t n, uint32_t next)
+{
+        if (!jit_step(jit))
+                return jit->exit;
+        vm_access(&jit->vm, n, next);
+        return jit_goto(jit);
+}
+
+static uint8_t *jit_share(Jit *jit, int32_t n, uint32_t next)
+{
+        if (!jit_step(jit))
+                return jit->exit;
+        vm_share(&jit->vm, n, next);
+        return NULL;
+}
+
+static uint8_t *jit_closure(Jit *jit, int32_t len, uint32_t next)
+{
+        if (!jit_step(jit))
+                return jit->exit;
+        vm_closure(&jit->vm, len, next);
+        return NULL;
+}
+
+static uint8_t *jit_thunk(Jit *jit, int32_t len, uint32_t next)
+{
+        if (!jit_step(jit))
+                return jit->exit;
+        vm_thunk(&jit->vm, len, next);
+        return NULL;
+}
+
+static uint8_t *jit_apply(Jit *jit, int32_t operand, uint32_t next)
+{
+        if (!jit_step(jit))
+                return jit->exit;
+        vm_apply(&jit->vm, false, next);
+        return jit_goto(jit);
+}
+
+static uint8_t *jit_tail_apply(Jit *jit, int32_t operand, uint32_t next)
+{
+        if (!jit_step(jit))
+                return jit->exit;
+        vm_apply(&jit->vm, true, next);
+        return jit_goto(jit);
+}
+
+static uint8_t *jit_return(Jit *jit, int32_t operand, uint32_t next)
+{
+        if (!jit_step(jit))
+                return jit->exit;
+        vm_return(&jit->vm);
+        return jit_goto(jit);
+}
+
+static const Handler handlers[NOPCODES] = {
+    [OP_HALT] = jit_halt,
+    [OP_PUSH_VAR] = jit_push_var,
+    [OP_ACCESS] = jit_access,
+    [OP_SHARE] = jit_share,
+    [OP_CLOSURE] = jit_closure,
+    [OP_THUNK] = jit_thunk,
+    [OP_APPLY] = jit_apply,
+    [OP_TAIL_APPLY] = jit_tail_apply,
+    [OP_RETURN] = jit_return,
+};
+
+// ------------------------------------------------------------------
+// Just enough of an x86-64 assembler.  Memory operands are always either
+// [base + disp32] or [base + index*8 + disp32], and rsp, rbp and r8-r15 are
+// never used, so no SIB-only or REX.B cases come up.  The Jit * lives in rbx,
+// which is callee-saved, so it survives calls to the handlers.
+
+typedef enum
+{
+        RAX = 0,
+        RCX = 1,
+        RDX = 2,
+        RBX = 3,
+        RSI = 6,
+        RDI = 7,
+} Reg;
+
+typedef enum
+{
+        CC_B = 0x2,
+        CC_E = 0x4,
+        CC_NE = 0x5,
+        CC_A = 0x7,
+} Cond;
+
+#define REX_W 0x48
+
+typedef struct {
+        uint8_t *text; // NULL while only measuring.
+        size_t at;
+} Asm;
+
+static void put(Asm *a, const void *bytes, size_t n)
+{
+        if (a->text)
+                memcpy(a->text + a->at, bytes, n);
+        a->at += n;
+}
+
+static void put_u8(Asm *a, uint8_t u) { put(a, &u, 1); }
+
+static void put_u32(Asm *a, uint32_t u) { put(a, &u, 4); }
+
+static void put_u64(Asm *a, uint64_t u) { put(a, &u, 8); }
+
+// op reg, [base + disp]
+static void op_mem(Asm *a, uint8_t rex, uint8_t op, int reg, Reg base,
+                   int32_t disp)
+{
+        if (rex)
+                put_u8(a, rex);
+        put_u8(a, op);
+        put_u8(a, 0x80 | reg << 3 | base);
+        put_u32(a, disp);
+}
+
+// op reg, [base + index*8 + disp]
+static void op_idx(Asm *a, uint8_t rex, uint8_t op, int reg, Reg base,
+                   Reg index, int32_t disp)
+{
+        if (rex)
+                put_u8(a, rex);
+        put_u8(a, op);
+        put_u8(a, 0x84 | reg << 3);
+        put_u8(a, 0xc0 | index << 3 | base);
+        put_u32(a, disp);
+}
+
+// op rm, reg
+static void op_reg(Asm *a, uint8_t rex, uint8_t op, Reg reg, Reg rm)
+{
+        if (rex)
+                put_u8(a, rex);
+        put_u8(a, op);
+        put_u8(a, 0xc0 | reg << 3 | rm);
+}
+
+static void load64(Asm *a, Reg r, Reg base, int32_t disp)
+{
+        op_mem(a, REX_W, 0x8b, r, base, disp);
+}
+
+static void store64(Asm *a, Reg r, Reg base, int32_t disp)
+{
+        op_mem(a, REX_W, 0x89, r, base, disp);
+}
+
+static void load32(Asm *a, Reg r, Reg base, int32_t disp)
+{
+        op_mem(a, 0, 0x8b, r, base, disp);
+}
+
+static void store32(Asm *a, Reg r, Reg base, int32_t disp)
+{
+        op_mem(a, 0, 0x89, r, base, disp);
+}
+
+// mov dword (or, with REX.W, a sign-extended qword) [base + disp], imm
+static void store_imm(Asm *a, uint8_t rex, Reg base, int32_t disp, int32_t imm)
+{
+        op_mem(a, rex, 0xc7, 0, base, disp);
+        put_u32(a, imm);
+}
+
+// cmp dword [base + disp], imm
+static void cmp_imm(Asm *a, Reg base, int32_t disp, int32_t imm)
+{
+        op_mem(a, 0, 0x81, 7, base, disp);
+        put_u32(a, imm);
+}
+
+static void add_imm(Asm *a, uint8_t rex, Reg r, int32_t imm)
+{
+        op_reg(a, rex, 0x81, 0, r);
+        put_u32(a, imm);
+}
+
+static void mov_imm32(Asm *a, Reg r, uint32_t imm)
+{
+        put_u8(a, 0xb8 | r);
+        put_u32(a, imm);
+}
+
+static void jmp_to(Asm *a, size_t target)
+{
+        put_u8(a, 0xe9);
+        put_u32(a, target - (a->at + 4));
+}
+
+static void jcc_to(Asm *a, Cond cc, size_t target)
+{
+        put_u8(a, 0x0f);
+        put_u8(a, 0x80 | cc);
+        put_u32(a, target - (a->at + 4));
+}
+
+// A forward jump to a label that isn't known yet.  Returns the address of its
+// rel32, to be passed to land() once the label is reached.
+static size_t jcc_forward(Asm *a, Cond cc)
+{
+        put_u8(a, 0x0f);
+        put_u8(a, 0x80 | cc);
+        size_t field = a->at;
+        put_u32(a, 0);
+        return field;
+}
+
+static void land(Asm *a, size_t field)
+{
+        uint32_t rel = a->at - (field + 4);
+        if (a->text)
+                memcpy(a->text + field, &rel, 4);
+}
+
+// ------------------------------------------------------------------
+// Pieces of the instructions' fast paths.
+
+// jmp native[rcx]
+static void jmp_native(Asm *a)
+{
+        load64(a, RDX, RBX, offsetof(Jit, native));
+        op_idx(a, 0, 0xff, 4, RDX, RCX, 0);
+}
+
+// rax = the next free heap cell.  Clobbers rcx.
+static void alloc_cell(Asm *a)
+{
+        load64(a, RAX, RBX, OFF(heap.next));
+        op_mem(a, REX_W, 0x8d, RCX, RAX, sizeof(Cell)); // lea
+        store64(a, RCX, RBX, OFF(heap.next));
+        op_mem(a, 0, 0x81, 5, RBX, OFF(heap.nfree)); // sub
+        put_u32(a, 1);
+}
+
+// Make the cell in rax a thunk.  Clobbers rcx.
+static void init_thunk(Asm *a, ThunkState state, int32_t n)
+{
+        store_imm(a, 0, RAX, offsetof(Thunk, state), state);
+        store_imm(a, 0, RAX, offsetof(Thunk, n), n);
+        if (state == THUNK_FREE) {
+                store_imm(a, REX_W, RAX, offsetof(Thunk, env), 0);
+                return;
+        }
+        load64(a, RCX, RBX, OFF(env));
+        store64(a, RCX, RAX, offsetof(Thunk, env));
+}
+
+// Push rax on the value stack.  Clobbers rcx and rdx.
+static void push_rax(Asm *a)
+{
+        load32(a, RCX, RBX, OFF(nvals));
+        load64(a, RDX, RBX, OFF(vals));
+        op_idx(a, REX_W, 0x89, RAX, RDX, RCX, 0);
+        add_imm(a, 0, RCX, 1);
+        store32(a, RCX, RBX, OFF(nvals));
+}
+
+// Push a frame returning to `next`, which updates the thunk in rax if
+// `update`.  Clobbers rcx and rdx.
+static void push_frame(Asm *a, uint32_t next, bool update)
+{
+        load32(a, RCX, RBX, OFF(nframes));
+        op_reg(a, 0, 0x89, RCX, RDX); // mov edx, ecx
+        add_imm(a, 0, RDX, 1);
+        store32(a, RDX, RBX, OFF(nframes));
+        op_reg(a, REX_W, 0x69, RCX, RCX); // imul rcx, rcx, imm32
+        put_u32(a, sizeof(VmFrame));
+        op_mem(a, REX_W, 0x03, RCX, RBX, OFF(frames)); // add
+        store_imm(a, 0, RCX, offsetof(VmFrame, pc), next);
+        load64(a, RDX, RBX, OFF(env));
+        store64(a, RDX, RCX, offsetof(VmFrame, env));
+        if (update)
+                store64(a, RAX, RCX, offsetof(VmFrame, update));
+        else
+                store_imm(a, REX_W, RCX, offsetof(VmFrame, update), 0);
+}
+
+// rax = the thunk bound to de Bruijn variable n.  Clobbers rcx.
+static void env_lookup_rax(Asm *a, int32_t n)
+{
+        load64(a, RAX, RBX, OFF(env));
+        if (n <= 8) {
+                for (int32_t k = 0; k < n; k++)
+                        load64(a, RAX, RAX, offsetof(Env, next));
+        } else {
+                mov_imm32(a, RCX, n);
+                size_t loop = a->at;
+                load64(a, RAX, RAX, offsetof(Env, next));
+                add_imm(a, 0, RCX, -1);
+                jcc_to(a, CC_NE, loop);
+        }
+        load64(a, RAX, RAX, offsetof(Env, thunk));
+}
+
+// ------------------------------------------------------------------
+
+typedef struct {
+        const int32_t *code;
+        uint32_t *fast_len; // Instructions from here up to the next jump.
+        size_t *entry;      // Offset of each instruction's guard.
+        size_t *body;       // Offset of each instruction's fast path.
+        size_t exit;
+} Layout;
+
+typedef enum
+{
+        NEXT_FALL_THROUGH, // On to the next instruction.
+        NEXT_SKIP,         // Over the CLOSURE or THUNK's body.
+        NEXT_JUMP,         // To wherever the run-time state says.
+} NextKind;
+
+static NextKind next_kind(OpCode op)
+{
+        switch (op) {
+        case OP_PUSH_VAR:
+        case OP_SHARE:
+                return NEXT_FALL_THROUGH;
+        case OP_CLOSURE:
+        case OP_THUNK:
+                return NEXT_SKIP;
+        case OP_HALT:
+        case OP_ACCESS:
+        case OP_APPLY:
+        case OP_TAIL_APPLY:
+        case OP_RETURN:
+        case NOPCODES:
+                break;
+        }
+        return NEXT_JUMP;
+}
+
+// Where an instruction that doesn't jump goes next.
+static uint32_t static_next(const int32_t *code, uint32_t pc)
+{
+        uint32_t next = pc + bytecode_width(code, pc);
+        if (next_kind(code[pc]) == NEXT_SKIP)
+                next += code[pc + 1];
+        return next;
+}
+
+// Every instruction goes on to a later one, so one backwards pass will do.
+static void find_fast_lens(Layout *l, uint32_t size, uint32_t *starts)
+{
+        uint32_t n = 0;
+        for (uint32_t pc = 0; pc < size; pc += bytecode_width(l->code, pc))
+                starts[n++] = pc;
+        while (n--) {
+                uint32_t pc = starts[n];
+                l->fast_len[pc] = 1;
+                if (next_kind(l->code[pc]) != NEXT_JUMP)
+                        l->fast_len[pc] +=
+                            l->fast_len[static_next(l->code, pc)];
+        }
+}
+
+// Jump to the slow path unless there's budget for `len` instructions.  The
+// interpreter checks before each instruction that a step and two heap cells
+// are left, and that both stacks have room for one more; since no instruction
+// takes more than one of each, this is the same check, made in advance.
+static void put_guard(Asm *a, uint32_t len, size_t slow[4])
+{
+        load64(a, RAX, RBX, OFF(steps));
+        add_imm(a, REX_W, RAX, len);
+        op_mem(a, REX_W, 0x3b, RAX, RBX, OFF(max_steps)); // cmp
+        slow[0] = jcc_forward(a, CC_A);
+        cmp_imm(a, RBX, OFF(heap.nfree), len + 1);
+        slow[1] = jcc_forward(a, CC_B);
+        load32(a, RCX, RBX, OFF(nvals));
+        add_imm(a, 0, RCX, len);
+        op_mem(a, 0, 0x3b, RCX, RBX, OFF(vals_alloced));
+        slow[2] = jcc_forward(a, CC_A);
+        load32(a, RCX, RBX, OFF(nframes));
+        add_imm(a, 0, RCX, len);
+        op_mem(a, 0, 0x3b, RCX, RBX, OFF(frames_alloced));
+        slow[3] = jcc_forward(a, CC_A);
+        store64(a, RAX, RBX, OFF(steps));
+}
+
+static void put_access(Asm *a, const Layout *l, int32_t n, uint32_t next)
+{
+        env_lookup_rax(a, n);
+        cmp_imm(a, RAX, offsetof(Thunk, state), THUNK_DELAYED);
+        size_t ready = jcc_forward(a, CC_NE);
+        push_frame(a, next, true);
+        store_imm(a, 0, RAX, offsetof(Thunk, state), THUNK_BLACKHOLE);
+        load64(a, RDX, RAX, offsetof(Thunk, env));
+        store64(a, RDX, RBX, OFF(env));
+        load32(a, RCX, RAX, offsetof(Thunk, n));
+        jmp_native(a);
+        land(a, ready);
+        push_rax(a);
+        jmp_to(a, l->entry[next]);
+}
+
+static void put_apply(Asm *a, const Layout *l, bool tail, uint32_t next)
+{
+        // rsi = fun, rdi = arg.
+        load32(a, RCX, RBX, OFF(nvals));
+        add_imm(a, 0, RCX, -2);
+        store32(a, RCX, RBX, OFF(nvals));
+        load64(a, RDX, RBX, OFF(vals));
+        op_idx(a, REX_W, 0x8b, RSI, RDX, RCX, 0);
+        op_idx(a, REX_W, 0x8b, RDI, RDX, RCX, sizeof(Thunk *));
+        cmp_imm(a, RSI, offsetof(Thunk, state), THUNK_CLOSURE);
+        size_t neutral = jcc_forward(a, CC_NE);
+        if (!tail)
+                push_frame(a, next, false);
+        alloc_cell(a);
+        store64(a, RDI, RAX, offsetof(Env, thunk));
+        load64(a, RDX, RSI, offsetof(Thunk, env));
+        store64(a, RDX, RAX, offsetof(Env, next));
+        store64(a, RAX, RBX, OFF(env));
+        load32(a, RCX, RSI, offsetof(Thunk, n));
+        jmp_native(a);
+
+        land(a, neutral);
+        alloc_cell(a);
+        store_imm(a, 0, RAX, offsetof(Thunk, state), THUNK_APP);
+        store_imm(a, 0, RAX, offsetof(Thunk, n), 0);
+        store64(a, RSI, RAX, offsetof(Thunk, app.fun));
+        store64(a, RDI, RAX, offsetof(Thunk, app.arg));
+        push_rax(a);
+        jmp_to(a, l->entry[next]);
+}
+
+static void put_return(Asm *a)
+{
+        // rcx = the frame, rdx = the thunk to update.
+        load32(a, RCX, RBX, OFF(nframes));
+        add_imm(a, 0, RCX, -1);
+        store32(a, RCX, RBX, OFF(nframes));
+        op_reg(a, REX_W, 0x69, RCX, RCX); // imul rcx, rcx, imm32
+        put_u32(a, sizeof(VmFrame));
+        op_mem(a, REX_W, 0x03, RCX, RBX, OFF(frames)); // add
+        load64(a, RDX, RCX, offsetof(VmFrame, update));
+        op_reg(a, REX_W, 0x85, RDX, RDX); // test
+        size_t no_update = jcc_forward(a, CC_E);
+        load32(a, RAX, RBX, OFF(nvals));
+        load64(a, RSI, RBX, OFF(vals));
+        op_idx(a, REX_W, 0x8b, RSI, RSI, RAX, -(int32_t)sizeof(Thunk *));
+        _Static_assert(sizeof(Thunk) % 8 == 0, "Thunks are copied by qword");
+        for (int32_t k = 0; k < (int32_t)sizeof(Thunk); k += 8) {
+                load64(a, RAX, RSI, k);
+                store64(a, RAX, RDX, k);
+        }
+        land(a, no_update);
+        load64(a, RDX, RCX, offsetof(VmFrame, env));
+        store64(a, RDX, RBX, OFF(env));
+        load32(a, RCX, RCX, offsetof(VmFrame, pc));
+        jmp_native(a);
+}
+
+static void put_slow_path(Asm *a, const Layout *l, uint32_t pc)
+{
+        OpCode op = l->code[pc];
+        uint32_t width = bytecode_width(l->code, pc);
+        op_reg(a, REX_W, 0x89, RBX, RDI); // mov rdi, rbx
+        mov_imm32(a, RSI, width == 2 ? l->code[pc + 1] : 0);
+        mov_imm32(a, RDX, pc + width);
+        put_u8(a, REX_W);
+        put_u8(a, 0xb8 | RAX); // mov rax, imm64
+        put_u64(a, (uintptr_t)handlers[op]);
+        put(a, "\xff\xd0", 2); // call rax
+        if (next_kind(op) != NEXT_JUMP) {
+                op_reg(a, REX_W, 0x85, RAX, RAX); // test
+                size_t go_on = jcc_forward(a, CC_E);
+                put(a, "\xff\xe0", 2); // jmp rax
+                land(a, go_on);
+                jmp_to(a, l->entry[static_next(l->code, pc)]);
+                return;
+        }
+        put(a, "\xff\xe0", 2); // jmp rax
+}
+
+static void put_instruction(Asm *a, Layout *l, uint32_t pc)
+{
+        OpCode op = l->code[pc];
+        uint32_t width = bytecode_width(l->code, pc), next = pc + width;
+        int32_t operand = width == 2 ? l->code[pc + 1] : 0;
+        size_t slow[4];
+
+        l->entry[pc] = a->at;
+        if (!use_fast_paths()) {
+                // Nothing but the slow path, as if every guard failed.
+                l->body[pc] = a->at;
+                put_slow_path(a, l, pc);
+                return;
+        }
+        put_guard(a, l->fast_len[pc], slow);
+        l->body[pc] = a->at;
+        switch (op) {
+        case OP_HALT:
+                store_imm(a, 0, RBX, offsetof(Jit, status), EVAL_NORMAL_FORM);
+                jmp_to(a, l->exit);
+                break;
+        case OP_PUSH_VAR:
+                alloc_cell(a);
+                init_thunk(a, THUNK_FREE, operand);
+                push_rax(a);
+                jmp_to(a, l->body[next]);
+                break;
+        case OP_SHARE:
+                env_lookup_rax(a, operand);
+                push_rax(a);
+                jmp_to(a, l->body[next]);
+                break;
+        case OP_CLOSURE:
+        case OP_THUNK:
+                alloc_cell(a);
+                init_thunk(a, op == OP_CLOSURE ? THUNK_CLOSURE : THUNK_DELAYED,
+                           next);
+                push_rax(a);
+                jmp_to(a, l->body[next + operand]);
+                break;
+        case OP_ACCESS:
+                put_access(a, l, operand, next);
+                break;
+        case OP_APPLY:
+        case OP_TAIL_APPLY:
+                put_apply(a, l, op == OP_TAIL_APPLY, next);
+                break;
+        case OP_RETURN:
+                put_return(a);
+                break;
+        case NOPCODES: // LCOV_EXCL_LINE
+                DIE_LCOV_EXCL_LINE("Bad opcode %d at %u", op, pc);
+        }
+
+        for (int k = 0; k < 4; k++)
+                land(a, slow[k]);
+        put_slow_path(a, l, pc);
+}
+
+static void assemble(Asm *a, Layout *l, uint32_t size)
+{
+        // push rbx; mov rbx, rdi; jmp rsi
+        put(a, "\x53\x48\x89\xfb\xff\xe6", 6);
+        l->exit = a->at;
+        put(a, "\x5b\xc3", 2); // pop rbx; ret
+        for (uint32_t pc = 0; pc < size; pc += bytecode_width(l->code, pc))
+                put_instruction(a, l, pc);
+}
+
+// Every instruction's machine code has the same size whatever its jumps'
+// targets, so the first pass (which doesn't know them all yet) can measure
+// where everything goes, and the second can write it.
+static void jit_compile(Jit *jit, const Bytecode *code)
+{
+        uint32_t size = code->size;
+        uint32_t *lens =
+            realloc_or_die(HERE, NULL, 2 * sizeof(uint32_t) * size);
+        size_t *offs = realloc_or_die(HERE, NULL, 2 * sizeof(size_t) * size);
+        memset(offs, 0, 2 * sizeof(size_t) * size);
+        Layout l = {
+            .code = code->words,
+            .fast_len = lens,
+            .entry = offs,
+            .body = offs + size,
+        };
+        find_fast_lens(&l, size, lens + size);
+
+        Asm a = {0};
+        assemble(&a, &l, size);
+        uint8_t *text = mmap(NULL, a.at, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        DIE_IF(text == MAP_FAILED, "Can't map %zu bytes for the JIT.", a.at);
+        jit->text = text;
+        jit->text_size = a.at;
+        a = (Asm){.text = text};
+        assemble(&a, &l, size);
+        assert(a.at == jit->text_size);
+        DIE_IF(mprotect(text, a.at, PROT_READ | PROT_EXEC),
+               "Can't make the JIT's code executable.");
+
+        jit->native = realloc_or_die(HERE, NULL, sizeof(uint8_t *) * size);
+        for (uint32_t pc = 0; pc < size; pc += bytecode_width(l.code, pc))
+                jit->native[pc] = text + l.entry[pc];
+        jit->exit = text + l.exit;
+        free(lens);
+        free(offs);
+}
+
+static EvalStatus jit_run(Vm *vm)
+{
+        Jit *jit = (Jit *)vm;
+        void (*enter)(Jit *, uint8_t *) = (void (*)(Jit *, uint8_t *))jit->text;
+        jit->status = EVAL_REDUCED;
+        enter(jit, jit_goto(jit));
+        return jit->status;
+}
+
+int act_eval_jit(FILE *oot, const Ast *ast, const EvalBudget *budget)
+{
+        EvalBudget b = eval_budget_or_default(budget, default_budget);
+        AstIdx size;
+        const AstNode *nodes = ast_postfix(ast, &size);
+        Bytecode code = compile_bytecode(nodes, size);
+        Jit jit = {
+            .vm = {
+                .code = code.words,
+                .heap = {.max_bytes = b.max_bytes},
+                .max_steps = b.max_steps,
+            },
+        };
+        jit_compile(&jit, &code);
+        NodeVec out = {0};
+
+        EvalStatus status = EVAL_OUT_OF_MEMORY;
+        if (free_index_env(&jit.vm.heap, nodes, size, &jit.vm.env))
+                status = vm_normalize(&jit.vm, jit_run, &out);
+        if (status == EVAL_NORMAL_FORM)
+                unparse_postfix(oot, out.nodes, out.size);
+        int nerr = report_eval_failure(status, &b, jit.vm.steps);
+
+        free(out.nodes);
+        vm_free(&jit.vm);
+        munmap(jit.text, jit.text_size);
+        free(jit.native);
+        free(code.words);
+        return nerr;
+}
+
+#else // Not x86-64 Linux: fall back to the bytecode interpreter.
+
+int act_eval_jit(FILE *oot, const Ast *ast, const EvalBudget *budget)
+{
+        EvalBudget b = eval_budget_or_default(budget, default_budget);
+        return act_eval_vm(oot, ast, &b);
+}
+
+#endif
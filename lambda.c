@@ -1,52 +1,454 @@
 #define _GNU_SOURCE
 #include <assert.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <pthread.h>
+#include <unistd.h>
+
 #include "lambda.h"
+#include "sink.h"
 #include "untestable.h"
 
 // ------------------------------------------------------------------
-static void unparse(FILE *oot, const AstNode *nodes, uint32_t idx)
+
+// The unparsers keep an explicit stack of the nodes still to print, and the
+// punctuation between them, so that deep terms don't overflow the C stack.
+#define PUNCT ((AstIdx)1 << (8 * sizeof(AstIdx) - 1))
+
+typedef struct {
+        AstIdx size;
+        AstIdx alloced;
+        AstIdx *items;
+} Todo;
+
+static void todo_push(Todo *todo, AstIdx item)
 {
-        int32_t val;
-        AstNodeType node_t = ast_unpack(nodes, idx, &val);
-        switch (node_t) {
-        case ANT_VAR:
-                fputc(val + 'a', oot);
-                return;
+        if (todo->size == todo->alloced) {
+                todo->alloced = todo->alloced ? 2 * todo->alloced : 64;
+                todo->items = realloc_or_die(HERE, todo->items,
+                                             sizeof(AstIdx) * todo->alloced);
+        }
+        todo->items[todo->size++] = item;
+}
+
+// Pop the next node to print, printing any punctuation on the way.  Returns
+// false when there is nothing left.
+static bool todo_pop(Sink *sink, Todo *todo, AstIdx *idx)
+{
+        while (todo->size) {
+                AstIdx item = todo->items[--todo->size];
+                if (!(item & PUNCT)) {
+                        *idx = item;
+                        return true;
+                }
+                sink_putc(sink, item & ~PUNCT);
+        }
+        return false;
+}
+
+// Print the subtree at `root`, with `todo` (which is left empty) as the
+// stack.
+static void unparse_with(Sink *sink, Todo *todo, const AstNode *nodes,
+                         AstIdx root, const char *const *znums)
+{
+        todo_push(todo, root);
+        AstIdx idx;
+        while (todo_pop(sink, todo, &idx)) {
+                AstVal val;
+                AstNodeType node_t = ast_unpack(nodes, idx, &val);
+                switch (node_t) {
+                case ANT_VAR:
+                        if (val < 0) {
+                                sink_putc(sink, '#');
+                                sink_puts(sink, znums[-1 - val]);
+                                continue;
+                        }
+                        sink_putc(sink, val + 'a');
+                        continue;
+                case ANT_CALL:
+                        sink_putc(sink, '(');
+                        todo_push(todo, PUNCT | ')');
+                        todo_push(todo, ast_arg_idx(nodes, idx));
+                        todo_push(todo, PUNCT | ' ');
+                        todo_push(todo, val);
+                        continue;
+                case ANT_LAMBDA:
+                        sink_puts(sink, "[]");
+                        todo_push(todo, ast_lambda_body(nodes, idx));
+                        continue;
+                case ANT_BOUND:
+                        sink_putc(sink, val + '1');
+                        continue;
+                }
+                DIE_LCOV_EXCL_LINE(
+                    "Unparsing found Ast node %lu with bad type id %u",
+                    (unsigned long)idx, node_t);
+        }
+}
+
+static void unparse(Sink *sink, const AstNode *nodes, AstIdx root,
+                    const char *const *znums)
+{
+        Todo todo = {0};
+        unparse_with(sink, &todo, nodes, root, znums);
+        free(todo.items);
+}
+
+// ------------------------------------------------------------------
+
+void unparse_postfix_with_numbers(FILE *oot, const AstNode *nodes,
+                                  AstIdx size, const char *const *znums)
+{
+        DIE_IF(!size, "Unparsing an empty term.");
+        Sink sink;
+        sink_open_file(&sink, oot);
+        unparse(&sink, nodes, size - 1, znums);
+        sink_putc(&sink, '\n');
+        sink_close(&sink);
+}
+
+void unparse_postfix(FILE *oot, const AstNode *nodes, AstIdx size)
+{
+        unparse_postfix_with_numbers(oot, nodes, size, NULL);
+}
+
+// ------------------------------------------------------------------
+
+// Unparsing in parallel.  Every subtree is contiguous in the post-fix array,
+// and so is its output, whose length is the sum of what its nodes print: a
+// VAR or BOUND prints one character, a CALL its brackets and space, and a
+// LAMBDA its brackets (less the param slot's character, which isn't
+// printed).  With prefix sums of that over the array, walking down from the
+// root gives each subtree's place in the output.  The walk stops at
+// subtrees small enough to share out, and the threads print those into one
+// buffer, at their places, and the buffer is written out in one go.
+
+// Programs are only unparsed in parallel if there are at least this many
+// nodes per thread.
+#define UNPARSE_MIN_PER_THREAD (4 * 1024)
+
+// The prefix sums are kept for every UNPARSE_BLOCK nodes, and summed the rest
+// of the way when asked for.
+#define UNPARSE_BLOCK 64
+
+static uint32_t printed_length(AstNode n)
+{
+        switch (ast_type(n)) {
         case ANT_CALL:
-                fputc('(', oot);
-                unparse(oot, nodes, val);
-                fputc(' ', oot);
-                unparse(oot, nodes, ast_arg_idx(nodes, idx));
-                fputc(')', oot);
-                return;
+                return 3;
+        case ANT_VAR:
         case ANT_LAMBDA:
-                fputc('[', oot);
-                fputc(']', oot);
-                unparse(oot, nodes, ast_lambda_body(nodes, idx));
-                return;
         case ANT_BOUND:
-                fputc(val + '1', oot);
-                return;
+                return 1;
         }
-        DIE_LCOV_EXCL_LINE("Unparsing found Ast node %u with bad type id %u",
-                           idx, node_t);
+        return DIE_LCOV_EXCL_LINE("Measuring Ast node with bad type id %u",
+                                  ast_type(n));
+}
+
+// A subtree nodes[start:end], to be printed at buf[at:at + len].
+typedef struct {
+        AstIdx start;
+        AstIdx end;
+        uint64_t at;
+        uint64_t len;
+} UnparseSpan;
+
+typedef struct {
+        const AstNode *nodes;
+        AstIdx size;
+        // The length of the output of nodes[0:UNPARSE_BLOCK * k], for each k.
+        uint64_t *block_at;
+        char *buf;
+        UnparseSpan *spans;
+        AstIdx nspans;
+        AstIdx spans_alloced;
+        Todo todo; // For printing the small subtrees as they're placed.
+} ParUnparse;
+
+typedef struct {
+        ParUnparse *pu;
+        pthread_t thread;
+        AstIdx first; // Of the blocks to sum, or of the spans to print.
+        AstIdx last;
+} UnparseWorker;
+
+// The length of the output of nodes[0:end].
+static uint64_t printed_before(const ParUnparse *pu, AstIdx end)
+{
+        AstIdx block = end / UNPARSE_BLOCK;
+        uint64_t n = pu->block_at[block];
+        for (AstIdx k = block * UNPARSE_BLOCK; k < end; k++)
+                n += printed_length(pu->nodes[k]);
+        return n;
+}
+
+static uint64_t span_length(const ParUnparse *pu, AstIdx start, AstIdx end)
+{
+        return printed_before(pu, end) - printed_before(pu, start);
+}
+
+// The same, but summed node by node if there are fewer than `least`.
+static uint64_t subtree_length(const ParUnparse *pu, AstIdx start,
+                               AstIdx end, AstIdx least)
+{
+        if (end - start >= least)
+                return span_length(pu, start, end);
+        uint64_t n = 0;
+        for (AstIdx k = start; k < end; k++)
+                n += printed_length(pu->nodes[k]);
+        return n;
+}
+
+// Sum the lengths of each of blocks [first:last], into block_at[k + 1].
+static void *sum_blocks(void *arg)
+{
+        UnparseWorker *w = arg;
+        ParUnparse *pu = w->pu;
+        for (AstIdx b = w->first; b < w->last; b++) {
+                AstIdx end = (b + 1) * UNPARSE_BLOCK;
+                end = end < pu->size ? end : pu->size;
+                uint64_t n = 0;
+                for (AstIdx k = b * UNPARSE_BLOCK; k < end; k++)
+                        n += printed_length(pu->nodes[k]);
+                pu->block_at[b + 1] = n;
+        }
+        return NULL;
+}
+
+static void *print_spans(void *arg)
+{
+        UnparseWorker *w = arg;
+        ParUnparse *pu = w->pu;
+        for (AstIdx k = w->first; k < w->last; k++) {
+                UnparseSpan t = pu->spans[k];
+                Sink sink;
+                sink_open_buffer(&sink, pu->buf + t.at, t.len);
+                unparse(&sink, pu->nodes, t.end - 1, NULL);
+                assert(sink.len == t.len);
+        }
+        return NULL;
+}
+
+// Run `fn` on each of workers[0:n], the first on this thread.
+static void run_workers(UnparseWorker *workers, uint32_t n,
+                        void *(*fn)(void *))
+{
+        for (uint32_t k = 1; k < n; k++) {
+                DIE_IF(pthread_create(&workers[k].thread, NULL, fn,
+                                      &workers[k]),
+                       "Can't start an unparsing thread.");
+        }
+        fn(&workers[0]);
+        for (uint32_t k = 1; k < n; k++)
+                pthread_join(workers[k].thread, NULL);
+}
+
+// If the subtree `t` has at most `most` nodes, leave it in pu->spans if it has
+// at least `least`, or print it now if not, and return true.
+static bool place_small(ParUnparse *pu, UnparseSpan t, AstIdx most,
+                        AstIdx least)
+{
+        AstIdx n = t.end - t.start;
+        if (n > most)
+                return false;
+        if (n >= least) {
+                if (pu->nspans == pu->spans_alloced) {
+                        pu->spans_alloced =
+                            pu->spans_alloced ? 2 * pu->spans_alloced : 64;
+                        pu->spans = realloc_or_die(
+                            HERE, pu->spans,
+                            sizeof(UnparseSpan) * pu->spans_alloced);
+                }
+                pu->spans[pu->nspans++] = t;
+                return true;
+        }
+        Sink sink;
+        sink_open_buffer(&sink, pu->buf + t.at, t.len);
+        unparse_with(&sink, &pu->todo, pu->nodes, t.end - 1, NULL);
+        assert(sink.len == t.len);
+        return true;
+}
+
+// Walk down from the root, printing the punctuation of the nodes above the
+// subtrees of at most `most` nodes, and placing those with place_small().
+// Only subtrees of more than `most` nodes are stacked, and they are disjoint,
+// so there are few of them.
+static void place_spans(ParUnparse *pu, AstIdx most, AstIdx least)
+{
+        AstIdx depth = 0, depth_alloced = 0;
+        UnparseSpan *stack = NULL;
+        UnparseSpan t = {0, pu->size, 0, span_length(pu, 0, pu->size)};
+        bool big = !place_small(pu, t, most, least);
+        while (big || depth) {
+                if (!big)
+                        t = stack[--depth];
+                AstIdx root = t.end - 1;
+                AstVal val;
+                if (ast_unpack(pu->nodes, root, &val) != ANT_CALL) {
+                        // A LAMBDA, as a VAR or BOUND is one node.
+                        assert(ast_type(pu->nodes[root]) == ANT_LAMBDA);
+                        pu->buf[t.at] = '[';
+                        pu->buf[t.at + 1] = ']';
+                        t = (UnparseSpan){t.start, root - 1, t.at + 2,
+                                          t.len - 2};
+                        big = !place_small(pu, t, most, least);
+                        continue;
+                }
+
+                AstIdx iarg = val + 1;
+                uint64_t arg_len = subtree_length(pu, iarg, root, least);
+                uint64_t callee_len = t.len - 3 - arg_len;
+                pu->buf[t.at] = '(';
+                pu->buf[t.at + 1 + callee_len] = ' ';
+                pu->buf[t.at + t.len - 1] = ')';
+                UnparseSpan callee = {t.start, iarg, t.at + 1, callee_len};
+                UnparseSpan arg = {iarg, root, t.at + 2 + callee_len, arg_len};
+                bool big_callee = !place_small(pu, callee, most, least);
+                bool big_arg = !place_small(pu, arg, most, least);
+                if (big_callee && big_arg) {
+                        if (depth == depth_alloced) {
+                                depth_alloced =
+                                    depth_alloced ? 2 * depth_alloced : 64;
+                                stack = realloc_or_die(
+                                    HERE, stack,
+                                    sizeof(UnparseSpan) * depth_alloced);
+                        }
+                        stack[depth++] = arg;
+                }
+                big = big_callee || big_arg;
+                t = big_callee ? callee : arg;
+        }
+        free(stack);
+}
+
+// Print nodes[0:size] and a newline, on `nthreads` threads, to `oot`.
+static int unparse_parallel(FILE *oot, const AstNode *nodes, AstIdx size,
+                            uint32_t nthreads)
+{
+        AstIdx nblocks = (size + UNPARSE_BLOCK - 1) / UNPARSE_BLOCK;
+        ParUnparse pu = {.nodes = nodes, .size = size};
+        pu.block_at =
+            realloc_or_die(HERE, NULL, sizeof(uint64_t) * (nblocks + 1));
+        UnparseWorker *workers =
+            realloc_or_die(HERE, NULL, sizeof(UnparseWorker) * nthreads);
+
+        // Sum the blocks in parallel, and then the sums.
+        for (uint32_t k = 0; k < nthreads; k++) {
+                workers[k] = (UnparseWorker){
+                    .pu = &pu,
+                    .first = (uint64_t)nblocks * k / nthreads,
+                    .last = (uint64_t)nblocks * (k + 1) / nthreads,
+                };
+        }
+        run_workers(workers, nthreads, sum_blocks);
+        pu.block_at[0] = 0;
+        for (AstIdx b = 0; b < nblocks; b++)
+                pu.block_at[b + 1] += pu.block_at[b];
+
+        uint64_t len = pu.block_at[nblocks];
+        pu.buf = realloc_or_die(HERE, NULL, len + 1);
+        pu.buf[len] = '\n';
+        AstIdx most = size / nthreads / 4;
+        place_spans(&pu, most, most / 64);
+
+        // Deal the spans out, about the same length each.
+        uint64_t total = 0, dealt = 0;
+        for (AstIdx k = 0; k < pu.nspans; k++)
+                total += pu.spans[k].len;
+        uint64_t share = total / nthreads + 1;
+        uint32_t nworkers = 0;
+        for (AstIdx k = 0; k < pu.nspans; nworkers++) {
+                UnparseWorker *w = &workers[nworkers];
+                *w = (UnparseWorker){.pu = &pu, .first = k, .last = k};
+                uint64_t upto = share * (nworkers + 1);
+                do {
+                        dealt += pu.spans[k].len;
+                        w->last = ++k;
+                } while (k < pu.nspans && dealt < upto);
+        }
+        if (nworkers)
+                run_workers(workers, nworkers, print_spans);
+
+        Sink sink;
+        sink_open_file(&sink, oot);
+        sink_write(&sink, pu.buf, len + 1);
+        free(pu.buf);
+        free(pu.spans);
+        free(pu.todo.items);
+        free(pu.block_at);
+        free(workers);
+        return sink_close(&sink);
+}
+
+int act_unparse(FILE *oot, const Ast *ast, uint32_t nthreads)
+{
+        AstIdx size;
+        const AstNode *ast0 = ast_postfix(ast, &size);
+        DIE_IF(!size, "Unparsing an empty term.");
+        if (!nthreads) {
+                long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+                nthreads = ncpus > 0 ? ncpus : 1;
+        }
+        if (nthreads > 1 && size / nthreads >= UNPARSE_MIN_PER_THREAD)
+                return unparse_parallel(oot, ast0, size, nthreads);
+
+        Sink sink;
+        sink_open_file(&sink, oot);
+        unparse(&sink, ast0, size - 1, NULL);
+        sink_putc(&sink, '\n');
+        return sink_close(&sink);
 }
 
 // ------------------------------------------------------------------
 
-int act_unparse(FILE *oot, const Ast *ast)
+static void unparse_dag(Sink *sink, const DagNode *nodes, uint32_t root)
 {
+        Todo todo = {0};
+        todo_push(&todo, root);
+        AstIdx id;
+        while (todo_pop(sink, &todo, &id)) {
+                DagNode n = nodes[id];
+                switch (ast_type(n.node)) {
+                case ANT_VAR:
+                        sink_putc(sink, ast_val(n.node) + 'a');
+                        continue;
+                case ANT_CALL:
+                        sink_putc(sink, '(');
+                        todo_push(&todo, PUNCT | ')');
+                        todo_push(&todo, n.kids[1]);
+                        todo_push(&todo, PUNCT | ' ');
+                        todo_push(&todo, n.kids[0]);
+                        continue;
+                case ANT_LAMBDA:
+                        sink_puts(sink, "[]");
+                        todo_push(&todo, n.kids[1]);
+                        continue;
+                case ANT_BOUND:
+                        sink_putc(sink, ast_val(n.node) + '1');
+                        continue;
+                }
+                DIE_LCOV_EXCL_LINE(
+                    "Unparsing found DAG node %lu with bad type id %u",
+                    (unsigned long)id, ast_type(n.node));
+        }
+        free(todo.items);
+}
+
+int act_unparse_shared(FILE *oot, const Ast *ast)
+{
+        AstDag *dag = hash_cons(ast, true);
         uint32_t size;
-        const AstNode *ast0 = ast_postfix(ast, &size);
+        const DagNode *nodes = dag_nodes(dag, &size);
 
-        unparse(oot, ast0, size - 1);
-        fputc('\n', oot);
-        fflush(oot);
-        return 0;
+        Sink sink;
+        sink_open_file(&sink, oot);
+        unparse_dag(&sink, nodes, size - 1);
+        sink_putc(&sink, '\n');
+        delete_dag(dag);
+        return sink_close(&sink);
 }
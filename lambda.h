@@ -1,6 +1,7 @@
 #ifndef LAMBDA_2018_03_07_H
 #define LAMBDA_2018_03_07_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -16,6 +17,79 @@ typedef enum
         ANT_BOUND,
 } AstNodeType;
 
+#if defined(AST_COMPACT) && defined(AST_WIDE)
+#error "AST_COMPACT and AST_WIDE can't both be defined."
+#endif
+
+#ifdef AST_WIDE
+
+// Indices of nodes, and the token, arg_size or depth of one (see ast_val()).
+// With AST_WIDE (see the Makefile), they have 64 bits, so that an Ast can be
+// made from a source of more than 4 GiB.
+typedef uint64_t AstIdx;
+typedef int64_t AstVal;
+
+#else
+
+typedef uint32_t AstIdx;
+typedef int32_t AstVal;
+
+#endif
+
+#ifdef AST_COMPACT
+
+// A node in the AST, packed into one word (see AST_COMPACT in the Makefile):
+// the type, less one, is in the bottom two bits, and the token, arg_size or
+// depth (see below) is in the signed 30 bits above them.  So an Ast takes
+// half the memory, but can only have about half a billion nodes.
+typedef struct {
+        uint32_t bits;
+} AstNode;
+
+// The most nodes an Ast (or any post-fix term) can have.
+#define AST_MAX_NODES ((1 << 29) - 1)
+
+static inline AstNodeType ast_type(AstNode n)
+{
+        return (AstNodeType)((n.bits & 3) + 1);
+}
+
+static inline int32_t ast_val(AstNode n) { return (int32_t)n.bits >> 2; }
+
+static inline AstNode ast_node(AstNodeType type, int32_t val)
+{
+        DIE_IF(val < -AST_MAX_NODES - 1 || val > AST_MAX_NODES,
+               "Ast node value %d doesn't fit in 30 bits.", val);
+        return (AstNode){(uint32_t)val << 2 | (type - 1)};
+}
+
+#elif defined(AST_WIDE)
+
+// A node in the AST, packed into one 64-bit word, like AST_COMPACT's: the
+// type, less one, is in the bottom two bits, and the value in the signed 62
+// bits above them.  So a node takes the same 8 bytes as by default.
+typedef struct {
+        uint64_t bits;
+} AstNode;
+
+#define AST_MAX_NODES (((AstVal)1 << 61) - 1)
+
+static inline AstNodeType ast_type(AstNode n)
+{
+        return (AstNodeType)((n.bits & 3) + 1);
+}
+
+static inline AstVal ast_val(AstNode n) { return (int64_t)n.bits >> 2; }
+
+static inline AstNode ast_node(AstNodeType type, AstVal val)
+{
+        DIE_IF(val < -AST_MAX_NODES - 1 || val > AST_MAX_NODES,
+               "Ast node value %lld doesn't fit in 62 bits.", (long long)val);
+        return (AstNode){(uint64_t)val << 2 | (type - 1)};
+}
+
+#else
+
 // FIX: rename to AstVar
 // AstVar represents a named variable in the AST.
 typedef struct {
@@ -25,9 +99,9 @@ typedef struct {
 // AstCall represents a call of a function.  This relies on post-fix ordering of
 // Ast nodes:
 //        AstNode *call = ...
-//        assert(call->type == ANT_CALL)
+//        assert(ast_type(*call) == ANT_CALL)
 //        AstNode *argument = call - 1;
-//        AstNode *callee   = call - call->CALL.arg_size - 1;
+//        AstNode *callee   = call - ast_val(*call) - 1;
 //
 typedef struct {
         int32_t arg_size;
@@ -37,7 +111,9 @@ typedef struct {
         int32_t depth;
 } AstBound;
 
-// A node in the AST.
+// A node in the AST.  Code outside this header gets at the fields with
+// ast_type() and ast_val(), and makes nodes with ast_node(), so that it works
+// with the AST_COMPACT layout too.
 typedef struct {
         uint32_t type;
 
@@ -48,44 +124,64 @@ typedef struct {
         };
 } AstNode;
 
+#define AST_MAX_NODES INT32_MAX
+
+static inline AstNodeType ast_type(AstNode n) { return (AstNodeType)n.type; }
+
+// The token of a VAR, the arg_size of a CALL or the depth of a BOUND (which
+// are all the same int32_t), or zero for a LAMBDA.
+static inline int32_t ast_val(AstNode n) { return n.VAR.token; }
+
+static inline AstNode ast_node(AstNodeType type, int32_t val)
+{
+        return (AstNode){.type = type, .VAR = {.token = val}};
+}
+
+#endif
+
+// The evaluators (and hash_cons()) index the terms they work on with 32 bits,
+// even with AST_WIDE, so they only take terms of up to this many nodes.
+#define EVAL_MAX_NODES (AST_MAX_NODES < INT32_MAX ? AST_MAX_NODES : INT32_MAX)
+
 // Ast.  An opaque pointer to the result of parse().
 typedef struct Ast Ast;
 
 // Decodes an CALL AstNode into a function and argument pointer.
-static inline AstNodeType ast_unpack(const AstNode *nodes, uint32_t idx,
-                                     int32_t *val)
+static inline AstNodeType ast_unpack(const AstNode *nodes, AstIdx idx,
+                                     AstVal *val)
 {
         AstNode n = nodes[idx];
-        switch ((AstNodeType)n.type) {
+        switch (ast_type(n)) {
         case ANT_CALL:
-                *val = idx - n.CALL.arg_size - 1;
+                *val = idx - ast_val(n) - 1;
                 return ANT_CALL;
         case ANT_VAR:
-                *val = n.VAR.token;
+                *val = ast_val(n);
                 return ANT_VAR;
         case ANT_LAMBDA:
                 DIE_IF(idx < 1, "lambda without arg-slot");
                 n = nodes[idx - 1];
-                DIE_IF(n.type != ANT_VAR,
+                DIE_IF(ast_type(n) != ANT_VAR,
                        "lambda arg-slot should contain VAR, not tag = %u",
-                       n.type);
-                *val = n.VAR.token;
+                       ast_type(n));
+                *val = ast_val(n);
                 return ANT_LAMBDA;
         case ANT_BOUND:
-                *val = n.BOUND.depth;
+                *val = ast_val(n);
                 return ANT_BOUND;
         }
         return (AstNodeType)DIE_LCOV_EXCL_LINE(
-            "Upacking Ast node %u with bad type id %u", idx, n.type);
+            "Upacking Ast node %lu with bad type id %u", (unsigned long)idx,
+            ast_type(n));
 }
 
-static inline int32_t ast_arg_idx(const AstNode *nodes, uint32_t call_idx)
+static inline AstVal ast_arg_idx(const AstNode *nodes, AstIdx call_idx)
 {
         assert(call_idx >= 1);
         return call_idx - 1;
 }
 
-static inline int32_t ast_lambda_body(const AstNode *nodes, uint32_t ilambda)
+static inline AstVal ast_lambda_body(const AstNode *nodes, AstIdx ilambda)
 {
         assert(ilambda >= 2);
         return ilambda - 2;
@@ -100,21 +196,243 @@ static inline int32_t ast_lambda_body(const AstNode *nodes, uint32_t ilambda)
 // reported with report_syntax_errors.
 Ast *parse(const char *zname, const char *zsrc);
 
+// Like parse(), but parse into `ast` (which the result is), reusing its node
+// storage and scratch space, which aren't trimmed, so that parsing a run of
+// programs doesn't allocate once the buffers are big enough.  If `ast` is NULL,
+// a new one is made.  Pointers into the previous program's nodes are invalid
+// after this.
+Ast *reparse(Ast *ast, const char *zname, const char *zsrc);
+
+// Like reparse(), but the source is zsrc[0:len], which needn't be NUL
+// terminated.
+Ast *reparse_len(Ast *ast, const char *zname, const char *zsrc, size_t len);
+
+// Like parse(), but the source is zsrc[0:len], which needn't be NUL terminated
+// (it can be a file mapped into memory), and a big program is parsed on up to
+// `nthreads` threads (zero means one per CPU), with the same result.  `zsrc`
+// must outlive the result.
+Ast *parse_parallel(const char *zname, const char *zsrc, size_t len,
+                    uint32_t nthreads);
+
+// Parse a source in chunks, as it arrives: parse_start() begins, each
+// parse_more() parses zchunk[0:len], the next part of the source, as far as it
+// can, and parse_finish() parses the rest and returns the Ast, as parse()
+// would for the whole source.  Only the end of a chunk that might go on into
+// the next is kept, so the chunks needn't outlive the call.
+Ast *parse_start(const char *zname);
+void parse_more(Ast *ast, const char *zchunk, size_t len);
+Ast *parse_finish(Ast *ast);
+
+// Make an Ast from a copy of the post-fix term nodes[0:size], as if it had been
+// parsed from `zsrc`.  `zname` and `zsrc` must outlive the result.
+Ast *ast_from_postfix(const char *zname, const char *zsrc,
+                      const AstNode *nodes, AstIdx size);
+
 // Return all the nodes as an array in post-fix order.  Ast retains ownership.
-const AstNode *ast_postfix(const Ast *ast, uint32_t *size);
+const AstNode *ast_postfix(const Ast *ast, AstIdx *size);
 
 // Discard an Ast (including the stored error messages.)
 void delete_ast(Ast *ast);
 
+// Print the syntax errors in `ast` to `oot` (or nowhere, if `oot` is NULL), and
+// return how many there were.
 int report_syntax_errors(FILE *oot, Ast *ast);
 
+// --------------------------------------------------------------------------------------
+
+// A node of a hash-consed Ast (see hashcons.c), which stands for every
+// occurrence of one distinct subterm.  `node` is as in the post-fix array,
+// except that a CALL's arg_size is zero (and an unshared LAMBDA's token is its
+// post-fix index).  The kids are ids of earlier nodes: a CALL's callee and
+// argument, or a LAMBDA's param slot and body.
+typedef struct {
+        AstNode node;
+        uint32_t kids[2];
+} DagNode;
+
+// AstDag.  An opaque pointer to the result of hash_cons().
+typedef struct AstDag AstDag;
+
+// Share the identical subterms of `ast`, except that if `share_lambdas` is
+// false, each LAMBDA (and so each term containing one) is kept apart.  `ast`
+// isn't needed afterwards.
+extern AstDag *hash_cons(const Ast *ast, bool share_lambdas);
+
+// Return the distinct subterms, by id.  The root is the last one.
+extern const DagNode *dag_nodes(const AstDag *dag, uint32_t *size);
+
+// Return the id of each node of the post-fix array the AstDag was made from.
+extern const uint32_t *dag_ids(const AstDag *dag, uint32_t *nnodes);
+
+extern void delete_dag(AstDag *dag);
+
+// Like act_unparse() and act_type(), with the same output, but working from
+// the hash-consed `ast`.  act_type_shared() types each distinct subterm only
+// once, but doesn't share lambdas, as the types of their occurrences aren't
+// generalised and so can differ.
+extern int act_unparse_shared(FILE *oot, const Ast *ast);
+extern int act_type_shared(FILE *oot, const Ast *ast, bool compact);
+
+// --------------------------------------------------------------------------------------
+
 // Print the lambda-program at zsrc, writing the result to `oot`.  The source
 // is both counted and NUL terminated, i.e. `src_len == strlen(zsrc)`.  `zname`
 // is a filename (used for error messages and such).  Returns the number of
-// errors found.
-extern int act_unparse(FILE *oot, const Ast *ast);
+// errors found.  A big Ast is printed on up to `nthreads` threads (zero means
+// one per CPU), into one buffer that is then written out whole.
+extern int act_unparse(FILE *oot, const Ast *ast, uint32_t nthreads);
+
+// Infer types for all expressions in the Ast, line-by-line, postfix.  If
+// `compact`, each fun-type is expanded only the first time it is printed, and
+// is just named after that, so the output is linear in the size of the Ast.
+// The big subtrees of a big Ast are typed on up to `nthreads` threads (zero
+// means one per CPU), with the same output.
+extern int act_type(FILE *oot, const Ast *ast, bool compact,
+                    uint32_t nthreads);
+
+// TypeBuffers.  An opaque pointer to what act_type() types a program in.
+typedef struct TypeBuffers TypeBuffers;
+extern TypeBuffers *new_type_buffers(void);
+extern void delete_type_buffers(TypeBuffers *bufs);
+
+// Like act_type(), but typing in `bufs`, which are kept, untrimmed, for the
+// next program, so that typing a run of programs doesn't allocate once they
+// are big enough.
+extern int act_retype(FILE *oot, const Ast *ast, bool compact,
+                      uint32_t nthreads, TypeBuffers *bufs);
+
+// Print the term stored in post-fix order in `nodes[0:size]` (the root is the
+// last node), followed by a newline.  This is how act_unparse() prints an Ast,
+// and is also how evaluators print the terms they compute.
+extern void unparse_postfix(FILE *oot, const AstNode *nodes, AstIdx size);
+
+// Like unparse_postfix(), but a VAR with a negative token stands for a natural
+// number, which is printed as '#' followed by the digits znums[-1 - token].
+extern void unparse_postfix_with_numbers(FILE *oot, const AstNode *nodes,
+                                         AstIdx size,
+                                         const char *const *znums);
+
+// --------------------------------------------------------------------------------------
+
+// Limits on the work an evaluator may do before it gives up on a term that
+// (probably) has no normal form.  A zero field means "use the default".
+// `threads` is how many threads a parallel evaluator may use (by default, one
+// per CPU).
+typedef struct {
+        uint64_t max_steps;
+        uint64_t max_bytes;
+        uint32_t threads;
+        // If set, the field is cut to its default if beyond it, so that a
+        // request can't raise the budget of a server that has none of its own.
+        bool cap_steps;
+        bool cap_bytes;
+} EvalBudget;
+
+// Reduce the program to beta-normal form, using normal-order (leftmost,
+// outermost first) reduction, and print the result.  Returns nonzero and
+// reports to stderr if the budget runs out before a normal form is found.
+extern int act_eval(FILE *oot, const Ast *ast, const EvalBudget *budget);
+
+// Like act_eval(), but finds the normal form with a call-by-need abstract
+// machine that runs the Ast in place, evaluating each shared argument at most
+// once.  Budget steps are machine transitions rather than beta-steps.
+extern int act_eval_lazy(FILE *oot, const Ast *ast, const EvalBudget *budget);
+
+// Like act_eval_lazy(), but first compiles the Ast to bytecode (see vm.h) and
+// then runs that on a threaded-dispatch interpreter.
+extern int act_eval_vm(FILE *oot, const Ast *ast, const EvalBudget *budget);
+
+// Like act_eval_vm(), but compiles the bytecode to machine code.  Falls back
+// to act_eval_vm() on hosts other than x86-64 Linux.
+extern int act_eval_jit(FILE *oot, const Ast *ast, const EvalBudget *budget);
+
+// Like act_eval(), but translates the Ast into an interaction net (see net.c)
+// and reduces that, in parallel on budget->threads threads.  Budget steps are
+// interactions.
+extern int act_eval_net(FILE *oot, const Ast *ast, const EvalBudget *budget);
+
+// Find the beta-normal form by evaluating the Ast into closures and neutral
+// terms and quoting the result back (normalization by evaluation, see nbe.c),
+// and print it.  Finds the same normal form as act_eval(), but never
+// substitutes, so is much faster for big terms.  Budget steps are
+// beta-reductions.
+extern int act_normalize(FILE *oot, const Ast *ast, const EvalBudget *budget);
+
+// Like act_normalize(), but Church numerals, booleans and the usual arithmetic
+// on them (see church.h) are replaced by native numbers.  Numerals in the
+// normal form are printed in decimal (as #N) if `decimal`, and otherwise as
+// lambdas.  Budget steps are beta-reductions, plus the cost of the arithmetic.
+extern int act_normalize_church(FILE *oot, const Ast *ast,
+                                const EvalBudget *budget, bool decimal);
+
+// Evaluate each line of zsrc[0:src_len] as a program by itself, as
+// act_eval_lazy() does, but taking turns, `slice` steps at a time (or a
+// default if zero), so that programs that don't terminate can't hold up the
+// rest.  Each program has its own `budget`.  Normal forms are printed as
+// "LINE: TERM" as they are found, and errors reported to stderr, tagged with
+// `zname` and the line.  Returns the number of programs that failed.
+extern int act_round_robin(FILE *oot, const char *zname, const char *zsrc,
+                           size_t src_len, const EvalBudget *budget,
+                           uint64_t slice);
+
+// What act_corpus() does with each program: print to `oot`, report errors to
+// error_stream(), and return the number of errors.  `tbufs` is the worker's,
+// for act_retype().
+typedef int (*CorpusAction)(FILE *oot, const Ast *ast, TypeBuffers *tbufs,
+                            void *arg);
+
+// Parse each of the files zpaths[0:npaths] (or for a directory, each of the
+// files under it, in order of name) and run `act` on it, with `arg`, on up to
+// `nthreads` threads (zero means one per CPU).  Each line of the output is
+// tagged with "PATH: ", and so are the errors, which go to error_stream().
+// All of a file's output is written, in the order of the files, once it is
+// done.  Returns the number of files that failed.
+extern int act_corpus(FILE *oot, char *const *zpaths, size_t npaths,
+                      uint32_t nthreads, CorpusAction act, void *arg);
+
+// What act_serve() does with the program of each request: run the actions the
+// request's options, `zopts`, ask for on `ast`, print to `oot`, report errors
+// to error_stream(), and return the number of errors.  `zopts` is the
+// worker's to change, and `tbufs` is the worker's, for act_retype().
+typedef int (*ServeAction)(FILE *oot, char *zopts, const Ast *ast,
+                           TypeBuffers *tbufs, void *arg);
+
+// Serve requests on a Unix socket made at `zpath`, running `act` with `arg` on
+// up to `nthreads` threads (zero means one per CPU) at once, until SIGINT or
+// SIGTERM.  Each request is a 32-bit length, big-endian, and then that many
+// bytes: a line of options, and the program.  Each is answered, in order, with
+// a 32-bit length and then: the number of syntax errors and of other errors
+// (32 bits each), the nanoseconds the request waited for a worker, took to
+// parse and took to run (64 bits each), the length of the output (32 bits),
+// the output, and the errors.  Returns the number of errors setting up.
+extern int act_serve(const char *zpath, uint32_t nthreads, ServeAction act,
+                     void *arg);
+
+// Print the bytecode that act_eval_vm() would run, one instruction per line.
+extern int act_dump_bytecode(FILE *oot, const Ast *ast);
+
+// --------------------------------------------------------------------------------------
+
+// The signature of act_eval() and the other evaluators.
+typedef int (*EvalAction)(FILE *oot, const Ast *ast, const EvalBudget *budget);
+
+// A directory of normal forms of closed terms, that persists from one run to
+// the next (see cache.c).  Terms are looked up by their structure, so
+// alpha-equivalent terms share an entry.
+typedef struct Cache Cache;
+
+// Open the cache in `zdir`, creating the directory if need be.  Returns NULL
+// (after reporting why to stderr) if that fails.
+extern Cache *open_cache(const char *zdir);
+
+// Like act(oot, ast, budget), but first replaces every closed subterm of `ast`
+// whose normal form is in `cache` by that normal form.  Afterwards, if the
+// program is closed and its normal form was printed, that is stored in the
+// cache.
+extern int act_cached(Cache *cache, EvalAction act, FILE *oot, const Ast *ast,
+                      const EvalBudget *budget);
 
-// Infer types for all expressions in the Ast, line-by-line, postfix.
-extern int act_type(FILE *oot, const Ast *ast);
+// Report the number of cache hits and misses to `oot`, and free `cache`.
+extern void close_cache(FILE *oot, Cache *cache);
 
 #endif // LAMBDA_2018_03_07_H
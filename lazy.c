@@ -0,0 +1,369 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eval.h"
+#include "lambda.h"
+#include "machine.h"
+#include "untestable.h"
+
+// A strong, call-by-need Krivine machine.  The code is the post-fix AstNode
+// array itself, which is never copied or modified: the machine walks it with
+// ast_unpack(), ast_arg_idx() and ast_lambda_body().  Arguments are passed as
+// thunks which are overwritten with their value the first time they are
+// forced, so a shared argument is evaluated only once.
+//
+// The machine only ever evaluates to weak head normal form.  The full normal
+// form is found by "reading back" values: a closure is read back by applying
+// it to a fresh variable and evaluating its body, a variable applied to some
+// arguments is read back by reading back each of the arguments.  Everything
+// (including the readback) is driven by explicit stacks, never by recursion.
+//
+// So the machine's whole state is in one LazyMachine, and it can stop after
+// any step and carry on later.  EvalContext (see eval.h) hands that out to
+// the scheduler (sched.c), which takes turns running many of them.
+
+static const EvalBudget default_budget = {
+    .max_steps = 1u << 26,
+    .max_bytes = 64u << 20,
+};
+
+// No step allocates more than this many heap cells, pushes more than this
+// many frames or emits more than this many output nodes.  (Except that reading
+// back a neutral term pushes a frame for each argument, and so reserves space
+// for them itself.)
+#define STEP_RESERVE 2
+
+typedef enum
+{
+        MODE_EVAL,     // Evaluate code[pc] in env.
+        MODE_RETURN,   // Hand `value` to the frame on top of the stack.
+        MODE_READBACK, // The stack is empty, so read back `value`.
+        MODE_NEXT,     // Pop a readback frame.
+        MODE_DONE,     // `out` holds the normal form.
+} Mode;
+
+typedef struct {
+        const AstNode *code;
+        uint32_t mode;
+        uint32_t pc;
+        Env *env;
+        Thunk *value;
+        uint32_t level;
+
+        Stack stack;  // FRAME_ARG and FRAME_UPDATE
+        Stack frames; // readback frames.
+        NodeVec out;
+
+        Heap heap;
+        uint64_t steps;
+        uint64_t max_steps;
+} LazyMachine;
+
+// Everything a step needs is reserved at its start, so that running out of
+// memory never leaves a step half done.
+static bool reserve_step(LazyMachine *m)
+{
+        return heap_reserve_cells(&m->heap, STEP_RESERVE) &&
+               reserve_frames(&m->heap, &m->stack, STEP_RESERVE) &&
+               reserve_frames(&m->heap, &m->frames, STEP_RESERVE) &&
+               reserve_nodes(&m->heap, &m->out, STEP_RESERVE);
+}
+
+// ------------------------------------------------------------------
+
+static void give_value(LazyMachine *m, Thunk *value)
+{
+        m->value = value;
+        m->mode = m->stack.depth ? MODE_RETURN : MODE_READBACK;
+}
+
+static void force(LazyMachine *m, Thunk *t)
+{
+        switch ((ThunkState)t->state) {
+        case THUNK_DELAYED:
+                push(&m->stack, FRAME_UPDATE, 0, t);
+                t->state = THUNK_BLACKHOLE;
+                m->pc = t->n;
+                m->env = t->env;
+                m->mode = MODE_EVAL;
+                return;
+        // LCOV_EXCL_START
+        case THUNK_BLACKHOLE:
+                // In the pure lambda calculus, a thunk can't be reached from
+                // its own environment.
+                DIE_LCOV_EXCL_LINE("BUG: re-entered a thunk being evaluated.");
+                return;
+                // LCOV_EXCL_STOP
+        case THUNK_CLOSURE:
+        case THUNK_FREE:
+        case THUNK_LEVEL:
+        case THUNK_APP:
+        case THUNK_NUM:
+                give_value(m, t);
+                return;
+        }
+}
+
+static void step_eval(LazyMachine *m)
+{
+        AstVal val;
+        const AstNode *code = m->code;
+        switch (ast_unpack(code, m->pc, &val)) {
+        case ANT_CALL: {
+                uint32_t arg = ast_arg_idx(code, m->pc);
+                Thunk *t = new_thunk(&m->heap, THUNK_DELAYED, arg, m->env);
+                push(&m->stack, FRAME_ARG, 0, t);
+                m->pc = val;
+                return;
+        }
+        case ANT_LAMBDA:
+                if (m->stack.depth &&
+                    m->stack.frames[m->stack.depth - 1].kind == FRAME_ARG) {
+                        Thunk *arg = pop(&m->stack).thunk;
+                        m->env = new_env(&m->heap, arg, m->env);
+                        m->pc = ast_lambda_body(code, m->pc);
+                        return;
+                }
+                give_value(m,
+                           new_thunk(&m->heap, THUNK_CLOSURE, m->pc, m->env));
+                return;
+        case ANT_BOUND:
+                force(m, env_lookup(m->env, val));
+                return;
+        case ANT_VAR:
+                give_value(m, new_thunk(&m->heap, THUNK_FREE, val, NULL));
+                return;
+        }
+}
+
+static void step_return(LazyMachine *m)
+{
+        Thunk *v = m->value;
+        Frame f = pop(&m->stack);
+        switch ((FrameKind)f.kind) {
+        case FRAME_UPDATE:
+                *f.thunk = *v;
+                give_value(m, v);
+                return;
+        case FRAME_ARG:
+                if (v->state == THUNK_CLOSURE) {
+                        m->env = new_env(&m->heap, f.thunk, v->env);
+                        m->pc = ast_lambda_body(m->code, v->n);
+                        m->mode = MODE_EVAL;
+                        return;
+                }
+                give_value(m, new_app(&m->heap, v, f.thunk));
+                return;
+        // LCOV_EXCL_START
+        case FRAME_RESUME:
+        case FRAME_LAMBDA:
+        case FRAME_CALL:
+        case FRAME_READ:
+                break;
+        }
+        DIE_LCOV_EXCL_LINE("Readback frame %u on the eval stack.", f.kind);
+        // LCOV_EXCL_STOP
+}
+
+static EvalStatus step_readback(LazyMachine *m)
+{
+        Thunk *v = m->value;
+        AstVal token;
+        uint32_t nargs = 0;
+        switch ((ThunkState)v->state) {
+        case THUNK_CLOSURE:
+                ast_unpack(m->code, v->n, &token);
+                push(&m->frames, FRAME_LAMBDA, token, NULL);
+                Thunk *var = new_thunk(&m->heap, THUNK_LEVEL, m->level++, NULL);
+                m->env = new_env(&m->heap, var, v->env);
+                m->pc = ast_lambda_body(m->code, v->n);
+                m->mode = MODE_EVAL;
+                return EVAL_REDUCED;
+        case THUNK_APP:
+                for (Thunk *h = v; h->state == THUNK_APP; h = h->app.fun)
+                        nargs++;
+                if (!reserve_frames(&m->heap, &m->frames, nargs))
+                        return EVAL_OUT_OF_MEMORY;
+                // The last argument is pushed first, so it is read last.
+                for (; v->state == THUNK_APP; v = v->app.fun)
+                        push(&m->frames, FRAME_READ, 0, v->app.arg);
+                break;
+        case THUNK_FREE:
+        case THUNK_LEVEL:
+                break;
+        // LCOV_EXCL_START
+        case THUNK_DELAYED:
+        case THUNK_BLACKHOLE:
+                DIE_LCOV_EXCL_LINE("Reading back unevaluated thunk.");
+        case THUNK_NUM:
+                DIE_LCOV_EXCL_LINE("Native number outside --church.");
+                // LCOV_EXCL_STOP
+        }
+
+        if (v->state == THUNK_FREE)
+                emit(&m->out, ANT_VAR, v->n);
+        else
+                emit(&m->out, ANT_BOUND, m->level - v->n - 1);
+        m->mode = MODE_NEXT;
+        return EVAL_REDUCED;
+}
+
+static void step_next(LazyMachine *m)
+{
+        if (!m->frames.depth) {
+                m->mode = MODE_DONE;
+                return;
+        }
+
+        Frame f = pop(&m->frames);
+        switch ((FrameKind)f.kind) {
+        case FRAME_LAMBDA:
+                emit(&m->out, ANT_VAR, f.n);
+                emit(&m->out, ANT_LAMBDA, 0);
+                m->level--;
+                return;
+        case FRAME_CALL:
+                emit(&m->out, ANT_CALL, m->out.size - f.n);
+                return;
+        case FRAME_READ:
+                push(&m->frames, FRAME_CALL, m->out.size, NULL);
+                force(m, f.thunk);
+                return;
+        // LCOV_EXCL_START
+        case FRAME_ARG:
+        case FRAME_UPDATE:
+        case FRAME_RESUME:
+                break;
+        }
+        DIE_LCOV_EXCL_LINE("Eval frame %u on the readback stack.", f.kind);
+        // LCOV_EXCL_STOP
+}
+
+static EvalStatus step(LazyMachine *m)
+{
+        if (!reserve_step(m))
+                return EVAL_OUT_OF_MEMORY;
+
+        switch ((Mode)m->mode) {
+        case MODE_EVAL:
+                step_eval(m);
+                return EVAL_REDUCED;
+        case MODE_RETURN:
+                step_return(m);
+                return EVAL_REDUCED;
+        case MODE_READBACK:
+                return step_readback(m);
+        case MODE_NEXT:
+                step_next(m);
+                return EVAL_REDUCED;
+        case MODE_DONE:
+                return EVAL_NORMAL_FORM;
+        }
+        return DIE_LCOV_EXCL_LINE("Bad machine mode %u", m->mode);
+}
+
+// Run at most `fuel` steps.  Returns EVAL_REDUCED if the fuel runs out first.
+static EvalStatus run(LazyMachine *m, uint64_t fuel)
+{
+        EvalStatus status = EVAL_REDUCED;
+        for (; status == EVAL_REDUCED && fuel; fuel--) {
+                if (m->steps >= m->max_steps && m->mode != MODE_DONE)
+                        return EVAL_OUT_OF_STEPS;
+                m->steps++;
+                status = step(m);
+        }
+        return status;
+}
+
+static void delete_machine(LazyMachine *m)
+{
+        heap_free(&m->heap);
+        free(m->stack.frames);
+        free(m->frames.frames);
+        free(m->out.nodes);
+}
+
+// ------------------------------------------------------------------
+
+struct EvalContext {
+        LazyMachine m;
+        EvalBudget budget;
+        EvalStatus status;
+};
+
+// Sets *status to EVAL_REDUCED, or to EVAL_OUT_OF_MEMORY if there isn't room
+// to bind the term's free indices.
+static LazyMachine new_machine(const AstNode *code, uint32_t size,
+                               const EvalBudget *b, EvalStatus *status)
+{
+        LazyMachine m = {
+            .code = code,
+            .mode = MODE_EVAL,
+            .pc = size - 1,
+            .heap = {.max_bytes = b->max_bytes},
+            .max_steps = b->max_steps,
+        };
+        *status = free_index_env(&m.heap, code, size, &m.env)
+                      ? EVAL_REDUCED
+                      : EVAL_OUT_OF_MEMORY;
+        return m;
+}
+
+EvalContext *new_eval_context(const AstNode *code, uint32_t size,
+                              const EvalBudget *budget)
+{
+        DIE_IF(!size, "Evaluating an empty term.");
+        EvalContext *ctx = realloc_or_die(HERE, NULL, sizeof(EvalContext));
+        ctx->budget = eval_budget_or_default(budget, default_budget);
+        ctx->m = new_machine(code, size, &ctx->budget, &ctx->status);
+        return ctx;
+}
+
+EvalStatus eval_context_run(EvalContext *ctx, uint64_t fuel)
+{
+        if (ctx->status == EVAL_REDUCED)
+                ctx->status = run(&ctx->m, fuel);
+        return ctx->status;
+}
+
+const AstNode *eval_context_result(const EvalContext *ctx, uint32_t *size)
+{
+        DIE_IF(ctx->status != EVAL_NORMAL_FORM,
+               "No normal form to return (status %u).", ctx->status);
+        *size = ctx->m.out.size;
+        return ctx->m.out.nodes;
+}
+
+int eval_context_report(const EvalContext *ctx)
+{
+        return report_eval_failure(ctx->status, &ctx->budget, ctx->m.steps);
+}
+
+void delete_eval_context(EvalContext *ctx)
+{
+        delete_machine(&ctx->m);
+        free(ctx);
+}
+
+int act_eval_lazy(FILE *oot, const Ast *ast, const EvalBudget *budget)
+{
+        EvalBudget b = eval_budget_or_default(budget, default_budget);
+        AstIdx size;
+        const AstNode *code = ast_postfix(ast, &size);
+        EvalStatus status;
+        LazyMachine m = new_machine(code, size, &b, &status);
+
+        if (status == EVAL_REDUCED)
+                status = run(&m, UINT64_MAX);
+        if (status == EVAL_NORMAL_FORM)
+                unparse_postfix(oot, m.out.nodes, m.out.size);
+        int nerr = report_eval_failure(status, &b, m.steps);
+
+        delete_machine(&m);
+        return nerr;
+}
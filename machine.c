@@ -0,0 +1,112 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "lambda.h"
+#include "machine.h"
+#include "untestable.h"
+
+// Heap cells are allocated from the arena this many at a time.
+#define HEAP_BLOCK 4096
+
+static bool heap_have_room(const Heap *heap, size_t more)
+{
+        return heap->arena.bytes + heap->vec_bytes + more <= heap->max_bytes;
+}
+
+bool heap_reserve_cells(Heap *heap, uint32_t n)
+{
+        if (heap->nfree >= n)
+                return true;
+
+        assert(n <= HEAP_BLOCK);
+        size_t size = sizeof(Cell) * HEAP_BLOCK;
+        if (!heap_have_room(heap, size))
+                return false;
+        heap->next = arena_alloc(&heap->arena, size);
+        heap->nfree = HEAP_BLOCK;
+        return true;
+}
+
+bool heap_reserve_vec(Heap *heap, void **pvec, uint32_t *alloced,
+                      size_t elt_size, uint64_t need)
+{
+        if (need <= *alloced)
+                return true;
+
+        uint64_t n = *alloced ? *alloced : 64;
+        while (n < need)
+                n *= 2;
+        if (n > UINT32_MAX || !heap_have_room(heap, elt_size * (n - *alloced)))
+                return false;
+
+        *pvec = realloc_or_die(HERE, *pvec, elt_size * n);
+        heap->vec_bytes += elt_size * (n - *alloced);
+        *alloced = n;
+        return true;
+}
+
+void *heap_alloc(Heap *heap, size_t n)
+{
+        if (!heap_have_room(heap, n))
+                return NULL;
+        return arena_alloc(&heap->arena, n);
+}
+
+void heap_free(Heap *heap)
+{
+        arena_free(&heap->arena);
+        *heap = (Heap){.max_bytes = heap->max_bytes};
+}
+
+bool free_index_env(Heap *heap, const AstNode *code, uint32_t size,
+                    Env **penv)
+{
+        // need[k]: how many lambdas code[k] needs around it to be closed.
+        uint32_t *need = realloc_or_die(HERE, NULL, sizeof(uint32_t) * size);
+        for (uint32_t k = 0; k < size; k++) {
+                AstVal val;
+                uint32_t body;
+                switch (ast_unpack(code, k, &val)) {
+                case ANT_VAR:
+                        need[k] = 0;
+                        continue;
+                case ANT_BOUND:
+                        need[k] = val + 1;
+                        continue;
+                case ANT_CALL:
+                        need[k] = need[val] > need[k - 1] ? need[val]
+                                                          : need[k - 1];
+                        continue;
+                case ANT_LAMBDA:
+                        body = ast_lambda_body(code, k);
+                        need[k] = need[body] ? need[body] - 1 : 0;
+                        continue;
+                }
+        }
+        uint32_t nfree = need[size - 1];
+        free(need);
+
+        // The head is the index just beyond the outermost lambda, which reads
+        // back as BOUND level, at any level.
+        Env *env = NULL;
+        while (nfree--) {
+                if (!heap_reserve_cells(heap, 2))
+                        return false;
+                Thunk *t = new_thunk(heap, THUNK_LEVEL, -1 - (int32_t)nfree,
+                                     NULL);
+                env = new_env(heap, t, env);
+        }
+        *penv = env;
+        return true;
+}
+
+void emit(NodeVec *out, AstNodeType type, int32_t val)
+{
+        assert(out->size < out->alloced);
+        AstNode *pn = out->nodes + out->size++;
+        *pn = ast_node(type, val);
+}
@@ -0,0 +1,196 @@
+#ifndef MACHINE_2026_10_16_H
+#define MACHINE_2026_10_16_H
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "lambda.h"
+#include "untestable.h"
+
+// Run-time data shared by the abstract machines (lazy.c, vm.c): thunks,
+// environments, the heap they live in and the stacks and output buffers used
+// to read back normal forms.
+
+typedef struct Env Env;
+typedef struct Thunk Thunk;
+typedef struct Nat Nat;
+
+typedef enum
+{
+        THUNK_DELAYED,   // Not yet evaluated: code n in env.
+        THUNK_BLACKHOLE, // Being evaluated.
+        THUNK_CLOSURE,   // The lambda whose code is n, in env.
+        THUNK_FREE,      // The free variable whose token is n.
+        THUNK_LEVEL,     // The variable bound at readback level n.
+        THUNK_APP,       // The neutral app.fun applied to app.arg.
+        THUNK_NUM,       // The Church numeral for `nat` (see church.h).
+} ThunkState;
+
+// A Thunk is a suspended computation, which is overwritten with its value (in
+// weak head normal form) once that has been computed.  So a value is just a
+// thunk in one of the states after THUNK_BLACKHOLE.  What "code" means is up
+// to the machine: an Ast index for lazy.c, a bytecode offset for vm.c.
+struct Thunk {
+        uint32_t state;
+        int32_t n;
+        union {
+                Env *env;
+                Nat *nat;
+                struct {
+                        Thunk *fun;
+                        Thunk *arg;
+                } app;
+        };
+};
+
+// Environments are linked lists, the head being de Bruijn index 1.
+struct Env {
+        Thunk *thunk;
+        Env *next;
+};
+
+typedef union {
+        Thunk thunk;
+        Env env;
+} Cell;
+
+// The Heap hands out cells from blocks carved out of an arena, and also keeps
+// count of bytes held in the machine's stacks, so that a single `max_bytes`
+// limit covers everything.  Cells are reserved before they are allocated, so
+// running out of memory never leaves a machine half way through a step.
+typedef struct {
+        Arena arena;
+        Cell *next;
+        uint32_t nfree;
+        size_t vec_bytes;
+        uint64_t max_bytes;
+} Heap;
+
+extern bool heap_reserve_cells(Heap *heap, uint32_t n);
+
+// Make sure the realloc()ed array at *pvec, with room for *alloced elements,
+// has room for at least `need`.
+extern bool heap_reserve_vec(Heap *heap, void **pvec, uint32_t *alloced,
+                             size_t elt_size, uint64_t need);
+
+// Returns `n` bytes from the heap's arena, or NULL if that would take the heap
+// beyond `max_bytes`.
+extern void *heap_alloc(Heap *heap, size_t n);
+
+extern void heap_free(Heap *heap);
+
+static inline Cell *heap_cell(Heap *heap)
+{
+        assert(heap->nfree);
+        heap->nfree--;
+        return heap->next++;
+}
+
+static inline Thunk *new_thunk(Heap *heap, ThunkState state, int32_t n,
+                               Env *env)
+{
+        Thunk *t = &heap_cell(heap)->thunk;
+        *t = (Thunk){.state = state, .n = n, .env = env};
+        return t;
+}
+
+static inline Thunk *new_app(Heap *heap, Thunk *fun, Thunk *arg)
+{
+        Thunk *t = &heap_cell(heap)->thunk;
+        *t = (Thunk){.state = THUNK_APP, .app = {.fun = fun, .arg = arg}};
+        return t;
+}
+
+static inline Thunk *new_num(Heap *heap, Nat *nat)
+{
+        Thunk *t = &heap_cell(heap)->thunk;
+        *t = (Thunk){.state = THUNK_NUM, .nat = nat};
+        return t;
+}
+
+static inline Env *new_env(Heap *heap, Thunk *thunk, Env *next)
+{
+        Env *e = &heap_cell(heap)->env;
+        *e = (Env){.thunk = thunk, .next = next};
+        return e;
+}
+
+// Sets *penv to bind each de Bruijn index that refers beyond the outermost
+// lambda of the post-fix term code[0:size] to a free variable, which reads
+// back as that same index, as act_eval() leaves it.  Returns false if the
+// heap hasn't room.
+extern bool free_index_env(Heap *heap, const AstNode *code, uint32_t size,
+                           Env **penv);
+
+// Every index is bound, once the machine starts from free_index_env().
+static inline Thunk *env_lookup(Env *env, int32_t depth)
+{
+        while (depth--) {
+                DIE_IF(!env, "BOUND refers beyond the outermost lambda.");
+                env = env->next;
+        }
+        DIE_IF(!env, "BOUND refers beyond the outermost lambda.");
+        return env->thunk;
+}
+
+// ------------------------------------------------------------------
+
+typedef enum
+{
+        FRAME_ARG,    // An argument waiting for a function.
+        FRAME_UPDATE, // Overwrite `thunk` with the value being returned.
+        FRAME_RESUME, // Drop the value being returned, and return `thunk`.
+        FRAME_LAMBDA, // Readback: finish a lambda with param token `n`.
+        FRAME_CALL,   // Readback: finish a CALL whose arg starts at out[n].
+        FRAME_READ,   // Readback: read back `thunk` as the next CALL's arg.
+} FrameKind;
+
+typedef struct {
+        uint32_t kind;
+        int32_t n;
+        Thunk *thunk;
+} Frame;
+
+typedef struct {
+        Frame *frames;
+        uint32_t depth;
+        uint32_t alloced;
+} Stack;
+
+static inline bool reserve_frames(Heap *heap, Stack *stack, uint64_t n)
+{
+        return heap_reserve_vec(heap, (void **)&stack->frames, &stack->alloced,
+                                sizeof(Frame), stack->depth + n);
+}
+
+static inline void push(Stack *stack, FrameKind kind, int32_t n, Thunk *thunk)
+{
+        assert(stack->depth < stack->alloced);
+        stack->frames[stack->depth++] = (Frame){kind, n, thunk};
+}
+
+static inline Frame pop(Stack *stack)
+{
+        assert(stack->depth);
+        return stack->frames[--stack->depth];
+}
+
+// A growing post-fix array, into which normal forms are read back.
+typedef struct {
+        AstNode *nodes;
+        uint32_t size;
+        uint32_t alloced;
+} NodeVec;
+
+static inline bool reserve_nodes(Heap *heap, NodeVec *out, uint64_t n)
+{
+        return heap_reserve_vec(heap, (void **)&out->nodes, &out->alloced,
+                                sizeof(AstNode), out->size + n);
+}
+
+extern void emit(NodeVec *out, AstNodeType type, int32_t val);
+
+#endif // MACHINE_2026_10_16_H
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
@@ -5,71 +6,287 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
 #include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "lambda.h"
+#include "sink.h"
 #include "untestable.h"
 
+static const struct {
+        const char *name;
+        EvalAction act;
+} eval_engines[] = {
+    {"subst", act_eval},
+    {"lazy", act_eval_lazy},
+    {"vm", act_eval_vm},
+    {"jit", act_eval_jit},
+    {"net", act_eval_net},
+};
+
 typedef struct {
         // Just test code for reading sources.  Read the input and
         // write it, and it's length to stdout.
         bool test_source_read;
+        // Unparse and type from the distinct subterms (see hashcons.c).
+        bool hash_cons;
+        // Evaluate each line by itself, in turns of `slice` steps.
+        bool round_robin;
+        uint64_t slice;
+        // Run the actions on each line by itself.
+        bool batch;
         struct {
                 bool unparse;
                 bool type;
+                bool type_compact;
+                bool dump_bytecode;
+                bool normalize;
+                bool church;
+                bool church_decimal;
+                EvalAction eval;
         } actions;
+        EvalBudget budget;
+        // Where to keep normal forms between runs, if anywhere.
+        const char *zcache;
+        // The file to read the program from, rather than STDIN.
+        const char *zfile;
+        // Files (or directories of them) to run the actions on, each by
+        // itself, rather than reading one program.
+        char *const *zpaths;
+        size_t npaths;
+        // The Unix socket to serve requests on, if any.
+        const char *zserve;
 } LambdaConfig;
 
+// A program's source, zsrc[0:len], which is NUL terminated if it was read,
+// but not if it's a file mapped into memory.
+typedef struct {
+        const char *zname;
+        const char *zsrc;
+        size_t len;
+        char *buf; // To free(), if read.
+        void *map; // To munmap(), if mapped.
+} Source;
+
+// Set `*act` to the engine named `zname` (the first, if NULL).  Returns false,
+// having said why to `err`, if there is no such engine.
+static bool find_engine(FILE *err, const char *zname, EvalAction *act)
+{
+        size_t n = sizeof(eval_engines) / sizeof(eval_engines[0]);
+        if (!zname) {
+                *act = eval_engines[0].act;
+                return true;
+        }
+        for (size_t k = 0; k < n; k++) {
+                if (!strcmp(zname, eval_engines[k].name)) {
+                        *act = eval_engines[k].act;
+                        return true;
+                }
+        }
+        fprintf(err, "--eval: unknown engine '%s'\n", zname);
+        return false;
+}
+
+static bool parse_count(FILE *err, const char *zopt, const char *zval,
+                        uint64_t *count)
+{
+        char *zend;
+        errno = 0;
+        unsigned long long n = strtoull(zval, &zend, 0);
+        if (errno || zend == zval || *zend || !n) {
+                fprintf(err, "--%s needs a positive integer, not '%s'\n", zopt,
+                        zval);
+                return false;
+        }
+        *count = n;
+        return true;
+}
+
+static int act_church_lambda(FILE *oot, const Ast *ast,
+                             const EvalBudget *budget)
+{
+        return act_normalize_church(oot, ast, budget, false);
+}
+
+static int act_church_decimal(FILE *oot, const Ast *ast,
+                              const EvalBudget *budget)
+{
+        return act_normalize_church(oot, ast, budget, true);
+}
+
+// Sets `*decimal` if numbers are to be printed in decimal.
+static bool parse_church_format(FILE *err, const char *zval, bool *decimal)
+{
+        if (!zval || !strcmp(zval, "lambda") || !strcmp(zval, "decimal")) {
+                *decimal = zval && !strcmp(zval, "decimal");
+                return true;
+        }
+        fprintf(err, "--church: unknown format '%s'\n", zval);
+        return false;
+}
+
+// Sets `*compact` if types are to be printed compactly.
+static bool parse_type_format(FILE *err, const char *zval, bool *compact)
+{
+        if (!zval || !strcmp(zval, "full") || !strcmp(zval, "compact")) {
+                *compact = zval && !strcmp(zval, "compact");
+                return true;
+        }
+        fprintf(err, "--type: unknown format '%s'\n", zval);
+        return false;
+}
+
+enum Opt
+{
+        OPT_DONE = -1,
+        OPT_BAD = '?',
+        // OPT_DEFAULT = ':',
+        OPT_TEST_SOURCE_READ = 1000,
+        OPT_ACT_TYPE,
+        OPT_ACT_UNPARSE,
+        OPT_ACT_EVAL,
+        OPT_ACT_DUMP_BYTECODE,
+        OPT_ACT_NORMALIZE,
+        OPT_ACT_CHURCH,
+        OPT_MAX_STEPS,
+        OPT_MAX_BYTES,
+        OPT_HASH_CONS,
+        // The options above can be given in a request to --serve too.
+        OPT_THREADS,
+        OPT_ROUND_ROBIN,
+        OPT_CACHE,
+        OPT_FILE,
+        OPT_BATCH,
+        OPT_SERVE,
+};
+
+enum
+{
+        HAS_NO_ARG,
+        HAS_ARG,
+        HAS_OPTIONAL_ARG,
+};
+
+static const struct option longopts[] = {
+    {"test-source-read", HAS_NO_ARG, NULL, OPT_TEST_SOURCE_READ},
+    {"unparse", HAS_NO_ARG, NULL, OPT_ACT_UNPARSE},
+    {"type", HAS_OPTIONAL_ARG, NULL, OPT_ACT_TYPE},
+    {"eval", HAS_OPTIONAL_ARG, NULL, OPT_ACT_EVAL},
+    {"dump-bytecode", HAS_NO_ARG, NULL, OPT_ACT_DUMP_BYTECODE},
+    {"normalize", HAS_NO_ARG, NULL, OPT_ACT_NORMALIZE},
+    {"church", HAS_OPTIONAL_ARG, NULL, OPT_ACT_CHURCH},
+    {"max-steps", HAS_ARG, NULL, OPT_MAX_STEPS},
+    {"max-bytes", HAS_ARG, NULL, OPT_MAX_BYTES},
+    {"threads", HAS_ARG, NULL, OPT_THREADS},
+    {"round-robin", HAS_OPTIONAL_ARG, NULL, OPT_ROUND_ROBIN},
+    {"cache", HAS_ARG, NULL, OPT_CACHE},
+    {"hash-cons", HAS_NO_ARG, NULL, OPT_HASH_CONS},
+    {"file", HAS_ARG, NULL, OPT_FILE},
+    {"batch", HAS_NO_ARG, NULL, OPT_BATCH},
+    {"serve", HAS_ARG, NULL, OPT_SERVE},
+    {0},
+};
+
+// Set what option `opt`, with the argument `zarg` (or NULL), says to in `conf`.
+// Returns false, having said why to `err`, if the argument is bad.
+static bool set_option(LambdaConfig *conf, enum Opt opt, const char *zarg,
+                       FILE *err)
+{
+        uint64_t n;
+        switch (opt) {
+        case OPT_TEST_SOURCE_READ:
+                conf->test_source_read = true;
+                return true;
+        case OPT_ACT_TYPE:
+                conf->actions.type = true;
+                return parse_type_format(err, zarg,
+                                         &conf->actions.type_compact);
+        case OPT_ACT_UNPARSE:
+                conf->actions.unparse = true;
+                return true;
+        case OPT_ACT_EVAL:
+                return find_engine(err, zarg, &conf->actions.eval);
+        case OPT_ACT_DUMP_BYTECODE:
+                conf->actions.dump_bytecode = true;
+                return true;
+        case OPT_ACT_NORMALIZE:
+                conf->actions.normalize = true;
+                return true;
+        case OPT_ACT_CHURCH:
+                conf->actions.church = true;
+                return parse_church_format(err, zarg,
+                                           &conf->actions.church_decimal);
+        case OPT_MAX_STEPS:
+                return parse_count(err, "max-steps", zarg,
+                                   &conf->budget.max_steps);
+        case OPT_MAX_BYTES:
+                return parse_count(err, "max-bytes", zarg,
+                                   &conf->budget.max_bytes);
+        case OPT_THREADS:
+                if (!parse_count(err, "threads", zarg, &n))
+                        return false;
+                conf->budget.threads = n;
+                return true;
+        case OPT_ROUND_ROBIN:
+                conf->round_robin = true;
+                return !zarg ||
+                       parse_count(err, "round-robin", zarg, &conf->slice);
+        case OPT_CACHE:
+                conf->zcache = zarg;
+                return true;
+        case OPT_HASH_CONS:
+                conf->hash_cons = true;
+                return true;
+        case OPT_FILE:
+                conf->zfile = zarg;
+                return true;
+        case OPT_BATCH:
+                conf->batch = true;
+                return true;
+        case OPT_SERVE:
+                conf->zserve = zarg;
+                return true;
+        // LCOV_EXCL_START
+        case OPT_DONE:
+        case OPT_BAD:
+                break;
+        }
+        return (bool)DIE_LCOV_EXCL_LINE("Setting bad option %d.", opt);
+        // LCOV_EXCL_STOP
+}
+
+static bool has_actions(const LambdaConfig *conf)
+{
+        return conf->actions.unparse || conf->actions.type ||
+               conf->actions.eval || conf->actions.dump_bytecode ||
+               conf->actions.normalize || conf->actions.church;
+}
+
 static LambdaConfig parse_argv_or_die(int argc, char *const *argv)
 {
-        LambdaConfig conf = {0};
-        enum Opt
-        {
-                OPT_DONE = -1,
-                OPT_BAD = '?',
-                // OPT_DEFAULT = ':',
-                OPT_TEST_SOURCE_READ = 1000,
-                OPT_ACT_TYPE,
-                OPT_ACT_UNPARSE,
-        };
-        enum
-        {
-                HAS_NO_ARG,
-                HAS_ARG,
-        };
-        static struct option longopts[] = {
-            {"test-source-read", HAS_NO_ARG, NULL, OPT_TEST_SOURCE_READ},
-            {"unparse", HAS_NO_ARG, NULL, OPT_ACT_UNPARSE},
-            {"type", HAS_NO_ARG, NULL, OPT_ACT_TYPE},
-            {0},
-        };
-
-        unsigned nacts = 0;
+        LambdaConfig conf = {.zcache = getenv("LAMBDA_CACHE")};
         for (;;) {
                 enum Opt c = getopt_long(argc, argv, "", longopts, NULL);
-                switch (c) {
-                case OPT_TEST_SOURCE_READ:
-                        conf.test_source_read = true;
-                        continue;
-                case OPT_ACT_TYPE:
-                        conf.actions.type = true;
-                        nacts++;
+                if (c == OPT_DONE)
                         break;
-                case OPT_ACT_UNPARSE:
-                        conf.actions.unparse = true;
-                        nacts++;
-                        break;
-                case OPT_DONE:
-                        goto end;
-                case OPT_BAD: /* deliberate fallthrough */;
-                default:
+                if (c == OPT_BAD) {
                         // Should have already printed more specific message.
                         fprintf(stderr, "Error parsing command line\n");
                         fflush(stderr);
                         exit(1);
                 }
+                if (!set_option(&conf, c, optarg, stderr)) {
+                        fflush(stderr);
+                        exit(1);
+                }
         }
-end:
+        bool nacts = has_actions(&conf);
+
+        conf.zpaths = argv + optind;
+        conf.npaths = argc - optind;
 
         if (nacts && conf.test_source_read) {
                 fprintf(stderr, "--test-source-read means read the then exit, "
@@ -78,8 +295,40 @@ end:
                 exit(1);
         }
 
+        if (nacts && conf.round_robin) {
+                fprintf(stderr, "--round-robin evaluates each line by itself, "
+                                "it cannot be used along with actions.\n");
+                fflush(stderr);
+                exit(1);
+        }
+
+        if (conf.batch && conf.round_robin) {
+                fprintf(stderr, "--batch and --round-robin both run each line "
+                                "by itself, use one or the other.\n");
+                fflush(stderr);
+                exit(1);
+        }
+
+        if (conf.npaths && (conf.zfile || conf.round_robin || conf.batch ||
+                            conf.test_source_read || conf.zcache)) {
+                fprintf(stderr, "Files to run can't be given along with "
+                                "--file, --round-robin, --batch, "
+                                "--test-source-read or --cache.\n");
+                fflush(stderr);
+                exit(1);
+        }
+
+        if (conf.zserve && (conf.npaths || conf.zfile || conf.round_robin ||
+                            conf.batch || conf.test_source_read ||
+                            conf.zcache)) {
+                fprintf(stderr, "--serve can't be used along with files to "
+                                "run, --file, --round-robin, --batch, "
+                                "--test-source-read or --cache.\n");
+                fflush(stderr);
+                exit(1);
+        }
+
         if (!nacts) {
-                nacts++;
                 conf.actions.unparse = true;
         }
 
@@ -114,7 +363,7 @@ static int read_whole_file(FILE *fin, char **obuf, size_t *osize)
         return ern;
 }
 
-static char *read_stdin_or_exit(const LambdaConfig *config)
+static Source read_stdin_or_exit(void)
 {
         size_t size;
         char *buf;
@@ -127,42 +376,399 @@ static char *read_stdin_or_exit(const LambdaConfig *config)
         }
         assert(buf);
         assert(strlen(buf) == size);
+        return (Source){.zname = "STDIN", .zsrc = buf, .len = size, .buf = buf};
+}
+
+// Map the file at `zpath` into memory, to be read once from start to end, so
+// that it is parsed where it is, without a copy.  Anything but a regular file
+// (a pipe, say, whose size is zero) is read into a buffer instead.
+static Source map_file_or_exit(const char *zpath)
+{
+        Source src = {.zname = zpath, .zsrc = ""};
+        struct stat st;
+        int fd = open(zpath, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) < 0)
+                goto fail;
+        if (!S_ISREG(st.st_mode)) {
+                FILE *fin = fdopen(fd, "r");
+                if (!fin)
+                        goto fail; // LCOV_EXCL_LINE
+                int nerr = read_whole_file(fin, &src.buf, &src.len);
+                fclose(fin);
+                if (nerr < 0) {
+                        free(src.buf);
+                        errno = -nerr;
+                        goto fail;
+                }
+                src.zsrc = src.buf;
+                return src;
+        }
+        if (st.st_size > 0) {
+                src.len = st.st_size;
+                src.map = mmap(NULL, src.len, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (src.map == MAP_FAILED)
+                        goto fail;
+                madvise(src.map, src.len, MADV_SEQUENTIAL);
+                src.zsrc = src.map;
+        }
+        close(fd);
+        return src;
+
+fail:
+        fprintf(stderr, "Error reading %s: %s\n", zpath, strerror(errno));
+        fflush(stderr);
+        exit(1);
+}
+
+static void check_source_len_or_exit(const char *zname, size_t len)
+{
+        // LCOV_EXCL_START: the test would need 4GB of source.
+        if (len >= (AstIdx)-1) {
+                fprintf(stderr,
+                        "%s is %lu bytes, too big to parse without "
+                        "WIDE_AST (see the Makefile).\n",
+                        zname, len);
+                fflush(stderr);
+                exit(1);
+        }
+        // LCOV_EXCL_STOP
+}
+
+static Source read_source_or_exit(const LambdaConfig *config)
+{
+        Source src = config->zfile ? map_file_or_exit(config->zfile)
+                                   : read_stdin_or_exit();
+        check_source_len_or_exit(src.zname, src.len);
 
         if (config->test_source_read) {
-                printf("%lu %s\n", size, buf);
-                free(buf);
+                printf("%lu ", src.len);
+                fwrite(src.zsrc, 1, src.len, stdout);
+                putchar('\n');
                 exit(0);
         }
 
-        return buf;
+        return src;
+}
+
+static void free_source(Source *src)
+{
+        free(src->buf);
+        if (src->map)
+                munmap(src->map, src->len);
+}
+
+// Whether to parse STDIN as it arrives, which it does if it's a pipe (or the
+// like) rather than a file, and only the parser needs it.
+static bool streams_stdin(const LambdaConfig *config)
+{
+        struct stat st;
+        if (config->zfile || config->round_robin || config->batch ||
+            config->test_source_read)
+                return false;
+        return fstat(STDIN_FILENO, &st) < 0 || !S_ISREG(st.st_mode);
+}
+
+// Parse STDIN a read(2) at a time, so that the parser keeps up with whatever
+// is writing it, and the source isn't kept.
+static Ast *parse_stdin_or_exit(void)
+{
+        enum { CHUNK = 64 * 1024 };
+        char *chunk = realloc_or_die(HERE, NULL, CHUNK);
+        Ast *ast = parse_start("STDIN");
+        size_t len = 0;
+        for (;;) {
+                ssize_t n = read(STDIN_FILENO, chunk, read_size(CHUNK));
+                if (n < 0 && errno == EINTR)
+                        continue; // LCOV_EXCL_LINE
+                int nerr = read_errnum(chunk, n);
+                if (nerr < 0) {
+                        fprintf(stderr, "Error reading STDIN: %s\n",
+                                strerror(-nerr));
+                        exit(1);
+                }
+                if (!n)
+                        break;
+                check_source_len_or_exit("STDIN", len += n);
+                parse_more(ast, chunk, n);
+        }
+        free(chunk);
+        return parse_finish(ast);
+}
+
+// Run `act`, through the cache if there is one.
+static int do_eval(FILE *oot, Cache *cache, EvalAction act,
+                   const EvalBudget *budget, const Ast *ast)
+{
+        if (cache)
+                return act_cached(cache, act, oot, ast, budget);
+        return act(oot, ast, budget);
 }
 
-static int do_actions(const LambdaConfig *conf, const Ast *ast)
+// Run the actions `conf` asks for on `ast`, typing in `tbufs`, if not NULL.
+static int do_actions(FILE *oot, const LambdaConfig *conf, Cache *cache,
+                      TypeBuffers *tbufs, const Ast *ast)
 {
+        AstIdx size;
+        ast_postfix(ast, &size);
+        // LCOV_EXCL_START: the test would need half a billion nodes.
+        if (size > EVAL_MAX_NODES &&
+            (conf->hash_cons || conf->actions.dump_bytecode ||
+             conf->actions.eval || conf->actions.normalize ||
+             conf->actions.church)) {
+                FILE *err = error_stream();
+                fprintf(err,
+                        "The program has %lu nodes, too many to evaluate "
+                        "or hash-cons (at most %ld).\n",
+                        (unsigned long)size, (long)EVAL_MAX_NODES);
+                fflush(err);
+                return 1;
+        }
+        // LCOV_EXCL_STOP
+
         int nerr = 0;
         if (conf->actions.unparse) {
-                nerr += act_unparse(stdout, ast);
+                nerr += conf->hash_cons ? act_unparse_shared(oot, ast)
+                                        : act_unparse(oot, ast,
+                                                      conf->budget.threads);
         }
         if (conf->actions.type) {
-                nerr += act_type(stdout, ast);
+                bool compact = conf->actions.type_compact;
+                uint32_t nthreads = conf->budget.threads;
+                nerr += conf->hash_cons ? act_type_shared(oot, ast, compact)
+                        : tbufs ? act_retype(oot, ast, compact, nthreads, tbufs)
+                                : act_type(oot, ast, compact, nthreads);
+        }
+        if (conf->actions.dump_bytecode) {
+                nerr += act_dump_bytecode(oot, ast);
+        }
+        if (conf->actions.eval) {
+                nerr += do_eval(oot, cache, conf->actions.eval,
+                                &conf->budget, ast);
         }
-        return 0;
+        if (conf->actions.normalize) {
+                nerr += do_eval(oot, cache, act_normalize, &conf->budget,
+                                ast);
+        }
+        if (conf->actions.church) {
+                nerr += do_eval(oot, cache,
+                                conf->actions.church_decimal
+                                    ? act_church_decimal
+                                    : act_church_lambda,
+                                &conf->budget, ast);
+        }
+        return nerr;
+}
+
+// ------------------------------------------------------------------
+// Batches.  Each line of the source is a program by itself, parsed into the
+// same Ast, and run through the actions, with its output tagged "LINE: ", and
+// its errors "NAME:LINE: ".  A program that fails doesn't stop the rest.
+
+static bool is_blank(const char *z, size_t len)
+{
+        for (size_t k = 0; k < len; k++) {
+                if (z[k] != ' ' && z[k] != '\t')
+                        return false;
+        }
+        return true;
+}
+
+// Run the actions on each line of `src` by itself.  The output goes through a
+// Tagger to one big Sink, so that many programs' output is written at once,
+// and the errors the actions report through another.  Returns the number of
+// programs that failed.
+static int run_batch(const LambdaConfig *config, Cache *cache,
+                     const Source *src)
+{
+        LambdaConfig conf = *config;
+        if (!conf.budget.threads) {
+                // Once, rather than for each program.
+                long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+                conf.budget.threads = ncpus > 0 ? ncpus : 1;
+        }
+
+        size_t name_size = strlen(src->zname) + sizeof(":4294967295: ");
+        char *zname = realloc_or_die(HERE, NULL, name_size);
+        char *zerr_tag = realloc_or_die(HERE, NULL, name_size);
+        char zout_tag[sizeof("4294967295: ")];
+        Tagger out = {.ztag = zout_tag}, err = {0};
+        sink_open_fd(&out.sink, STDOUT_FILENO);
+        sink_open_fd(&err.sink, STDERR_FILENO);
+        tagger_open(&out, false);
+        tagger_open(&err, true);
+
+        Ast *ast = NULL;
+        TypeBuffers *tbufs = new_type_buffers();
+        int nfailed = 0;
+        const char *zend = src->zsrc + src->len;
+        uint32_t line = 1;
+        for (const char *z = src->zsrc;; line++) {
+                const char *zE = memchr(z, '\n', zend - z);
+                size_t len = zE ? (size_t)(zE - z) : (size_t)(zend - z);
+                if (!is_blank(z, len)) {
+                        snprintf(zname, name_size, "%s:%u", src->zname, line);
+                        ast = reparse_len(ast, zname, z, len);
+                        // Syntax errors name the program's line themselves.
+                        err.ztag = "";
+                        int nerr = report_syntax_errors(err.file, ast);
+                        if (!nerr) {
+                                snprintf(zout_tag, sizeof(zout_tag), "%u: ",
+                                         line);
+                                snprintf(zerr_tag, name_size, "%s: ", zname);
+                                err.ztag = zerr_tag;
+                                set_error_stream(err.file);
+                                nerr = do_actions(out.file, &conf, cache, tbufs,
+                                                  ast);
+                                tagger_end_line(&out);
+                                set_error_stream(NULL);
+                        }
+                        tagger_end_line(&err);
+                        nfailed += nerr != 0;
+                }
+                if (!zE)
+                        break;
+                z = zE + 1;
+        }
+
+        nfailed += tagger_close(&out) + tagger_close(&err);
+        if (ast)
+                delete_ast(ast);
+        delete_type_buffers(tbufs);
+        free(zerr_tag);
+        free(zname);
+        return nfailed;
+}
+
+// ------------------------------------------------------------------
+// Corpora.  Each file is a program by itself, run on one of the workers in
+// corpus.c, so the actions themselves run on one thread.
+
+static int act_corpus_file(FILE *oot, const Ast *ast, TypeBuffers *tbufs,
+                           void *arg)
+{
+        return do_actions(oot, arg, NULL, tbufs, ast);
+}
+
+static int run_corpus(const LambdaConfig *config)
+{
+        LambdaConfig conf = *config;
+        conf.budget.threads = 1;
+        return act_corpus(stdout, conf.zpaths, conf.npaths,
+                          config->budget.threads, act_corpus_file, &conf);
+}
+
+// ------------------------------------------------------------------
+// Serving.  Each request to the server in serve.c gives its own options, as on
+// the command line, and the actions it asks for replace the server's.  The
+// actions run on one thread, as many requests are run at once.
+
+// Set the options in `zopts`, separated by spaces, in `conf`.  Only those that
+// say what to do with a program (the actions, their budget and --hash-cons)
+// can be given.  Returns false, having said why to `err`, if any are bad.
+static bool set_request_options(LambdaConfig *conf, char *zopts, FILE *err)
+{
+        LambdaConfig req = *conf;
+        memset(&req.actions, 0, sizeof(req.actions));
+        char *zsave;
+        for (char *zopt = strtok_r(zopts, " \t", &zsave); zopt;
+             zopt = strtok_r(NULL, " \t", &zsave)) {
+                char *zarg = strchr(zopt, '=');
+                if (zarg)
+                        *zarg++ = '\0';
+                const struct option *o = longopts;
+                while (o->name && (strncmp(zopt, "--", 2) ||
+                                   strcmp(zopt + 2, o->name)))
+                        o++;
+                if (!o->name || o->val > OPT_HASH_CONS) {
+                        fprintf(err, "Requests can't give option '%s'.\n",
+                                zopt);
+                        return false;
+                }
+                if (o->has_arg == (zarg ? HAS_NO_ARG : HAS_ARG)) {
+                        fprintf(err, "%s %s an argument.\n", zopt,
+                                zarg ? "doesn't take" : "needs");
+                        return false;
+                }
+                if (!set_option(&req, o->val, zarg, err))
+                        return false;
+        }
+        if (!has_actions(&req))
+                req.actions = conf->actions;
+
+        // A request may lower the server's budget, but not raise it.
+        const EvalBudget *own = &conf->budget;
+        EvalBudget *b = &req.budget;
+        if (own->max_steps && b->max_steps > own->max_steps)
+                b->max_steps = own->max_steps;
+        if (own->max_bytes && b->max_bytes > own->max_bytes)
+                b->max_bytes = own->max_bytes;
+        b->cap_steps = !own->max_steps;
+        b->cap_bytes = !own->max_bytes;
+        *conf = req;
+        return true;
+}
+
+static int act_request(FILE *oot, char *zopts, const Ast *ast,
+                       TypeBuffers *tbufs, void *arg)
+{
+        LambdaConfig conf = *(const LambdaConfig *)arg;
+        if (!set_request_options(&conf, zopts, error_stream()))
+                return 1;
+        return do_actions(oot, &conf, NULL, tbufs, ast);
+}
+
+static int run_serve(const LambdaConfig *config)
+{
+        LambdaConfig conf = *config;
+        conf.budget.threads = 1;
+        return act_serve(conf.zserve, config->budget.threads, act_request,
+                         &conf);
 }
 
 int main(int argc, char *const *argv)
 {
         init_debugging();
         LambdaConfig config = parse_argv_or_die(argc, argv);
+        if (config.npaths)
+                return run_corpus(&config) ? 1 : 0;
+        if (config.zserve)
+                return run_serve(&config) ? 1 : 0;
+
+        Source src = {0};
+        if (!streams_stdin(&config))
+                src = read_source_or_exit(&config);
+        if (config.round_robin) {
+                int nerr = act_round_robin(stdout, src.zname, src.zsrc, src.len,
+                                           &config.budget, config.slice);
+                free_source(&src);
+                return nerr ? 1 : 0;
+        }
+
+        Cache *cache = NULL;
+        if (config.zcache && !(cache = open_cache(config.zcache))) {
+                free_source(&src);
+                return 1;
+        }
 
-        char *zsrc = read_stdin_or_exit(&config);
+        if (config.batch) {
+                int nfailed = run_batch(&config, cache, &src);
+                if (cache)
+                        close_cache(stderr, cache);
+                free_source(&src);
+                return nfailed ? 1 : 0;
+        }
 
-        Ast *ast = parse("STDIN", zsrc);
+        Ast *ast = src.zsrc ? parse_parallel(src.zname, src.zsrc, src.len,
+                                             config.budget.threads)
+                            : parse_stdin_or_exit();
         int nerr = report_syntax_errors(stderr, ast);
         if (!nerr) {
-                nerr = do_actions(&config, ast);
+                nerr = do_actions(stdout, &config, cache, NULL, ast);
         }
 
+        if (cache)
+                close_cache(stderr, cache);
         delete_ast(ast);
-        free(zsrc);
+        free_source(&src);
         return nerr ? 1 : 0;
 }
@@ -0,0 +1,667 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "church.h"
+#include "eval.h"
+#include "lambda.h"
+#include "machine.h"
+#include "untestable.h"
+
+// Normalization by evaluation.  The post-fix AstNode array is evaluated into
+// a semantic domain of values, which are either closures (a lambda and its
+// environment) or neutral terms (a variable applied to some arguments), and
+// the normal form is found by "quoting" the value back into post-fix nodes.
+// Quoting a closure applies it to a fresh variable (a de Bruijn level) and
+// quotes the result, so there is no substitution and no shifting of indices
+// anywhere: a BOUND node is just an environment lookup.
+//
+// The values are the Thunks of machine.h, and arguments are passed by need,
+// so that act_normalize() finds a normal form whenever normal-order reduction
+// would.  But an argument that is already a value (a lambda, a variable) is
+// passed as that value, so most arguments never need a thunk or an update.
+//
+// eval() and quote() are the two halves of the usual recursive definition.
+// Both loop over explicit stacks instead, and quote() calls eval() but not
+// the other way round, so neither recurses.
+//
+// act_normalize_church() also tags the Church encodings in the code (see
+// church.h).  A numeral evaluates to a native number, which is only expanded
+// back into a lambda (appended to a copy of the code) if it is applied to
+// something, or quoted without --church=decimal.  A tagged combinator that is
+// applied to native arguments is run natively.  Arguments are evaluated first
+// if need be, but only those that the lambda itself would have used, and
+// anything else (a combinator applied to a free variable, say) is left to the
+// lambda, so the normal form is the same either way.
+
+// Steps are beta-reductions, which are cheap here.
+static const EvalBudget default_budget = {
+    .max_steps = 1u << 28,
+    .max_bytes = 64u << 20,
+};
+
+// No iteration of eval() or quote() allocates more than this many heap cells
+// (quoting a lambda needs a variable, an environment and a thunk for the
+// body), pushes more than this many frames or emits more than this many
+// nodes.  (Except that quoting a neutral term pushes a frame for each
+// argument, and so reserves space for them itself.)
+#define STEP_RESERVE 3
+
+typedef struct {
+        const AstNode *code;
+
+        // Only for act_normalize_church().  Tags are for code[0:ntags], which
+        // is the Ast followed by a lambda for true (at true_pc).  The code is
+        // prog.nodes, which grows as numbers are expanded.
+        const ChurchTag *tags;
+        uint32_t ntags;
+        uint32_t true_pc;
+        NodeVec prog;
+        bool decimal;
+        char **znums; // Decimal numbers quoted so far.
+        uint32_t nnums;
+        uint32_t nums_alloced;
+
+        Heap heap;
+        Stack stack;  // eval(): FRAME_ARG and FRAME_UPDATE
+        Stack frames; // quote(): FRAME_LAMBDA, FRAME_CALL and FRAME_READ
+        NodeVec out;
+        uint32_t level;
+        uint64_t steps;
+        uint64_t max_steps;
+} Normalizer;
+
+static bool reserve_step(Normalizer *nz)
+{
+        // Usually there is room already, and checking costs no calls.
+        if (nz->heap.nfree >= STEP_RESERVE &&
+            nz->stack.depth + STEP_RESERVE <= nz->stack.alloced &&
+            nz->frames.depth + STEP_RESERVE <= nz->frames.alloced &&
+            nz->out.size + STEP_RESERVE <= nz->out.alloced)
+                return true;
+        return heap_reserve_cells(&nz->heap, STEP_RESERVE) &&
+               reserve_frames(&nz->heap, &nz->stack, STEP_RESERVE) &&
+               reserve_frames(&nz->heap, &nz->frames, STEP_RESERVE) &&
+               reserve_nodes(&nz->heap, &nz->out, STEP_RESERVE);
+}
+
+// ------------------------------------------------------------------
+
+static ChurchOp church_op(const Normalizer *nz, uint32_t pc)
+{
+        return pc < nz->ntags ? nz->tags[pc].op : CHURCH_NONE;
+}
+
+// The value of the lambda code[pc] in env: a native number for a numeral, and
+// otherwise a closure.  Returns NULL if there is no room for the number.
+static Thunk *closure(Normalizer *nz, uint32_t pc, Env *env)
+{
+        if (church_op(nz, pc) != CHURCH_NUM)
+                return new_thunk(&nz->heap, THUNK_CLOSURE, pc, env);
+        Nat *nat = nat_from(&nz->heap, nz->tags[pc].n);
+        if (!nat)
+                return NULL;
+        nat->pc = pc;
+        return new_num(&nz->heap, nat);
+}
+
+// The argument code[pc] in env, as a value if that costs nothing more than a
+// cell, and otherwise as a thunk to be evaluated when (if) it is needed.
+static Thunk *delay(Normalizer *nz, uint32_t pc, Env *env)
+{
+        AstVal val;
+        switch (ast_unpack(nz->code, pc, &val)) {
+        case ANT_BOUND:
+                return env_lookup(env, val);
+        case ANT_LAMBDA:
+                return closure(nz, pc, env);
+        case ANT_VAR:
+                return new_thunk(&nz->heap, THUNK_FREE, val, NULL);
+        case ANT_CALL:
+                break;
+        }
+        return new_thunk(&nz->heap, THUNK_DELAYED, pc, env);
+}
+
+static bool count_steps(Normalizer *nz, uint64_t n)
+{
+        if (n > nz->max_steps - nz->steps)
+                return false;
+        nz->steps += n;
+        return true;
+}
+
+static bool count_beta(Normalizer *nz) { return count_steps(nz, 1); }
+
+// Start evaluating the delayed thunk `t`, to be overwritten with its value.
+static void enter(Stack *stack, Thunk *t, uint32_t *pc, Env **env)
+{
+        push(stack, FRAME_UPDATE, 0, t);
+        t->state = THUNK_BLACKHOLE;
+        *pc = t->n;
+        *env = t->env;
+}
+
+// ------------------------------------------------------------------
+
+// Replace the native number *pv with a closure for its numeral, appending the
+// numeral to the code if it isn't there already.
+static bool expand(Normalizer *nz, Thunk **pv)
+{
+        Nat *nat = (*pv)->nat;
+        NodeVec *prog = &nz->prog;
+        uint64_t n;
+        if (nat->pc < 0) {
+                if (!nat_to_u64(nat, &n) ||
+                    n > (EVAL_MAX_NODES - 5 - prog->size) / 2 ||
+                    !reserve_nodes(&nz->heap, prog, 2 * n + 5))
+                        return false;
+                for (uint64_t k = 0; k < n; k++)
+                        emit(prog, ANT_BOUND, 1);
+                emit(prog, ANT_BOUND, 0);
+                for (uint64_t k = 0; k < n; k++)
+                        emit(prog, ANT_CALL, 2 * k + 1);
+                emit(prog, ANT_VAR, 'x' - 'a');
+                emit(prog, ANT_LAMBDA, 0);
+                emit(prog, ANT_VAR, 'f' - 'a');
+                emit(prog, ANT_LAMBDA, 0);
+                nat->pc = prog->size - 1;
+                nz->code = prog->nodes;
+        }
+        *pv = new_thunk(&nz->heap, THUNK_CLOSURE, nat->pc, NULL);
+        return true;
+}
+
+// Evaluate `arg`, then go back to applying *pv.
+static EvalStatus force_arg(Normalizer *nz, Thunk **pv, Thunk *arg,
+                            uint32_t *pc, Env **env)
+{
+        push(&nz->stack, FRAME_RESUME, 0, *pv);
+        enter(&nz->stack, arg, pc, env);
+        *pv = NULL;
+        return EVAL_REDUCED;
+}
+
+static Thunk *new_bool(Normalizer *nz, bool truth)
+{
+        if (truth)
+                return new_thunk(&nz->heap, THUNK_CLOSURE, nz->true_pc, NULL);
+        Nat *zero = nat_from(&nz->heap, 0);
+        return zero ? new_num(&nz->heap, zero) : NULL;
+}
+
+// Sets *truth if `t` is a native boolean (false being zero).
+static bool as_bool(const Normalizer *nz, const Thunk *t, bool *truth)
+{
+        if (t->state == THUNK_NUM && nat_is_zero(t->nat)) {
+                *truth = false;
+                return true;
+        }
+        if (t->state == THUNK_CLOSURE && church_op(nz, t->n) == CHURCH_TRUE) {
+                *truth = true;
+                return true;
+        }
+        return false;
+}
+
+// Native arithmetic, charging steps for the work: a step per pair of limbs
+// multiplied, and at least one.  Sets *r to NULL if there is no room.
+static EvalStatus arithmetic(Normalizer *nz, ChurchOp op, const Nat *x,
+                             const Nat *y, Nat **r)
+{
+        Heap *heap = &nz->heap;
+        uint64_t n, bits = 32 * (uint64_t)y->nlimbs;
+        switch (op) {
+        case CHURCH_PLUS:
+                if (!count_steps(nz, 1 + x->nlimbs + y->nlimbs))
+                        return EVAL_OUT_OF_STEPS;
+                *r = nat_add(heap, x, y);
+                return EVAL_REDUCED;
+        case CHURCH_MULT:
+                if (!count_steps(nz, 1 + (uint64_t)x->nlimbs * y->nlimbs))
+                        return EVAL_OUT_OF_STEPS;
+                *r = nat_mul(heap, x, y);
+                return EVAL_REDUCED;
+        case CHURCH_EXP:
+                // y^x, for x > 0.
+                if (!y->nlimbs || (y->nlimbs == 1 && y->limbs[0] == 1)) {
+                        *r = (Nat *)y;
+                        return count_beta(nz) ? EVAL_REDUCED
+                                              : EVAL_OUT_OF_STEPS;
+                }
+                while (bits && !(y->limbs[(bits - 1) / 32] >>
+                                 (bits - 1) % 32 & 1))
+                        bits--;
+                if (!nat_to_u64(x, &n) || n > 8 * nz->heap.max_bytes / bits)
+                        return EVAL_OUT_OF_MEMORY;
+                n = n * bits / 32 + 1;
+                if (!count_steps(nz, n * n))
+                        return EVAL_OUT_OF_STEPS;
+                nat_to_u64(x, &n);
+                *r = nat_pow(heap, y, n);
+                return EVAL_REDUCED;
+        // LCOV_EXCL_START
+        case CHURCH_NONE:
+        case CHURCH_NUM:
+        case CHURCH_TRUE:
+        case CHURCH_SUCC:
+        case CHURCH_ISZERO:
+        case CHURCH_NOT:
+        case CHURCH_AND:
+        case CHURCH_OR:
+                break;
+        }
+        return (EvalStatus)DIE_LCOV_EXCL_LINE("Church op %u isn't arithmetic.",
+                                              op);
+        // LCOV_EXCL_STOP
+}
+
+// `v` is about to be applied to the FRAME_ARGs on top of the stack.  If it is
+// a native number, expand it into a closure, to be applied as usual.  If it is
+// a tagged combinator with enough arguments, either evaluate an argument that
+// it needs (and try again after), or run it natively, replacing it and its
+// arguments with the result.  Returns EVAL_REDUCED if it has done either of
+// those last two, and EVAL_NORMAL_FORM if *pv is to be applied as usual.
+static EvalStatus apply_church(Normalizer *nz, Thunk **pv, uint32_t *pc,
+                               Env **env)
+{
+        Thunk *v = *pv;
+        if (v->state == THUNK_NUM)
+                return expand(nz, pv) ? EVAL_NORMAL_FORM : EVAL_OUT_OF_MEMORY;
+        if (v->state != THUNK_CLOSURE)
+                return EVAL_NORMAL_FORM;
+
+        ChurchOp op = church_op(nz, v->n);
+        uint32_t arity = church_arity(op);
+        Stack *stack = &nz->stack;
+        Thunk *args[2] = {NULL, NULL};
+        if (!arity || stack->depth < arity)
+                return EVAL_NORMAL_FORM;
+        for (uint32_t k = 0; k < arity; k++) {
+                Frame f = stack->frames[stack->depth - 1 - k];
+                if (f.kind != FRAME_ARG)
+                        return EVAL_NORMAL_FORM;
+                args[k] = f.thunk;
+        }
+
+        // `x` is the argument the lambda would use first, `y` the other.
+        Thunk *x = args[op == CHURCH_EXP], *y = args[op != CHURCH_EXP];
+        if (x->state == THUNK_DELAYED)
+                return force_arg(nz, pv, x, pc, env);
+
+        bool truth;
+        Nat *nat = NULL;
+        Thunk *r = NULL;
+        switch (op) {
+        case CHURCH_NOT:
+        case CHURCH_AND:
+        case CHURCH_OR:
+                if (!as_bool(nz, x, &truth))
+                        return EVAL_NORMAL_FORM;
+                if (!count_beta(nz))
+                        return EVAL_OUT_OF_STEPS;
+                if (op == CHURCH_AND)
+                        r = truth ? y : x;
+                else if (op == CHURCH_OR)
+                        r = truth ? x : y;
+                else
+                        r = new_bool(nz, !truth);
+                break;
+        case CHURCH_ISZERO:
+                if (x->state != THUNK_NUM)
+                        return EVAL_NORMAL_FORM;
+                if (!count_beta(nz))
+                        return EVAL_OUT_OF_STEPS;
+                r = new_bool(nz, nat_is_zero(x->nat));
+                break;
+        case CHURCH_SUCC:
+                if (x->state != THUNK_NUM)
+                        return EVAL_NORMAL_FORM;
+                if (!count_steps(nz, 1 + x->nat->nlimbs))
+                        return EVAL_OUT_OF_STEPS;
+                if ((nat = nat_from(&nz->heap, 1)) &&
+                    (nat = nat_add(&nz->heap, x->nat, nat)))
+                        r = new_num(&nz->heap, nat);
+                break;
+        case CHURCH_PLUS:
+        case CHURCH_MULT:
+        case CHURCH_EXP:
+                if (x->state != THUNK_NUM)
+                        return EVAL_NORMAL_FORM;
+                if (nat_is_zero(x->nat)) {
+                        // 0 * n is 0, but n^0 is [x]x, not a numeral.
+                        if (op == CHURCH_EXP)
+                                return EVAL_NORMAL_FORM;
+                        if (op == CHURCH_MULT) {
+                                if (!count_beta(nz))
+                                        return EVAL_OUT_OF_STEPS;
+                                r = x;
+                                break;
+                        }
+                }
+                if (y->state == THUNK_DELAYED)
+                        return force_arg(nz, pv, y, pc, env);
+                if (y->state != THUNK_NUM)
+                        return EVAL_NORMAL_FORM;
+                EvalStatus status = arithmetic(nz, op, x->nat, y->nat, &nat);
+                if (status != EVAL_REDUCED)
+                        return status;
+                if (nat)
+                        r = new_num(&nz->heap, nat);
+                break;
+        // LCOV_EXCL_START
+        case CHURCH_NONE:
+        case CHURCH_NUM:
+        case CHURCH_TRUE:
+                DIE_LCOV_EXCL_LINE("Church op %u has no arguments.", op);
+                // LCOV_EXCL_STOP
+        }
+        if (!r)
+                return EVAL_OUT_OF_MEMORY;
+
+        DIE_IF(r->state == THUNK_BLACKHOLE,
+               "BUG: re-entered a thunk being evaluated.");
+        stack->depth -= arity;
+        *pv = r;
+        if (r->state == THUNK_DELAYED) {
+                enter(stack, r, pc, env);
+                *pv = NULL;
+        }
+        return EVAL_REDUCED;
+}
+
+// Evaluate `t` to a value, overwriting it with that value if it was delayed,
+// and store the value in *result.  This only returns from just after reserving
+// room for a step, so the caller has room for a step of its own to use the
+// value.
+static EvalStatus eval(Normalizer *nz, Thunk *t, Thunk **result)
+{
+        Stack *stack = &nz->stack;
+        assert(!stack->depth);
+        if (t->state != THUNK_DELAYED) {
+                *result = t;
+                return EVAL_NORMAL_FORM;
+        }
+
+        // The caller has reserved room for this.
+        uint32_t pc;
+        Env *env;
+        enter(stack, t, &pc, &env);
+        Thunk *v = NULL; // The value being returned, if any.
+        for (;;) {
+                if (!reserve_step(nz))
+                        return EVAL_OUT_OF_MEMORY;
+
+                if (v) {
+                        if (!stack->depth) {
+                                *result = v;
+                                return EVAL_NORMAL_FORM;
+                        }
+                        if (nz->tags &&
+                            stack->frames[stack->depth - 1].kind == FRAME_ARG) {
+                                EvalStatus status =
+                                    apply_church(nz, &v, &pc, &env);
+                                if (status == EVAL_REDUCED)
+                                        continue;
+                                if (status != EVAL_NORMAL_FORM)
+                                        return status;
+                        }
+                        Frame f = pop(stack);
+                        if (f.kind == FRAME_UPDATE) {
+                                *f.thunk = *v;
+                                v = f.thunk;
+                                continue;
+                        }
+                        if (f.kind == FRAME_RESUME) {
+                                v = f.thunk;
+                                continue;
+                        }
+                        assert(f.kind == FRAME_ARG);
+                        if (v->state != THUNK_CLOSURE) {
+                                v = new_app(&nz->heap, v, f.thunk);
+                                continue;
+                        }
+                        if (!count_beta(nz))
+                                return EVAL_OUT_OF_STEPS;
+                        env = new_env(&nz->heap, f.thunk, v->env);
+                        pc = ast_lambda_body(nz->code, v->n);
+                        v = NULL;
+                        continue;
+                }
+
+                AstVal val;
+                Thunk *arg;
+                switch (ast_unpack(nz->code, pc, &val)) {
+                case ANT_CALL:
+                        arg = delay(nz, ast_arg_idx(nz->code, pc), env);
+                        if (!arg)
+                                return EVAL_OUT_OF_MEMORY;
+                        push(stack, FRAME_ARG, 0, arg);
+                        pc = val;
+                        continue;
+                case ANT_LAMBDA:
+                        // Tagged lambdas go round as values, to be applied by
+                        // apply_church().
+                        if (church_op(nz, pc) == CHURCH_NONE &&
+                            stack->frames[stack->depth - 1].kind == FRAME_ARG) {
+                                if (!count_beta(nz))
+                                        return EVAL_OUT_OF_STEPS;
+                                env = new_env(&nz->heap, pop(stack).thunk, env);
+                                pc = ast_lambda_body(nz->code, pc);
+                                continue;
+                        }
+                        // A numeral's closure is a few bytes, and no budget
+                        // has been found that runs out on them.
+                        if (!(v = closure(nz, pc, env)))
+                                return EVAL_OUT_OF_MEMORY; // LCOV_EXCL_LINE
+                        continue;
+                case ANT_BOUND:
+                        v = env_lookup(env, val);
+                        if (v->state == THUNK_DELAYED) {
+                                enter(stack, v, &pc, &env);
+                                v = NULL;
+                        }
+                        DIE_IF(v && v->state == THUNK_BLACKHOLE,
+                               "BUG: re-entered a thunk being evaluated.");
+                        continue;
+                case ANT_VAR:
+                        v = new_thunk(&nz->heap, THUNK_FREE, val, NULL);
+                        continue;
+                }
+        }
+}
+
+// Quote a number as a VAR with a negative token, standing for nz->znums[-1 -
+// token].  Converting to decimal costs a step per limb squared.
+static EvalStatus quote_decimal(Normalizer *nz, const Nat *nat)
+{
+        uint64_t nlimbs = nat->nlimbs;
+        if (!count_steps(nz, 1 + nlimbs * nlimbs))
+                return EVAL_OUT_OF_STEPS;
+        char *z = nat_decimal(&nz->heap, nat);
+        if (!z || !heap_reserve_vec(&nz->heap, (void **)&nz->znums,
+                                    &nz->nums_alloced, sizeof(char *),
+                                    nz->nnums + 1))
+                return EVAL_OUT_OF_MEMORY;
+        nz->znums[nz->nnums] = z;
+        emit(&nz->out, ANT_VAR, -1 - (int32_t)nz->nnums++);
+        return EVAL_NORMAL_FORM;
+}
+
+// Quote the value of `t` into nz->out.
+static EvalStatus quote(Normalizer *nz, Thunk *t)
+{
+        Stack *frames = &nz->frames;
+        for (;;) {
+                if (!reserve_step(nz))
+                        return EVAL_OUT_OF_MEMORY;
+
+                if (t) {
+                        Thunk *v;
+                        EvalStatus status = eval(nz, t, &v);
+                        if (status != EVAL_NORMAL_FORM)
+                                return status;
+                        t = NULL;
+
+                        AstVal token;
+                        uint32_t nargs = 0;
+                        switch ((ThunkState)v->state) {
+                        case THUNK_CLOSURE:
+                                ast_unpack(nz->code, v->n, &token);
+                                push(frames, FRAME_LAMBDA, token, NULL);
+                                Thunk *var = new_thunk(&nz->heap, THUNK_LEVEL,
+                                                       nz->level++, NULL);
+                                Env *env = new_env(&nz->heap, var, v->env);
+                                t = new_thunk(&nz->heap, THUNK_DELAYED,
+                                              ast_lambda_body(nz->code, v->n),
+                                              env);
+                                continue;
+                        case THUNK_APP:
+                                for (Thunk *h = v; h->state == THUNK_APP;
+                                     h = h->app.fun)
+                                        nargs++;
+                                if (!reserve_frames(&nz->heap, frames, nargs))
+                                        return EVAL_OUT_OF_MEMORY;
+                                // The last argument is pushed first, so it is
+                                // read last.
+                                for (; v->state == THUNK_APP; v = v->app.fun)
+                                        push(frames, FRAME_READ, 0, v->app.arg);
+                                break;
+                        case THUNK_NUM:
+                                if (nz->decimal) {
+                                        status = quote_decimal(nz, v->nat);
+                                        if (status != EVAL_NORMAL_FORM)
+                                                return status;
+                                        continue;
+                                }
+                                // Quote the numeral's lambda next time round.
+                                if (!expand(nz, &v))
+                                        return EVAL_OUT_OF_MEMORY;
+                                t = v;
+                                continue;
+                        case THUNK_FREE:
+                        case THUNK_LEVEL:
+                                break;
+                        // LCOV_EXCL_START
+                        case THUNK_DELAYED:
+                        case THUNK_BLACKHOLE:
+                                DIE_LCOV_EXCL_LINE(
+                                    "Quoting an unevaluated thunk.");
+                                // LCOV_EXCL_STOP
+                        }
+                        if (v->state == THUNK_FREE)
+                                emit(&nz->out, ANT_VAR, v->n);
+                        else
+                                emit(&nz->out, ANT_BOUND,
+                                     nz->level - v->n - 1);
+                        continue;
+                }
+
+                if (!frames->depth)
+                        return EVAL_NORMAL_FORM;
+                Frame f = pop(frames);
+                switch ((FrameKind)f.kind) {
+                case FRAME_LAMBDA:
+                        emit(&nz->out, ANT_VAR, f.n);
+                        emit(&nz->out, ANT_LAMBDA, 0);
+                        nz->level--;
+                        continue;
+                case FRAME_CALL:
+                        emit(&nz->out, ANT_CALL, nz->out.size - f.n);
+                        continue;
+                case FRAME_READ:
+                        push(frames, FRAME_CALL, nz->out.size, NULL);
+                        t = f.thunk;
+                        continue;
+                // LCOV_EXCL_START
+                case FRAME_ARG:
+                case FRAME_UPDATE:
+                case FRAME_RESUME:
+                        break;
+                }
+                DIE_LCOV_EXCL_LINE("Eval frame %u while quoting.", f.kind);
+                // LCOV_EXCL_STOP
+        }
+}
+
+static void delete_normalizer(Normalizer *nz)
+{
+        heap_free(&nz->heap);
+        free(nz->stack.frames);
+        free(nz->frames.frames);
+        free(nz->out.nodes);
+        free(nz->prog.nodes);
+        free((ChurchTag *)nz->tags);
+        free(nz->znums);
+}
+
+// Quote code[root], print the result and clean up.
+static int normalize(FILE *oot, Normalizer *nz, uint32_t root,
+                     const EvalBudget *b)
+{
+        Thunk t = {.state = THUNK_DELAYED, .n = root};
+        EvalStatus status = EVAL_OUT_OF_MEMORY;
+        if (free_index_env(&nz->heap, nz->code, root + 1, &t.env))
+                status = quote(nz, &t);
+        if (status == EVAL_NORMAL_FORM)
+                unparse_postfix_with_numbers(oot, nz->out.nodes, nz->out.size,
+                                             (const char *const *)nz->znums);
+        int nerr = report_eval_failure(status, b, nz->steps);
+
+        delete_normalizer(nz);
+        return nerr;
+}
+
+// ------------------------------------------------------------------
+
+int act_normalize(FILE *oot, const Ast *ast, const EvalBudget *budget)
+{
+        EvalBudget b = eval_budget_or_default(budget, default_budget);
+        AstIdx size;
+        Normalizer nz = {
+            .code = ast_postfix(ast, &size),
+            .heap = {.max_bytes = b.max_bytes},
+            .max_steps = b.max_steps,
+        };
+        return normalize(oot, &nz, size - 1, &b);
+}
+
+int act_normalize_church(FILE *oot, const Ast *ast, const EvalBudget *budget,
+                         bool decimal)
+{
+        EvalBudget b = eval_budget_or_default(budget, default_budget);
+        AstIdx size;
+        const AstNode *code = ast_postfix(ast, &size);
+        Normalizer nz = {
+            .heap = {.max_bytes = b.max_bytes},
+            .max_steps = b.max_steps,
+            .decimal = decimal,
+        };
+
+        // Copy the code, and follow it with [a][b]a.
+        NodeVec *prog = &nz.prog;
+        if (!reserve_nodes(&nz.heap, prog, size + 5)) {
+                delete_normalizer(&nz);
+                return report_eval_failure(EVAL_OUT_OF_MEMORY, &b, 0);
+        }
+        memcpy(prog->nodes, code, sizeof(AstNode) * size);
+        prog->size = size;
+        emit(prog, ANT_BOUND, 1);
+        emit(prog, ANT_VAR, 'b' - 'a');
+        emit(prog, ANT_LAMBDA, 0);
+        emit(prog, ANT_VAR, 'a' - 'a');
+        emit(prog, ANT_LAMBDA, 0);
+        nz.code = prog->nodes;
+        nz.ntags = prog->size;
+        nz.true_pc = prog->size - 1;
+
+        ChurchTag *tags =
+            realloc_or_die(HERE, NULL, sizeof(ChurchTag) * nz.ntags);
+        church_match(nz.code, nz.ntags, tags);
+        nz.tags = tags;
+        return normalize(oot, &nz, size - 1, &b);
+}
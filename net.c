@@ -0,0 +1,966 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "deque.h"
+#include "eval.h"
+#include "lambda.h"
+#include "machine.h"
+#include "untestable.h"
+
+// An interaction-net reducer, in the style of Lamping's abstract algorithm
+// (without the oracle): the term is translated into a net of Lafont's
+// interaction combinators, where both lambda and application are CON agents,
+// sharing is done by DUP agents labelled with the lambda whose variable they
+// share, and ERA erases.  Variables that are used more than once are shared
+// rather than copied, and that sharing survives going under lambdas, so a DUP
+// copies only as much of a term as it really needs.
+//
+// Nodes live in one flat buffer, and are only ever written by the thread that
+// creates (or consumes) them.  The wires between nodes' auxiliary ports are
+// "vars", whose ends are resolved with an atomic exchange as the nodes on
+// either side are consumed (this is the linker of the HVM2 paper), so active
+// pairs can be reduced in any order and in parallel.  Each worker keeps its
+// active pairs on a Chase-Lev work-stealing deque.
+//
+// Reducing every active pair is a strict strategy: a term that only has a
+// normal form because a diverging argument is discarded will run out of
+// budget here.  And without the oracle, DUPs with the same label can meet
+// when they shouldn't, which goes wrong for some terms that aren't typeable
+// in elementary affine logic, though not for things like Church arithmetic.
+
+static const EvalBudget default_budget = {
+    .max_steps = 1u << 26,
+    .max_bytes = 256u << 20,
+};
+
+#define NONE UINT32_MAX
+
+// ------------------------------------------------------------------
+
+typedef uint64_t Port;
+
+typedef enum
+{
+        PORT_EMPTY, // An unresolved var (or, with a val, a free one).
+        PORT_VAR,   // One end of a wire to an auxiliary port.
+        PORT_NODE,  // The main port of nodes[val].
+        PORT_ERA,   // An eraser.
+        PORT_FREE,  // The free variable with token val (see FREE_INDEX).
+} PortTag;
+
+// A PORT_FREE whose val has this bit set is the de Bruijn index that refers
+// (val - FREE_INDEX) lambdas beyond the term's outermost, which reads back as
+// the same index.
+#define FREE_INDEX (1u << 31)
+
+static inline Port new_port(PortTag tag, uint32_t val)
+{
+        return (uint64_t)val << 8 | tag;
+}
+
+static inline PortTag port_tag(Port p) { return p & 0xff; }
+
+static inline uint32_t port_val(Port p) { return p >> 8; }
+
+typedef enum
+{
+        NODE_UNUSED,
+        NODE_REDEX, // Not an agent: a pair of ports waiting to interact.
+        NODE_ROOT,  // Not an agent: holds the term's root.
+        NODE_CON,
+        NODE_DUP,
+} NodeKind;
+
+// Binary agents keep their kind here, and their auxiliary ports in `slot`.
+// The main port is whoever holds a PORT_NODE that points to the node.
+typedef struct {
+        uint32_t kind;
+        uint32_t label;
+        Port slot[2];
+} NetNode;
+
+// ------------------------------------------------------------------
+
+typedef struct Net Net;
+
+typedef struct {
+        Net *net;
+        uint32_t id;
+        pthread_t thread;
+        Deque deque;
+
+        // Nodes and vars come from the worker's free list, then from the
+        // chunk [next, end) it has claimed from the net.
+        uint32_t node_free, nfree_nodes, node_next, node_end;
+        uint32_t var_free, nfree_vars, var_next, var_end;
+
+        // Interactions this worker may still do, and has done.
+        uint64_t allowance;
+        uint64_t steps;
+
+        // Redexes that can't be reduced: a free variable applied to something.
+        uint32_t *stuck;
+        uint32_t nstuck;
+        uint32_t stuck_alloced;
+} Worker;
+
+struct Net {
+        NetNode *nodes;
+        uint32_t max_nodes;
+        _Atomic uint64_t node_top;
+
+        _Atomic Port *vars;
+        uint32_t max_vars;
+        _Atomic uint64_t var_top;
+
+        _Atomic uint64_t pending; // Redexes pushed but not yet reduced.
+        _Atomic uint64_t granted; // Steps handed out to workers.
+        uint64_t max_steps;
+        _Atomic int status;       // EVAL_REDUCED while still running.
+
+        Worker *workers;
+        uint32_t nworkers;
+        uint32_t root;
+};
+
+#define CHUNK 1024
+
+// Enough for any one interaction: two new nodes and four redexes, and four
+// vars.  (Building the net needs less per node.)
+#define NODES_PER_STEP 8
+#define VARS_PER_STEP 4
+
+// Steps are granted to workers this many at a time.
+#define STEP_GRANT 1024
+
+static void stop(Net *net, EvalStatus status)
+{
+        int running = EVAL_REDUCED;
+        atomic_compare_exchange_strong(&net->status, &running, status);
+}
+
+static void free_node(Worker *w, uint32_t n)
+{
+        NetNode *node = &w->net->nodes[n];
+        node->kind = NODE_UNUSED;
+        node->slot[0] = w->node_free;
+        w->node_free = n;
+        w->nfree_nodes++;
+}
+
+static uint32_t alloc_node(Worker *w, NodeKind kind, uint32_t label, Port p0,
+                           Port p1)
+{
+        uint32_t n = w->node_free;
+        if (n != NONE) {
+                w->node_free = w->net->nodes[n].slot[0];
+                w->nfree_nodes--;
+        } else {
+                assert(w->node_next < w->node_end);
+                n = w->node_next++;
+        }
+        w->net->nodes[n] = (NetNode){kind, label, {p0, p1}};
+        return n;
+}
+
+static void free_var(Worker *w, uint32_t x)
+{
+        atomic_store_explicit(&w->net->vars[x],
+                              new_port(PORT_EMPTY, w->var_free),
+                              memory_order_relaxed);
+        w->var_free = x;
+        w->nfree_vars++;
+}
+
+static Port alloc_var(Worker *w)
+{
+        uint32_t x = w->var_free;
+        if (x != NONE) {
+                w->var_free = port_val(atomic_load_explicit(
+                    &w->net->vars[x], memory_order_relaxed));
+                w->nfree_vars--;
+                atomic_store_explicit(&w->net->vars[x], PORT_EMPTY,
+                                      memory_order_relaxed);
+        } else {
+                assert(w->var_next < w->var_end);
+                x = w->var_next++;
+        }
+        return new_port(PORT_VAR, x);
+}
+
+// Claim a fresh chunk of [0, max) from *top, putting what's left of the
+// current chunk [*next, *end) on the free list.
+static bool claim_chunk(Worker *w, _Atomic uint64_t *top, uint64_t max,
+                        uint32_t *next, uint32_t *end,
+                        void (*release)(Worker *, uint32_t))
+{
+        uint64_t start = atomic_fetch_add(top, CHUNK);
+        if (start + CHUNK > max)
+                return false;
+        while (*next < *end)
+                release(w, (*next)++);
+        *next = start;
+        *end = start + CHUNK;
+        return true;
+}
+
+static bool reserve_step(Worker *w)
+{
+        Net *net = w->net;
+        bool nodes = w->nfree_nodes + (w->node_end - w->node_next) >=
+                         NODES_PER_STEP ||
+                     claim_chunk(w, &net->node_top, net->max_nodes,
+                                 &w->node_next, &w->node_end, free_node);
+        bool vars = w->nfree_vars + (w->var_end - w->var_next) >=
+                        VARS_PER_STEP ||
+                    claim_chunk(w, &net->var_top, net->max_vars, &w->var_next,
+                                &w->var_end, free_var);
+        return nodes && vars;
+}
+
+static void push_redex(Worker *w, Port a, Port b)
+{
+        uint32_t r = alloc_node(w, NODE_REDEX, 0, a, b);
+        atomic_fetch_add(&w->net->pending, 1);
+        deque_push(&w->deque, r);
+}
+
+// Connect a and b.  If either is a var whose other end has already been
+// connected to something, connect that instead, and so on.
+static void connect(Worker *w, Port a, Port b)
+{
+        for (;;) {
+                if (port_tag(a) != PORT_VAR) {
+                        Port t = a;
+                        a = b;
+                        b = t;
+                }
+                if (port_tag(a) != PORT_VAR) {
+                        push_redex(w, a, b);
+                        return;
+                }
+                uint32_t x = port_val(a);
+                Port got = atomic_exchange(&w->net->vars[x], b);
+                if (got == PORT_EMPTY)
+                        return;
+                // Both ends of x have arrived, so x is no longer needed.
+                free_var(w, x);
+                a = got;
+        }
+}
+
+// ------------------------------------------------------------------
+
+typedef enum
+{
+        AGENT_ERA,
+        AGENT_FREE,
+        AGENT_CON,
+        AGENT_DUP,
+} AgentKind;
+
+static AgentKind agent_kind(const Net *net, Port p)
+{
+        switch (port_tag(p)) {
+        case PORT_ERA:
+                return AGENT_ERA;
+        case PORT_FREE:
+                return AGENT_FREE;
+        case PORT_NODE:
+                if (net->nodes[port_val(p)].kind == NODE_CON)
+                        return AGENT_CON;
+                return AGENT_DUP;
+        // LCOV_EXCL_START
+        case PORT_EMPTY:
+        case PORT_VAR:
+                return DIE_LCOV_EXCL_LINE("Port %lx in an active pair.", p);
+        // LCOV_EXCL_STOP
+        }
+        return DIE_LCOV_EXCL_LINE("Port %lx has a bad tag.", p);
+}
+
+// A nullary agent p meets binary agent n: p goes to both of n's aux ports.
+static void spread(Worker *w, uint32_t n, Port p)
+{
+        NetNode node = w->net->nodes[n];
+        free_node(w, n);
+        connect(w, node.slot[0], p);
+        connect(w, node.slot[1], p);
+}
+
+static void annihilate(Worker *w, uint32_t a, uint32_t b)
+{
+        NetNode na = w->net->nodes[a], nb = w->net->nodes[b];
+        free_node(w, a);
+        free_node(w, b);
+        connect(w, na.slot[0], nb.slot[0]);
+        connect(w, na.slot[1], nb.slot[1]);
+}
+
+// Each agent passes through the other, and so is copied.  a and b are re-used
+// as two of the four copies.
+static void commute(Worker *w, uint32_t a, uint32_t b)
+{
+        NetNode *nodes = w->net->nodes;
+        NetNode na = nodes[a], nb = nodes[b];
+        Port v0 = alloc_var(w), v1 = alloc_var(w);
+        Port v2 = alloc_var(w), v3 = alloc_var(w);
+        nodes[b] = (NetNode){nb.kind, nb.label, {v0, v1}};
+        uint32_t b2 = alloc_node(w, nb.kind, nb.label, v2, v3);
+        nodes[a] = (NetNode){na.kind, na.label, {v0, v2}};
+        uint32_t a2 = alloc_node(w, na.kind, na.label, v1, v3);
+        connect(w, na.slot[0], new_port(PORT_NODE, b));
+        connect(w, na.slot[1], new_port(PORT_NODE, b2));
+        connect(w, nb.slot[0], new_port(PORT_NODE, a));
+        connect(w, nb.slot[1], new_port(PORT_NODE, a2));
+}
+
+static void interact(Worker *w, uint32_t redex)
+{
+        Net *net = w->net;
+        Port a = net->nodes[redex].slot[0], b = net->nodes[redex].slot[1];
+        AgentKind ka = agent_kind(net, a), kb = agent_kind(net, b);
+        if (ka > kb) {
+                Port p = a;
+                a = b;
+                b = p;
+                AgentKind k = ka;
+                ka = kb;
+                kb = k;
+        }
+        w->allowance--;
+        w->steps++;
+        if (ka == AGENT_FREE && kb == AGENT_CON) {
+                if (w->nstuck == w->stuck_alloced) {
+                        uint32_t n = w->stuck_alloced * 2;
+                        n = n ? n : 64;
+                        w->stuck = realloc_or_die(HERE, w->stuck,
+                                                  sizeof(uint32_t) * n);
+                        w->stuck_alloced = n;
+                }
+                w->stuck[w->nstuck++] = redex;
+                return;
+        }
+
+        free_node(w, redex);
+        if (kb < AGENT_CON)
+                return; // Nullary agents just vanish.
+        if (ka < AGENT_CON)
+                return spread(w, port_val(b), a);
+
+        const NetNode *na = &net->nodes[port_val(a)];
+        const NetNode *nb = &net->nodes[port_val(b)];
+        if (na->kind == nb->kind && na->label == nb->label)
+                return annihilate(w, port_val(a), port_val(b));
+        commute(w, port_val(a), port_val(b));
+}
+
+static bool grant_steps(Worker *w)
+{
+        Net *net = w->net;
+        uint64_t start = atomic_fetch_add(&net->granted, STEP_GRANT);
+        if (start >= net->max_steps)
+                return false;
+        w->allowance = net->max_steps - start < STEP_GRANT
+                           ? net->max_steps - start
+                           : STEP_GRANT;
+        return true;
+}
+
+static int64_t steal(Worker *w)
+{
+        Net *net = w->net;
+        for (uint32_t k = 1; k < net->nworkers; k++) {
+                Worker *victim = &net->workers[(w->id + k) % net->nworkers];
+                int64_t r;
+                while ((r = deque_steal(&victim->deque)) == DEQUE_ABORT)
+                        ;
+                if (r != DEQUE_EMPTY)
+                        return r;
+        }
+        return DEQUE_EMPTY;
+}
+
+static void *work(void *arg)
+{
+        Worker *w = arg;
+        Net *net = w->net;
+        while (atomic_load(&net->status) == EVAL_REDUCED) {
+                int64_t r = deque_take(&w->deque);
+                if (r == DEQUE_EMPTY)
+                        r = steal(w);
+                if (r == DEQUE_EMPTY) {
+                        if (!atomic_load(&net->pending))
+                                break;
+                        // Others are still working, and may yet push more.
+                        sched_yield(); // LCOV_EXCL_LINE
+                        continue;      // LCOV_EXCL_LINE
+                }
+                if (!w->allowance && !grant_steps(w)) {
+                        stop(net, EVAL_OUT_OF_STEPS);
+                        break;
+                }
+                if (!reserve_step(w)) {
+                        stop(net, EVAL_OUT_OF_MEMORY);
+                        break;
+                }
+                interact(w, r);
+                atomic_fetch_sub(&net->pending, 1);
+        }
+        return NULL;
+}
+
+// ------------------------------------------------------------------
+// Translating the post-fix Ast.  Each subterm becomes a Port, on a stack: a
+// free variable is a PORT_FREE, a lambda is a CON whose slots are its
+// variable and its body, an application is a CON whose slots are the argument
+// and the result, with the function connected to its main port.  A bound
+// variable is a var leading back to its lambda, through DUPs if the variable
+// is used more than once.
+
+static bool build_net(Worker *w, const AstNode *nodes, uint32_t size)
+{
+        uint32_t *scratch =
+            realloc_or_die(HERE, NULL, 4 * sizeof(uint32_t) * size);
+        uint32_t *first = scratch, *stack = scratch + size;
+        uint32_t *binder = scratch + 2 * size, *uses = scratch + 3 * size;
+        Port *ports = realloc_or_die(HERE, NULL, sizeof(Port) * 3 * size);
+        Port *head = ports + size, *tail = ports + 2 * size;
+        bool ok = false;
+
+        // Find each BOUND's lambda, and count each lambda's uses.
+        find_subtree_starts(nodes, size, first);
+        memset(uses, 0, sizeof(uint32_t) * size);
+        uint32_t depth = 0;
+        for (uint32_t p = size; p--;) {
+                head[p] = new_port(PORT_ERA, 0);
+                while (depth && p < first[stack[depth - 1]])
+                        depth--;
+                if (ast_type(nodes[p]) == ANT_LAMBDA)
+                        stack[depth++] = p;
+                if (ast_type(nodes[p]) != ANT_BOUND)
+                        continue;
+                uint32_t up = ast_val(nodes[p]);
+                if (up < depth) {
+                        binder[p] = stack[depth - 1 - up];
+                        uses[binder[p]]++;
+                } else {
+                        // Beyond the outermost lambda.  A BOUND isn't a
+                        // lambda, so its own uses[] can say how far.
+                        binder[p] = NONE;
+                        uses[p] = up - depth;
+                }
+        }
+
+        // A lambda's variable goes to the main port of a DUP for its first
+        // use, whose second slot goes to a DUP for the next use, and so on,
+        // with the last use at the end of the chain.  head[L] is what goes in
+        // lambda L's first slot (an eraser if it has no uses), and tail[L] the
+        // var at the far end of the chain so far.
+        uint32_t nports = 0;
+        for (uint32_t p = 0; p < size; p++) {
+                if (!reserve_step(w))
+                        goto out;
+                AstVal val;
+                switch (ast_unpack(nodes, p, &val)) {
+                case ANT_VAR:
+                        if (p + 1 < size &&
+                            ast_type(nodes[p + 1]) == ANT_LAMBDA)
+                                continue;
+                        ports[nports++] = new_port(PORT_FREE, val);
+                        continue;
+                case ANT_BOUND: {
+                        uint32_t l = binder[p];
+                        if (l == NONE) {
+                                ports[nports++] =
+                                    new_port(PORT_FREE, FREE_INDEX | uses[p]);
+                                continue;
+                        }
+                        bool first_use = port_tag(head[l]) == PORT_ERA;
+                        if (!--uses[l]) {
+                                if (first_use)
+                                        head[l] = tail[l] = alloc_var(w);
+                                ports[nports++] = tail[l];
+                                continue;
+                        }
+                        if (first_use)
+                                head[l] = tail[l] = alloc_var(w);
+                        Port use = alloc_var(w), rest = alloc_var(w);
+                        uint32_t dup =
+                            alloc_node(w, NODE_DUP, l + 1, use, rest);
+                        connect(w, tail[l], new_port(PORT_NODE, dup));
+                        tail[l] = rest;
+                        ports[nports++] = use;
+                        continue;
+                }
+                case ANT_CALL: {
+                        Port arg = ports[--nports], fun = ports[--nports];
+                        Port result = alloc_var(w);
+                        uint32_t app = alloc_node(w, NODE_CON, 0, arg, result);
+                        connect(w, fun, new_port(PORT_NODE, app));
+                        ports[nports++] = result;
+                        continue;
+                }
+                case ANT_LAMBDA: {
+                        Port body = ports[--nports];
+                        uint32_t lam =
+                            alloc_node(w, NODE_CON, 0, head[p], body);
+                        ports[nports++] = new_port(PORT_NODE, lam);
+                        continue;
+                }
+                }
+        }
+        w->net->root = alloc_node(w, NODE_ROOT, 0, ports[0], 0);
+        ok = true;
+out:
+        free(ports);
+        free(scratch);
+        return ok;
+}
+
+// ------------------------------------------------------------------
+// Reading back the normal form.  Since vars are only resolved when one of
+// their ends is consumed, this first works out what every live port is
+// connected to.  Then it walks from the root: entering a CON by its main port
+// means a lambda, by its first slot that lambda's variable, and by its second
+// slot the result of an application.  Going through a DUP from a slot to its
+// main port pushes which slot onto a context, and coming back in by the main
+// port of a DUP with the same label pops it to find which slot to leave by.
+
+typedef enum
+{
+        AT_MAIN,
+        AT_SLOT0,
+        AT_SLOT1,
+        AT_NULLARY,
+} PosKind;
+
+// Where a wire ends: a port of a node, or a nullary agent.
+typedef struct {
+        uint32_t kind;
+        uint32_t node;
+        Port nullary;
+} Pos;
+
+typedef struct Binder Binder;
+struct Binder {
+        const Binder *next;
+        uint32_t node;
+        uint32_t depth; // How many binders are outside it.
+};
+
+typedef struct DupCtx DupCtx;
+struct DupCtx {
+        const DupCtx *next;
+        uint32_t label;
+        uint32_t slot;
+};
+
+typedef enum
+{
+        TASK_READ,
+        TASK_READ_ARG, // A READ that's the argument of the TASK_CALL below it.
+        TASK_CALL,
+        TASK_LAMBDA,
+} TaskKind;
+
+typedef struct {
+        uint32_t kind;
+        uint32_t n;
+        Pos pos;
+        const Binder *binders;
+        const DupCtx *dups;
+} Task;
+
+typedef struct {
+        const Net *net;
+        uint32_t nnodes;
+        uint64_t *occ; // The (up to two) ends of each var.
+        Pos *main_peer;
+
+        Arena arena;
+        Task *tasks;
+        uint32_t ntasks;
+        uint32_t tasks_alloced;
+        NodeVec out;
+        uint64_t steps;
+        uint64_t max_steps;
+        uint64_t max_bytes;
+} Reader;
+
+// The ends of a var are kept in Reader.occ as one of these.  A var x whose
+// first end has been connected has that end's peer in vars[x], and if that is
+// another var y, then one of y's ends is "held" by x.
+#define OWN_END 0
+#define SLOT_END(n, k) (2 * (uint64_t)(n) + (k) + 1)
+#define HELD_END(x) ((uint64_t)1 << 40 | (x))
+
+static Pos slot_peer(const Reader *r, uint32_t n, uint32_t slot)
+{
+        uint64_t from = SLOT_END(n, slot);
+        Port p = r->net->nodes[n].slot[slot];
+        for (;;) {
+                switch (port_tag(p)) {
+                case PORT_NODE:
+                        return (Pos){.kind = AT_MAIN, .node = port_val(p)};
+                case PORT_ERA:
+                case PORT_FREE:
+                        return (Pos){.kind = AT_NULLARY, .nullary = p};
+                case PORT_VAR:
+                        break;
+                // LCOV_EXCL_START
+                case PORT_EMPTY:
+                        DIE_LCOV_EXCL_LINE("An empty port in a slot.");
+                // LCOV_EXCL_STOP
+                }
+                uint32_t x = port_val(p);
+                Port q = atomic_load(&r->net->vars[x]);
+                if (q != PORT_EMPTY && from != OWN_END) {
+                        p = q;
+                        from = HELD_END(x);
+                        continue;
+                }
+                uint64_t end = r->occ[2 * x] != from ? r->occ[2 * x]
+                                                     : r->occ[2 * x + 1];
+                DIE_IF(!end, "Var %u has only one end.", x);
+                if (end >= HELD_END(0)) {
+                        // Carry on out of the holder's other end.
+                        p = new_port(PORT_VAR, end - HELD_END(0));
+                        from = OWN_END;
+                        continue;
+                }
+                return (Pos){.kind = AT_SLOT0 + (end - 1) % 2,
+                             .node = (end - 1) / 2};
+        }
+}
+
+static void add_end(Reader *r, uint32_t x, uint64_t end)
+{
+        r->occ[2 * x + !!r->occ[2 * x]] = end;
+}
+
+static bool is_live(const NetNode *node)
+{
+        return node->kind == NODE_CON || node->kind == NODE_DUP ||
+               node->kind == NODE_ROOT;
+}
+
+static void find_peers(Reader *r)
+{
+        const Net *net = r->net;
+        uint64_t nvars = atomic_load(&net->var_top);
+        nvars = nvars < net->max_vars ? nvars : net->max_vars;
+        r->occ = realloc_or_die(HERE, NULL, 2 * sizeof(uint64_t) * nvars);
+        memset(r->occ, 0, 2 * sizeof(uint64_t) * nvars);
+        r->main_peer = realloc_or_die(HERE, NULL, sizeof(Pos) * r->nnodes);
+        for (uint32_t n = 0; n < r->nnodes; n++) {
+                const NetNode *node = &net->nodes[n];
+                for (uint32_t k = 0; is_live(node) && k < 2; k++) {
+                        if (port_tag(node->slot[k]) != PORT_VAR)
+                                continue;
+                        add_end(r, port_val(node->slot[k]), SLOT_END(n, k));
+                }
+        }
+        for (uint32_t x = 0; x < nvars; x++) {
+                Port q = atomic_load(&net->vars[x]);
+                if (port_tag(q) == PORT_VAR)
+                        add_end(r, port_val(q), HELD_END(x));
+        }
+        for (uint32_t n = 0; n < r->nnodes; n++) {
+                const NetNode *node = &net->nodes[n];
+                uint32_t nslots = node->kind == NODE_ROOT ? 1 : 2;
+                for (uint32_t k = 0; is_live(node) && k < nslots; k++) {
+                        Pos peer = slot_peer(r, n, k);
+                        if (peer.kind == AT_MAIN)
+                                r->main_peer[peer.node] =
+                                    (Pos){.kind = AT_SLOT0 + k, .node = n};
+                }
+        }
+        for (uint32_t k = 0; k < net->nworkers; k++) {
+                const Worker *w = &net->workers[k];
+                for (uint32_t j = 0; j < w->nstuck; j++) {
+                        const NetNode *pair = &net->nodes[w->stuck[j]];
+                        Port free = pair->slot[0], app = pair->slot[1];
+                        if (port_tag(free) != PORT_FREE) {
+                                free = pair->slot[1];
+                                app = pair->slot[0];
+                        }
+                        r->main_peer[port_val(app)] =
+                            (Pos){.kind = AT_NULLARY, .nullary = free};
+                }
+        }
+}
+
+// Grow (*items)[*alloced] to hold at least `need` items, unless that would
+// take the reader beyond its budget.
+static bool reader_grow(Reader *r, void **items, uint32_t *alloced,
+                        size_t size, uint32_t need)
+{
+        size_t bytes = r->arena.bytes + sizeof(AstNode) * r->out.alloced +
+                       sizeof(Task) * r->tasks_alloced;
+        if (need <= *alloced)
+                return bytes <= r->max_bytes;
+        uint32_t n = *alloced ? 2 * *alloced : 64;
+        if (bytes + size * (n - *alloced) > r->max_bytes)
+                return false;
+        *items = realloc_or_die(HERE, *items, size * n);
+        *alloced = n;
+        return true;
+}
+
+// Make sure there is room for any one step of reading back.  Binders and DUP
+// contexts come from an arena, which can get ahead of the budget by a chunk
+// or so before this notices.
+static bool reader_reserve(Reader *r)
+{
+        return reader_grow(r, (void **)&r->out.nodes, &r->out.alloced,
+                           sizeof(AstNode), r->out.size + 2) &&
+               reader_grow(r, (void **)&r->tasks, &r->tasks_alloced,
+                           sizeof(Task), r->ntasks + 3);
+}
+
+static void push_task(Reader *r, TaskKind kind, Pos pos, const Binder *binders,
+                      const DupCtx *dups)
+{
+        r->tasks[r->ntasks++] = (Task){kind, 0, pos, binders, dups};
+}
+
+static void *reader_alloc(Reader *r, size_t size)
+{
+        void *p = arena_alloc(&r->arena, size);
+        assert(p); // The arena has no limit.
+        return p;
+}
+
+// Remove the innermost entry for `label` from *dups, copying the entries in
+// front of it, and set *slot to its slot.  Returns false if there is none.
+static bool pop_dup(Reader *r, const DupCtx **dups, uint32_t label,
+                    uint32_t *slot)
+{
+        const DupCtx *d = *dups;
+        for (; d && d->label != label; d = d->next)
+                ;
+        if (!d)
+                return false;
+        *slot = d->slot;
+        const DupCtx *end = d;
+        const DupCtx **link = dups;
+        for (d = *dups; d != end; d = d->next) {
+                DupCtx *copy = reader_alloc(r, sizeof(DupCtx));
+                *copy = *d;
+                *link = copy;
+                link = &copy->next;
+        }
+        *link = end->next;
+        return true;
+}
+
+static EvalStatus read_term(Reader *r, Task t)
+{
+        const NetNode *nodes = r->net->nodes;
+        for (;; r->steps++) {
+                if (r->steps >= r->max_steps)
+                        return EVAL_OUT_OF_STEPS;
+                if (t.pos.kind == AT_NULLARY) {
+                        if (port_tag(t.pos.nullary) != PORT_FREE)
+                                return EVAL_LOST;
+                        uint32_t val = port_val(t.pos.nullary);
+                        if (!(val & FREE_INDEX)) {
+                                emit(&r->out, ANT_VAR, val);
+                                return EVAL_REDUCED;
+                        }
+                        int32_t depth = t.binders ? t.binders->depth + 1 : 0;
+                        emit(&r->out, ANT_BOUND, depth + (val - FREE_INDEX));
+                        return EVAL_REDUCED;
+                }
+
+                uint32_t n = t.pos.node;
+                const NetNode *node = &nodes[n];
+                if (node->kind == NODE_DUP) {
+                        uint32_t slot = t.pos.kind - AT_SLOT0;
+                        if (t.pos.kind == AT_MAIN) {
+                                if (!pop_dup(r, &t.dups, node->label, &slot))
+                                        return EVAL_LOST;
+                                t.pos = slot_peer(r, n, slot);
+                                continue;
+                        }
+                        DupCtx *d = reader_alloc(r, sizeof(DupCtx));
+                        *d = (DupCtx){t.dups, node->label, slot};
+                        t.dups = d;
+                        t.pos = r->main_peer[n];
+                        continue;
+                }
+
+                DIE_IF(node->kind != NODE_CON, "Reading back node kind %u.",
+                       node->kind);
+                switch ((PosKind)t.pos.kind) {
+                case AT_MAIN: {
+                        Binder *b = reader_alloc(r, sizeof(Binder));
+                        *b = (Binder){t.binders, n,
+                                      t.binders ? t.binders->depth + 1 : 0};
+                        push_task(r, TASK_LAMBDA, t.pos, NULL, NULL);
+                        push_task(r, TASK_READ, slot_peer(r, n, 1), b, t.dups);
+                        return EVAL_REDUCED;
+                }
+                case AT_SLOT0: {
+                        int32_t depth = 0;
+                        const Binder *b = t.binders;
+                        for (; b && b->node != n; b = b->next)
+                                depth++;
+                        if (!b)
+                                return EVAL_LOST;
+                        // The search is a step per binder passed.
+                        r->steps += depth;
+                        emit(&r->out, ANT_BOUND, depth);
+                        return EVAL_REDUCED;
+                }
+                case AT_SLOT1:
+                        push_task(r, TASK_CALL, t.pos, NULL, NULL);
+                        push_task(r, TASK_READ_ARG, slot_peer(r, n, 0),
+                                  t.binders, t.dups);
+                        push_task(r, TASK_READ, r->main_peer[n], t.binders,
+                                  t.dups);
+                        return EVAL_REDUCED;
+                // LCOV_EXCL_START
+                case AT_NULLARY:
+                        return DIE_LCOV_EXCL_LINE("A nullary CON.");
+                // LCOV_EXCL_STOP
+                }
+        }
+}
+
+static EvalStatus read_back(Reader *r)
+{
+        // The net took more room than this needs.
+        DIE_IF(!reader_reserve(r), "No room to read back a net.");
+        push_task(r, TASK_READ, slot_peer(r, r->net->root, 0), NULL, NULL);
+        while (r->ntasks) {
+                if (!reader_reserve(r))
+                        return EVAL_OUT_OF_MEMORY;
+                Task t = r->tasks[--r->ntasks];
+                EvalStatus status;
+                switch ((TaskKind)t.kind) {
+                case TASK_READ_ARG:
+                        r->tasks[r->ntasks - 1].n = r->out.size;
+                        /* fallthrough */
+                case TASK_READ:
+                        status = read_term(r, t);
+                        if (status != EVAL_REDUCED)
+                                return status;
+                        continue;
+                case TASK_CALL:
+                        emit(&r->out, ANT_CALL, r->out.size - t.n);
+                        continue;
+                case TASK_LAMBDA:
+                        emit(&r->out, ANT_VAR, -1);
+                        emit(&r->out, ANT_LAMBDA, 0);
+                        continue;
+                }
+        }
+        return EVAL_NORMAL_FORM;
+}
+
+// ------------------------------------------------------------------
+
+static void *map_or_die(size_t bytes)
+{
+        void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        DIE_IF(p == MAP_FAILED, "Can't map %zu bytes for a net.", bytes);
+        return p;
+}
+
+static EvalStatus reduce(Net *net)
+{
+        for (uint32_t k = 1; k < net->nworkers; k++) {
+                Worker *w = &net->workers[k];
+                DIE_IF(pthread_create(&w->thread, NULL, work, w),
+                       "Can't start a worker thread.");
+        }
+        work(&net->workers[0]);
+        for (uint32_t k = 1; k < net->nworkers; k++)
+                pthread_join(net->workers[k].thread, NULL);
+        stop(net, EVAL_NORMAL_FORM);
+        return atomic_load(&net->status);
+}
+
+int act_eval_net(FILE *oot, const Ast *ast, const EvalBudget *budget)
+{
+        EvalBudget b = eval_budget_or_default(budget, default_budget);
+        uint32_t nworkers = b.threads;
+        if (!nworkers) {
+                long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+                nworkers = ncpus > 0 ? ncpus : 1;
+        }
+
+        size_t node_bytes = b.max_bytes / 4 * 3, var_bytes = b.max_bytes / 4;
+        uint64_t max_nodes = node_bytes / sizeof(NetNode);
+        uint64_t max_vars = var_bytes / sizeof(Port);
+        Net net = {
+            .nodes = map_or_die(node_bytes),
+            .max_nodes = max_nodes < NONE ? max_nodes : NONE,
+            .vars = map_or_die(var_bytes),
+            .max_vars = max_vars < NONE ? max_vars : NONE,
+            .max_steps = b.max_steps,
+            .status = EVAL_REDUCED,
+            .nworkers = nworkers,
+        };
+        net.workers = realloc_or_die(HERE, NULL, sizeof(Worker) * nworkers);
+        for (uint32_t k = 0; k < nworkers; k++) {
+                Worker *w = &net.workers[k];
+                *w = (Worker){.net = &net, .id = k};
+                w->node_free = w->var_free = NONE;
+                deque_init(&w->deque);
+        }
+
+        AstIdx size;
+        const AstNode *nodes = ast_postfix(ast, &size);
+        EvalStatus status = EVAL_OUT_OF_MEMORY;
+        if (build_net(&net.workers[0], nodes, size))
+                status = reduce(&net);
+
+        uint64_t steps = 0;
+        for (uint32_t k = 0; k < nworkers; k++)
+                steps += net.workers[k].steps;
+
+        // Reading back takes whatever steps reducing left.
+        Reader r = {
+            .net = &net,
+            .max_steps = b.max_steps - steps,
+            .max_bytes = b.max_bytes,
+        };
+        if (status == EVAL_NORMAL_FORM) {
+                uint64_t top = atomic_load(&net.node_top);
+                r.nnodes = top < net.max_nodes ? top : net.max_nodes;
+                find_peers(&r);
+                status = read_back(&r);
+        }
+        if (status == EVAL_NORMAL_FORM)
+                unparse_postfix(oot, r.out.nodes, r.out.size);
+        int nerr = report_eval_failure(status, &b, steps + r.steps);
+
+        arena_free(&r.arena);
+        free(r.tasks);
+        free(r.out.nodes);
+        free(r.occ);
+        free(r.main_peer);
+        for (uint32_t k = 0; k < nworkers; k++) {
+                deque_free(&net.workers[k].deque);
+                free(net.workers[k].stuck);
+        }
+        free(net.workers);
+        munmap(net.nodes, node_bytes);
+        munmap((void *)net.vars, var_bytes);
+        return nerr;
+}
@@ -1,12 +1,16 @@
 #define _GNU_SOURCE
 #include <assert.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "lambda.h"
+#include "scan.h"
 #include "untestable.h"
 
 typedef struct SyntaxError SyntaxError;
@@ -15,23 +19,96 @@ struct SyntaxError {
         char *zmsg;
 };
 
+// The parser is recursive descent, but with an explicit stack, so that
+// deeply nested programs don't overflow the C stack.  There is a frame for
+// each expression (that is, each run of calls) and each lambda being parsed.
+// A frame is resumed with the end of the non-call expression (variable,
+// parenthesised expression or lambda) that was parsed for it, or NULL if
+// there wasn't one.
+typedef enum
+{
+        FRAME_EXPR,
+        FRAME_PAREN_EXPR, // The same, but between parens.
+        FRAME_LAMBDA,
+} ParseFrameType;
+
+// Source positions are offsets into the source (see src_offset()).
+typedef struct {
+        uint8_t type;
+        uint8_t more;  // EXPR: whether the callee has been parsed.
+        int8_t token;  // LAMBDA: the param.
+        AstIdx z0;     // EXPR: where it began.  LAMBDA: where the body began.
+        AstIdx z;      // EXPR: where the last non-call expr began.  LAMBDA:
+                       // the depth inside it.
+        AstIdx func;   // EXPR: the callee of the next CALL.  LAMBDA: the
+                       // param's previous binding depth.
+} ParseFrame;
+
+typedef struct {
+        AstIdx size;
+        AstIdx alloced;
+        ParseFrame *frames;
+} ParseStack;
+
+// Part of the source that parse_parallel() leaves to a worker: a
+// parenthesised expression, or a run of the args of the calls of one
+// expression (which make a run of nodes of their own: each arg's, then its
+// CALL's).  The parser that does the rest pushes a single node in its place.
+typedef struct {
+        AstIdx z0;    // Where it starts.
+        AstIdx zE;    // Just after it.
+        bool run;     // Whether it's a run of args.
+        AstIdx at;    // Its node in the partial Ast.
+        AstIdx start; // Where its nodes are in its worker's Ast.
+        AstIdx size;
+        uint32_t worker;
+        // The parser's bindings when it got to z0.
+        AstIdx current_depth;
+        AstIdx binding_depths[26];
+} ParseHole;
+
+// The `at` of a hole the parser hasn't come to, and more than any source's
+// length.
+#define NO_NODE ((AstIdx)-1)
+
+// The nodes grow geometrically as they're parsed.  parse() trims them to size
+// afterwards, and frees the scratch space, but reparse() keeps it all for the
+// next program.
+//
+// zsrc[0:zsrc_len] is the part of the source being parsed, which is all of it
+// unless it is streamed (see parse_start()), when it's the latest chunk's
+// worth, kept in `buf`, and starts `zbase` bytes into the source.
 struct Ast {
         const char *zname;
         const char *zsrc;
         SyntaxError *error;
-        uint32_t zsrc_len;
-        uint32_t nnodes_alloced;
-        uint32_t nnodes;
-        uint32_t current_depth;
-        uint32_t binding_depths[26];
-        AstNode nodes[];
+        AstIdx zsrc_len;
+        AstIdx zbase;
+        bool partial; // Whether more of the source is to come.
+        AstIdx nnodes_alloced;
+        AstIdx nnodes;
+        AstIdx current_depth;
+        AstIdx binding_depths[26];
+        AstNode *nodes;
+        // Scratch space: which bytes of zsrc aren't whitespace (see scan.h),
+        // the parser's stack, and the expressions to skip, in source order.
+        uint64_t *nonwhite;
+        size_t nonwhite_alloced;
+        ParseStack stack;
+        ParseHole *holes;
+        AstIdx nholes;
+        AstIdx next_hole;
+        AstIdx zstop; // Where a worker's run of args ends, or zero.
+        char *buf;    // A streamed source's bytes from zsrc on.
+        size_t buf_len;
+        size_t buf_alloced;
 };
 
 // ------------------------------------------------------------------
 
-const AstNode *ast_postfix(const Ast *ast, uint32_t *size_ret)
+const AstNode *ast_postfix(const Ast *ast, AstIdx *size_ret)
 {
-        uint32_t nnodes = ast->nnodes;
+        AstIdx nnodes = ast->nnodes;
         DIE_IF(!nnodes, "An empty AST is postfix.");
         *size_ret = nnodes;
         return ast->nodes;
@@ -39,29 +116,40 @@ const AstNode *ast_postfix(const Ast *ast, uint32_t *size_ret)
 
 static const AstNode *ast_root(const Ast *ast)
 {
-        uint32_t nnodes = ast->nnodes;
+        AstIdx nnodes = ast->nnodes;
         DIE_IF(!nnodes, "Empty AST has no root");
         return ast->nodes + nnodes - 1;
 }
 
+static void grow_nodes(Ast *ast, size_t n)
+{
+        DIE_IF(n > AST_MAX_NODES, "%s needs %lu Ast nodes, more than %ld.",
+               ast->zname, n, (long)AST_MAX_NODES);
+        // Nodes are added one at a time, so doubling is always enough.
+        size_t alloced = ast->nnodes_alloced ? 2 * ast->nnodes_alloced : 256;
+        alloced = alloced < AST_MAX_NODES ? alloced : AST_MAX_NODES;
+        ast->nodes =
+            realloc_or_die(HERE, ast->nodes, sizeof(AstNode) * alloced);
+        ast->nnodes_alloced = alloced;
+}
+
 static AstNode *ast_node_alloc(Ast *ast, size_t n)
 {
         size_t u = ast->nnodes;
         size_t nu = u + n;
-        DIE_IF(nu > ast->nnodes_alloced,
-               "BUG: %s is using %lu Ast nodes, only %d are alloced",
-               ast->zname, nu, ast->nnodes_alloced);
+        if (nu > ast->nnodes_alloced)
+                grow_nodes(ast, nu);
 
         ast->nnodes = nu;
         return ast->nodes + u;
 }
 
-static SyntaxError *add_syntax_error(Ast *ast, const char *zloc,
-                                     const char *zfmt, ...)
+// Note a syntax error at offset `n` of the source.
+static SyntaxError *add_syntax_error(Ast *ast, size_t n, const char *zfmt,
+                                     ...)
 {
-        size_t n = zloc - ast->zsrc;
-        DIE_IF(n > ast->zsrc_len, "Creating error at invalid source loc %ld",
-               n);
+        DIE_IF(n > ast->zbase + ast->zsrc_len,
+               "Creating error at invalid source loc %ld", n);
         SyntaxError *e = realloc_or_die(HERE, 0, sizeof(SyntaxError));
         *e = (SyntaxError){.prev = ast->error};
 
@@ -88,14 +176,25 @@ static SyntaxError *add_syntax_error(Ast *ast, const char *zloc,
         return ast->error = e;
 }
 
+// The errors are listed newest first, but are printed oldest first.
 static int print_syntax_errors(FILE *oot, const SyntaxError *e)
 {
-        if (!e)
-                return 0;
-        int n = print_syntax_errors(oot, e->prev);
-        fputs(e->zmsg, oot);
-        fputc('\n', oot);
-        return n + 1;
+        int n = 0;
+        for (const SyntaxError *p = e; p; p = p->prev)
+                n++;
+        if (!oot || !n)
+                return n;
+
+        const SyntaxError **es =
+            realloc_or_die(HERE, NULL, sizeof(SyntaxError *) * n);
+        for (int k = n; k--; e = e->prev)
+                es[k] = e;
+        for (int k = 0; k < n; k++) {
+                fputs(es[k]->zmsg, oot);
+                fputc('\n', oot);
+        }
+        free(es);
+        return n;
 }
 
 int report_syntax_errors(FILE *oot, Ast *ast)
@@ -103,7 +202,7 @@ int report_syntax_errors(FILE *oot, Ast *ast)
         return print_syntax_errors(oot, ast->error);
 }
 
-void delete_ast(Ast *ast)
+static void delete_syntax_errors(Ast *ast)
 {
         SyntaxError *e, *pe = ast->error;
         while ((e = pe)) {
@@ -111,31 +210,68 @@ void delete_ast(Ast *ast)
                 free(e->zmsg);
                 free(e);
         }
+        ast->error = NULL;
+}
+
+// Free the parser's scratch space.
+static void free_scratch(Ast *ast)
+{
+        free(ast->nonwhite);
+        free(ast->stack.frames);
+        free(ast->holes);
+        free(ast->buf);
+        ast->nonwhite = NULL;
+        ast->nonwhite_alloced = 0;
+        ast->stack = (ParseStack){0};
+        ast->holes = NULL;
+        ast->nholes = ast->next_hole = 0;
+        ast->buf = NULL;
+        ast->buf_len = ast->buf_alloced = 0;
+}
+
+void delete_ast(Ast *ast)
+{
+        delete_syntax_errors(ast);
+        free_scratch(ast);
+        free(ast->nodes);
         free(ast);
 }
 
 // ------------------------------------------------------------------
 
-static const char *eat_white(const char *z0)
+// The byte at z, or NUL at the end of the source (which needn't have one).
+static char src_char(const Ast *ast, const char *z)
 {
-        for (;; z0++) {
-                char ch = *z0;
-                switch (ch) {
-                case ' ':
-                case '\t':
-                case '\n':
-                        continue;
-                default:
-                        return z0;
-                }
-        }
+        return z < ast->zsrc + ast->zsrc_len ? *z : 0;
+}
+
+static AstIdx src_offset(const Ast *ast, const char *z)
+{
+        return ast->zbase + (z - ast->zsrc);
+}
+
+static const char *src_at(const Ast *ast, AstIdx off)
+{
+        return ast->zsrc + (off - ast->zbase);
+}
+
+// Skip to the next non-whitespace byte, a word of the bitmap at a time.
+static const char *eat_white(const Ast *ast, const char *z0)
+{
+        size_t k = z0 - ast->zsrc;
+        const uint64_t *word = ast->nonwhite + k / 64;
+        uint64_t bits = *word & (~0ull << (k % 64));
+        while (!bits)
+                bits = *++word;
+        k = 64 * (word - ast->nonwhite) + __builtin_ctzll(bits);
+        return ast->zsrc + k;
 }
 
 static uint8_t idx_from_letter(char c) { return (uint8_t)c - (uint8_t)'a'; }
 
 static const char *lex_varname(Ast *ast, int32_t *idxptr, const char *z0)
 {
-        uint8_t idx = idx_from_letter(*z0);
+        uint8_t idx = idx_from_letter(src_char(ast, z0));
         if (idx >= 26) {
                 *idxptr = -1;
                 return z0;
@@ -143,14 +279,15 @@ static const char *lex_varname(Ast *ast, int32_t *idxptr, const char *z0)
         *idxptr = idx;
 
         const char *z = z0 + 1;
-        if (idx_from_letter(*z) >= 26) {
+        if (idx_from_letter(src_char(ast, z)) >= 26) {
                 return z;
         }
 
-        while (idx_from_letter(*z) < 26)
+        while (idx_from_letter(src_char(ast, z)) < 26)
                 z++;
-        add_syntax_error(ast, z0, "Multi-byte varnames aren't allowed.  '%.*s'",
-                         z - z0, z0);
+        add_syntax_error(ast, src_offset(ast, z0),
+                         "Multi-byte varnames aren't allowed.  '%.*s'", z - z0,
+                         z0);
         return z;
 }
 
@@ -158,7 +295,7 @@ static uint8_t idx_from_digit(char c) { return (uint8_t)c - (uint8_t)'0'; }
 
 static const char *lex_int(Ast *ast, int32_t *idxptr, const char *z0)
 {
-        uint8_t idx = idx_from_digit(*z0);
+        uint8_t idx = idx_from_digit(src_char(ast, z0));
         if (idx >= 10) {
                 *idxptr = -1;
                 return z0;
@@ -166,14 +303,15 @@ static const char *lex_int(Ast *ast, int32_t *idxptr, const char *z0)
         *idxptr = idx;
 
         const char *z = z0 + 1;
-        if (idx_from_digit(*z) >= 10) {
+        if (idx_from_digit(src_char(ast, z)) >= 10) {
                 return z;
         }
 
-        while (idx_from_digit(*z) < 10)
+        while (idx_from_digit(src_char(ast, z)) < 10)
                 z++;
-        add_syntax_error(ast, z0, "Multi-digit nums aren't allowed.  '%.*s'",
-                         z - z0, z0);
+        add_syntax_error(ast, src_offset(ast, z0),
+                         "Multi-digit nums aren't allowed.  '%.*s'", z - z0,
+                         z0);
         return z;
 }
 
@@ -183,168 +321,1023 @@ static void push_varname(Ast *ast, int32_t token)
 
         AstNode *pn = ast_node_alloc(ast, 1);
         DBG("pushed expr %lu: VAR token=%d", pn - ast->nodes, token);
-        *pn = (AstNode){
-            .type = ANT_VAR,
-            .VAR = {.token = token},
-        };
+        *pn = ast_node(ANT_VAR, token);
 }
 
-static void push_bound(Ast *ast, int32_t depth)
+static void push_bound(Ast *ast, AstVal depth)
 {
-        DIE_IF(depth < 0, "Bad depth %u.", depth);
+        DIE_IF(depth < 0, "Bad depth %ld.", (long)depth);
 
         AstNode *pn = ast_node_alloc(ast, 1);
-        DBG("pushed expr %lu: BOUND depth=%d", pn - ast->nodes, depth);
-        *pn = (AstNode){
-            .type = ANT_BOUND,
-            .BOUND = {.depth = depth},
-        };
+        DBG("pushed expr %lu: BOUND depth=%ld", pn - ast->nodes, (long)depth);
+        *pn = ast_node(ANT_BOUND, depth);
 }
 
 static void push_var(Ast *ast, int32_t token)
 {
         DIE_IF(token + 'a' > 'z', "Bad token %u.", token);
-        uint32_t bdepth = ast->binding_depths[token];
+        AstIdx bdepth = ast->binding_depths[token];
         return bdepth ? push_bound(ast, ast->current_depth - bdepth)
                       : push_varname(ast, token);
 }
 
-static const char *parse_expr(Ast *ast, const char *z0);
-static const char *parse_non_call_expr(Ast *ast, const char *z0);
+static ParseFrame *push_frame(ParseStack *st, ParseFrame f)
+{
+        if (st->size == st->alloced) {
+                st->alloced = st->alloced ? 2 * st->alloced : 64;
+                st->frames = realloc_or_die(HERE, st->frames,
+                                            sizeof(ParseFrame) * st->alloced);
+        }
+        st->frames[st->size] = f;
+        return st->frames + st->size++;
+}
+
+static AstIdx root_idx(const Ast *ast) { return ast_root(ast) - ast->nodes; }
+
+// If the next hole is a paren (or a `run`) at z0, note the bindings there,
+// push a node in its place, and return its end.  Otherwise return NULL.
+static const char *skip_hole(Ast *ast, const char *z0, bool run)
+{
+        AstIdx off = src_offset(ast, z0);
+        // The parser comes to the start of every hole (or stops short of it,
+        // at a syntax error), so this is just in case one is passed by.
+        while (ast->next_hole < ast->nholes &&
+               ast->holes[ast->next_hole].z0 < off)
+                ast->next_hole++; // LCOV_EXCL_LINE
+        if (ast->next_hole == ast->nholes ||
+            ast->holes[ast->next_hole].z0 != off ||
+            ast->holes[ast->next_hole].run != run)
+                return NULL;
+
+        ParseHole *h = ast->holes + ast->next_hole++;
+        h->at = ast->nnodes;
+        h->current_depth = ast->current_depth;
+        memcpy(h->binding_depths, ast->binding_depths,
+               sizeof(h->binding_depths));
+        *ast_node_alloc(ast, 1) = ast_node(ANT_VAR, 0);
+        return src_at(ast, h->zE);
+}
+
+// Start an expression at z0, returning where its callee starts.
+static const char *begin_expr(Ast *ast, ParseStack *st, const char *z0,
+                              bool parens)
+{
+        const char *z1 = eat_white(ast, z0);
+        push_frame(st, (ParseFrame){
+                           .type = parens ? FRAME_PAREN_EXPR : FRAME_EXPR,
+                           .z0 = src_offset(ast, z0),
+                           .z = src_offset(ast, z1),
+                       });
+        return z1;
+}
 
-static const char *parse_lambda(Ast *ast, const char *z0)
+// Start the lambda at z0, binding its param, and return where its body
+// starts.
+static const char *begin_lambda(Ast *ast, ParseStack *st, const char *z0)
 {
-        DIE_IF(*z0 != '[', "bad call to %s.", z0);
+        DIE_IF(src_char(ast, z0) != '[', "bad call to %.1s.", z0);
         int32_t token;
-        const char *zE = eat_white(z0 + 1);
+        const char *zE = eat_white(ast, z0 + 1);
         zE = lex_varname(ast, &token, zE);
-        zE = eat_white(zE);
-        if (*zE == ']') {
+        zE = eat_white(ast, zE);
+        if (src_char(ast, zE) == ']') {
                 zE++;
         } else {
                 size_t n = zE - z0;
-                if (*zE)
+                if (zE < ast->zsrc + ast->zsrc_len)
                         n++;
                 // FIX: test this error
-                add_syntax_error(ast, z0, "Lambda '%.*s' doesn't end in ']'", n,
-                                 z0);
+                add_syntax_error(ast, src_offset(ast, z0),
+                                 "Lambda '%.*s' doesn't end in ']'", n, z0);
         }
 
-        uint32_t inner_depth = ast->current_depth + 1;
-        uint32_t sink = 0, *binding = &sink;
+        AstIdx inner_depth = ast->current_depth + 1;
+        AstIdx sink = 0, *binding = &sink;
         if (token >= 0)
                 binding = ast->binding_depths + token;
-        uint32_t prev_bound = *binding;
+        AstIdx prev_bound = *binding;
 
         ast->current_depth = inner_depth;
         *binding = inner_depth;
 
-        DBG("Bound token %d to depth=%u", token, inner_depth);
-        const char *zbody = zE;
-        zE = parse_non_call_expr(ast, zE);
+        DBG("Bound token %d to depth=%lu", token, (unsigned long)inner_depth);
+        push_frame(st, (ParseFrame){
+                           .type = FRAME_LAMBDA,
+                           .token = token,
+                           .z0 = src_offset(ast, zE),
+                           .z = inner_depth,
+                           .func = prev_bound,
+                       });
+        return zE;
+}
+
+// What descend() returns if it gets to the end of a partial source, where
+// parse_more() resumes it.
+static const char NEED_MORE[1];
+
+// Parse the non-call expression at z0, as far as a variable, pushing a frame
+// for each paren and lambda on the way.  Returns the end of the variable, or
+// NULL if there isn't one.
+static const char *descend(Ast *ast, ParseStack *st, const char *z0)
+{
+        for (;;) {
+                if (ast->partial && z0 == ast->zsrc + ast->zsrc_len)
+                        return NEED_MORE;
+                int32_t token;
+                const char *zE = lex_varname(ast, &token, z0);
+                if (token >= 0) {
+                        push_var(ast, token);
+                        return zE;
+                }
+                zE = lex_int(ast, &token, z0);
+                if (token >= 0) {
+                        if (token == 0) {
+                                add_syntax_error(
+                                    ast, src_offset(ast, z0),
+                                    "0 is an invalid debrujin index");
+                                token++;
+                        }
+                        push_bound(ast, token - 1);
+                        return zE;
+                }
+
+                switch (src_char(ast, z0)) {
+                case '(':
+                        if (ast->nholes && (zE = skip_hole(ast, z0, false)))
+                                return zE;
+                        z0 = begin_expr(ast, st, z0 + 1, true);
+                        continue;
+                case '[':
+                        z0 = begin_lambda(ast, st, z0);
+                        continue;
+                }
+                return NULL;
+        }
+}
+
+// Resume the expression on top of the stack with the non-call expression
+// ending at zE.  Returns the end of the expression if it is finished (or NULL
+// if it failed), otherwise it descends into the next non-call expression, and
+// sets *done to false.  If zE is NULL because a frame above `failed` (having
+// said why), so does the expression, rather than going back over the source
+// to try again, so that the parser only ever goes forwards.
+static const char *resume_expr(Ast *ast, ParseStack *st, const char *zE,
+                               bool failed, bool *done)
+{
+        ParseFrame *f = st->frames + st->size - 1;
+        if (!f->more) {
+                if (!zE) {
+                        if (failed)
+                                return NULL;
+                        // Skip a byte, and try again.
+                        const char *z1 = src_at(ast, f->z);
+                        if (!ast->error)
+                                add_syntax_error(ast, f->z0,
+                                                 "Expected expr");
+                        if (z1 == ast->zsrc + ast->zsrc_len)
+                                return NULL;
+                        z1 = eat_white(ast, z1 + 1);
+                        f->z = src_offset(ast, z1);
+                        *done = false;
+                        return descend(ast, st, z1);
+                }
+                f->more = true;
+        } else {
+                size_t arg_size = root_idx(ast) - f->func;
+                if (!zE)
+                        return failed ? NULL : src_at(ast, f->z);
+                DIE_IF(arg_size > AST_MAX_NODES,
+                       "Huge arg parsed %lu nodes, why no ENOMEM?", arg_size);
+                AstNode *call = ast_node_alloc(ast, 1);
+                *call = ast_node(ANT_CALL, arg_size);
+                DBG("pushed expr %lu: CALL arg_size=%lu", call - ast->nodes,
+                    arg_size);
+                if (src_offset(ast, zE) == ast->zstop && st->size == 1)
+                        return zE;
+        }
+
+        const char *z = eat_white(ast, zE);
+        const char *zH;
+        while (ast->nholes && (zH = skip_hole(ast, z, true)))
+                z = eat_white(ast, zH);
+        f->func = root_idx(ast);
+        f->z = src_offset(ast, z);
+        *done = false;
+        return descend(ast, st, z);
+}
+
+// Finish the lambda on top of the stack, whose body ends at zE (or `failed`,
+// which has been reported already).
+static const char *end_lambda(Ast *ast, const ParseFrame *f, const char *zE,
+                              bool failed)
+{
         if (!zE) {
-                add_syntax_error(ast, zbody, "Expected lambda body");
+                if (!failed)
+                        add_syntax_error(ast, f->z0, "Expected lambda body");
                 return NULL;
         }
 
         // FIX: ast_root is a bad name
-        const AstNode *body = ast_root(ast);
-        *binding = prev_bound;
+        AstIdx body = root_idx(ast);
+        if (f->token >= 0)
+                ast->binding_depths[f->token] = f->func;
+        AstIdx inner_depth = f->z;
         ast->current_depth = inner_depth - 1;
 
-        push_varname(ast, token);
+        push_varname(ast, f->token);
         AstNode *pn = ast_node_alloc(ast, 1);
-        *pn = (AstNode){
-            .type = ANT_LAMBDA,
-        };
-        DBG("pushed expr %lu: LAMBDA inner depth=%u", pn - ast->nodes,
-            inner_depth);
-        assert(pn - body == 2);
+        *pn = ast_node(ANT_LAMBDA, 0);
+        DBG("pushed expr %lu: LAMBDA inner depth=%lu", pn - ast->nodes,
+            (unsigned long)inner_depth);
+        assert(root_idx(ast) - body == 2);
         return zE;
 }
 
-static const char *parse_non_call_expr(Ast *ast, const char *z0)
+// Finish the frames on the stack, given the end of the non-call expression
+// that was parsed for the top one, or until descend() needs more source.
+static const char *parse_frames(Ast *ast, const char *zE)
 {
-        int32_t token;
-        const char *zE = lex_varname(ast, &token, z0);
-        if (token >= 0) {
-                push_var(ast, token);
-                return zE;
-        }
-        zE = lex_int(ast, &token, z0);
-        if (token >= 0) {
-                if (token == 0) {
-                        add_syntax_error(ast, z0,
-                                         "0 is an invalid debrujin index");
-                        token++;
+        ParseStack *st = &ast->stack;
+        bool failed = false;
+        while (st->size && zE != NEED_MORE) {
+                ParseFrame *f = st->frames + st->size - 1;
+                bool done = true;
+                switch ((ParseFrameType)f->type) {
+                case FRAME_EXPR:
+                        zE = resume_expr(ast, st, zE, failed, &done);
+                        break;
+                case FRAME_PAREN_EXPR:
+                        zE = resume_expr(ast, st, zE, failed, &done);
+                        if (!done)
+                                break;
+                        f = st->frames + st->size - 1;
+                        if (!zE || src_char(ast, zE) != ')') {
+                                if (!failed)
+                                        add_syntax_error(ast, f->z0 - 1,
+                                                         "Unmatched '('");
+                                break;
+                        }
+                        zE++;
+                        break;
+                case FRAME_LAMBDA:
+                        zE = end_lambda(ast, f, zE, failed);
+                        break;
+                }
+                failed = done && !zE;
+                if (done)
+                        st->size--;
+        }
+        return zE;
+}
+
+static const char *parse_expr(Ast *ast, const char *z0)
+{
+        ParseStack *st = &ast->stack;
+        st->size = 0;
+        return parse_frames(ast,
+                            descend(ast, st, begin_expr(ast, st, z0, false)));
+}
+
+Ast *ast_from_postfix(const char *zname, const char *zsrc,
+                      const AstNode *nodes, AstIdx size)
+{
+        DIE_IF(!size, "An Ast needs at least one node.");
+        Ast *ast = realloc_or_die(HERE, 0, sizeof(Ast));
+        *ast = (Ast){
+            .zname = zname,
+            .zsrc = zsrc,
+            .zsrc_len = strlen(zsrc),
+            .nnodes_alloced = size,
+            .nnodes = size,
+            .nodes = realloc_or_die(HERE, NULL, sizeof(AstNode) * size),
+        };
+        memcpy(ast->nodes, nodes, sizeof(AstNode) * size);
+        return ast;
+}
+
+// Make room for the bitmap of `len` bytes of source.
+static void grow_nonwhite(Ast *ast, size_t len)
+{
+        size_t nwords = scan_nwords(len);
+        if (nwords > ast->nonwhite_alloced) {
+                free(ast->nonwhite);
+                ast->nonwhite =
+                    realloc_or_die(HERE, NULL, sizeof(uint64_t) * nwords);
+                ast->nonwhite_alloced = nwords;
+        }
+}
+
+// Start parsing zsrc[0:len] into `ast` (or a new Ast), making room for the
+// bitmap, but not filling it in.
+static Ast *begin_parse(Ast *ast, const char *zname, const char *zsrc,
+                        size_t len)
+{
+        DIE_IF(len >= NO_NODE, "%s is %lu bytes, too big for %lu-bit Ast "
+                               "indices (see WIDE_AST in the Makefile).",
+               zname, len, 8 * sizeof(AstIdx));
+        if (!ast) {
+                ast = realloc_or_die(HERE, 0, sizeof(Ast));
+                *ast = (Ast){0};
+        }
+        delete_syntax_errors(ast);
+        ast->zname = zname;
+        ast->zsrc = zsrc;
+        ast->zsrc_len = len;
+        ast->zbase = 0;
+        ast->partial = false;
+        ast->nnodes = 0;
+        ast->current_depth = 0;
+        memset(ast->binding_depths, 0, sizeof(ast->binding_depths));
+
+        grow_nonwhite(ast, len);
+        return ast;
+}
+
+// Note a syntax error if the parse ended at zE (rather than failing, if it's
+// NULL) short of the end of zsrc[0:zsrc_len], at a stray ')' or the like.
+static void end_parse(Ast *ast, const char *zE)
+{
+        if (zE && zE != ast->zsrc + ast->zsrc_len)
+                add_syntax_error(ast, src_offset(ast, zE), "Unexpected '%c'",
+                                 *zE);
+}
+
+static void parse_all(Ast *ast) { end_parse(ast, parse_expr(ast, ast->zsrc)); }
+
+Ast *reparse_len(Ast *ast, const char *zname, const char *zsrc, size_t len)
+{
+        ast = begin_parse(ast, zname, zsrc, len);
+        scan_nonwhite(zsrc, len, ast->nonwhite);
+        parse_all(ast);
+        return ast;
+}
+
+Ast *reparse(Ast *ast, const char *zname, const char *zsrc)
+{
+        return reparse_len(ast, zname, zsrc, strlen(zsrc));
+}
+
+// Free the scratch space, and the unused nodes.
+static Ast *trim(Ast *ast)
+{
+        free_scratch(ast);
+        if (ast->nnodes && ast->nnodes < ast->nnodes_alloced) {
+                ast->nodes = realloc_or_die(HERE, ast->nodes,
+                                            sizeof(AstNode) * ast->nnodes);
+                ast->nnodes_alloced = ast->nnodes;
+        }
+        return ast;
+}
+
+Ast *parse(const char *zname, const char *zsrc)
+{
+        return trim(reparse(NULL, zname, zsrc));
+}
+
+// ------------------------------------------------------------------
+// Parsing a source as it arrives.
+//
+// The parser only ever goes forwards, and its state between bytes is all in
+// the Ast (the stack of frames, and the bindings), so it can stop wherever
+// descend() starts on a non-call expression, and go on from there with more
+// of the source.  But the lexer needs to see the whole of a token, and
+// begin_lambda() the whole of a lambda's `[x]`, so each chunk is parsed as far
+// as the last of those that might go on into the next one, and those bytes
+// are all that's kept of it.
+
+static bool is_white(char c) { return c == ' ' || c == '\t' || c == '\n'; }
+
+static bool is_token_byte(char c)
+{
+        return idx_from_letter(c) < 26 || idx_from_digit(c) < 10;
+}
+
+// How much of buf[0:len] can be parsed before the rest of the source arrives.
+// (A `[` that's cut off can end the `[` before it, so that's checked again.)
+static size_t parseable_len(const char *buf, size_t len)
+{
+        for (;;) {
+                while (len && is_token_byte(buf[len - 1]))
+                        len--;
+                const char *zlambda = memrchr(buf, '[', len);
+                if (!zlambda)
+                        return len;
+                const char *z = zlambda + 1, *zE = buf + len;
+                while (z < zE && is_white(*z))
+                        z++;
+                while (z < zE && idx_from_letter(*z) < 26)
+                        z++;
+                while (z < zE && is_white(*z))
+                        z++;
+                if (z < zE)
+                        return len;
+                len = zlambda - buf;
+        }
+}
+
+// Parse as much of ast->buf as can be, and drop it from the buffer.
+static void parse_buf(Ast *ast)
+{
+        ParseStack *st = &ast->stack;
+        size_t len = ast->partial ? parseable_len(ast->buf, ast->buf_len)
+                                  : ast->buf_len;
+        if (!st->size) {
+                // It failed, and the rest is ignored, as parse_all() would.
+                len = ast->buf_len;
+        } else if (len || !ast->partial) {
+                ast->zsrc = ast->buf;
+                ast->zsrc_len = len;
+                grow_nonwhite(ast, len);
+                scan_nonwhite(ast->buf, len, ast->nonwhite);
+
+                // Go on from where descend() stopped, which is after any
+                // whitespace, unless it was at a lambda's body.
+                const char *z = ast->zsrc;
+                ParseFrame *f = st->frames + st->size - 1;
+                if (f->type != FRAME_LAMBDA) {
+                        z = eat_white(ast, z);
+                        f->z = src_offset(ast, z);
                 }
-                push_bound(ast, token - 1);
-                return zE;
+                const char *zE = parse_frames(ast, descend(ast, st, z));
+                if (zE != NEED_MORE)
+                        end_parse(ast, zE);
+        }
+
+        memmove(ast->buf, ast->buf + len, ast->buf_len - len);
+        ast->buf_len -= len;
+        ast->zbase += len;
+}
+
+Ast *parse_start(const char *zname)
+{
+        Ast *ast = begin_parse(NULL, zname, "", 0);
+        ast->partial = true;
+        ParseStack *st = &ast->stack;
+        scan_nonwhite("", 0, ast->nonwhite);
+        begin_expr(ast, st, ast->zsrc, false);
+        return ast;
+}
+
+void parse_more(Ast *ast, const char *zchunk, size_t len)
+{
+        DIE_IF(!ast->partial, "%s has been parsed already.", ast->zname);
+        size_t total = ast->zbase + ast->buf_len + len;
+        DIE_IF(total >= NO_NODE, "%s is over %lu bytes, too big for %lu-bit "
+                                 "Ast indices (see WIDE_AST in the Makefile).",
+               ast->zname, total, 8 * sizeof(AstIdx));
+        if (ast->buf_len + len > ast->buf_alloced) {
+                size_t alloced = ast->buf_alloced ? ast->buf_alloced : 4096;
+                while (alloced < ast->buf_len + len)
+                        alloced *= 2;
+                ast->buf = realloc_or_die(HERE, ast->buf, alloced);
+                ast->buf_alloced = alloced;
         }
+        memcpy(ast->buf + ast->buf_len, zchunk, len);
+        ast->buf_len += len;
+        parse_buf(ast);
+}
+
+Ast *parse_finish(Ast *ast)
+{
+        DIE_IF(!ast->partial, "%s has been parsed already.", ast->zname);
+        ast->partial = false;
+        if (!ast->buf)
+                ast->buf = realloc_or_die(HERE, NULL, 1);
+        parse_buf(ast);
+        ast->zsrc = NULL;
+        ast->zsrc_len = 0;
+        return trim(ast);
+}
+
+// ------------------------------------------------------------------
+// Parsing on several threads.
+//
+// A parenthesised expression parses the same wherever it is, given the
+// bindings of the lambdas around it, and so does a run of args of the calls
+// of one expression.  So the source is cut into a chunk per thread, and each
+// worker finds the matching parens in its chunk, and the balance of parens
+// (and brackets) across it, while it scans for whitespace.  A scan of those
+// balances gives the depth at the start of each chunk, which checks that the
+// parens match, and lets a '(' left open at the end of a chunk be matched
+// with a ')' closing one from before the start of the next.  Each chunk also
+// notes where the args of each expression in it end.
+//
+// The biggest expressions (and runs) that aren't too big are left to the
+// workers, and the rest is parsed as usual, but with a node in the place of
+// each of them, which notes the bindings there.  Then the workers parse them,
+// each into an Ast of its own, and the nodes are copied into one, with the
+// arg_size of each call around them fixed up.
+//
+// If anything is amiss, the whole program is parsed again as usual, so that
+// the syntax errors are the same.
+
+// Programs are only parsed in parallel if there are at least this many bytes
+// of source per thread.
+#define PARSE_MIN_PER_THREAD (16 * 1024)
+// Where the first and the last of the terms of an expression so far end (the
+// callee's, then its last arg's), or zero.
+typedef struct {
+        AstIdx first;
+        AstIdx last;
+} ArgRun;
+
+typedef struct {
+        AstIdx z0;
+        AstIdx mark; // How many holes were found before it.
+        ArgRun run;
+} OpenParen;
+
+typedef struct {
+        Ast *ast;
+        pthread_t thread;
+        AstIdx start; // Of the chunk, a multiple of 64.
+        AstIdx end;
+        AstIdx most;  // The size of parens to leave to workers (in bytes).
+        AstIdx least;
+        int64_t depth;  // Of parens at start, once they've been summed.
+        int64_t parens; // The number of '(', less that of ')'.
+        int64_t closed; // The number of ')' that close a '(' before start.
+        int32_t brackets;
+        int32_t brackets_min;
+        int32_t brackets_max;
+        // Where those ')' are, for as far as `most` bytes into the chunk.
+        AstIdx *closes;
+        AstIdx ncloses;
+        AstIdx closes_alloced;
+        // The '(' not closed by the end of the chunk, so far.
+        OpenParen *opens;
+        AstIdx nopens;
+        AstIdx opens_alloced;
+        // The args at the shallowest depth, after the last of those ')'.
+        ArgRun run;
+        // Whether in a lambda's brackets.  The chunk might start in them, so
+        // a param isn't taken for a variable, if the first bracket closes.
+        bool bracketed;
+        bool seen_bracket;
+        // The holes: the biggest parens of between `least` and `most` bytes
+        // (but not those inside them), and the runs of at least `least`
+        // bytes that aren't inside those.
+        ParseHole *found;
+        AstIdx nfound;
+        AstIdx found_alloced;
+} ParseChunk;
+
+typedef struct {
+        Ast ast; // The nodes of its holes, one after the other.
+        pthread_t thread;
+        ParseHole *holes;
+        const AstIdx *shift;
+        AstNode *nodes;
+        AstIdx first; // Of its holes.
+        AstIdx last;
+        bool failed;
+} HoleWorker;
+
+static void *grow_array(void *p, AstIdx *alloced, size_t elem_size)
+{
+        *alloced = *alloced ? 2 * *alloced : 64;
+        return realloc_or_die(HERE, p, elem_size * *alloced);
+}
+
+static void add_found(ParseChunk *c, AstIdx z0, AstIdx zE, bool run)
+{
+        if (c->nfound == c->found_alloced)
+                c->found = grow_array(c->found, &c->found_alloced,
+                                      sizeof(ParseHole));
+        c->found[c->nfound++] = (ParseHole){.z0 = z0, .zE = zE, .run = run};
+}
+
+// Note that an arg (or a callee) ends just before zsrc[k], in the expression
+// of the innermost open paren.
+static void end_arg(ParseChunk *c, AstIdx k)
+{
+        ArgRun *run = c->nopens ? &c->opens[c->nopens - 1].run : &c->run;
+        if (!run->first)
+                run->first = k;
+        else
+                run->last = k;
+}
 
-        switch (*z0) {
+static void add_run(ParseChunk *c, ArgRun run)
+{
+        if (run.last && run.last - run.first >= c->least)
+                add_found(c, run.first, run.last, true);
+}
+
+// Note the byte zsrc[k], which isn't whitespace.
+static void scan_byte(ParseChunk *c, AstIdx k)
+{
+        char ch = c->ast->zsrc[k];
+        switch (ch) {
         case '(':
-                zE = parse_expr(ast, z0 + 1);
-                if (!zE || *zE != ')') {
-                        add_syntax_error(ast, z0, "Unmatched '('");
-                        return zE;
+                if (c->nopens == c->opens_alloced)
+                        c->opens = grow_array(c->opens, &c->opens_alloced,
+                                              sizeof(OpenParen));
+                c->opens[c->nopens++] = (OpenParen){.z0 = k, .mark = c->nfound};
+                c->parens++;
+                return;
+        case ')':
+                c->parens--;
+                if (!c->nopens) {
+                        c->closed++;
+                        add_run(c, c->run);
+                        c->run = (ArgRun){.first = k + 1};
+                        if (k - c->start >= c->most)
+                                return;
+                        if (c->ncloses == c->closes_alloced)
+                                c->closes =
+                                    grow_array(c->closes, &c->closes_alloced,
+                                               sizeof(AstIdx));
+                        c->closes[c->ncloses++] = k;
+                        return;
+                }
+                OpenParen o = c->opens[--c->nopens];
+                end_arg(c, k + 1);
+                AstIdx size = k + 1 - o.z0;
+                if (size > c->most) {
+                        add_run(c, o.run);
+                        return;
                 }
-                return zE + 1;
+                c->nfound = o.mark;
+                if (size >= c->least)
+                        add_found(c, o.z0, k + 1, false);
+                return;
         case '[':
-                return parse_lambda(ast, z0);
+                c->bracketed = c->seen_bracket = true;
+                c->brackets++;
+                if (c->brackets > c->brackets_max)
+                        c->brackets_max = c->brackets;
+                return;
+        case ']':
+                if (!c->seen_bracket)
+                        c->run = (ArgRun){0};
+                c->bracketed = false;
+                c->seen_bracket = true;
+                c->brackets--;
+                if (c->brackets < c->brackets_min)
+                        c->brackets_min = c->brackets;
+                return;
         }
+        if (!c->bracketed &&
+            (idx_from_letter(ch) < 26 || idx_from_digit(ch) < 10))
+                end_arg(c, k + 1);
+}
+
+static void *scan_chunk(void *arg)
+{
+        ParseChunk *c = arg;
+        const uint64_t *words = c->ast->nonwhite;
+        // The last chunk's bitmap includes the end's bit.  The others are
+        // whole words, which mustn't spill into the next chunk's.
+        const char *z = c->ast->zsrc + c->start;
+        if (c->end < c->ast->zsrc_len)
+                scan_blocks(z, (c->end - c->start) / 64,
+                            c->ast->nonwhite + c->start / 64);
+        else
+                scan_nonwhite(z, c->end - c->start,
+                              c->ast->nonwhite + c->start / 64);
 
+        for (AstIdx w = c->start / 64; w < (c->end + 63) / 64; w++) {
+                for (uint64_t bits = words[w]; bits; bits &= bits - 1) {
+                        AstIdx k = 64 * w + __builtin_ctzll(bits);
+                        if (k >= c->end)
+                                break;
+                        scan_byte(c, k);
+                }
+        }
+        add_run(c, c->run);
+        for (AstIdx k = 0; k < c->nopens; k++)
+                add_run(c, c->opens[k].run);
         return NULL;
 }
 
-static const char *parse_expr(Ast *ast, const char *z0)
+// Sum the chunks' parens and brackets.  Returns whether they match.
+static bool sum_depths(ParseChunk *chunks, uint32_t n)
+{
+        int64_t depth = 0;
+        int32_t brackets = 0;
+        for (uint32_t k = 0; k < n; k++) {
+                ParseChunk *c = chunks + k;
+                if (depth < c->closed || brackets + c->brackets_min < 0 ||
+                    brackets + c->brackets_max > 1)
+                        return false;
+                c->depth = depth;
+                depth += c->parens;
+                brackets += c->brackets;
+        }
+        return !depth && !brackets;
+}
+
+// Find the biggest expression of between `least` and `most` bytes that opens
+// in chunk `c` and closes in the next one.
+static void find_across(ParseChunk *c, const ParseChunk *next)
 {
-        const char *z, *z1 = eat_white(z0);
-        while (!(z = parse_non_call_expr(ast, z1))) {
-                if (!ast->error)
-                        add_syntax_error(ast, z0, "Expected expr");
-                if (!*z1)
+        bool found = false;
+        AstIdx z0, zE;
+        for (AstIdx k = c->nopens; k--;) {
+                if (c->end - c->opens[k].z0 > c->most)
+                        break;
+                // The depth it opens at, which its ')' returns to.
+                int64_t depth = c->depth - c->closed + k;
+                if (next->depth - next->closed > depth)
+                        break;
+                int64_t m = next->depth - 1 - depth;
+                if (m >= next->ncloses)
+                        break;
+                if (next->closes[m] + 1 - c->opens[k].z0 > c->most)
+                        break;
+                z0 = c->opens[k].z0;
+                zE = next->closes[m] + 1;
+                found = zE - z0 >= c->least;
+        }
+        if (found)
+                add_found(c, z0, zE, false);
+}
+
+// By where they start, the biggest first.
+static int compare_holes(const void *a, const void *b)
+{
+        const ParseHole *ha = a, *hb = b;
+        if (ha->z0 != hb->z0)
+                return ha->z0 < hb->z0 ? -1 : 1;
+        return ha->zE > hb->zE ? -1 : ha->zE < hb->zE;
+}
+
+// Gather the chunks' holes into ast->holes, leaving out those inside others.
+static void gather_holes(Ast *ast, ParseChunk *chunks, uint32_t nthreads)
+{
+        AstIdx n = 0;
+        for (uint32_t k = 0; k < nthreads; k++)
+                n += chunks[k].nfound;
+        ParseHole *holes = realloc_or_die(HERE, NULL, sizeof(ParseHole) * n);
+        n = 0;
+        for (uint32_t k = 0; k < nthreads; k++) {
+                memcpy(holes + n, chunks[k].found,
+                       sizeof(ParseHole) * chunks[k].nfound);
+                n += chunks[k].nfound;
+        }
+        // A run starts at its first arg, after the end of the one before.
+        for (AstIdx k = 0; k < n; k++) {
+                if (holes[k].run)
+                        holes[k].z0 = src_offset(
+                            ast, eat_white(ast, src_at(ast, holes[k].z0)));
+        }
+        qsort(holes, n, sizeof(ParseHole), compare_holes);
+
+        AstIdx nholes = 0, zE = 0;
+        for (AstIdx k = 0; k < n; k++) {
+                if (holes[k].z0 < zE || holes[k].z0 >= holes[k].zE)
+                        continue;
+                zE = holes[k].zE;
+                holes[nholes] = holes[k];
+                holes[nholes++].at = NO_NODE;
+        }
+        ast->holes = holes;
+        ast->nholes = nholes;
+        ast->next_hole = 0;
+}
+
+// Drop the holes the parser didn't come to, and deal the rest out to
+// `nthreads` workers by size.
+static void deal_holes(Ast *ast, uint32_t nthreads)
+{
+        ParseHole *holes = ast->holes;
+        AstIdx nholes = 0;
+        uint64_t total = 0;
+        for (AstIdx k = 0; k < ast->nholes; k++) {
+                if (holes[k].at == NO_NODE)
+                        continue;
+                holes[nholes++] = holes[k];
+                total += holes[k].zE - holes[k].z0;
+        }
+        uint64_t before = 0;
+        for (AstIdx k = 0; k < nholes; k++) {
+                holes[k].worker = before * nthreads / total;
+                before += holes[k].zE - holes[k].z0;
+        }
+        ast->nholes = nholes;
+}
+
+static void *parse_holes(void *arg)
+{
+        HoleWorker *w = arg;
+        Ast *ast = &w->ast;
+        ParseStack *st = &ast->stack;
+        for (AstIdx k = w->first; k < w->last; k++) {
+                ParseHole *h = w->holes + k;
+                ast->current_depth = h->current_depth;
+                memcpy(ast->binding_depths, h->binding_depths,
+                       sizeof(h->binding_depths));
+                h->start = ast->nnodes;
+                st->size = 0;
+                ast->zstop = h->run ? h->zE : 0;
+                if (h->run) {
+                        // The args of a callee that isn't here, whose root is
+                        // (as if) just before them.
+                        push_frame(st, (ParseFrame){
+                                           .type = FRAME_EXPR,
+                                           .more = true,
+                                           .z0 = h->z0,
+                                           .z = h->z0,
+                                           .func = ast->nnodes - 1,
+                                       });
+                }
+                const char *zE = parse_frames(
+                    ast, descend(ast, st, src_at(ast, h->z0)));
+                if (ast->error || zE != src_at(ast, h->zE)) {
+                        w->failed = true;
                         return NULL;
-                z1 = eat_white(z1 + 1);
+                }
+                h->size = ast->nnodes - h->start;
+        }
+        return NULL;
+}
+
+static void *copy_holes(void *arg)
+{
+        HoleWorker *w = arg;
+        for (AstIdx k = w->first; k < w->last; k++) {
+                const ParseHole *h = w->holes + k;
+                memcpy(w->nodes + h->at + w->shift[k], w->ast.nodes + h->start,
+                       sizeof(AstNode) * h->size);
         }
+        return NULL;
+}
 
-        for (;;) {
-                const AstNode *func = ast_root(ast);
-                z = eat_white(z);
-                const char *z1 = parse_non_call_expr(ast, z);
-                size_t arg_size = ast_root(ast) - func;
-                if (!z1) {
-                        return z;
+static void run_hole_workers(HoleWorker *workers, uint32_t n,
+                             void *(*fn)(void *))
+{
+        for (uint32_t k = 1; k < n; k++) {
+                DIE_IF(pthread_create(&workers[k].thread, NULL, fn,
+                                      &workers[k]),
+                       "Can't start a parsing thread.");
+        }
+        fn(&workers[0]);
+        for (uint32_t k = 1; k < n; k++)
+                pthread_join(workers[k].thread, NULL);
+}
+
+// How many more nodes the holes before node `idx` of the partial Ast have
+// than the one node each that stands for them.
+static AstIdx shift_before(const Ast *ast, const AstIdx *shift,
+                             AstIdx idx)
+{
+        AstIdx lo = 0, hi = ast->nholes;
+        while (lo < hi) {
+                AstIdx mid = lo + (hi - lo) / 2;
+                if (ast->holes[mid].at < idx)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return shift[lo];
+}
+
+// Copy the partial Ast and the workers' nodes into one array.
+static void stitch(Ast *ast, HoleWorker *workers, uint32_t nthreads)
+{
+        AstIdx nholes = ast->nholes;
+        AstIdx *shift = realloc_or_die(HERE, NULL,
+                                         sizeof(AstIdx) * (nholes + 1));
+        uint64_t total = ast->nnodes;
+        shift[0] = 0;
+        for (AstIdx k = 0; k < nholes; k++) {
+                total += ast->holes[k].size - 1;
+                DIE_IF(total > AST_MAX_NODES,
+                       "%s needs %lu Ast nodes, more than %ld.", ast->zname,
+                       total, (long)AST_MAX_NODES);
+                shift[k + 1] = total - ast->nnodes;
+        }
+
+        AstNode *nodes = realloc_or_die(HERE, NULL, sizeof(AstNode) * total);
+        AstIdx h = 0;
+        for (AstIdx k = 0; k < ast->nnodes; k++) {
+                if (h < nholes && ast->holes[h].at == k) {
+                        h++;
+                        continue;
                 }
-                DIE_IF(arg_size > INT32_MAX,
-                       "Huge arg parsed %lu nodes, why no ENOMEM?", arg_size);
-                z = z1;
-                AstNode *call = ast_node_alloc(ast, 1);
-                *call =
-                    (AstNode){.type = ANT_CALL, .CALL = {.arg_size = arg_size}};
-                DBG("pushed expr %lu: CALL arg_size=%lu", call - ast->nodes,
-                    arg_size);
+                AstNode n = ast->nodes[k];
+                if (ast_type(n) == ANT_CALL) {
+                        AstVal arg_size = ast_val(n);
+                        arg_size += shift[h] -
+                                    shift_before(ast, shift, k - arg_size);
+                        n = ast_node(ANT_CALL, arg_size);
+                }
+                nodes[k + shift[h]] = n;
         }
+        for (uint32_t k = 0; k < nthreads; k++) {
+                workers[k].shift = shift;
+                workers[k].nodes = nodes;
+        }
+        run_hole_workers(workers, nthreads, copy_holes);
+
+        free(shift);
+        free(ast->nodes);
+        ast->nodes = nodes;
+        ast->nnodes = ast->nnodes_alloced = total;
 }
 
-Ast *parse(const char *zname, const char *zsrc)
+// Find the holes in ast->zsrc, on `nthreads` threads, and parse the rest.
+// Returns whether there are any holes to fill in.
+static bool parse_around_holes(Ast *ast, uint32_t nthreads)
 {
-        size_t n = strlen(zsrc) + 8;
+        AstIdx len = ast->zsrc_len;
+        AstIdx most = len / nthreads / 4;
+        ParseChunk *chunks =
+            realloc_or_die(HERE, NULL, sizeof(ParseChunk) * nthreads);
+        for (uint32_t k = 0; k < nthreads; k++) {
+                chunks[k] = (ParseChunk){
+                    .ast = ast,
+                    .start = (uint64_t)len * k / nthreads & ~63ull,
+                    .end = (uint64_t)len * (k + 1) / nthreads & ~63ull,
+                    .most = most,
+                    .least = most / 16,
+                };
+        }
+        chunks[nthreads - 1].end = len;
+        for (uint32_t k = 1; k < nthreads; k++) {
+                DIE_IF(pthread_create(&chunks[k].thread, NULL, scan_chunk,
+                                      &chunks[k]),
+                       "Can't start a parsing thread.");
+        }
+        scan_chunk(&chunks[0]);
+        for (uint32_t k = 1; k < nthreads; k++)
+                pthread_join(chunks[k].thread, NULL);
 
-        Ast *ast = realloc_or_die(HERE, 0, sizeof(Ast) + sizeof(AstNode) * n);
-        *ast = (Ast){
-            .zname = zname,
-            .zsrc = zsrc,
-            .zsrc_len = (int32_t)n,
-            .nnodes_alloced = n,
-        };
-        for (int k = 0; k < n; k++) {
-                ast->nodes[k] = (AstNode){0};
+        bool ok = sum_depths(chunks, nthreads);
+        if (ok) {
+                for (uint32_t k = 0; k + 1 < nthreads; k++)
+                        find_across(chunks + k, chunks + k + 1);
+                gather_holes(ast, chunks, nthreads);
         }
+        for (uint32_t k = 0; k < nthreads; k++) {
+                free(chunks[k].closes);
+                free(chunks[k].opens);
+                free(chunks[k].found);
+        }
+        free(chunks);
+        if (!ok || !ast->nholes)
+                return false;
+
+        parse_all(ast);
+        deal_holes(ast, nthreads);
+        return !ast->error && ast->nholes;
+}
 
-        const char *zE = parse_expr(ast, zsrc);
-        DIE_IF(zE && *zE, "Unused bytes after program source: '%.*s...'", 10,
-               zE);
+// Parse ast->zsrc on `nthreads` threads, or return false if it can't be.
+static bool parse_in_parallel(Ast *ast, uint32_t nthreads)
+{
+        if (!parse_around_holes(ast, nthreads))
+                return false;
 
-        return ast;
+        HoleWorker *workers =
+            realloc_or_die(HERE, NULL, sizeof(HoleWorker) * nthreads);
+        uint32_t h = 0;
+        for (uint32_t k = 0; k < nthreads; k++) {
+                workers[k] = (HoleWorker){
+                    .ast = {.zname = ast->zname,
+                            .zsrc = ast->zsrc,
+                            .zsrc_len = ast->zsrc_len,
+                            .nonwhite = ast->nonwhite},
+                    .holes = ast->holes,
+                    .first = h,
+                };
+                while (h < ast->nholes && ast->holes[h].worker == k)
+                        h++;
+                workers[k].last = h;
+        }
+        run_hole_workers(workers, nthreads, parse_holes);
+        bool ok = true;
+        for (uint32_t k = 0; k < nthreads; k++)
+                ok = ok && !workers[k].failed;
+        if (ok)
+                stitch(ast, workers, nthreads);
+
+        for (uint32_t k = 0; k < nthreads; k++) {
+                Ast *wast = &workers[k].ast;
+                delete_syntax_errors(wast);
+                free(wast->nodes);
+                free(wast->stack.frames);
+        }
+        free(workers);
+        return ok;
+}
+
+Ast *parse_parallel(const char *zname, const char *zsrc, size_t len,
+                    uint32_t nthreads)
+{
+        if (!nthreads) {
+                long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+                nthreads = ncpus > 0 ? ncpus : 1;
+        }
+        Ast *ast = begin_parse(NULL, zname, zsrc, len);
+        if (nthreads < 2 || ast->zsrc_len / nthreads < PARSE_MIN_PER_THREAD ||
+            !parse_in_parallel(ast, nthreads)) {
+                // Not worth it, or something's amiss.
+                free(ast->holes);
+                ast->holes = NULL;
+                ast->nholes = 0;
+                ast = reparse_len(ast, zname, zsrc, len);
+        }
+        return trim(ast);
 }
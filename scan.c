@@ -0,0 +1,107 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "scan.h"
+#include "untestable.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Each kernel returns the non-whitespace bits of z[0:64].
+typedef uint64_t (*ScanKernel)(const char *z);
+
+static uint64_t scan64_scalar(const char *z)
+{
+        uint64_t white = 0;
+        for (int k = 0; k < 64; k++) {
+                char ch = z[k];
+                white |= (uint64_t)(ch == ' ' || ch == '\t' || ch == '\n') << k;
+        }
+        return ~white;
+}
+
+#if defined(__x86_64__)
+
+static uint64_t scan64_sse2(const char *z)
+{
+        const __m128i space = _mm_set1_epi8(' ');
+        const __m128i tab = _mm_set1_epi8('\t');
+        const __m128i newline = _mm_set1_epi8('\n');
+        uint64_t white = 0;
+        for (int k = 0; k < 64; k += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(z + k));
+                __m128i w = _mm_or_si128(
+                    _mm_cmpeq_epi8(v, space),
+                    _mm_or_si128(_mm_cmpeq_epi8(v, tab),
+                                 _mm_cmpeq_epi8(v, newline)));
+                white |= (uint64_t)(uint16_t)_mm_movemask_epi8(w) << k;
+        }
+        return ~white;
+}
+
+__attribute__((target("avx2"))) static uint64_t scan64_avx2(const char *z)
+{
+        const __m256i space = _mm256_set1_epi8(' ');
+        const __m256i tab = _mm256_set1_epi8('\t');
+        const __m256i newline = _mm256_set1_epi8('\n');
+        uint64_t white = 0;
+        for (int k = 0; k < 64; k += 32) {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(z + k));
+                __m256i w = _mm256_or_si256(
+                    _mm256_cmpeq_epi8(v, space),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(v, tab),
+                                    _mm256_cmpeq_epi8(v, newline)));
+                white |= (uint64_t)(uint32_t)_mm256_movemask_epi8(w) << k;
+        }
+        return ~white;
+}
+
+static ScanKernel best_kernel(void)
+{
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && may_use_isa("avx2"))
+                return scan64_avx2;
+        if (may_use_isa("sse2"))
+                return scan64_sse2;
+        return scan64_scalar;
+}
+
+#else // Not x86-64: classify a byte at a time.
+
+static ScanKernel best_kernel(void) { return scan64_scalar; }
+
+#endif
+
+// Any thread may be the first here, and they all pick the same kernel.
+static ScanKernel kernel(void)
+{
+        static _Atomic(ScanKernel) best;
+        ScanKernel k = atomic_load_explicit(&best, memory_order_relaxed);
+        if (!k) {
+                k = best_kernel();
+                atomic_store_explicit(&best, k, memory_order_relaxed);
+        }
+        return k;
+}
+
+void scan_blocks(const char *z, size_t nblocks, uint64_t *words)
+{
+        ScanKernel scan = kernel();
+        for (size_t w = 0; w < nblocks; w++)
+                words[w] = scan(z + 64 * w);
+}
+
+void scan_nonwhite(const char *zsrc, size_t len, uint64_t *words)
+{
+        // The last block is copied into a NUL-padded buffer, so the kernels
+        // never read past zsrc[len - 1].
+        size_t nwhole = len / 64;
+        scan_blocks(zsrc, nwhole, words);
+        char last[64] = {0};
+        memcpy(last, zsrc + 64 * nwhole, len - 64 * nwhole);
+        words[nwhole] = kernel()(last);
+}
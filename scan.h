@@ -0,0 +1,23 @@
+#ifndef SCAN_2026_10_16_H
+#define SCAN_2026_10_16_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The number of words in the bitmap scan_nonwhite() makes of `len` bytes.
+static inline size_t scan_nwords(size_t len) { return (len + 64) / 64; }
+
+// The parser's pre-pass.  Fills words[0:scan_nwords(len)] with a bitmap of
+// the bytes of zsrc[0:len] that aren't whitespace (' ', '\t' or '\n'): bit
+// k % 64 of word k / 64 is set if zsrc[k] isn't.  The bits from `len` on are
+// set, as if the source were NUL padded, so there is always a set bit at or
+// after any byte of the source.  Only zsrc[0:len] is read, so the source
+// needn't be NUL terminated.  The bytes are classified 64 at a time, with AVX2
+// or SSE2 where the CPU has them.
+extern void scan_nonwhite(const char *zsrc, size_t len, uint64_t *words);
+
+// Like scan_nonwhite(), but for the `nblocks` whole blocks of 64 bytes at z,
+// filling words[0:nblocks], with no padding.
+extern void scan_blocks(const char *z, size_t nblocks, uint64_t *words);
+
+#endif // SCAN_2026_10_16_H
@@ -0,0 +1,136 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eval.h"
+#include "lambda.h"
+#include "untestable.h"
+
+// A round-robin scheduler for EvalContexts.  Each line of the input is a
+// program of its own, with a context of its own.  The contexts wait in a
+// ring, and each in turn runs for one slice of steps and then goes to the
+// back, so a program that never finishes only ever takes its share of the
+// time, and is stopped by its own budget.  Results are printed as programs
+// finish, tagged with their line numbers.
+
+// Steps per turn if the caller doesn't say.
+#define DEFAULT_SLICE 1024
+
+typedef struct {
+        uint32_t line;
+        char *zname;
+        char *zsrc;
+        Ast *ast;
+        EvalContext *ctx;
+} Task;
+
+static void delete_task(Task *t)
+{
+        if (t->ctx)
+                delete_eval_context(t->ctx);
+        delete_ast(t->ast);
+        free(t->zsrc);
+        free(t->zname);
+}
+
+// Parse line number `line`, at zline[0:len], into *t, and start evaluating it.
+// Returns false (after reporting them) if there are syntax errors.
+static bool start_task(Task *t, const char *zname, uint32_t line,
+                       const char *zline, size_t len, const EvalBudget *budget)
+{
+        *t = (Task){.line = line};
+        t->zsrc = strndup(zline, len);
+        DIE_IF(!t->zsrc, "Couldn't copy line %u.", line);
+        DIE_IF(asprintf(&t->zname, "%s:%u", zname, line) < 0,
+               "Couldn't name line %u.", line);
+        t->ast = parse(t->zname, t->zsrc);
+        if (report_syntax_errors(stderr, t->ast)) {
+                delete_task(t);
+                return false;
+        }
+
+        AstIdx size;
+        const AstNode *code = ast_postfix(t->ast, &size);
+        t->ctx = new_eval_context(code, size, budget);
+        return true;
+}
+
+// Print the result of a task that has finished with `status`, and return the
+// number of errors.
+static int finish_task(FILE *oot, Task *t, EvalStatus status)
+{
+        int nerr = 0;
+        uint32_t size;
+        if (status == EVAL_NORMAL_FORM) {
+                const AstNode *nodes = eval_context_result(t->ctx, &size);
+                fprintf(oot, "%u: ", t->line);
+                unparse_postfix(oot, nodes, size);
+        } else {
+                fprintf(stderr, "%s: ", t->zname);
+                nerr = eval_context_report(t->ctx);
+        }
+        delete_task(t);
+        return nerr;
+}
+
+static bool is_blank(const char *z, size_t len)
+{
+        for (size_t k = 0; k < len; k++) {
+                if (z[k] != ' ' && z[k] != '\t')
+                        return false;
+        }
+        return true;
+}
+
+int act_round_robin(FILE *oot, const char *zname, const char *zsrc,
+                    size_t src_len, const EvalBudget *budget, uint64_t slice)
+{
+        if (!slice)
+                slice = DEFAULT_SLICE;
+
+        const char *zend = zsrc + src_len;
+        uint32_t nlines = 1;
+        for (const char *z = zsrc; (z = memchr(z, '\n', zend - z)); z++)
+                nlines++;
+        Task *ring = realloc_or_die(HERE, NULL, sizeof(Task) * nlines);
+
+        // Start all the programs, in order.
+        int nerr = 0;
+        uint32_t count = 0, line = 1;
+        for (const char *z = zsrc;; line++) {
+                const char *zE = memchr(z, '\n', zend - z);
+                size_t len = zE ? (size_t)(zE - z) : (size_t)(zend - z);
+                if (!is_blank(z, len)) {
+                        if (start_task(ring + count, zname, line, z, len,
+                                       budget))
+                                count++;
+                        else
+                                nerr++;
+                }
+                if (!zE)
+                        break;
+                z = zE + 1;
+        }
+
+        // Give each a turn, until they have all finished.  Tasks are taken
+        // from ring[head], and put back after the last of the `count` tasks
+        // waiting.
+        for (uint32_t head = 0; count;) {
+                Task t = ring[head];
+                head = (head + 1) % nlines;
+                count--;
+                EvalStatus status = eval_context_run(t.ctx, slice);
+                if (status == EVAL_REDUCED)
+                        ring[(head + count++) % nlines] = t;
+                else
+                        nerr += finish_task(oot, &t, status);
+        }
+
+        free(ring);
+        return nerr;
+}
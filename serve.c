@@ -0,0 +1,595 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "lambda.h"
+#include "sink.h"
+#include "untestable.h"
+
+// Serving requests on a Unix socket.  This thread waits on the socket and the
+// connections with epoll, reads the requests, and writes out the answers; the
+// workers take the requests off a queue and answer them, each into buffers of
+// its own (the Ast, the TypeBuffers and the Sinks), which grow to fit the
+// biggest request it has answered, and are reused for the next.
+//
+// A connection's requests may be answered by different workers, and so out of
+// order, so each is kept on the connection's list until it is answered, and
+// the answers are written from the front of the list as they are done.  When
+// a worker is done with a request, it puts it on the done list and wakes this
+// thread with an eventfd.
+
+// Requests longer than this are taken to be garbage, and the connection is
+// dropped.
+#define SERVE_MAX_REQUEST ((uint32_t)1 << 30)
+
+// A connection with this many requests not yet answered isn't read until some
+// are, so that a client that doesn't read its answers can't pile them up.
+#define SERVE_MAX_PENDING 64
+
+// The length of an answer's header, after its own length: the number of
+// syntax errors and of other errors, the times and the length of the output.
+#define ANSWER_HEADER (4 + 4 + 8 + 8 + 8 + 4)
+
+typedef struct Request Request;
+typedef struct Conn Conn;
+
+struct Request {
+        Conn *conn;
+        Request *next_in_conn; // Asked after this one on `conn`.
+        Request *next;         // In the work queue, or the done list.
+        char *buf;             // The request, then the answer.
+        size_t len;
+        size_t written; // How much of the answer has been written.
+        uint64_t start_ns; // When it was read.
+        bool done;
+};
+
+struct Conn {
+        int fd; // -1 once the connection is dropped.
+        char *in;
+        size_t in_len;
+        size_t in_alloced;
+        // The requests not yet answered (or whose answers aren't all
+        // written), in the order they were asked.
+        Request *first, *last;
+        uint32_t npending;
+        uint32_t events; // What epoll is waiting for.
+        bool eof;        // The client has sent all it will.
+        // On the server's list of live connections, or of dropped ones.
+        Conn *prev, *next;
+};
+
+typedef struct Server Server;
+
+typedef struct {
+        Server *server;
+        pthread_t thread;
+        Ast *ast;
+        TypeBuffers *tbufs;
+        Tagger out, err;
+        Sink answer;
+} ServeWorker;
+
+struct Server {
+        ServeAction act;
+        void *arg;
+        int epfd, listen_fd, wake_fd, signal_fd;
+        ServeWorker *workers;
+        uint32_t nworkers;
+        Conn *live;
+        // Dropped connections, to free once all of this round's events are
+        // handled (as there may be more for them), and none of their
+        // requests are with the workers.
+        Conn *dead;
+        // The connections with answers to write, reused by take_answers().
+        Conn **woken;
+        size_t woken_alloced;
+
+        // Guarded by `lock`.  The workers wait on `ready` for requests.
+        pthread_mutex_t lock;
+        pthread_cond_t ready;
+        Request *todo_first, *todo_last;
+        Request *done;
+        bool stopping;
+};
+
+static uint64_t now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t get_u32(const char *z)
+{
+        const unsigned char *u = (const unsigned char *)z;
+        return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 |
+               (uint32_t)u[2] << 8 | u[3];
+}
+
+static void put_u32(Sink *sink, uint32_t n)
+{
+        for (int shift = 24; shift >= 0; shift -= 8)
+                sink_putc(sink, n >> shift);
+}
+
+static void put_u64(Sink *sink, uint64_t n)
+{
+        put_u32(sink, n >> 32);
+        put_u32(sink, n);
+}
+
+// ------------------------------------------------------------------
+// The workers.
+
+// Answer `req`, leaving the answer in req->buf.
+static void answer(ServeWorker *w, Request *req)
+{
+        Server *s = w->server;
+        uint64_t start_ns = now_ns(), parse_ns = 0, run_ns = 0;
+        uint32_t nsyntax = 0, nerr = 0;
+        char *zopts = req->buf;
+        char *zsrc = memchr(req->buf, '\n', req->len);
+        if (!zsrc) {
+                fprintf(w->err.file, "A request starts with a line of "
+                                     "options.\n");
+                nerr = 1;
+        } else {
+                *zsrc++ = '\0';
+                size_t len = req->buf + req->len - zsrc;
+                w->ast = reparse_len(w->ast, "request", zsrc, len);
+                nsyntax = report_syntax_errors(w->err.file, w->ast);
+                parse_ns = now_ns() - start_ns;
+                if (!nsyntax)
+                        nerr = s->act(w->out.file, zopts, w->ast, w->tbufs,
+                                      s->arg);
+                run_ns = now_ns() - start_ns - parse_ns;
+        }
+        tagger_end_line(&w->out);
+        tagger_end_line(&w->err);
+
+        Sink *a = &w->answer;
+        Sink *out = &w->out.sink, *err = &w->err.sink;
+        put_u32(a, ANSWER_HEADER + out->len + err->len);
+        put_u32(a, nsyntax);
+        put_u32(a, nerr);
+        put_u64(a, start_ns - req->start_ns);
+        put_u64(a, parse_ns);
+        put_u64(a, run_ns);
+        put_u32(a, out->len);
+        sink_write(a, out->buf, out->len);
+        sink_write(a, err->buf, err->len);
+        out->len = err->len = 0;
+        free(req->buf);
+        req->buf = sink_take(a, &req->len);
+}
+
+static void *serve_work(void *arg)
+{
+        ServeWorker *w = arg;
+        Server *s = w->server;
+        set_error_stream(w->err.file);
+        for (;;) {
+                pthread_mutex_lock(&s->lock);
+                while (!s->todo_first && !s->stopping)
+                        pthread_cond_wait(&s->ready, &s->lock);
+                Request *req = s->stopping ? NULL : s->todo_first;
+                if (req)
+                        s->todo_first = req->next;
+                pthread_mutex_unlock(&s->lock);
+                if (!req)
+                        break;
+
+                answer(w, req);
+
+                pthread_mutex_lock(&s->lock);
+                req->next = s->done;
+                s->done = req;
+                pthread_mutex_unlock(&s->lock);
+                uint64_t one = 1;
+                DIE_IF(write(s->wake_fd, &one, sizeof(one)) != sizeof(one),
+                       "Can't wake the server: %s", strerror(errno));
+        }
+        set_error_stream(NULL);
+        return NULL;
+}
+
+static void start_worker(Server *s, ServeWorker *w)
+{
+        *w = (ServeWorker){.server = s, .out.ztag = "", .err.ztag = ""};
+        w->tbufs = new_type_buffers();
+        sink_open_memory(&w->out.sink);
+        sink_open_memory(&w->err.sink);
+        sink_open_memory(&w->answer);
+        tagger_open(&w->out, false);
+        tagger_open(&w->err, false);
+        DIE_IF(pthread_create(&w->thread, NULL, serve_work, w),
+               "Can't start a server worker.");
+}
+
+static void free_worker(ServeWorker *w)
+{
+        tagger_close(&w->out);
+        tagger_close(&w->err);
+        sink_close(&w->answer);
+        if (w->ast)
+                delete_ast(w->ast);
+        delete_type_buffers(w->tbufs);
+}
+
+// ------------------------------------------------------------------
+// The connections.
+
+static void watch(Server *s, Conn *c, uint32_t events)
+{
+        if (c->fd < 0 || events == c->events)
+                return;
+        struct epoll_event ev = {.events = events, .data.ptr = c};
+        DIE_IF(epoll_ctl(s->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0,
+               "Can't watch a connection: %s", strerror(errno));
+        c->events = events;
+}
+
+static void drop(Server *s, Conn *c)
+{
+        if (c->fd < 0)
+                return;
+        close(c->fd);
+        c->fd = -1;
+        free(c->in);
+        c->in = NULL;
+        if (c->prev)
+                c->prev->next = c->next;
+        else
+                s->live = c->next;
+        if (c->next)
+                c->next->prev = c->prev;
+        c->prev = NULL;
+        c->next = s->dead;
+        s->dead = c;
+}
+
+// Take the whole requests off the front of c->in, and queue them, up to
+// SERVE_MAX_PENDING.  The rest wait in c->in until answers are written.
+static void take_requests(Server *s, Conn *c)
+{
+        size_t at = 0;
+        while (c->in_len - at >= 4 && c->npending < SERVE_MAX_PENDING) {
+                uint32_t len = get_u32(c->in + at);
+                if (len > SERVE_MAX_REQUEST) {
+                        drop(s, c);
+                        return;
+                }
+                if (c->in_len - at - 4 < len)
+                        break;
+                Request *req = realloc_or_die(HERE, NULL, sizeof(Request));
+                *req = (Request){.conn = c, .len = len,
+                                 .start_ns = now_ns()};
+                req->buf = realloc_or_die(HERE, NULL, len + 1);
+                memcpy(req->buf, c->in + at + 4, len);
+                at += 4 + len;
+
+                if (c->last)
+                        c->last->next_in_conn = req;
+                else
+                        c->first = req;
+                c->last = req;
+                c->npending++;
+                pthread_mutex_lock(&s->lock);
+                if (s->todo_first)
+                        s->todo_last->next = req;
+                else
+                        s->todo_first = req;
+                s->todo_last = req;
+                pthread_cond_signal(&s->ready);
+                pthread_mutex_unlock(&s->lock);
+        }
+        c->in_len -= at;
+        memmove(c->in, c->in + at, c->in_len);
+}
+
+// Write out the answers at the front of c's list that are done, and watch for
+// what the connection is waiting for next.
+static void write_answers(Server *s, Conn *c)
+{
+        while (c->first && c->first->done) {
+                Request *req = c->first;
+                if (c->fd >= 0 && req->written < req->len) {
+                        ssize_t n = send(c->fd, req->buf + req->written,
+                                         req->len - req->written,
+                                         MSG_NOSIGNAL);
+                        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                                break;
+                        if (n < 0)
+                                drop(s, c); // The client is gone.
+                        else
+                                req->written += n;
+                        continue;
+                }
+                c->first = req->next_in_conn;
+                if (!c->first)
+                        c->last = NULL;
+                c->npending--;
+                free(req->buf);
+                free(req);
+        }
+        if (c->fd >= 0)
+                take_requests(s, c);
+        if (c->eof && !c->first)
+                drop(s, c);
+        uint32_t events = 0;
+        if (!c->eof && c->npending < SERVE_MAX_PENDING)
+                events |= EPOLLIN;
+        if (c->first && c->first->done)
+                events |= EPOLLOUT;
+        watch(s, c, events);
+}
+
+static void read_requests(Server *s, Conn *c)
+{
+        while (c->fd >= 0 && !c->eof && c->npending < SERVE_MAX_PENDING) {
+                if (c->in_alloced - c->in_len < 4096) {
+                        c->in_alloced = 2 * c->in_alloced + 4096;
+                        c->in = realloc_or_die(HERE, c->in, c->in_alloced);
+                }
+                size_t room = c->in_alloced - c->in_len;
+                ssize_t n = read(c->fd, c->in + c->in_len, read_size(room));
+                if (n < 0 && errno == EAGAIN)
+                        break;
+                if (n < 0 && errno == EINTR)
+                        continue; // LCOV_EXCL_LINE
+                if (read_errnum(c->in + c->in_len, n) < 0) {
+                        drop(s, c);
+                        return;
+                }
+                // The client may have shut down its end only for writing,
+                // and still want its answers.
+                c->eof = !n;
+                c->in_len += n;
+                take_requests(s, c);
+        }
+        if (c->fd >= 0)
+                write_answers(s, c);
+}
+
+static void accept_conns(Server *s)
+{
+        for (;;) {
+                int fd = accept4(s->listen_fd, NULL, NULL,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0 && errno == EINTR)
+                        continue; // LCOV_EXCL_LINE
+                if (fd < 0 && errno != EAGAIN) {
+                        // LCOV_EXCL_START
+                        fprintf(stderr, "Can't accept a connection: %s\n",
+                                strerror(errno));
+                        fflush(stderr);
+                        // LCOV_EXCL_STOP
+                }
+                if (fd < 0)
+                        return;
+                Conn *c = realloc_or_die(HERE, NULL, sizeof(Conn));
+                *c = (Conn){.fd = fd, .events = EPOLLIN, .next = s->live};
+                if (s->live)
+                        s->live->prev = c;
+                s->live = c;
+                struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+                DIE_IF(epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) < 0,
+                       "Can't watch a connection: %s", strerror(errno));
+        }
+}
+
+// Mark the requests the workers have answered as done, and write them out.
+static void take_answers(Server *s)
+{
+        uint64_t count;
+        DIE_IF(read(s->wake_fd, &count, sizeof(count)) != sizeof(count),
+               "Can't read the server's wake-ups: %s", strerror(errno));
+        pthread_mutex_lock(&s->lock);
+        Request *done = s->done;
+        s->done = NULL;
+        pthread_mutex_unlock(&s->lock);
+        // Writing out a connection's answers frees them, so note whose they
+        // are first.
+        size_t nwoken = 0;
+        for (Request *req = done; req; req = req->next) {
+                req->done = true;
+                if (nwoken == s->woken_alloced) {
+                        s->woken_alloced = 2 * s->woken_alloced + 16;
+                        s->woken = realloc_or_die(
+                            HERE, s->woken, sizeof(Conn *) * s->woken_alloced);
+                }
+                s->woken[nwoken++] = req->conn;
+        }
+        for (size_t k = 0; k < nwoken; k++)
+                write_answers(s, s->woken[k]);
+}
+
+static void free_conn(Conn *c)
+{
+        while (c->first) {
+                Request *req = c->first;
+                c->first = req->next_in_conn;
+                free(req->buf);
+                free(req);
+        }
+        free(c);
+}
+
+// Free the dropped connections whose requests have all been answered (or all
+// of them, if `all`).
+static void bury_dead(Server *s, bool all)
+{
+        Conn **pc = &s->dead;
+        while (*pc) {
+                Conn *c = *pc;
+                if (c->first && !all) {
+                        pc = &c->next;
+                        continue;
+                }
+                *pc = c->next;
+                free_conn(c);
+        }
+}
+
+// ------------------------------------------------------------------
+
+// Whether a server is listening on the socket at `addr`.
+static bool is_listened_on(const struct sockaddr_un *addr)
+{
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        DIE_IF(fd < 0, "Can't make a socket: %s", strerror(errno));
+        bool listened = connect(fd, (const struct sockaddr *)addr,
+                                sizeof(*addr)) == 0 ||
+                        errno != ECONNREFUSED;
+        close(fd);
+        return listened;
+}
+
+// Listen on a socket bound at `zpath`, replacing one there that nothing is
+// listening on (left behind by a server that is gone).
+static int listen_at(const char *zpath)
+{
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        if (strlen(zpath) >= sizeof(addr.sun_path)) {
+                fprintf(stderr, "--serve: '%s' is too long for a socket.\n",
+                        zpath);
+                return -1;
+        }
+        strcpy(addr.sun_path, zpath);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        DIE_IF(fd < 0, "Can't make a socket: %s", strerror(errno));
+        const struct sockaddr *sa = (const struct sockaddr *)&addr;
+        int r = bind(fd, sa, sizeof(addr));
+        if (r < 0 && errno == EADDRINUSE && !is_listened_on(&addr)) {
+                unlink(zpath);
+                r = bind(fd, sa, sizeof(addr));
+        }
+        if (r < 0 || listen(fd, SOMAXCONN) < 0) {
+                fprintf(stderr, "Can't serve on %s: %s\n", zpath,
+                        strerror(errno));
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+// Take the signal to stop, so that it isn't still pending when it's let
+// through again.
+static bool take_signal(Server *s)
+{
+        struct signalfd_siginfo info;
+        DIE_IF(read(s->signal_fd, &info, sizeof(info)) != sizeof(info),
+               "Can't read the signal to stop: %s", strerror(errno));
+        return true;
+}
+
+static void watch_fd(Server *s, int *fd)
+{
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = fd};
+        DIE_IF(epoll_ctl(s->epfd, EPOLL_CTL_ADD, *fd, &ev) < 0,
+               "Can't watch the server's fd %d: %s", *fd, strerror(errno));
+}
+
+int act_serve(const char *zpath, uint32_t nthreads, ServeAction act, void *arg)
+{
+        Server s = {.act = act, .arg = arg};
+        s.listen_fd = listen_at(zpath);
+        if (s.listen_fd < 0) {
+                fflush(stderr);
+                return 1;
+        }
+
+        // Stop on SIGINT or SIGTERM, which the workers don't take either.
+        sigset_t stop, old;
+        sigemptyset(&stop);
+        sigaddset(&stop, SIGINT);
+        sigaddset(&stop, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &stop, &old);
+        s.signal_fd = signalfd(-1, &stop, SFD_CLOEXEC);
+        s.wake_fd = eventfd(0, EFD_CLOEXEC);
+        s.epfd = epoll_create1(EPOLL_CLOEXEC);
+        DIE_IF(s.signal_fd < 0 || s.wake_fd < 0 || s.epfd < 0,
+               "Can't set up the server: %s", strerror(errno));
+        watch_fd(&s, &s.listen_fd);
+        watch_fd(&s, &s.wake_fd);
+        watch_fd(&s, &s.signal_fd);
+
+        if (!nthreads) {
+                long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+                nthreads = ncpus > 0 ? ncpus : 1;
+        }
+        s.nworkers = nthreads;
+        s.workers = realloc_or_die(HERE, NULL,
+                                   sizeof(ServeWorker) * s.nworkers);
+        pthread_mutex_init(&s.lock, NULL);
+        pthread_cond_init(&s.ready, NULL);
+        for (uint32_t k = 0; k < s.nworkers; k++)
+                start_worker(&s, &s.workers[k]);
+
+        enum { MAX_EVENTS = 64 };
+        struct epoll_event evs[MAX_EVENTS];
+        for (bool stopping = false; !stopping;) {
+                int n = epoll_wait(s.epfd, evs, MAX_EVENTS, -1);
+                DIE_IF(n < 0 && errno != EINTR, "Can't wait for events: %s",
+                       strerror(errno));
+                for (int k = 0; k < n; k++) {
+                        void *p = evs[k].data.ptr;
+                        uint32_t events = evs[k].events;
+                        if (p == &s.listen_fd)
+                                accept_conns(&s);
+                        else if (p == &s.wake_fd)
+                                take_answers(&s);
+                        else if (p == &s.signal_fd)
+                                stopping = take_signal(&s);
+                        else if (events & (EPOLLERR | EPOLLHUP))
+                                drop(&s, p); // The client is gone.
+                        else if (events & EPOLLIN)
+                                read_requests(&s, p);
+                        else
+                                write_answers(&s, p);
+                }
+                bury_dead(&s, false);
+        }
+
+        // Stop the workers, leaving the requests they haven't started.
+        pthread_mutex_lock(&s.lock);
+        s.stopping = true;
+        pthread_cond_broadcast(&s.ready);
+        pthread_mutex_unlock(&s.lock);
+        for (uint32_t k = 0; k < s.nworkers; k++) {
+                pthread_join(s.workers[k].thread, NULL);
+                free_worker(&s.workers[k]);
+        }
+        while (s.live)
+                drop(&s, s.live);
+        bury_dead(&s, true);
+
+        close(s.listen_fd);
+        unlink(zpath);
+        close(s.epfd);
+        close(s.wake_fd);
+        close(s.signal_fd);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        pthread_cond_destroy(&s.ready);
+        pthread_mutex_destroy(&s.lock);
+        free(s.workers);
+        free(s.woken);
+        return 0;
+}
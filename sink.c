@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "sink.h"
+#include "untestable.h"
+
+// A sink on a file descriptor starts with a buffer small enough for the usual
+// one-line outputs, and grows it up to SINK_MAX_BUF before it starts flushing.
+#define SINK_MIN_BUF (16 * 1024)
+#define SINK_MAX_BUF (1024 * 1024)
+
+void sink_open_fd(Sink *sink, int fd)
+{
+        assert(fd >= 0);
+        *sink = (Sink){.fd = fd};
+}
+
+void sink_open_memory(Sink *sink)
+{
+        *sink = (Sink){.fd = -1};
+}
+
+void sink_open_buffer(Sink *sink, char *buf, size_t size)
+{
+        *sink = (Sink){.buf = buf, .alloced = size, .fd = -1};
+}
+
+void sink_open_file(Sink *sink, FILE *oot)
+{
+        fflush(oot);
+        int fd = fileno(oot);
+        if (fd < 0) {
+                sink_open_memory(sink);
+                sink->file = oot;
+                return;
+        }
+        sink_open_fd(sink, fd);
+}
+
+// Write all of iov[0:niov] to `fd`, or record why not.
+static void write_all(Sink *sink, struct iovec *iov, int niov)
+{
+        while (niov && !sink->errnum) {
+                // Only the first part, if that is to be cut short.
+                size_t len = iov->iov_len;
+                iov->iov_len = write_size(len);
+                ssize_t n = writev(sink->fd, iov,
+                                   iov->iov_len < len ? 1 : niov);
+                iov->iov_len = len;
+                if (n < 0) {
+                        if (errno != EINTR)
+                                sink->errnum = errno;
+                        continue;
+                }
+                for (; niov && (size_t)n >= iov->iov_len; iov++, niov--)
+                        n -= iov->iov_len;
+                if (niov) {
+                        iov->iov_base = (char *)iov->iov_base + n;
+                        iov->iov_len -= n;
+                }
+        }
+}
+
+void sink_flush(Sink *sink)
+{
+        if (sink->fd < 0 || !sink->len)
+                return;
+        struct iovec iov = {sink->buf, sink->len};
+        write_all(sink, &iov, 1);
+        sink->len = 0;
+}
+
+void sink_make_room(Sink *sink, size_t n)
+{
+        if (sink->alloced - sink->len >= n)
+                return;
+        if (sink->fd >= 0 && sink->alloced >= SINK_MAX_BUF) {
+                sink_flush(sink);
+                if (sink->alloced >= n)
+                        return;
+        }
+
+        size_t alloced = sink->alloced ? sink->alloced : SINK_MIN_BUF;
+        while (alloced - sink->len < n)
+                alloced *= 2;
+        sink->buf = realloc_or_die(HERE, sink->buf, alloced);
+        sink->alloced = alloced;
+}
+
+void sink_write(Sink *sink, const char *buf, size_t n)
+{
+        // An empty buf may be NULL, as may an empty sink's.
+        if (!n)
+                return;
+        if (sink->fd >= 0 && n >= SINK_MAX_BUF) {
+                struct iovec iov[2] = {{sink->buf, sink->len},
+                                       {(char *)buf, n}};
+                write_all(sink, iov + !sink->len, 1 + !!sink->len);
+                sink->len = 0;
+                return;
+        }
+        sink_make_room(sink, n);
+        memcpy(sink->buf + sink->len, buf, n);
+        sink->len += n;
+}
+
+void sink_puts(Sink *sink, const char *zstr)
+{
+        sink_write(sink, zstr, strlen(zstr));
+}
+
+char *sink_take(Sink *sink, size_t *len)
+{
+        assert(sink->fd < 0);
+        sink_make_room(sink, 1);
+        sink->buf[sink->len] = 0;
+        char *buf = sink->buf;
+        *len = sink->len;
+        *sink = (Sink){.fd = -1, .file = sink->file};
+        return buf;
+}
+
+int sink_close(Sink *sink)
+{
+        if (sink->file && sink->fd < 0) {
+                size_t len;
+                char *buf = sink_take(sink, &len);
+                fwrite(buf, 1, len, sink->file);
+                fflush(sink->file);
+                free(buf);
+        }
+        sink_flush(sink);
+        free(sink->buf);
+
+        int errnum = sink->errnum;
+        *sink = (Sink){.fd = -1};
+        if (!errnum)
+                return 0;
+        FILE *err = error_stream();
+        fprintf(err, "Error writing output: %s\n", strerror(errnum));
+        fflush(err);
+        return 1;
+}
+
+// ------------------------------------------------------------------
+
+static ssize_t write_tagged(void *cookie, const char *buf, size_t n)
+{
+        Tagger *t = cookie;
+        for (const char *z = buf, *zend = buf + n; z < zend;) {
+                if (!t->midline)
+                        sink_puts(&t->sink, t->ztag);
+                const char *zE = memchr(z, '\n', zend - z);
+                size_t len = zE ? (size_t)(zE + 1 - z) : (size_t)(zend - z);
+                sink_write(&t->sink, z, len);
+                t->midline = !zE;
+                z += len;
+        }
+        if (t->unbuffered)
+                sink_flush(&t->sink);
+        return n;
+}
+
+void tagger_open(Tagger *t, bool unbuffered)
+{
+        t->midline = false;
+        t->unbuffered = unbuffered;
+        t->file = fopencookie(t, "w", (cookie_io_functions_t){
+                                          .write = write_tagged,
+                                      });
+        DIE_IF(!t->file, "Couldn't open a stream for tagged output.");
+        if (unbuffered)
+                setvbuf(t->file, NULL, _IONBF, 0);
+}
+
+void tagger_end_line(Tagger *t)
+{
+        fflush(t->file);
+        // Every action ends its lines, so this is just in case.
+        if (t->midline)
+                write_tagged(t, "\n", 1); // LCOV_EXCL_LINE
+}
+
+int tagger_close(Tagger *t)
+{
+        fclose(t->file);
+        t->file = NULL;
+        return sink_close(&t->sink);
+}
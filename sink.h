@@ -0,0 +1,88 @@
+#ifndef SINK_2026_10_16_H
+#define SINK_2026_10_16_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Sink is buffered output for the printers, which write a character or two at
+// a time.  The characters go into a big user-space buffer, which is either
+// flushed to a file descriptor with write(2) (or writev(2)) when full, or kept
+// and grown in memory.
+typedef struct {
+        char *buf;
+        size_t len;
+        size_t alloced;
+        int fd;     // Where to flush to, or -1 to keep the output in memory.
+        FILE *file; // If not NULL, handed the output by sink_close().
+        int errnum; // The first error writing to fd, or zero.
+} Sink;
+
+// Start `sink` writing to `fd`.
+extern void sink_open_fd(Sink *sink, int fd);
+
+// Start `sink` keeping the output in memory, for sink_take().
+extern void sink_open_memory(Sink *sink);
+
+// Start `sink` writing into buf[0:size], which must be big enough for all that
+// is written, as it is never flushed or grown.  Such a sink isn't closed.
+extern void sink_open_buffer(Sink *sink, char *buf, size_t size);
+
+// Start `sink` writing to `oot`, after anything already buffered there.  The
+// output bypasses stdio's buffer and goes straight to fileno(oot), unless
+// `oot` hasn't got one (e.g. it's a memstream), in which case it is kept in
+// memory and written to `oot` by sink_close().
+extern void sink_open_file(Sink *sink, FILE *oot);
+
+// Make room in the buffer for at least `n` more bytes, by flushing or growing
+// it.  sink_putc() and the rest do this as need be.
+extern void sink_make_room(Sink *sink, size_t n);
+
+// Append buf[0:n].  Big writes to an empty buffer skip the copy, and big
+// writes to a buffer with something in it are flushed with it by writev().
+extern void sink_write(Sink *sink, const char *buf, size_t n);
+
+static inline void sink_putc(Sink *sink, char c)
+{
+        if (sink->len == sink->alloced)
+                sink_make_room(sink, 1);
+        sink->buf[sink->len++] = c;
+}
+
+extern void sink_puts(Sink *sink, const char *zstr);
+
+// Write out what's buffered (if the sink has a file descriptor).
+extern void sink_flush(Sink *sink);
+
+// Return the output of a memory sink, NUL terminated, with its length in
+// `*len`, and leave the sink empty.  The caller owns the result.
+extern char *sink_take(Sink *sink, size_t *len);
+
+// Flush and free `sink`.  Returns the number of errors (zero or one), after
+// reporting any to error_stream().
+extern int sink_close(Sink *sink);
+
+// A stdio stream, `file`, whose output goes to `sink`, with each line starting
+// with `ztag`, so that what's printed to a FILE (by the actions, say) can be
+// tagged without the printer knowing.  Open the sink before tagger_open(), and
+// set `ztag`, which can change between lines.
+typedef struct {
+        Sink sink;
+        const char *ztag;
+        FILE *file;
+        bool midline;
+        bool unbuffered;
+} Tagger;
+
+// Open t->file.  If `unbuffered`, each write to it is flushed through the sink
+// straight away, as errors should be.
+extern void tagger_open(Tagger *t, bool unbuffered);
+
+// Pass on all that has been written to t->file, and end its last line if it
+// didn't.
+extern void tagger_end_line(Tagger *t);
+
+// Close t->file and the sink.  Returns the number of errors writing.
+extern int tagger_close(Tagger *t);
+
+#endif // SINK_2026_10_16_H
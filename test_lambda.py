@@ -1,10 +1,15 @@
 #!/usr/bin/env -S -i python3
 
+import contextlib
 import re
 import os
 import pytest
+import signal
+import socket
+import struct
 import subprocess
 import sys
+import time
 from collections import namedtuple
 
 def use_valgrind():
@@ -93,9 +98,9 @@ def stderr_lines(text):
                 yield line
 
 
-def run_lambda(input, faults_to_inject=(), args=None):
+def run_lambda(input, faults_to_inject=(), args=None, files=()):
         env = dict()
-        cmd = config.command + args_from(args)
+        cmd = config.command + args_from(args) + [str(f) for f in files]
         if faults_to_inject:
                 for fault in faults_to_inject:
                         assert ',' not in fault
@@ -142,6 +147,79 @@ def test_big_error():
 def test_read_error():
         assert X.err() == run_lambda('bang! an EIO',
                 faults_to_inject={'unreadable-bangs'}).match_err('Error reading.*')
+        # A batch reads the whole of STDIN first, rather than parsing it as
+        # it arrives.
+        assert X.err() == run_lambda('bang! an EIO', args=dict(batch=True),
+                                     faults_to_inject={'unreadable-bangs'})\
+                .match_err('Error reading STDIN: Input/output error')
+
+def test_file_is_parsed_in_place(tmp_path):
+        # The source ends a page with a variable, so reading past it faults.
+        path = tmp_path / 'prog.lam'
+        path.write_text(' ' * (4096 - 5) + 'x y z')
+        assert X.ok('((x y) z)') == run_lambda('', args=dict(file=path))
+        path.write_text('')
+        assert X.read('') == run_lambda('', args=dict(TEST_SOURCE_READ,
+                                                      file=path))
+
+def test_file_errors(tmp_path):
+        path = tmp_path / 'prog.lam'
+        assert X.err() == run_lambda('', args=dict(file=path))\
+                .match_err('Error reading .*prog.lam: No such file.*')
+        path.write_text('x 0')
+        assert X.err() == run_lambda('', args=dict(file=path))\
+                .match_err('.*prog.lam:2: Syntax error: 0 is an invalid.*')
+        # sysfs says its files have a size, but won't map them.
+        sysfs = '/sys/devices/system/cpu/online'
+        if os.path.exists(sysfs):
+                assert X.err() == run_lambda('', args=dict(file=sysfs))\
+                        .match_err('Error reading %s: No such device' % sysfs)
+
+def test_file_can_be_a_pipe(tmp_path):
+        # STDIN is a pipe here, which has no size, so it's read, not mapped.
+        pipe = dict(file='/dev/stdin')
+        assert X.ok('((x y) z)') == run_lambda('x y z', args=pipe)
+        assert X.read('little') == run_lambda('little',
+                                              args=dict(TEST_SOURCE_READ,
+                                                        **pipe))
+        assert X.err() == run_lambda('bang! an EIO', args=pipe,
+                                     faults_to_inject={'unreadable-bangs'})\
+                .match_err('Error reading /dev/stdin: Input/output error')
+        assert X.err() == run_lambda('', args=dict(file=tmp_path))\
+                .match_err('Error reading .*: Is a directory')
+
+def test_file_parses_as_stdin_does(tmp_path):
+        src = big_src_with_lambdas(8192)
+        path = tmp_path / 'prog.lam'
+        path.write_text(src)
+        for n in ['1', '2']:
+                assert run_lambda(src, args=dict(threads=n)) == \
+                        run_lambda('', args=dict(file=path, threads=n))
+
+@pytest.mark.parametrize('src', [
+        '[x]x', '[ x ]( x\t y )', 'f (x y)\n z', '[x][y][z]1 2 3', '[x y',
+        '[  a[  ]y', '[xy', 'ab cd', '12 3', ')(', '(x', '[]  ', '[x] )',
+])
+def test_source_is_parsed_as_it_arrives(src):
+        # With a byte per read, the parser stops for more after every token.
+        assert run_lambda(src) == \
+                run_lambda(src, faults_to_inject={'tiny-reads'})
+
+def test_big_source_is_parsed_as_it_arrives(tmp_path):
+        src = big_src_with_lambdas(4096)
+        args = dict(threads='1')
+        assert run_lambda_on_file(tmp_path, src, args) == \
+                run_lambda(src, faults_to_inject={'tiny-reads'}, args=args)
+
+@pytest.mark.parametrize('fault', ['no-avx2', 'no-simd'])
+def test_scan_kernels_agree(fault):
+        # The SSE2 and plain kernels see the same whitespace as AVX2 does.
+        words = big_src_with_lambdas(1024).split(' ')
+        src = ''.join(w + ' \t\n  '[k % 5] for k, w in enumerate(words))
+        for s in [src, src[:len(src) // 2] + ')' + src[len(src) // 2:]]:
+                assert run_lambda(s, args=dict(threads='1')) == \
+                        run_lambda(s, faults_to_inject={fault},
+                                   args=dict(threads='1'))
 
 def test_trivial_program():
         assert X.ok('x') == run_lambda('x')
@@ -173,6 +251,9 @@ def EXPECTED_EXPR_MSG():
 def EXPECTED_LAMBDA_BODY_MSG():
         return"Expected lambda body"
 
+def UNEXPECTED_MSG(c):
+        return "Unexpected '{}'".format(c)
+
 def test_parse_error_unmatched_paren():
         assert X.err(FILENAME(), 0, UNMATCHED_MSG('(')) == \
                 run_lambda('(x').parse_err()
@@ -191,6 +272,62 @@ def test_scan_after_expected_expr_error():
                 X.err(FILENAME(), 1, UNMATCHED_MSG(')')),
         ]
 
+@pytest.mark.parametrize('src,at', [('x )', 2), ('[x]x]', 4), ('(x) y#', 5)])
+def test_parse_error_stray_bytes_after_program(src, at):
+        assert X.err(FILENAME(), at, UNEXPECTED_MSG(src[at])) == \
+                run_lambda(src).parse_err()
+
+def test_parse_errors_arent_scanned_twice():
+        # The parser doesn't go back over the source after an error, so it
+        # reports each error once, and not those of what enclosed it.
+        assert run_lambda('[xy').parse_errs() == [
+                X.err(FILENAME(), 1, MULTIBYTE_VAR_MSG('xy')),
+                X.err(FILENAME(), 0, "Lambda '[xy' doesn't end in ']'"),
+                X.err(FILENAME(), 3, EXPECTED_LAMBDA_BODY_MSG()),
+        ]
+        assert run_lambda('f ([x] )').parse_errs() == [
+                X.err(FILENAME(), 6, EXPECTED_LAMBDA_BODY_MSG()),
+        ]
+
+DEEP = 10**5
+
+@pytest.mark.parametrize('src,xout,action', [
+        ('(' * DEEP + 'x' + ')' * DEEP, 'x', 'unparse'),
+        ('(' * DEEP + 'x' + ')' * DEEP, 'X', 'type'),
+        ('f (' * DEEP + 'x' + ')' * DEEP, '(f ' * DEEP + 'x' + ')' * DEEP,
+         'unparse'),
+        ('f' + ' x' * DEEP, '(' * DEEP + 'f' + ' x)' * DEEP, 'unparse'),
+        ('[x]' * DEEP + 'x', '[]' * DEEP + '1', 'unparse'),
+], ids=['parens', 'parens-type', 'right-calls', 'left-calls', 'lambdas'])
+def test_deep_programs_dont_overflow_the_stack(src, xout, action):
+        assert X.ok(xout) == run_lambda(src, args={action: True})
+
+def test_big_output_arrives_whole():
+        # The types of a chain of n calls add up to over a megabyte, more than
+        # the output buffer holds.
+        n = 150
+        def fun_type(k):
+                if k == n:
+                        return 'F' + 'r' * n
+                return 'F%s=(X %s)' % ('r' * k, fun_type(k + 1))
+        lines = [fun_type(0)]
+        for k in range(1, n + 1):
+                lines += ['X', fun_type(k)]
+        assert X.ok('\n'.join(lines)) == \
+                run_lambda('f' + ' x' * n, args={'type': True})
+
+@pytest.mark.parametrize('action', ['unparse', 'type'])
+def test_write_error(action):
+        with open('/dev/full', 'w') as full:
+                cp = subprocess.run(config.command + ['--' + action],
+                                    input='x y', stdout=full,
+                                    stderr=subprocess.PIPE,
+                                    text=True,
+                                    timeout=config.seconds_per_command)
+        assert 1 == cp.returncode
+        assert ['Error writing output: No space left on device'] == \
+                list(stderr_lines(cp.stderr))
+
 def test_explicit_act_unparse():
         assert X.ok('x') == run_lambda('x', args={"unparse":True})
 
@@ -267,6 +404,136 @@ def test_deepish_recursive_type():
         assert A.T == "(B Ar={})".format(Ar.T.replace("=(B Ar)", ""))
         assert _A == A
 
+def test_type_unified_late_is_named_by_first_occurrence():
+        # The subtrees' types are only unified at the root, whichever of them
+        # ends up representing the rest.
+        src = 't (t (t d c) (t b a)) (t (t h g) (t f e))'
+        names = {t.N for t in types(src)}
+        assert names == {'T', 'Tr', 'D'}
+
+def big_src_with_lambdas(nleaves):
+        # Big enough to be parsed, typed or printed in parallel, with variables
+        # shared between the threads' chunks, lambdas (some binding variables
+        # across big subtrees), calls that span the chunks, and long runs of
+        # args.
+        vars = 'abcdefghij'
+        leaves = ['[q]%s' % vars[k % 7] if k % 5 == 0 else vars[k % 10]
+                  for k in range(nleaves)]
+        depth = 0
+        while len(leaves) > 1:
+                depth += 1
+                v = vars[depth % 10]
+                leaves = ['[%s](t %s %s)' % (v, l, r) if k % 3 == 0
+                          else '(t %s %s)' % (l, r)
+                          for k, (l, r) in enumerate(zip(leaves[::2],
+                                                         leaves[1::2]))]
+        run = ' '.join('(g %s)' % vars[k % 10] for k in range(nleaves))
+        return '[x](f x (%s) y z %s x)' % (leaves[0], run)
+
+def big_src_without_bound_vars(nleaves):
+        # Like big_src_with_lambdas(), but programs with bound variables are
+        # typed serially, so none of this one's lambdas use their param.
+        vars = 'abcdefghij'
+        leaves = ['[q]%s' % vars[k % 7] if k % 5 == 0 else vars[k % 10]
+                  for k in range(nleaves)]
+        while len(leaves) > 1:
+                leaves = ['(t %s %s)' % (l, r) if k % 3 else '(%s %s)' % (l, r)
+                          for k, (l, r) in enumerate(zip(leaves[::2],
+                                                         leaves[1::2]))]
+        run = ' '.join('(g %s)' % vars[k % 10] for k in range(nleaves))
+        return 'f (%s) y z %s' % (leaves[0], run)
+
+def run_lambda_on_file(tmp_path, src, args):
+        # A pipe on STDIN is parsed as it arrives, but a file in parallel.
+        path = tmp_path / 'prog.lam'
+        path.write_text(src)
+        r = run_lambda('', args=dict(args, file=path))
+        if r.err:
+                return R(err=[l.replace(str(path), FILENAME()) for l in r.err])
+        return r
+
+@pytest.mark.parametrize('action', [dict(type=True), dict(type='compact'),
+                                    dict(unparse=True)])
+def test_threads_change_nothing(action, tmp_path):
+        src = big_src_with_lambdas(8192)
+        serial = run_lambda(src, args=dict(action, threads='1'))
+        for n in ['2', '3', '4']:
+                args = dict(action, threads=n)
+                assert serial == run_lambda(src, args=args)
+                assert serial == run_lambda_on_file(tmp_path, src, args)
+
+def test_short_writes_change_nothing(tmp_path):
+        # Printed in parallel, a term is written in one go, here a megabyte
+        # and more, while a type is written a line at a time.
+        for src, action in [('p' + ' x' * 300000, dict(unparse=True)),
+                            (big_src_with_lambdas(8192), dict(type=True))]:
+                args = dict(action, threads='2')
+                assert run_lambda(src, args=args) == \
+                        run_lambda(src, args=args,
+                                   faults_to_inject={'short-writes'})
+
+@pytest.mark.parametrize('action', [dict(type=True), dict(type='compact')])
+def test_threads_change_no_types(action, tmp_path):
+        src = big_src_without_bound_vars(8192)
+        serial = run_lambda(src, args=dict(action, threads='1'))
+        assert serial.out
+        for n in ['2', '3', '4']:
+                args = dict(action, threads=n)
+                assert serial == run_lambda(src, args=args)
+                assert serial == run_lambda_on_file(tmp_path, src, args)
+
+def test_threads_change_no_syntax_errors(tmp_path):
+        src = big_src_with_lambdas(8192)
+        for bad in ['ab', ')', '[x', '0']:
+                at = len(src) // 3
+                bad_src = src[:at] + ' ' + bad + ' ' + src[at:]
+                serial = run_lambda(bad_src, args=dict(threads='1'))
+                assert serial.err
+                for n in ['2', '4']:
+                        args = dict(threads=n)
+                        assert serial == run_lambda(bad_src, args=args)
+                        assert serial == \
+                                run_lambda_on_file(tmp_path, bad_src, args)
+
+def test_threads_parse_a_paren_across_a_whole_chunk(tmp_path):
+        # It opens near the end of the first of three chunks, and closes in
+        # the third.
+        src = 'p' + ' x' * 8200 + ' (q' + ' y' * 13300 + ') ' + ' z' * 4000
+        assert run_lambda(src, args=dict(threads='1')) == \
+                run_lambda_on_file(tmp_path, src, dict(threads='3'))
+
+def test_threads_give_up_on_the_holes_after_a_syntax_error(tmp_path):
+        # The parser stops at the '!', short of the parens after it.
+        src = 'p' + ' x' * 3000 + ' (q' + ' y' * 3000 + ') ! (r' + \
+                ' y' * 3000 + ') (s' + ' z' * 8000 + ')'
+        serial = run_lambda(src, args=dict(threads='1'))
+        assert serial.err
+        assert serial == run_lambda_on_file(tmp_path, src, dict(threads='2'))
+
+def test_type_bound_var_apart_from_free_vars():
+        # The lambda is typed the same whichever free variable follows it.
+        for v, V in [('a', 'A'), ('b', 'B')]:
+                assert X.ok('1\nX\nXf=[X](X 1)\nX\n1') == \
+                        run_lambda('[x]x ' + v, args=dict(type=True))
+                full = ['1=(%s 1r)' % V, V, '1r', 'X', 'Xf=[X](X 1r)']
+                assert X.ok('\n'.join(full)) == \
+                        run_lambda('[x](x %s)' % v, args=dict(type=True))
+
+def test_type_compact_expands_each_fun_type_once():
+        A = 'A=(B Ar=(Ar Arr=(C Arrr)))'
+        full = [A, 'B', 'Ar=(Ar Arr=(C Arrr))', A, 'B',
+                'Ar=(Ar Arr=(C Arrr))', 'Arr=(C Arrr)', 'C', 'Arrr']
+        compact = [A, 'B', 'Ar', 'A', 'B', 'Ar', 'Arr', 'C', 'Arrr']
+        src = '(a b) (a b) c'
+        assert X.ok('\n'.join(full)) == run_lambda(src, args=dict(type=True))
+        assert X.ok('\n'.join(compact)) == \
+                run_lambda(src, args=dict(type='compact'))
+        F = 'F=(Xf=[X](X Z) Fr)'
+        assert X.ok('\n'.join([F, 'Z', 'X', 'Xf', 'Fr'])) == \
+                run_lambda('f [x]z', args=dict(type='compact'))
+        assert X.err() == run_lambda('x', args=dict(type='short'))\
+                .match_err("--type: unknown format 'short'")
+
 def test_deeper_recursive_type():
         A, B, Ar, C, Arr, D, Arrr, _A, Arrrr = types("((((a b) c) d) a)")
 
@@ -490,3 +757,1058 @@ def test_bound_vars_nest_correctly():
         src = '[x][y](x y)'
         assert X.ok('[][](2 1)') == run_lambda(src)
 
+@pytest.mark.parametrize('src', [
+        'f (x y) (x y)',
+        'n (a x) (y a) (y b) (b x)',
+        '((((a b) c) d) a) ((((a b) c) d) a)',
+        '[x]z [x]z',
+        '[y]x [y]x',
+        '[r](b y) [x]y',
+        '[x][x]z [x][x]z',
+        'g (x [y]z) (x [y]z) (x [y]z) [p](q q)',
+        '[x](x x) [y]([z]z y)',
+        '[x][y](y x) ([x][y](y x) a)',
+])
+def test_hash_cons_changes_nothing(src):
+        for action in [dict(unparse=True), dict(type=True)]:
+                shared = dict(action, hash_cons=True)
+                assert run_lambda(src, args=action) == \
+                        run_lambda(src, args=shared)
+
+
+def evaluate(src, **kwargs):
+        args = dict(eval=True)
+        args.update(kwargs)
+        return run_lambda(src, args=args)
+
+def test_eval_free_var_is_normal():
+        assert X.ok('((x y) z)') == evaluate('x y z')
+
+def test_eval_identity():
+        assert X.ok('y') == evaluate('[x]x y')
+
+def test_eval_reduces_leftmost_outermost_first():
+        # Normal order never evaluates the discarded argument.
+        assert X.ok('a') == evaluate('[x][y]x a ([x](x x) [x](x x))')
+
+def test_eval_under_lambda_shifts_free_indices():
+        assert X.ok('[][](2 1)') == evaluate('[y]([x][y](x y) y)')
+
+def test_eval_s_combinator():
+        assert X.ok('[][][]((3 1) (2 1))') == \
+                evaluate('[a][b]([x][y][z](x z (y z)) a b)')
+
+def test_eval_fixes_arg_sizes_of_enclosing_calls():
+        assert X.ok('((q y) (z [](1 1)))') == \
+                evaluate('q ([x]x y) (z ([x][w](w w) q))')
+
+def test_eval_church_arithmetic():
+        two = '[f][x](f (f x))'
+        assert X.ok('[][](2 (2 (2 (2 1))))') == evaluate(two + ' ' + two)
+
+def test_eval_gives_up_after_max_steps():
+        omega = '[x](x x) [x](x x)'
+        assert X.err() == evaluate(omega, max_steps=1000)\
+                .match_err('Evaluation error: no normal form within 1000 .*')
+
+def test_eval_gives_up_after_4096_steps_by_default():
+        # Far fewer than the machines take: every step copies the whole term.
+        omega = '[x](x x) [x](x x)'
+        assert X.err() == evaluate(omega)\
+                .match_err('Evaluation error: no normal form within 4096 .*')
+
+def test_eval_gives_up_at_max_bytes():
+        growing = '[x](x x) [x](x x x)'
+        assert X.err() == evaluate(growing, max_bytes=100000)\
+                .match_err('Evaluation error: out of memory.*')
+
+def test_eval_gives_up_at_any_byte():
+        # Whichever of a step's allocations it is that doesn't fit.
+        src = '[x](x x) ([y]y z)'
+        n = least_budget(src, 'max_bytes', eval=True)
+        assert evaluate(src) == evaluate(src, max_bytes=str(n))
+        for k in range(2, n, 4):
+                assert X.err() == evaluate(src, max_bytes=str(k))\
+                        .match_err('Evaluation error: out of memory .*')
+
+def test_eval_gives_up_on_a_reduct_too_big_to_index():
+        # A step that would copy a 100000-node argument 50000 times.
+        src = '[x](%s) (p%s)' % (' '.join('x' * 50000), ' q' * 50000)
+        assert X.err() == evaluate(src)\
+                .match_err('Evaluation error: out of memory .* 0 steps.')
+
+def test_eval_budget_must_be_a_positive_number():
+        assert X.err() == evaluate('x', max_steps='lots')\
+                .match_err('--max-steps needs a positive integer.*')
+
+@pytest.fixture(params=['subst', 'lazy', 'vm', 'jit', 'net'])
+def engine(request):
+        return request.param
+
+EVAL_SOURCES = [
+        'x y z',
+        '[x][y]x a ([x](x x) [x](x x))',
+        '[y]([x][y](x y) y)',
+        '[a][b]([x][y][z](x z (y z)) a b)',
+        'q ([x]x y) (z ([x][w](w w) q))',
+        '[f][x](f (f (f x))) [f][x](f (f x))',
+        '[x][y](x [z](z y)) [q](q q)',
+        '[f][x](f (f x)) [f][x](f (f x)) [b](p b b) z',
+        # Deep enough that the JIT looks variables up in a loop.
+        '[a][b][c][d][e][f][g][h][i][j](a j a) p q r s t u v w x y',
+]
+
+@pytest.mark.parametrize('src', EVAL_SOURCES)
+def test_eval_engines_agree(engine, src):
+        assert evaluate(src) == evaluate(src, eval=engine)
+
+MACHINE_ACTIONS = [dict(eval='lazy'), dict(eval='vm'), dict(eval='jit'),
+                   dict(normalize=True), dict(church=True)]
+
+@pytest.mark.parametrize('action', MACHINE_ACTIONS)
+@pytest.mark.parametrize('src', ['1', 'x 1', '[x](x 2)', '[x]2',
+                                 '[a][b](b a) 1 [z]z', '[x][y](3 x 1 y 2)'])
+def test_eval_machine_leaves_free_indices_free(action, src):
+        # As substitution does, whatever the depth they are read back at.
+        assert evaluate(src) == run_lambda(src, args=action)
+
+@pytest.mark.parametrize('action', MACHINE_ACTIONS)
+def test_eval_machine_binds_free_indices_within_budget(action):
+        assert X.err() == run_lambda('x 1', args=dict(action, max_bytes='1'))\
+                .match_err('Evaluation error: out of memory.*')
+
+def test_eval_jit_matches_reference_unparse():
+        plus = '[m][n][f][x](m f (n f x))'
+        two = '[f][x](f (f x))'
+        src = '%s %s (%s %s %s)' % (plus, two, plus, two, two)
+        reference = evaluate(src).out
+        assert run_lambda(reference) == evaluate(src, eval='jit')
+
+@pytest.mark.parametrize('src', EVAL_SOURCES)
+def test_eval_jit_slow_paths_agree(src):
+        # As if every guard found the budget short.
+        assert evaluate(src) == run_lambda(src, faults_to_inject={'slow-paths'},
+                                           args=dict(eval='jit'))
+
+@pytest.mark.parametrize('faults', [(), ('slow-paths',)])
+@pytest.mark.parametrize('src', ['1', 'x 1', '[x](x 2)', '[x](x 2) y',
+                                 # As deep as the JIT unrolls lookups.
+                                 '[a][b][c][d][e][f][g][h](a 9 h) p'])
+def test_eval_jit_free_indices(faults, src):
+        assert evaluate(src) == run_lambda(src, faults_to_inject=faults,
+                                           args=dict(eval='jit'))
+
+def test_eval_jit_slow_paths_run_out_like_vm():
+        # Each instruction's slow path checks the budget as the interpreter
+        # would, so the JIT gives up at the same steps.
+        for src, nsteps in [('[x][y](x [z](z y)) [q](q q)', 26),
+                            ('q ([x]x y) (z ([x][w](w w) q))', 43)]:
+                for n in range(1, nsteps + 1):
+                        args = dict(eval='jit', max_steps=str(n))
+                        assert evaluate(src, eval='vm', max_steps=str(n)) == \
+                                run_lambda(src, args=args,
+                                           faults_to_inject={'slow-paths'})
+
+def test_eval_unknown_engine():
+        assert X.err() == evaluate('x', eval='magic')\
+                .match_err("--eval: unknown engine 'magic'")
+
+@pytest.mark.parametrize('machine', ['lazy', 'vm', 'jit'])
+def test_eval_machine_gives_up(machine):
+        omega = '[x](x x) [x](x x)'
+        assert X.err() == evaluate(omega, eval=machine, max_steps=1000)\
+                .match_err('Evaluation error: no normal form within 1000 .*')
+        assert X.err() == evaluate(omega, eval=machine, max_bytes=100000)\
+                .match_err('Evaluation error: out of memory.*')
+
+@pytest.mark.parametrize('machine', ['lazy', 'vm', 'jit'])
+def test_eval_machine_gives_up_reading_back(machine):
+        # Y f has a weak head normal form at every depth, but no normal form.
+        yf = '[f]([x](f (x x)) [x](f (x x))) g'
+        assert X.err() == evaluate(yf, eval=machine, max_steps=1000)\
+                .match_err('Evaluation error: no normal form within 1000 .*')
+        assert X.err() == evaluate(yf, eval=machine, max_bytes=100000)\
+                .match_err('Evaluation error: out of memory.*')
+
+@pytest.mark.parametrize('machine', ['lazy', 'vm'])
+@pytest.mark.parametrize('src', [
+        '[x](p x x) ([y]y [z]z)',
+        # Reading back the last call needs more frames than the rest did.
+        'p' + ' (q%s)' % (' x' * 300) * 8 + ' ([y](r%s) x)' % (' y' * 700),
+        # Its arguments are all pushed before any is read back.
+        'p' + ' x' * 3000,
+])
+def test_eval_machine_gives_up_at_the_last_step_or_byte(machine, src):
+        # Whatever runs out first, the normal form is printed or nothing is.
+        full = evaluate(src, eval=machine)
+        assert evaluate(src) == full
+        for budget in ['max_steps', 'max_bytes']:
+                n = least_budget(src, budget, eval=machine)
+                assert full == evaluate(src, eval=machine, **{budget: str(n)})
+                for less in [n - 1] + [n * k // 8 for k in range(1, 8)]:
+                        assert X.err() == evaluate(src, eval=machine,
+                                                   **{budget: str(less)})\
+                                .match_err('Evaluation error: .*')
+
+@pytest.mark.parametrize('threads', ['1', '4'])
+def test_eval_net_threads_agree(threads):
+        three = '[f][x](f (f (f x)))'
+        mult = '[m][n][f](m (n f))'
+        src = 't (%s %s %s) (%s %s)' % (mult, three, three, three, three)
+        assert evaluate(src) == evaluate(src, eval='net', threads=threads)
+        many = 't' + ' ([x](x x) a)' * 100
+        assert evaluate(many) == evaluate(many, eval='net', threads=threads)
+
+def test_eval_net_gives_up():
+        omega = '[x](x x) [x](x x)'
+        assert X.err() == evaluate(omega, eval='net', max_steps=1000)\
+                .match_err('Evaluation error: no normal form within 1000 .*')
+        # The net for 2^20 is small, but reading it back is not.
+        two = '[f][x](f (f x))'
+        twenty = '[f][x]' + '(f ' * 20 + 'x' + ')' * 20
+        src = '[m][n](n m) %s %s g y' % (two, twenty)
+        assert X.err() == evaluate(src, eval='net', max_steps=1000)\
+                .match_err('Evaluation error: no normal form within 1000 .*')
+        assert X.err() == evaluate(src, eval='net', max_bytes=100000)\
+                .match_err('Evaluation error: out of memory.*')
+        assert X.err() == evaluate(src, eval='net', max_steps=10)\
+                .match_err('Evaluation error: no normal form within 10 .*')
+        assert X.err() == evaluate(src, eval='net', max_bytes=1000)\
+                .match_err('Evaluation error: out of memory.*')
+        # Copying a thousand lambdas takes more room than that.
+        copy = '[x](p x x) (%sq)' % ('[y]' * 1000)
+        assert X.err() == evaluate(copy, eval='net', max_bytes=100000)\
+                .match_err('Evaluation error: out of memory.*')
+
+@pytest.mark.parametrize('threads', ['1', '4'])
+@pytest.mark.parametrize('src', [
+        '[x](x x) [x](x x)',
+        # Small to reduce, but the normal form is huge and deep.
+        '([x](x x) (([f][x](f (f (f x))) [m][n][f][x](m f (n f x))) '
+        '[m][n][f](m (n f))))',
+])
+def test_eval_net_stops_within_its_budget(threads, src):
+        # Every interaction counts, and reading back takes what is left,
+        # so the time taken is bounded by the steps allowed.
+        assert X.err() == evaluate(src, eval='net', threads=threads,
+                                   max_steps='1000000')\
+                .match_err('Evaluation error: no normal form within 1000000 .*')
+
+@pytest.mark.parametrize('src', ['1', 'x 1', '[x](x 2)', '[x]2',
+                                 '[a][b](b a) 1 [z]z', '[x][y](3 x 1 y 2)',
+                                 '[x](x x) [y](y 2)'])
+def test_eval_net_leaves_free_indices_free(src):
+        assert evaluate(src) == evaluate(src, eval='net')
+
+@pytest.mark.parametrize('src', [
+        '[x](x (x x [z]z) x) [y](y (c c) y)',
+        # Read-back reaches an erased term.
+        '[x](x x x [z]c) [y]([w][v](w (w v)) [w][v](w (w v)))',
+        # Read-back enters a copy that no path it took asked for.
+        '[x](x [z][u](z (z u)) x) [y]([w][v]v (y y d) [w](w w))',
+])
+def test_eval_net_can_lose_track(src):
+        # Without Lamping's oracle, copies of a shared function that are
+        # applied to each other can be confused.
+        assert X.err() == evaluate(src, eval='net')\
+                .match_err('Evaluation error: lost track of the term .*')
+        # However far it gets, and on however many threads, it never prints
+        # a wrong normal form.
+        for threads in ['1', '4']:
+                for n in range(1, 101):
+                        assert X.err() == evaluate(src, eval='net',
+                                                   threads=threads,
+                                                   max_steps=str(n))\
+                                .match_err('Evaluation error: (?:lost track|'
+                                           'no normal form) .*')
+
+def test_eval_threads_must_be_a_positive_number():
+        assert X.err() == evaluate('x', eval='net', threads='all')\
+                .match_err('--threads needs a positive integer.*')
+
+def normalize(src, **kwargs):
+        args = dict(normalize=True)
+        args.update(kwargs)
+        return run_lambda(src, args=args)
+
+@pytest.mark.parametrize('src', EVAL_SOURCES + [
+        # Shared arguments are evaluated once, and then quoted twice.
+        '[x](p x x) ([y]y [z]z)',
+        '[f]([x](f (x x)) [x](f (x x))) [g][n](n q) [y]y',
+])
+def test_normalize_agrees_with_eval(src):
+        assert evaluate(src) == normalize(src)
+
+def test_normalize_gives_up():
+        omega = '[x](x x) [x](x x)'
+        assert X.err() == normalize(omega, max_steps=1000)\
+                .match_err('Evaluation error: no normal form within 1000 .*')
+        curried = '[a][b][c]a p q r'
+        assert X.err() == normalize(curried, max_steps=2)\
+                .match_err('Evaluation error: no normal form within 2 .*')
+        growing = '[x](x x) [x](x x x)'
+        assert X.err() == normalize(growing, max_bytes=100000)\
+                .match_err('Evaluation error: out of memory.*')
+        yf = '[f]([x](f (x x)) [x](f (x x))) g'
+        assert X.err() == normalize(yf, max_steps=1000)\
+                .match_err('Evaluation error: no normal form within 1000 .*')
+        assert X.err() == normalize(yf, max_bytes=100000)\
+                .match_err('Evaluation error: out of memory.*')
+
+def least_budget(src, budget, **action):
+        # The least max_steps or max_bytes that src normalizes within.
+        lo, hi = 0, 1 << 30
+        while hi - lo > 1:
+                mid = (lo + hi) // 2
+                args = dict(action or dict(normalize=True),
+                            **{budget: str(mid)})
+                if run_lambda(src, args=args).out:
+                        hi = mid
+                else:
+                        lo = mid
+        return hi
+
+@pytest.mark.parametrize('src', [
+        '[x](p x x) ([y]y [z]z)',
+        '[f]([x](f (x x)) [x](f (x x))) [g][n](n q) [y]y',
+        # Reading back the last call needs more frames than the rest did.
+        'p' + ' (q%s)' % (' x' * 300) * 8 + ' ([y](r%s) x)' % (' y' * 700),
+])
+def test_normalize_gives_up_at_the_last_step_or_byte(src):
+        # Whatever runs out first, the normal form is printed or nothing is.
+        full = normalize(src)
+        n = least_budget(src, 'max_steps')
+        assert full == normalize(src, max_steps=str(n))
+        if n > 1:
+                assert X.err() == normalize(src, max_steps=str(n - 1))\
+                        .match_err('Evaluation error: no normal form within '
+                                   '%d .*' % (n - 1))
+        n = least_budget(src, 'max_bytes')
+        assert full == normalize(src, max_bytes=str(n))
+        assert X.err() == normalize(src, max_bytes=str(n - 1))\
+                .match_err('Evaluation error: out of memory.*')
+
+def church(n):
+        return '[f][x]' + '(f ' * n + 'x' + ')' * n
+
+SUCC = '[n][f][x](f (n f x))'
+PLUS = '[m][n][f][x](m f (n f x))'
+MULT = '[m][n][f](m (n f))'
+EXP = '[m][n](n m)'
+ISZERO = '[n](n [x][a][b]b [a][b]a)'
+TRUE, FALSE = '[a][b]a', '[a][b]b'
+NOT, AND, OR = '[p][a][b](p b a)', '[p][q](p q p)', '[p][q](p p q)'
+
+def church_normalize(src, **kwargs):
+        args = dict(church=True)
+        args.update(kwargs)
+        return run_lambda(src, args=args)
+
+@pytest.mark.parametrize('src', EVAL_SOURCES + [
+        '%s (%s %s %s)' % (SUCC, MULT, church(3), church(4)),
+        '%s %s %s g y' % (EXP, church(2), church(5)),
+        '%s a %s' % (PLUS, church(2)),
+        '%s [x][y]x (%s %s)' % (EXP, SUCC, church(1)),
+        '%s %s %s' % (EXP, church(3), church(0)),
+        '%s %s ([x](x x) [x](x x))' % (MULT, church(0)),
+        '%s (%s %s)' % (ISZERO, PLUS, church(0)),
+        '[p][q](p q p) %s %s' % (TRUE, FALSE),
+        '[p][q](p p q) (%s %s) q' % (ISZERO, church(1)),
+        '[p][a][b](p b a) (%s %s)' % (ISZERO, church(0)),
+        # Combinators applied to what they don't expect are left to the
+        # lambda.
+        '%s [z]z' % SUCC,
+        '%s y' % SUCC,
+        '%s %s y' % (PLUS, church(2)),
+        '%s y' % NOT,
+        '%s [z]z %s' % (AND, TRUE),
+        '%s [z]z' % ISZERO,
+        '%s %s (%s %s)' % (AND, TRUE, ISZERO, church(0)),
+])
+def test_church_agrees_with_normalize(src):
+        assert normalize(src) == church_normalize(src)
+
+def test_church_prints_decimal():
+        src = '%s %s (%s %s %s)' % (EXP, church(2), PLUS, church(50),
+                                    church(50))
+        assert X.ok('#1267650600228229401496703205376') == \
+                church_normalize(src, church='decimal')
+        assert X.ok('[](1 #3)') == \
+                church_normalize('[y](y (%s %s))' % (SUCC, church(2)),
+                                 church='decimal')
+        assert X.ok('#0') == church_normalize(FALSE, church='decimal')
+        assert X.ok('[][]2') == church_normalize(TRUE, church='decimal')
+
+@pytest.mark.parametrize('src, n', [
+        ('%s %s %s' % (EXP, church(0), church(3)), '0'),
+        ('%s %s %s' % (EXP, church(1), church(5)), '1'),
+        ('%s %s %s' % (EXP, church(2), church(20)), '1048576'),
+        ('%s %s (%s %s %s)' % (PLUS, church(1), EXP, church(2), church(40)),
+         '1099511627777'),
+        ('%s %s (%s %s %s)' % (PLUS, church(2), PLUS, church(1), church(1)),
+         '4'),
+        ('%s %s (%s %s)' % (OR, FALSE, ISZERO, church(2)), '0'),
+        ('%s %s' % (NOT, TRUE), '0'),
+])
+def test_church_computes_natively(src, n):
+        assert X.ok('#' + n) == church_normalize(src, church='decimal')
+
+@pytest.mark.parametrize('src', [
+        '%s %s (%s %s %s)' % (SUCC, church(2), PLUS, church(1), church(2)),
+        '%s %s (%s %s)' % (AND, TRUE, NOT, FALSE),
+        '%s (%s %s) %s' % (OR, ISZERO, church(0), FALSE),
+        '%s (%s %s %s) (%s %s %s)' % (MULT, PLUS, church(0), church(0), EXP,
+                                      church(3), church(3)),
+        '%s %s (%s %s %s)' % (EXP, church(2), MULT, church(3), church(3)),
+        '%s (%s %s)' % (ISZERO, SUCC, church(0)),
+])
+@pytest.mark.parametrize('decimal', [False, True])
+def test_church_gives_up_at_any_step(src, decimal):
+        args = dict(church='decimal') if decimal else {}
+        full = church_normalize(src, **args)
+        n = least_budget(src, 'max_steps', church=args.get('church', True))
+        assert full == church_normalize(src, max_steps=str(n), **args)
+        for k in range(1, n):
+                assert X.err() == church_normalize(src, max_steps=str(k),
+                                                   **args)\
+                        .match_err('Evaluation error: no normal form within '
+                                   '%d .*' % k)
+        n = least_budget(src, 'max_bytes', church=args.get('church', True))
+        assert full == church_normalize(src, max_bytes=str(n), **args)
+        assert X.err() == church_normalize(src, max_bytes=str(n - 1), **args)\
+                .match_err('Evaluation error: out of memory.*')
+
+BIG = '(%s %s %s)' % (EXP, church(2), church(3000))
+
+@pytest.mark.parametrize('src,decimal', [
+        ('%s (%s %s %s)' % (ISZERO, MULT, BIG, BIG), False),
+        ('%s (%s %s %s)' % (ISZERO, EXP, BIG, church(5)), False),
+        ('%s %s %s' % (MULT, BIG, BIG), True),
+])
+def test_church_runs_out_of_memory_in_arithmetic(src, decimal):
+        # 2^3000 is big enough for the last allocation to be a number's.
+        args = dict(church='decimal' if decimal else True)
+        full = church_normalize(src, **args)
+        n = least_budget(src, 'max_bytes', **args)
+        assert full == church_normalize(src, max_bytes=str(n), **args)
+        assert X.err() == church_normalize(src, max_bytes=str(n - 1), **args)\
+                .match_err('Evaluation error: out of memory.*')
+
+def test_church_gives_up():
+        three = church(3)
+        huge = '%s %s (%s %s (%s %s %s))' % (EXP, three, EXP, three, EXP,
+                                             three, three)
+        assert X.err() == church_normalize(huge, church='decimal')\
+                .match_err('Evaluation error: out of memory.*')
+        cube = '%s (%s %s %s) %s' % (MULT, MULT, church(99), church(99),
+                                     church(99))
+        big = '%s %s (%s)' % (EXP, three, cube)
+        assert X.err() == church_normalize(big, church='decimal')\
+                .match_err('Evaluation error: no normal form within .*')
+        # 3^9801 is quick to compute, but not to apply.
+        power = '%s %s (%s %s %s)' % (EXP, three, MULT, church(99),
+                                      church(99))
+        assert X.err() == church_normalize('%s g y' % power)\
+                .match_err('Evaluation error: out of memory.*')
+        # 2^20 is small, but not as a lambda.
+        two20 = '%s %s %s' % (EXP, church(2), church(20))
+        assert X.err() == church_normalize(two20, max_bytes='1000000')\
+                .match_err('Evaluation error: out of memory.*')
+        assert X.err() == church_normalize('x', max_bytes='1')\
+                .match_err('Evaluation error: out of memory .* 0 steps.')
+        assert X.err() == church_normalize('x', church='roman')\
+                .match_err("--church: unknown format 'roman'")
+
+def cached(src, cache_dir, **kwargs):
+        """Returns stdout and the cache's report on stderr."""
+        args = dict(cache=cache_dir)
+        args.update(kwargs or dict(normalize=True))
+        cp = subprocess.run(config.command + args_from(args), text=True,
+                            input=src, capture_output=True,
+                            timeout=config.seconds_per_command)
+        return cp.stdout, list(stderr_lines(cp.stderr))
+
+def hits(nhits, nmisses):
+        return ['Cache: %d hits, %d misses.' % (nhits, nmisses)]
+
+def test_cache_remembers_normal_forms(tmp_path):
+        src = '%s %s %s' % (MULT, church(3), church(4))
+        expected = normalize(src).out
+        # The whole program and (MULT 3) both miss.
+        assert (expected, hits(0, 2)) == cached(src, tmp_path)
+        for args in [dict(normalize=True), dict(eval='vm'), dict(church=True)]:
+                assert (expected, hits(1, 0)) == cached(src, tmp_path, **args)
+        # Names of params don't count.
+        renamed = src.replace('f', 'g').replace('x', 'z')
+        assert (expected, hits(1, 0)) == cached(renamed, tmp_path)
+        # Nor do closed subterms of a bigger term.
+        outer = '[y](y (%s))' % src
+        assert normalize(outer).out == cached(outer, tmp_path)[0]
+        assert (normalize(outer).out, hits(1, 0)) == cached(outer, tmp_path)
+        # Open terms and normal forms aren't looked up.
+        assert (normalize('a b').out, hits(0, 0)) == cached('a b', tmp_path)
+
+def test_cache_ignores_bad_entries(tmp_path):
+        src = '%s %s' % (SUCC, church(2))
+        cached(src, tmp_path)
+        for entry in tmp_path.iterdir():
+                entry.write_bytes(b'LNF1\x05\x01garbage')
+        assert (normalize(src).out, hits(0, 1)) == cached(src, tmp_path)
+        assert (normalize(src).out, hits(1, 0)) == cached(src, tmp_path)
+        # Numbers printed in decimal aren't stored.
+        other = '%s %s' % (SUCC, church(5))
+        assert ('#6\n', hits(0, 1)) == cached(other, tmp_path,
+                                              church='decimal')
+        assert ('#6\n', hits(0, 1)) == cached(other, tmp_path,
+                                              church='decimal')
+
+def varint(v):
+        out = b''
+        while True:
+                out += bytes([v & 0x7f | (0x80 if v >> 7 else 0)])
+                v >>= 7
+                if not v:
+                        return out
+
+def cache_entry(key, nf, nkey=None):
+        # Nodes are (type, val), with the types numbered as in AstNodeType.
+        nodes = b''.join(varint(v << 2 | t - 1) for t, v in key + nf)
+        return b'LNF1' + varint(len(key) if nkey is None else nkey) + \
+                varint(len(nf)) + nodes
+
+def read_cache_entry(data):
+        def get():
+                nonlocal data
+                v = shift = 0
+                while True:
+                        c, data = data[0], data[1:]
+                        v |= (c & 0x7f) << shift
+                        shift += 7
+                        if not c & 0x80:
+                                return v
+        assert data[:4] == b'LNF1'
+        data = data[4:]
+        nkey, nnf = get(), get()
+        nodes = []
+        for _ in range(nkey + nnf):
+                v = get()
+                nodes.append(((v & 3) + 1, v >> 2))
+        return nodes[:nkey], nodes[nkey:]
+
+VAR, CALL, LAMBDA, BOUND = 1, 2, 3, 4
+
+def test_cache_misses_on_corrupt_entries(tmp_path):
+        src = '%s %s' % (SUCC, church(2))
+        cached(src, tmp_path)
+        [entry] = tmp_path.iterdir()
+        key, nf = read_cache_entry(entry.read_bytes())
+        assert cache_entry(key, nf) == entry.read_bytes()
+        k = next(k for k, (t, v) in enumerate(key) if t == BOUND)
+        bounds = [(BOUND, 0)] * 3
+        bad = [
+                b'LNF1' + b'\xff' * 20,
+                cache_entry(key, nf)[:-1],
+                cache_entry(key, nf) + b'\0',
+                cache_entry(key, nf, nkey=len(key) + 1),
+                cache_entry(key, [(CALL, 1 << 40)]),
+                # Collisions: other terms with the same hash.
+                cache_entry(key[:k] + [(BOUND, key[k][1] + 1)] + key[k + 1:],
+                            nf),
+                cache_entry(key[:k] + [(VAR, 0)] + key[k + 1:], nf),
+                # Normal forms that aren't closed terms.
+                cache_entry(key, [(CALL, 0)]),
+                cache_entry(key, bounds + [(CALL, 2)]),
+                cache_entry(key, [(BOUND, 0), (LAMBDA, 0)]),
+                cache_entry(key, bounds + [(LAMBDA, 0)]),
+                cache_entry(key, [(BOUND, 0), (VAR, 0), (LAMBDA, 0)] * 2),
+                cache_entry(key, [(BOUND, 1), (VAR, 0), (LAMBDA, 0)]),
+        ]
+        for data in bad:
+                entry.write_bytes(data)
+                assert (normalize(src).out, hits(0, 1)) == \
+                        cached(src, tmp_path)
+                assert cache_entry(key, nf) == entry.read_bytes()
+        # If the entry can't be replaced, the temporary file is removed.
+        entry.unlink()
+        entry.mkdir()
+        assert (normalize(src).out, hits(0, 1)) == cached(src, tmp_path)
+        assert [entry] == list(tmp_path.iterdir())
+
+def test_cache_needs_a_directory(tmp_path):
+        f = tmp_path / 'file'
+        f.write_text('')
+        assert X.err() == run_lambda('x', args=dict(cache=f / 'dir'))\
+                .match_err("Can't create cache directory .*")
+
+def round_robin(src, **kwargs):
+        args = dict(round_robin=True)
+        args.update(kwargs)
+        return run_lambda(src, args=args)
+
+def test_round_robin_prints_results_as_they_finish():
+        two = '[f][x](f (f x))'
+        src = '%s %s\n\n[x]x q\n  \n' % (two, two)
+        assert X.ok('1: [][](2 (2 (2 (2 1))))\n3: q') == round_robin(src)
+        assert X.ok('3: q\n1: [][](2 (2 (2 (2 1))))') == \
+                round_robin(src, round_robin='1')
+
+def test_round_robin_budgets_each_program():
+        omega = '[x](x x) [x](x x)'
+        src = 'x\n%s\ny' % omega
+        assert X.err() == round_robin(src, max_steps=1000)\
+                .match_err('STDIN:2: Evaluation error: no normal form .*')
+        growing = '[x](x x) [x](x x x)'
+        assert X.err() == round_robin(growing, max_bytes=100000)\
+                .match_err('STDIN:1: Evaluation error: out of memory.*')
+
+def test_round_robin_goes_on_after_a_bad_program():
+        # Free de Bruijn indices are no harm, and stay free.
+        good = 'x\n1\n[a]a q\n[x](x 2) y\n\n\n[a][b](b a) 1 [z]z\n'
+        assert X(out='1: x\n2: 1\n3: q\n4: (y 1)\n7: 1\n') == \
+                round_robin(good)
+        bad = good.replace('\n\n\n', '\n(z\n[x](x x) [x](x x)\n')
+        assert round_robin(bad, max_steps=1000).err == [
+                "STDIN:5:0: Syntax error: Unmatched '('.",
+                'STDIN:6: Evaluation error: no normal form within 1000 steps.',
+        ]
+
+def test_round_robin_reports_syntax_errors_by_line():
+        assert X.err() == round_robin('x\n(y\nz')\
+                .match_err("STDIN:2:0: Syntax error: Unmatched '\\('.*")
+
+def batch(src, **kwargs):
+        args = dict(batch=True)
+        args.update(kwargs)
+        return run_lambda(src, args=args)
+
+@pytest.mark.parametrize('action', [dict(unparse=True), dict(type=True),
+                                    dict(eval='vm'), dict(church='decimal')])
+def test_batch_runs_each_line_by_itself(action):
+        progs = ['x y', '', '[f][x](f (f x))', '  ', '[x]x [f][x](f x)', 'q']
+        xout = ''
+        for line, prog in enumerate(progs, 1):
+                if prog.strip():
+                        out = run_lambda(prog, args=action).out
+                        xout += ''.join('%d: %s\n' % (line, l)
+                                        for l in out.splitlines())
+        assert X(out=xout) == batch('\n'.join(progs), **action)
+
+@pytest.mark.parametrize('action', [dict(eval=True), dict(eval='lazy'),
+                                    dict(eval='vm'), dict(eval='jit'),
+                                    dict(eval='net'), dict(normalize=True),
+                                    dict(church=True)])
+def test_batch_leaves_free_indices_free(action):
+        progs = ['x', '1', '[a]a q', '(x 2)', '[x](x 2) y',
+                 '[a][b](b a) 1 [z]z']
+        xout = ''.join('%d: %s' % (line, evaluate(prog).out)
+                       for line, prog in enumerate(progs, 1))
+        assert X(out=xout) == batch('\n'.join(progs), **action)
+
+def test_batch_goes_on_after_a_bad_program():
+        omega = '[x](x x) [x](x x)'
+        src = 'x )\n%s\n(y\nz' % omega
+        assert batch(src, eval=True, max_steps=1000).err == [
+                "STDIN:1:2: Syntax error: Unexpected ')'.",
+                'STDIN:2: Evaluation error: no normal form within 1000 steps.',
+                "STDIN:3:0: Syntax error: Unmatched '('.",
+        ]
+
+def test_batch_shares_a_cache(tmp_path):
+        src = '%s %s %s' % (MULT, church(3), church(4))
+        out = normalize(src).out
+        xout = '1: %s2: %s' % (out, out)
+        # The second line hits on what the first left.
+        assert (xout, hits(1, 2)) == cached('%s\n%s' % (src, src), tmp_path,
+                                            batch=True, normalize=True)
+        assert (xout, hits(2, 0)) == cached('%s\n%s' % (src, src), tmp_path,
+                                            batch=True, normalize=True)
+
+def test_batch_reads_a_file(tmp_path):
+        src = 'x\n[x]x\n' * 1000
+        assert batch(src) == run_lambda_on_file(tmp_path, src, dict(batch=True))
+
+def test_batch_of_blank_lines():
+        assert X(out='') == batch('\n  \n')
+
+def test_batch_is_not_round_robin():
+        assert X.err() == batch('x', round_robin=True)\
+                .match_err('--batch and --round-robin both run each line .*')
+
+def make_corpus(tmp_path, progs):
+        # Named so that the order of the names isn't the order of creation.
+        for k, prog in enumerate(progs):
+                d = tmp_path / ('d%d' % (k % 3))
+                d.mkdir(exist_ok=True)
+                (d / ('p%03d.lam' % k)).write_text(prog)
+        (tmp_path / 'd0' / '.hidden.lam').write_text('ab')
+        return sorted(str(p) for p in tmp_path.glob('d*/p*.lam'))
+
+@pytest.mark.parametrize('action', [dict(unparse=True), dict(type=True),
+                                    dict(eval='lazy')])
+def test_corpus_runs_each_file_in_order(action, tmp_path):
+        progs = ['x y', '[f][x](f (f x))', '[x]x [f][x](f x)', 'q (r s)'] * 8
+        paths = make_corpus(tmp_path, progs)
+        xout = ''
+        for path in paths:
+                out = run_lambda(open(path).read(), args=action).out
+                xout += ''.join('%s: %s\n' % (path, l)
+                                for l in out.splitlines())
+        for n in ['1', '2', '5']:
+                args = dict(action, threads=n)
+                assert X(out=xout) == \
+                        run_lambda('', args=args, files=[tmp_path])
+                assert X(out=xout) == run_lambda('', args=args, files=paths)
+
+def test_corpus_goes_on_after_a_bad_file(tmp_path):
+        omega = '[x](x x) [x](x x)'
+        paths = make_corpus(tmp_path, ['x', 'y )', omega, 'z', 'a!'])
+        # d0/p000 d0/p003 d1/p001 d1/p004 d2/p002
+        syntax, bang, omega = paths[2:]
+        missing = tmp_path / 'missing.lam'
+        r = run_lambda('', faults_to_inject={'unreadable-bangs'},
+                       args=dict(eval=True, max_steps=1000, threads='2'),
+                       files=paths + [missing])
+        assert r.err == [
+                "%s:2: Syntax error: Unexpected ')'." % syntax,
+                'Error reading %s: Input/output error' % bang,
+                '%s: Evaluation error: no normal form within 1000 steps.'
+                        % omega,
+                'Error reading %s: No such file or directory' % missing,
+        ]
+
+@pytest.mark.parametrize('machine', ['lazy', 'vm', 'jit', 'net'])
+def test_corpus_leaves_free_indices_free(machine, tmp_path):
+        paths = make_corpus(tmp_path, ['x 1', 'q', '[x](x 2)', '1 [a]a'])
+        xout = ''.join('%s: %s' % (path, evaluate(open(path).read()).out)
+                       for path in paths)
+        assert X(out=xout) == run_lambda('', args=dict(eval=machine),
+                                         files=[tmp_path])
+
+def test_corpus_follows_only_links_it_is_given(tmp_path):
+        top = tmp_path / 'c'
+        top.mkdir()
+        # A link back up the tree is left out, rather than followed round,
+        # but a link to a file is run.
+        paths = make_corpus(top, ['x y', 'q (r s)', '[x]x z'])
+        (top / 'd1' / 'up').symlink_to(tmp_path)
+        (top / 'd2' / 'p9.lam').symlink_to(paths[0])
+        paths.append(str(top / 'd2' / 'p9.lam'))
+        xout = ''.join('%s: %s' % (path, run_lambda(open(path).read()).out)
+                       for path in paths)
+        assert X(out=xout) == run_lambda('', files=[top])
+        (tmp_path / 'link').symlink_to(top)
+        assert X(out=xout.replace(str(top), str(tmp_path / 'link'))) == \
+                run_lambda('', files=[tmp_path / 'link'])
+        (tmp_path / 'empty').mkdir()
+        assert X(out='') == run_lambda('', files=[tmp_path / 'empty'])
+
+def test_corpus_is_not_a_batch(tmp_path):
+        assert X.err() == run_lambda('x', args=dict(batch=True),
+                                     files=[tmp_path])\
+                .match_err("Files to run can't be given along with .*")
+
+@contextlib.contextmanager
+def server(tmp_path, faults_to_inject=(), **kwargs):
+        path = tmp_path / 'lambda.sock'
+        env = None
+        if faults_to_inject:
+                env = dict(INJECTED_FAULTS=','.join(faults_to_inject))
+        args = dict(serve=path)
+        args.update(kwargs)
+        p = subprocess.Popen(config.command + args_from(args), env=env,
+                             stderr=subprocess.PIPE, text=True)
+        try:
+                for _ in range(100):
+                        with contextlib.suppress(OSError), connect(path):
+                                break
+                        time.sleep(0.05)
+                yield path
+        finally:
+                p.send_signal(signal.SIGTERM)
+                _, err = p.communicate(timeout=5)
+        assert not list(stderr_lines(err))
+        assert p.returncode == 0
+        assert not path.exists()
+
+def connect(path):
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.settimeout(5)
+        try:
+                sock.connect(str(path))
+        except OSError:
+                sock.close()
+                raise
+        return sock
+
+def ask(sock, opts, src):
+        req = ('%s\n%s' % (opts, src)).encode()
+        sock.sendall(struct.pack('!I', len(req)) + req)
+
+def recv_exactly(sock, n):
+        buf = b''
+        while len(buf) < n:
+                got = sock.recv(n - len(buf))
+                if not got:
+                        raise EOFError
+                buf += got
+        return buf
+
+Answer = namedtuple('Answer', ['nsyntax', 'nerr', 'out', 'err'])
+
+def answer(sock):
+        n, = struct.unpack('!I', recv_exactly(sock, 4))
+        buf = recv_exactly(sock, n)
+        nsyntax, nerr, wait, parse, run, nout = struct.unpack('!IIQQQI',
+                                                              buf[:36])
+        assert max(wait, parse, run) < 10**10
+        return Answer(nsyntax, nerr, buf[36:36 + nout].decode(),
+                      list(stderr_lines(buf[36 + nout:].decode())))
+
+def command_line_answer(opts, src):
+        args = dict(a[2:].partition('=')[::2] for a in opts.split())
+        r = run_lambda(src, args={k: v or True for k, v in args.items()})
+        if r.out is not None:
+                return Answer(0, 0, r.out, [])
+        err = [l.replace('STDIN', 'request') for l in r.err]
+        nsyntax = sum(1 for l in err if 'Syntax error' in l)
+        return Answer(nsyntax, int(not nsyntax), '', err)
+
+SERVE_REQUESTS = [
+        ('', 'x y'),
+        ('--unparse', '[f][x](f (f x))'),
+        ('--type', '[x]x [f][x](f x)'),
+        ('--type=compact --unparse', '[f][x](f (f x))'),
+        ('--eval=vm', '[x]x [f][x](f x)'),
+        ('--church=decimal', '[f][x](f (f x))'),
+        ('--hash-cons --type', '(a b) (a b)'),
+        ('--eval --max-steps=1000', '[x](x x) [x](x x)'),
+        ('--dump-bytecode --normalize', 'q (r s)'),
+        ('', 'x )'),
+        ('--type', '(y'),
+]
+
+@pytest.mark.parametrize('threads', ['1', '3'])
+def test_serve_answers_like_the_command_line(threads, tmp_path):
+        xanswers = [command_line_answer(o or '--unparse', src)
+                    for o, src in SERVE_REQUESTS]
+        with server(tmp_path, threads=threads) as path, connect(path) as sock:
+                for opts, src in SERVE_REQUESTS * 3:
+                        ask(sock, opts, src)
+                assert xanswers * 3 == [answer(sock)
+                                        for _ in SERVE_REQUESTS * 3]
+
+def test_serve_defaults_to_its_own_actions(tmp_path):
+        src = '[x]x [f][x](f x)'
+        with server(tmp_path, type='compact') as path, connect(path) as sock:
+                ask(sock, '', src)
+                assert answer(sock) == command_line_answer('--type=compact',
+                                                           src)
+                ask(sock, '--unparse', src)
+                assert answer(sock) == command_line_answer('--unparse', src)
+
+def test_serve_rejects_bad_requests(tmp_path):
+        bad = [
+                ('--threads=2', "Requests can't give option '--threads'."),
+                ('unparse', "Requests can't give option 'unparse'."),
+                ('--unparse=yes', "--unparse doesn't take an argument."),
+                ('--max-steps', '--max-steps needs an argument.'),
+                ('--max-steps=lots',
+                 "--max-steps needs a positive integer, not 'lots'"),
+                ('--eval=magic', "--eval: unknown engine 'magic'"),
+        ]
+        with server(tmp_path) as path, connect(path) as sock:
+                for opts, err in bad:
+                        ask(sock, opts, 'x')
+                        assert answer(sock) == Answer(0, 1, '', [err])
+                req = b'--unparse x'
+                sock.sendall(struct.pack('!I', len(req)) + req)
+                assert answer(sock) == Answer(
+                        0, 1, '', ['A request starts with a line of options.'])
+
+def test_serve_takes_free_indices_on_every_engine(tmp_path):
+        reqs = [('--eval=jit', '(x 2)'), ('--eval=vm', 'x 1'),
+                ('--eval=lazy', '[x](x 2) y'), ('--eval=net', '[x]2'),
+                ('--normalize', '1'), ('--church', '[a][b](b a) 1 [z]z')]
+        with server(tmp_path) as path, connect(path) as sock:
+                for opts, src in reqs:
+                        ask(sock, opts, src)
+                assert [command_line_answer(o, src) for o, src in reqs] == \
+                        [answer(sock) for _ in reqs]
+
+def test_serve_budgets_can_only_be_lowered(tmp_path):
+        omega = '[x](x x) [x](x x)'
+        growing = '[x](x x) [x](x x x)'
+        with server(tmp_path, max_steps='1000', max_bytes='100000') as path, \
+                        connect(path) as sock:
+                ask(sock, '--eval --max-steps=100000', omega)
+                assert answer(sock) == \
+                        command_line_answer('--eval --max-steps=1000', omega)
+                ask(sock, '--eval --max-steps=10', omega)
+                assert answer(sock) == \
+                        command_line_answer('--eval --max-steps=10', omega)
+                ask(sock, '--eval=vm --max-bytes=1000000', growing)
+                assert answer(sock) == command_line_answer(
+                        '--eval=vm --max-bytes=100000', growing)
+        # A server with no budget of its own has each evaluator's default.
+        with server(tmp_path) as path, connect(path) as sock:
+                # The JIT is quickest to fill its default 64MB.
+                ask(sock, '--eval=jit --max-bytes=%d' % (1 << 40), growing)
+                assert answer(sock) == command_line_answer('--eval=jit',
+                                                           growing)
+                ask(sock, '--eval --max-steps=%d' % (1 << 40), omega)
+                assert answer(sock) == command_line_answer('--eval', omega)
+
+def test_serve_many_clients_at_once(tmp_path):
+        # Tiny reads split every request over many reads.
+        with server(tmp_path, faults_to_inject={'tiny-reads'},
+                    threads='4') as path:
+                socks = [connect(path) for _ in range(20)]
+                progs = [['%s %s' % (chr(ord('a') + j), chr(ord('a') + k))
+                          for k in range(5)] for j in range(20)]
+                for k in range(5):
+                        for j, sock in enumerate(socks):
+                                ask(sock, '--eval', progs[j][k])
+                for k in range(5):
+                        for j, sock in enumerate(socks):
+                                assert answer(sock) == \
+                                        Answer(0, 0, '(%s)\n' % progs[j][k],
+                                               [])
+                for sock in socks:
+                        sock.close()
+
+def test_serve_holds_answers_for_slow_clients(tmp_path):
+        src = ' '.join(['[x](x x)'] * 10)
+        xout = run_lambda(src, args=dict(type=True)).out
+        with server(tmp_path) as path, connect(path) as sock:
+                # More requests than the server takes at once from one
+                # client, and more answers than fit in the socket's buffer.
+                for _ in range(100):
+                        ask(sock, '--type', src)
+                time.sleep(0.2)
+                for _ in range(100):
+                        assert answer(sock) == Answer(0, 0, xout, [])
+
+def test_serve_answers_after_the_client_is_done_asking(tmp_path):
+        with server(tmp_path) as path, connect(path) as sock:
+                progs = [chr(ord('a') + k) for k in range(10)]
+                for prog in progs:
+                        ask(sock, '', prog)
+                sock.shutdown(socket.SHUT_WR)
+                for prog in progs:
+                        assert answer(sock) == Answer(0, 0, prog + '\n', [])
+                assert sock.recv(1) == b''
+
+def test_serve_answers_requests_it_held_back(tmp_path):
+        # All at once, so that most wait in the server's buffer, and none
+        # come after them to wake it.
+        progs = ['%s %s' % (chr(ord('a') + k % 26), chr(ord('a') + k // 26))
+                 for k in range(300)]
+        reqs = b''
+        for prog in progs:
+                req = ('\n%s' % prog).encode()
+                reqs += struct.pack('!I', len(req)) + req
+        with server(tmp_path) as path, connect(path) as sock:
+                sock.sendall(reqs)
+                for prog in progs[:100]:
+                        assert answer(sock) == Answer(0, 0, '(%s)\n' % prog,
+                                                      [])
+                sock.shutdown(socket.SHUT_WR)
+                for prog in progs[100:]:
+                        assert answer(sock) == Answer(0, 0, '(%s)\n' % prog,
+                                                      [])
+                assert sock.recv(1) == b''
+
+def test_serve_drops_bad_connections(tmp_path):
+        with server(tmp_path, faults_to_inject={'unreadable-bangs'}) as path:
+                with connect(path) as sock:
+                        sock.sendall(struct.pack('!I', 2**31) + b'x')
+                        assert sock.recv(1) == b''
+                with connect(path) as sock:
+                        ask(sock, '', 'a!')
+                        assert sock.recv(1) == b''
+                with connect(path) as sock:
+                        # Hang up without waiting for the answers.
+                        for _ in range(50):
+                                ask(sock, '--type', '[x](x x) [y]y')
+                with connect(path) as sock:
+                        # Stop reading before the answer is written.
+                        ask(sock, '--type', '[x](x x) [y]y')
+                        sock.shutdown(socket.SHUT_RD)
+                        time.sleep(0.1)
+                with connect(path) as sock:
+                        ask(sock, '', 's h')
+                        assert answer(sock) == Answer(0, 0, '(s h)\n', [])
+
+def test_serve_stops_with_requests_left(tmp_path):
+        with server(tmp_path, threads='1', max_steps='100000') as path:
+                sock = connect(path)
+                for _ in range(3):
+                        ask(sock, '--eval --max-steps=100000',
+                            '[x](x x) [x](x x)')
+                # Once the first is answered, the others have been taken,
+                # and are left to be thrown away.
+                assert answer(sock).nerr == 1
+                time.sleep(0.05)
+        # Whatever was answered, and then nothing.
+        while sock.recv(4096):
+                pass
+        sock.close()
+
+def test_serve_replaces_a_stale_socket(tmp_path):
+        path = tmp_path / 'lambda.sock'
+        stale = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        stale.bind(str(path))
+        stale.close()
+        with server(tmp_path) as path, connect(path) as sock:
+                ask(sock, '', 'x')
+                assert answer(sock) == Answer(0, 0, 'x\n', [])
+                # But not one that is being served.
+                assert X.err() == run_lambda('', args=dict(serve=path))\
+                        .match_err("Can't serve on .*: Address already in use")
+
+def test_serve_needs_a_short_path(tmp_path):
+        path = tmp_path / ('s' * 200)
+        assert X.err() == run_lambda('', args=dict(serve=path))\
+                .match_err("--serve: '.*' is too long for a socket.")
+
+def test_serve_runs_nothing_else(tmp_path):
+        assert X.err() == run_lambda('x', args=dict(serve=tmp_path / 's',
+                                                    batch=True))\
+                .match_err("--serve can't be used along with .*")
+
+def test_round_robin_is_not_an_action():
+        assert X.err() == round_robin('x', eval=True)\
+                .match_err('--round-robin evaluates each line by itself.*')
+        assert X.err() == round_robin('x', round_robin='often')\
+                .match_err('--round-robin needs a positive integer.*')
+
+def test_dump_bytecode():
+        src = '[f](f f) [x](x y)'
+        assert X.ok('\n'.join([
+                '0000 HALT',
+                '0001 CLOSURE 6',
+                '0003 ACCESS 1',
+                '0005 SHARE 1',
+                '0007 TAIL_APPLY',
+                '0008 RETURN',
+                '0009 CLOSURE 6',
+                '0011 ACCESS 1',
+                '0013 PUSH_VAR y',
+                '0015 TAIL_APPLY',
+                '0016 RETURN',
+                '0017 APPLY',
+                '0018 HALT',
+        ])) == run_lambda(src, args=dict(dump_bytecode=True))
+
+def test_dump_bytecode_thunks_call_args():
+        assert X.ok('\n'.join([
+                '0000 HALT',
+                '0001 PUSH_VAR a',
+                '0003 THUNK 6',
+                '0005 PUSH_VAR b',
+                '0007 PUSH_VAR c',
+                '0009 TAIL_APPLY',
+                '0010 RETURN',
+                '0011 APPLY',
+                '0012 HALT',
+        ])) == run_lambda('a (b c)', args=dict(dump_bytecode=True))
@@ -7,24 +7,152 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <pthread.h>
+#include <unistd.h>
+
 #include "lambda.h"
+#include "sink.h"
 #include "untestable.h"
 
-#define MAX_TOKS (26 + 9)
-#define MAX_DEPTH 16
+// Slots for BOUNDs, below the ones for VARs: 26 letters, and -1 for a
+// nameless lambda's param.
+#define BOUND_SLOTS 10
+#define MIN_TOK (-1 - BOUND_SLOTS)
+#define MAX_TOKS (26 - MIN_TOK)
+
+typedef enum
+{
+        NOT_FUN,
+        MONO_FUN,
+        POLY_FUN,
+        TYPE_LINK,
+        TYPE_LATER, // Left for later by a worker thread.
+} FunTypeTag;
 
+// The types form a union-find forest, with union by rank and path halving.
+// A TYPE_LINK's `delta` is to its parent, which may be before or after it.  A
+// root's `delta` is to the first occurrence of its type, which names it, and
+// its `tag` says whether the type is a function.  A function's argument and
+// return types are relative to the root, and may be before or after it.
+//
+// Once the graph is built, the first occurrence of each type is made its root,
+// and every other occurrence links straight to it.
 typedef struct Type Type;
 struct Type {
-        int32_t delta;
-        int32_t delta_arg;
+        AstVal delta;
+        uint8_t tag;
+        uint8_t rank;
+        AstVal delta_arg;
+        AstVal delta_ret;
 };
 
-static void print_typename(FILE *oot, const AstNode *exprs, int32_t idx)
+// -----------------------------------------------------------------------------
+
+typedef struct {
+        AstIdx a;
+        AstIdx b;
+} TypePair;
+
+// The expressions to type are either the post-fix node array (`exprs`) or the
+// distinct subterms of a hash-consed Ast (`dag`).  Either way, an expression's
+// kids have smaller indices than it does, and its type is types[idx].
+typedef struct {
+        const AstNode *exprs;
+        const DagNode *dag;
+        AstIdx size;
+        Type types[];
+} TypeGraph;
+
+// What a thread typing (part of) a TypeGraph keeps to itself: the pairs of
+// types it still has to unify, last first, and the first occurrence of each
+// variable it has seen.
+typedef struct {
+        TypeGraph *tg;
+        AstIdx npending;
+        AstIdx pending_alloced;
+        TypePair *pending;
+        Type *bindings[MAX_TOKS];
+} Typer;
+
+typedef struct PrintItem PrintItem;
+
+// What act_retype() keeps from one program to the next: the graph, the pairs
+// of types still to unify, and the type printer's marks, stack and lines.  The
+// buffers only grow, so that typing a run of programs allocates nothing once
+// they are big enough for the biggest.
+struct TypeBuffers {
+        TypeGraph *tg;
+        AstIdx tg_alloced;
+        TypePair *pending;
+        AstIdx pending_alloced;
+        uint64_t *marks;
+        AstIdx marks_alloced;
+        PrintItem *items;
+        AstIdx items_alloced;
+        uint32_t *line_at;
+        AstIdx line_at_alloced;
+        Sink lines;
+};
+
+// Return `buf`, which has room for `*alloced` items of `size` bytes, grown to
+// have room for at least `n`.
+static void *reserve(void *buf, AstIdx *alloced, AstIdx n, size_t size)
+{
+        if (n <= *alloced)
+                return buf;
+        *alloced = n > 2 * *alloced ? n : 2 * *alloced;
+        return realloc_or_die(HERE, buf, size * *alloced);
+}
+
+// Like ast_unpack().
+static AstNodeType unpack(const TypeGraph *tg, AstIdx idx, AstVal *val)
+{
+        if (!tg->dag)
+                return ast_unpack(tg->exprs, idx, val);
+
+        DagNode n = tg->dag[idx];
+        switch (ast_type(n.node)) {
+        case ANT_CALL:
+                *val = n.kids[0];
+                return ANT_CALL;
+        case ANT_VAR:
+                *val = ast_val(n.node);
+                return ANT_VAR;
+        case ANT_LAMBDA:
+                *val = ast_val(tg->dag[n.kids[0]].node);
+                return ANT_LAMBDA;
+        case ANT_BOUND:
+                *val = ast_val(n.node);
+                return ANT_BOUND;
+        }
+        return (AstNodeType)DIE_LCOV_EXCL_LINE(
+            "Upacking DAG node %lu with bad type id %u", (unsigned long)idx,
+            ast_type(n.node));
+}
+
+// The argument of the CALL at `idx`.
+static AstIdx call_arg(const TypeGraph *tg, AstIdx idx)
+{
+        return tg->dag ? tg->dag[idx].kids[1] : ast_arg_idx(tg->exprs, idx);
+}
+
+// The param slot and body of the LAMBDA at `idx`.
+static AstIdx lambda_param(const TypeGraph *tg, AstIdx idx)
+{
+        return tg->dag ? tg->dag[idx].kids[0] : idx - 1;
+}
+
+static AstIdx lambda_body(const TypeGraph *tg, AstIdx idx)
+{
+        return tg->dag ? tg->dag[idx].kids[1] : ast_lambda_body(tg->exprs, idx);
+}
+
+static void print_typename(Sink *sink, const TypeGraph *tg, AstVal idx)
 {
         int k = 0;
-        int32_t val = idx;
+        AstVal val = idx;
         AstNodeType tag;
-        while (ANT_CALL == (tag = ast_unpack(exprs, val, &val))) {
+        while (ANT_CALL == (tag = unpack(tg, val, &val))) {
                 k++;
         }
 
@@ -33,298 +161,679 @@ static void print_typename(FILE *oot, const AstNode *exprs, int32_t idx)
                 tok = val + '1';
         }
 
-        fputc(tok, oot);
+        sink_putc(sink, tok);
         while (k--) {
-                fputc('r', oot);
+                sink_putc(sink, 'r');
         }
 }
 
 // -----------------------------------------------------------------------------
 
-typedef struct {
-        const AstNode *exprs;
-        uint32_t size;
-        uint32_t pad;
-        Type *bindings[MAX_TOKS];
-        Type types[];
-} TypeGraph;
-
-typedef enum
-{
-        NOT_FUN,
-        MONO_FUN,
-        POLY_FUN,
-} FunTypeTag;
-
-static uint32_t first_occurrence(const Type *types, uint32_t idx)
+// Only for a finished graph.
+static AstIdx first_occurrence(const Type *types, AstIdx idx)
 {
         Type t = types[idx];
-        if (t.delta < 0) {
+        if (t.tag == TYPE_LINK) {
                 idx += t.delta;
         }
-        assert(types[idx].delta >= 0);
+        assert(types[idx].tag != TYPE_LINK && types[idx].delta == 0);
         return idx;
 }
 
-static uint32_t relink_to_first(Type *types, uint32_t idx)
+// The root of idx's type, halving the path to it on the way.
+static AstIdx find_root(Type *types, AstIdx idx)
 {
-        Type t = types[idx];
-        if (t.delta >= 0)
-                return idx;
-
-        assert(t.delta < 0);
-        uint32_t first = relink_to_first(types, idx + t.delta);
-        types[idx].delta = first - idx;
-        assert(types[idx].delta < 0);
+        while (types[idx].tag == TYPE_LINK) {
+                AstIdx parent = idx + types[idx].delta;
+                if (types[parent].tag == TYPE_LINK) {
+                        AstIdx grandparent = parent + types[parent].delta;
+                        types[idx].delta = grandparent - idx;
+                        parent = grandparent;
+                }
+                idx = parent;
+        }
+        return idx;
+}
 
-        return first;
+// The first occurrence of the type rooted at `root`.
+static AstIdx root_first(const Type *types, AstIdx root)
+{
+        return root + types[root].delta;
 }
 
-static void replace_with_prior_link(Type *types, uint32_t idx, int32_t prior)
+static void replace_with_link(Type *types, AstIdx idx, AstIdx parent)
 {
-        assert(prior < idx);
-        types[idx] = (Type){.delta = prior - idx};
+        assert(parent != idx);
+        types[idx] = (Type){.delta = parent - idx, .tag = TYPE_LINK};
 }
 
-static void replace_with_fun(Type *types, uint32_t ifun, uint32_t iarg,
-                             uint32_t iret)
+static void replace_with_fun(Type *types, AstIdx ifun, FunTypeTag tag,
+                             AstIdx iarg, AstIdx iret)
 {
-        types[ifun] = (Type){
-            .delta = iret - ifun,
-            .delta_arg = iarg - ifun,
-        };
+        types[ifun].tag = tag;
+        types[ifun].delta_arg = iarg - ifun;
+        types[ifun].delta_ret = iret - ifun;
 }
 
-static FunTypeTag as_fun_type(const Type *types, uint32_t idx, uint32_t *arg,
-                              uint32_t *ret)
+static FunTypeTag as_fun_type(const TypeGraph *tg, AstIdx idx, AstIdx *arg,
+                              AstIdx *ret)
 {
-        Type t = types[idx];
+        Type t = tg->types[idx];
         *arg = idx + t.delta_arg;
         ;
-        if (t.delta <= 0) {
+        if (t.tag == NOT_FUN || t.tag == TYPE_LINK) {
                 return NOT_FUN;
         }
 
-        if (t.delta == 1) {
-                *ret = idx - 2;
-                return POLY_FUN;
-        }
-
-        // FIX? a free type (t.delta == 0) is a mono-fun?  Wikipedia agrees!
+        // FIX? a free type (t.tag == NOT_FUN) is a mono-fun?  Wikipedia agrees!
         // https://en.wikipedia.org/wiki/Hindley-Milner_type_system#Let-polymorphism
-        *ret = idx + t.delta;
-        return MONO_FUN;
+        *ret = idx + t.delta_ret;
+        return t.tag;
 }
 
-static void unify(Type *types, uint32_t ia, uint32_t ib);
-
-static void replace_subgraph_with_links(Type *types, uint32_t dest,
-                                        uint32_t repl)
+// Ask for ia and ib to be unified by the next unify_pending().  Pairs are
+// unified last first, so the sub-unifications of a pair are all done before
+// the pair pushed before it.
+static void unify(Typer *ty, AstIdx ia, AstIdx ib)
 {
-        uint32_t dest_ret, repl_ret;
-        uint32_t dest_arg, repl_arg;
-        bool dest_is_fun = as_fun_type(types, dest, &dest_arg, &dest_ret);
-        bool repl_is_fun = as_fun_type(types, repl, &repl_arg, &repl_ret);
+        if (ty->npending == ty->pending_alloced) {
+                ty->pending_alloced =
+                    ty->pending_alloced ? 2 * ty->pending_alloced : 64;
+                ty->pending = realloc_or_die(
+                    HERE, ty->pending, sizeof(TypePair) * ty->pending_alloced);
+        }
+        ty->pending[ty->npending++] = (TypePair){ia, ib};
+}
 
-        if (!repl_is_fun && dest_is_fun) {
-                replace_with_fun(types, repl, dest_arg, dest_ret);
+// Merge the types rooted at `dest` and `repl`, whose first occurrence is the
+// earlier.  The merged type is `repl`'s if that is a function, else `dest`'s
+// as a mono-fun, and both functions' parts are unified.  Which of the two
+// roots stays a root is up to their ranks.
+static void merge_types(Typer *ty, AstIdx dest, AstIdx repl)
+{
+        const TypeGraph *tg = ty->tg;
+        Type *types = ty->tg->types;
+        AstIdx dest_ret, repl_ret;
+        AstIdx dest_arg, repl_arg;
+        FunTypeTag dest_ft = as_fun_type(tg, dest, &dest_arg, &dest_ret);
+        FunTypeTag repl_ft = as_fun_type(tg, repl, &repl_arg, &repl_ret);
+        AstIdx first = root_first(types, repl);
+
+        AstIdx root = repl, child = dest;
+        if (types[dest].rank > types[repl].rank) {
+                root = dest;
+                child = repl;
+        }
+        uint8_t rank = types[root].rank;
+        rank += types[child].rank == rank;
+
+        replace_with_link(types, child, root);
+        types[root].delta = first - root;
+        types[root].rank = rank;
+        if (repl_ft) {
+                replace_with_fun(types, root, repl_ft, repl_arg, repl_ret);
+        } else if (dest_ft) {
+                replace_with_fun(types, root, MONO_FUN, dest_arg, dest_ret);
+        } else {
+                types[root].tag = NOT_FUN;
         }
 
-        replace_with_prior_link(types, dest, repl);
-        if (repl_is_fun && dest_is_fun) {
-                unify(types, repl_arg, dest_arg);
-                unify(types, repl_ret, dest_ret);
+        if (repl_ft && dest_ft) {
+                unify(ty, repl_ret, dest_ret);
+                unify(ty, repl_arg, dest_arg);
         }
 }
 
-static void unify(Type *types, uint32_t ia, uint32_t ib)
+static void unify_pending(Typer *ty)
 {
-        ia = relink_to_first(types, ia);
-        ib = relink_to_first(types, ib);
-        if (ia < ib)
-                return replace_subgraph_with_links(types, ib, ia);
-        if (ib < ia)
-                return replace_subgraph_with_links(types, ia, ib);
+        Type *types = ty->tg->types;
+        while (ty->npending) {
+                TypePair p = ty->pending[--ty->npending];
+                AstIdx ia = find_root(types, p.a);
+                AstIdx ib = find_root(types, p.b);
+                AstIdx first_a = root_first(types, ia);
+                AstIdx first_b = root_first(types, ib);
+                if (first_a < first_b)
+                        merge_types(ty, ib, ia);
+                else if (first_b < first_a)
+                        merge_types(ty, ia, ib);
+        }
 }
 
-static void coerce_callee(Type *types, uint32_t ifun, uint32_t iret)
+static void coerce_callee(Typer *ty, AstIdx ifun, AstIdx iarg,
+                          AstIdx iret)
 {
-        uint32_t iarg = iret - 1;
+        Type *types = ty->tg->types;
         assert(ifun < iret);
 
-        ifun = relink_to_first(types, ifun);
-        uint32_t old_iret, old_iarg;
-        if (!as_fun_type(types, ifun, &old_iarg, &old_iret)) {
-                replace_with_fun(types, ifun, iarg, iret);
+        ifun = find_root(types, ifun);
+        AstIdx old_iret, old_iarg;
+        if (!as_fun_type(ty->tg, ifun, &old_iarg, &old_iret)) {
+                replace_with_fun(types, ifun, MONO_FUN, iarg, iret);
                 return;
         }
 
-        unify(types, old_iarg, iarg);
-        unify(types, old_iret, iret);
+        unify(ty, old_iret, iret);
+        unify(ty, old_iarg, iarg);
+        unify_pending(ty);
 }
 
-static void bind_to_typevar(TypeGraph *tg, uint32_t target, int32_t tok)
+// Link `target` to the first occurrence of token `tok`, which is a VAR's
+// token, or -2 - a BOUND's depth, so that no depth shares a VAR's slot.
+// BOUNDs deeper than BOUND_SLOTS - 1 have no slot, so each is a type of its
+// own.
+static void bind_to_typevar(Typer *ty, AstIdx target, int32_t tok)
 {
-        uint32_t bidx = 9 + tok;
-        DIE_IF(tok > MAX_TOKS, "Overbig token %u", tok);
-        Type *binding = tg->bindings[bidx];
+        Type *types = ty->tg->types;
+        DIE_IF(tok >= MAX_TOKS + MIN_TOK, "Overbig token %d", tok);
+        if (tok < MIN_TOK)
+                return;
+        uint32_t bidx = tok - MIN_TOK;
+        Type *binding = ty->bindings[bidx];
         if (binding) {
-                replace_with_prior_link(tg->types, target, binding - tg->types);
+                replace_with_link(types, target,
+                                  find_root(types, binding - types));
         } else {
-                tg->bindings[bidx] = tg->types + target;
+                ty->bindings[bidx] = types + target;
         }
 }
 
-static void coerce_lambda(Type *types, uint32_t ifun, uint32_t ibody)
+static void coerce_lambda(Type *types, AstIdx ifun, AstIdx iparam,
+                          AstIdx ibody)
 {
-        assert(ibody == ifun - 2);
-        types[ifun] = (Type){
-            .delta = 1, // FIX: magic number
-            .delta_arg = -1,
-        };
+        assert(iparam < ifun && ibody < ifun);
+        replace_with_fun(types, ifun, POLY_FUN, iparam, ibody);
 }
 
-static void infer_new_type(TypeGraph *tg, uint32_t idx)
+// Make the first occurrence of each type its root, with every other occurrence
+// linking straight to it.  The first occurrence k of a type is the first index
+// of it found, at which point its root is moved to k.
+static void root_types_at_first(Type *types, AstIdx size)
+{
+        for (AstIdx k = 0; k < size; k++) {
+                AstIdx root = find_root(types, k);
+                if (root == k)
+                        continue;
+                if (root_first(types, root) != k) {
+                        replace_with_link(types, k, root);
+                        continue;
+                }
+
+                AstIdx iarg = root + types[root].delta_arg;
+                AstIdx iret = root + types[root].delta_ret;
+                types[k] = (Type){0};
+                replace_with_fun(types, k, types[root].tag, iarg, iret);
+                replace_with_link(types, root, k);
+        }
+}
+
+static void infer_new_type(Typer *ty, AstIdx idx)
 {
         // FIX: what if the lambda-param gets wrongly bound?
-        int32_t val;
-        AstNodeType tag = ast_unpack(tg->exprs, idx, &val);
+        const TypeGraph *tg = ty->tg;
+        AstVal val;
+        ty->tg->types[idx] = (Type){0};
+        AstNodeType tag = unpack(tg, idx, &val);
         switch (tag) {
         case ANT_VAR:
-                bind_to_typevar(tg, idx, val);
+                bind_to_typevar(ty, idx, val);
                 return;
         case ANT_CALL:
-                coerce_callee(tg->types, val, idx);
+                coerce_callee(ty, val, call_arg(tg, idx), idx);
                 return;
         case ANT_LAMBDA:
-                coerce_lambda(tg->types, idx, idx - 2);
+                coerce_lambda(ty->tg->types, idx, lambda_param(tg, idx),
+                              lambda_body(tg, idx));
                 return;
         case ANT_BOUND:
-                bind_to_typevar(tg, -idx, val);
+                bind_to_typevar(ty, idx, -2 - (int32_t)val);
                 return;
         }
-        DIE_LCOV_EXCL_LINE("Typing found expr %u with bad tag %d", idx, tag);
+        DIE_LCOV_EXCL_LINE("Typing found expr %lu with bad tag %d",
+                           (unsigned long)idx, tag);
 }
 
-static TypeGraph *build_type_graph(const Ast *ast)
+static TypeGraph *new_type_graph(TypeBuffers *bufs, const AstNode *exprs,
+                                 const DagNode *dag, AstIdx size)
 {
-        uint32_t size;
-        const AstNode *exprs = ast_postfix(ast, &size);
-        TypeGraph *tg =
-            realloc_or_die(HERE, 0, sizeof(TypeGraph) + sizeof(Type) * size);
-        *tg = (TypeGraph){.exprs = exprs, .size = size};
+        if (!bufs->tg || size > bufs->tg_alloced) {
+                bufs->tg_alloced = size;
+                bufs->tg = realloc_or_die(HERE, bufs->tg,
+                                          sizeof(TypeGraph) +
+                                              sizeof(Type) * size);
+        }
+        TypeGraph *tg = bufs->tg;
+        *tg = (TypeGraph){.exprs = exprs, .dag = dag, .size = size};
+        return tg;
+}
 
-        Type *types = tg->types;
-        for (uint32_t k = 0; k < size; k++) {
-                types[k] = (Type){0};
-                infer_new_type(tg, k);
+// A Typer of the whole graph, with the pending pairs kept in `bufs`.
+static Typer new_typer(TypeBuffers *bufs)
+{
+        return (Typer){.tg = bufs->tg,
+                       .pending = bufs->pending,
+                       .pending_alloced = bufs->pending_alloced};
+}
+
+static void keep_typer(TypeBuffers *bufs, Typer *ty)
+{
+        bufs->pending = ty->pending;
+        bufs->pending_alloced = ty->pending_alloced;
+}
+
+static TypeGraph *build_type_graph(TypeBuffers *bufs, const AstNode *exprs,
+                                   const DagNode *dag, AstIdx size)
+{
+        TypeGraph *tg = new_type_graph(bufs, exprs, dag, size);
+        Typer ty = new_typer(bufs);
+        for (AstIdx k = 0; k < size; k++) {
+                infer_new_type(&ty, k);
         }
+        keep_typer(bufs, &ty);
+
+        root_types_at_first(tg->types, size);
+        return tg;
+}
+
+// -----------------------------------------------------------------------------
+
+// Typing in parallel.  The types of a subtree of the post-fix array only
+// involve the subtree's own nodes, and the types of the free variables in it.
+// So the array is cut into a chunk per thread, and each worker types the nodes
+// of its chunk whose subtrees are wholly inside it, with a Typer of its own,
+// leaving the rest TYPE_LATER.  Then each worker's first occurrence of a
+// variable is unified with everybody else's, and the nodes left are typed as
+// usual.  The graph that comes out has the same types, with the same names,
+// as typing serially: a type is named by its first occurrence, it's a
+// lambda's type if its first occurrence is the lambda, and the rest is
+// unification, which doesn't depend on the order it's done in.
+//
+// Bound variables are typed by their de Bruijn depth rather than by where
+// they are bound (see bind_to_typevar()), so programs with them are typed
+// serially.
+
+// Programs are only typed in parallel if there are at least this many nodes
+// per thread.
+#define TYPE_MIN_PER_THREAD (4 * 1024)
 
-        for (uint32_t k = 0; k < size; k++) {
-                relink_to_first(types, k);
+typedef struct {
+        Typer ty;
+        pthread_t thread;
+        AstIdx start;
+        AstIdx end;
+} TypeWorker;
+
+static void *type_chunk(void *arg)
+{
+        TypeWorker *w = arg;
+        Type *types = w->ty.tg->types;
+        const AstNode *exprs = w->ty.tg->exprs;
+        for (AstIdx k = w->start; k < w->end; k++) {
+                AstVal val;
+                AstIdx kid = k;
+                switch (ast_unpack(exprs, k, &val)) {
+                case ANT_CALL:
+                        kid = val;
+                        break;
+                case ANT_LAMBDA:
+                        kid = ast_lambda_body(exprs, k);
+                        break;
+                case ANT_VAR:
+                case ANT_BOUND:
+                        break;
+                }
+                // The subtree starts where its first kid's does.
+                if (kid < w->start || types[kid].tag == TYPE_LATER)
+                        types[k] = (Type){.tag = TYPE_LATER};
+                else
+                        infer_new_type(&w->ty, k);
         }
+        return NULL;
+}
+
+static bool has_bound_vars(const AstNode *nodes, AstIdx size)
+{
+        for (AstIdx k = 0; k < size; k++) {
+                if (ast_type(nodes[k]) == ANT_BOUND)
+                        return true;
+        }
+        return false;
+}
 
+// Like build_type_graph(bufs, exprs, NULL, size), on up to `nthreads`
+// threads.
+static TypeGraph *build_type_graph_parallel(TypeBuffers *bufs,
+                                            const AstNode *exprs, AstIdx size,
+                                            uint32_t nthreads)
+{
+        if (nthreads < 2 || size / nthreads < TYPE_MIN_PER_THREAD ||
+            has_bound_vars(exprs, size))
+                return build_type_graph(bufs, exprs, NULL, size);
+
+        TypeGraph *tg = new_type_graph(bufs, exprs, NULL, size);
+        TypeWorker *workers =
+            realloc_or_die(HERE, NULL, sizeof(TypeWorker) * nthreads);
+        for (uint32_t k = 0; k < nthreads; k++) {
+                workers[k] = (TypeWorker){
+                    .ty = {.tg = tg},
+                    .start = (uint64_t)size * k / nthreads,
+                    .end = (uint64_t)size * (k + 1) / nthreads,
+                };
+        }
+        for (uint32_t k = 1; k < nthreads; k++) {
+                DIE_IF(pthread_create(&workers[k].thread, NULL, type_chunk,
+                                      &workers[k]),
+                       "Can't start a typing thread.");
+        }
+        type_chunk(&workers[0]);
+        for (uint32_t k = 1; k < nthreads; k++)
+                pthread_join(workers[k].thread, NULL);
+
+        // Unify the workers' variables, then type the rest.
+        Typer ty = new_typer(bufs);
+        for (uint32_t k = 0; k < nthreads; k++) {
+                Typer *wty = &workers[k].ty;
+                for (uint32_t b = 0; b < MAX_TOKS; b++) {
+                        if (!wty->bindings[b])
+                                continue;
+                        if (!ty.bindings[b])
+                                ty.bindings[b] = wty->bindings[b];
+                        else
+                                unify(&ty, ty.bindings[b] - tg->types,
+                                      wty->bindings[b] - tg->types);
+                }
+                free(wty->pending);
+        }
+        free(workers);
+        unify_pending(&ty);
+        for (AstIdx k = 0; k < size; k++) {
+                if (tg->types[k].tag == TYPE_LATER)
+                        infer_new_type(&ty, k);
+        }
+        keep_typer(bufs, &ty);
+
+        root_types_at_first(tg->types, size);
         return tg;
 }
 
 // ------------------------------------------------------------------
 
+// The type printer keeps an explicit stack of what is still to print.  While
+// a fun-type is being expanded, it is marked as being on the path from the
+// root, so that a recursive type is only expanded once.
+//
+// Every occurrence of a type prints the same line, so the line of a type that
+// occurs more than once is rendered once, into `lines`, and copied from there
+// after that, up to TYPE_LINES_MAX_BYTES of them.  In compact mode the marks
+// are never cleared, so that a fun-type is expanded only the first time it is
+// printed, and just named after that, and the lines are printed as they are
+// rendered.
+#define TYPE_LINES_MAX_BYTES (64 * 1024 * 1024)
+
+enum
+{
+        LINE_ONCE = 1,
+        LINE_AGAIN,
+        LINE_AT,
+};
+
+typedef enum
+{
+        PRINT_TYPE,
+        PRINT_SPACE,
+        PRINT_CLOSE, // And take the fun-type off the path.
+} PrintOp;
+
+struct PrintItem {
+        uint32_t op;
+        AstIdx idx;
+};
+
 typedef struct {
-        FILE *oot;
-        const AstNode *exprs;
-        const Type *types;
-        uint32_t depth;
-        uint32_t ntypes;
-        uint32_t stack[MAX_DEPTH];
+        Sink *sink; // Where types are rendered.
+        Sink *oot;  // Where the lines go.
+        const TypeGraph *tg;
+        TypeBuffers *bufs; // Where the buffers below are kept.
+        bool compact;
+        uint64_t *marks;
+        AstIdx size;
+        AstIdx alloced;
+        PrintItem *items;
+        // LINE_ONCE, LINE_AGAIN, or where in `lines` the type's line starts
+        // plus LINE_AT, for each first occurrence.
+        uint32_t *line_at;
+        Sink lines;
 } Unparser;
 
-typedef enum
+static void init_unparser(Unparser *unp, Sink *oot, TypeBuffers *bufs,
+                          bool compact)
 {
-        RECURSION_NOT_FOUND,
-        RECURSION_FOUND,
-} RecursionFound;
+        const TypeGraph *tg = bufs->tg;
+        *unp = (Unparser){.oot = oot, .tg = tg, .bufs = bufs,
+                          .compact = compact};
+        AstIdx nmarks = tg->size / 64 + 1;
+        bufs->marks = reserve(bufs->marks, &bufs->marks_alloced, nmarks,
+                              sizeof(uint64_t));
+        memset(bufs->marks, 0, sizeof(uint64_t) * nmarks);
+        unp->marks = bufs->marks;
+        unp->items = bufs->items;
+        unp->alloced = bufs->items_alloced;
+        if (!compact) {
+                bufs->line_at = reserve(bufs->line_at, &bufs->line_at_alloced,
+                                        tg->size, sizeof(uint32_t));
+                memset(bufs->line_at, 0, sizeof(uint32_t) * tg->size);
+                unp->line_at = bufs->line_at;
+                unp->lines = bufs->lines;
+                unp->lines.len = 0;
+        }
+}
 
-static RecursionFound unparse_push(Unparser *unp, uint32_t idx)
+// Hand the buffers that may have grown back to unp->bufs.
+static void free_unparser(Unparser *unp)
 {
-        uint32_t depth = unp->depth, k = depth;
-        while (k--)
-                if (unp->stack[k] == idx)
-                        return RECURSION_FOUND;
-        unp->stack[depth] = idx;
-        unp->depth = depth + 1;
-        return RECURSION_NOT_FOUND;
+        unp->bufs->items = unp->items;
+        unp->bufs->items_alloced = unp->alloced;
+        if (!unp->compact)
+                unp->bufs->lines = unp->lines;
 }
 
-static void unparse_pop(Unparser *unp)
+static bool is_marked(const Unparser *unp, AstIdx idx)
 {
-        int depth = (int)unp->depth - 1;
-        assert(depth >= 0);
-        unp->depth = depth;
+        return unp->marks[idx / 64] >> (idx % 64) & 1;
 }
 
-static void unparse_fun_expansion(Unparser *unp, uint32_t idx);
+static void set_mark(Unparser *unp, AstIdx idx, bool on)
+{
+        uint64_t bit = (uint64_t)1 << (idx % 64);
+        if (on)
+                unp->marks[idx / 64] |= bit;
+        else
+                unp->marks[idx / 64] &= ~bit;
+}
 
-static void unparse_type_(Unparser *unp, uint32_t idx)
+static void unparse_push(Unparser *unp, PrintOp op, AstIdx idx)
 {
-        idx = first_occurrence(unp->types, idx);
-        print_typename(unp->oot, unp->exprs, idx);
-        unparse_fun_expansion(unp, idx);
+        if (unp->size == unp->alloced) {
+                unp->alloced = unp->alloced ? 2 * unp->alloced : 64;
+                unp->items = realloc_or_die(HERE, unp->items,
+                                            sizeof(PrintItem) * unp->alloced);
+        }
+        unp->items[unp->size++] = (PrintItem){op, idx};
 }
 
-static void unparse_fun_expansion(Unparser *unp, uint32_t idx)
+static void unparse_type_(Unparser *unp, AstIdx idx)
 {
-        uint32_t iret, iarg;
-        FunTypeTag ft = as_fun_type(unp->types, idx, &iarg, &iret);
+        idx = first_occurrence(unp->tg->types, idx);
+        print_typename(unp->sink, unp->tg, idx);
+
+        AstIdx iret, iarg;
+        FunTypeTag ft = as_fun_type(unp->tg, idx, &iarg, &iret);
         if (ft == NOT_FUN) {
                 return;
         }
-
-        if (unparse_push(unp, idx) == RECURSION_FOUND) {
+        if (is_marked(unp, idx)) {
+                // A compact line names a lambda's type in full.
+                if (ft == POLY_FUN && unp->compact)
+                        sink_putc(unp->sink, 'f');
                 return;
         }
+        set_mark(unp, idx, true);
 
-        FILE *oot = unp->oot;
+        Sink *sink = unp->sink;
 
         if (ft == POLY_FUN) {
-                fputs("f=", oot);
-                fputc('[', oot);
-                print_typename(oot, unp->exprs, iarg);
-                fputc(']', oot);
+                sink_puts(sink, "f=[");
+                print_typename(sink, unp->tg, iarg);
+                sink_puts(sink, "](");
+        } else {
+                sink_puts(sink, "=(");
+        }
+
+        unparse_push(unp, PRINT_CLOSE, idx);
+        unparse_push(unp, PRINT_TYPE, iret);
+        unparse_push(unp, PRINT_SPACE, 0);
+        unparse_push(unp, PRINT_TYPE, iarg);
+}
+
+// Render the type of `idx` to `sink`, with a newline.
+static void unparse_type(Unparser *unp, Sink *sink, AstIdx idx)
+{
+        unp->sink = sink;
+        unparse_push(unp, PRINT_TYPE, idx);
+        while (unp->size) {
+                PrintItem item = unp->items[--unp->size];
+                switch ((PrintOp)item.op) {
+                case PRINT_TYPE:
+                        unparse_type_(unp, item.idx);
+                        continue;
+                case PRINT_SPACE:
+                        sink_putc(unp->sink, ' ');
+                        continue;
+                case PRINT_CLOSE:
+                        sink_putc(unp->sink, ')');
+                        if (!unp->compact)
+                                set_mark(unp, item.idx, false);
+                        continue;
+                }
+        }
+        sink_putc(unp->sink, '\n');
+}
+
+// Note that the line for the type of expression `idx` will be printed, before
+// any are.
+static void count_type_line(Unparser *unp, AstIdx idx)
+{
+        if (unp->compact)
+                return;
+        idx = first_occurrence(unp->tg->types, idx);
+        unp->line_at[idx] = unp->line_at[idx] ? LINE_AGAIN : LINE_ONCE;
+}
+
+// Print the line for the type of expression `idx`.
+static void print_type_line(Unparser *unp, AstIdx idx)
+{
+        if (!unp->compact)
+                idx = first_occurrence(unp->tg->types, idx);
+        if (unp->compact || unp->line_at[idx] == LINE_ONCE) {
+                unparse_type(unp, unp->oot, idx);
+                return;
+        }
+
+        Sink *lines = &unp->lines;
+        if (unp->line_at[idx] >= LINE_AT) {
+                const char *zline = lines->buf + unp->line_at[idx] - LINE_AT;
+                const char *zend =
+                    memchr(zline, '\n', lines->buf + lines->len - zline);
+                sink_write(unp->oot, zline, zend + 1 - zline);
+                return;
+        }
+
+        size_t start = lines->len;
+        unparse_type(unp, lines, idx);
+        sink_write(unp->oot, lines->buf + start, lines->len - start);
+        if (lines->len <= TYPE_LINES_MAX_BYTES) {
+                unp->line_at[idx] = start + LINE_AT;
         } else {
-                fputc('=', oot);
+                lines->len = start; // LCOV_EXCL_LINE (64MB of lines)
         }
+}
 
-        fputc('(', oot);
-        unparse_type_(unp, iarg);
-        fputc(' ', oot);
-        unparse_type_(unp, iret);
-        fputc(')', oot);
-        unparse_pop(unp);
+TypeBuffers *new_type_buffers(void)
+{
+        TypeBuffers *bufs = realloc_or_die(HERE, NULL, sizeof(TypeBuffers));
+        *bufs = (TypeBuffers){0};
+        sink_open_memory(&bufs->lines);
+        return bufs;
 }
 
-static void unparse_type(FILE *oot, const TypeGraph *tg, const Type *t)
+void delete_type_buffers(TypeBuffers *bufs)
 {
-        Unparser unp = {
-            .oot = oot,
-            .exprs = tg->exprs,
-            .types = tg->types,
-        };
+        free(bufs->tg);
+        free(bufs->pending);
+        free(bufs->marks);
+        free(bufs->items);
+        free(bufs->line_at);
+        sink_close(&bufs->lines);
+        free(bufs);
+}
 
-        unparse_type_(&unp, t - tg->types);
+int act_type(FILE *oot, const Ast *ast, bool compact, uint32_t nthreads)
+{
+        TypeBuffers *bufs = new_type_buffers();
+        int nerr = act_retype(oot, ast, compact, nthreads, bufs);
+        delete_type_buffers(bufs);
+        return nerr;
 }
 
-int act_type(FILE *oot, const Ast *ast)
+int act_retype(FILE *oot, const Ast *ast, bool compact, uint32_t nthreads,
+               TypeBuffers *bufs)
 {
-        TypeGraph *tg = build_type_graph(ast);
+        AstIdx size;
+        const AstNode *exprs = ast_postfix(ast, &size);
+        if (!nthreads) {
+                long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+                nthreads = ncpus > 0 ? ncpus : 1;
+        }
+        TypeGraph *tg = build_type_graph_parallel(bufs, exprs, size, nthreads);
+        Sink sink;
+        sink_open_file(&sink, oot);
+        Unparser unp;
+        init_unparser(&unp, &sink, bufs, compact);
+
+        for (AstIdx k = 0; k < tg->size; k++)
+                count_type_line(&unp, k);
+        for (AstIdx k = 0; k < tg->size; k++) {
+                DBG("type %lu: delta=%ld tag=%d", (unsigned long)k,
+                    (long)tg->types[k].delta, tg->types[k].tag);
+                print_type_line(&unp, k);
+        }
+
+        free_unparser(&unp);
+        return sink_close(&sink);
+}
 
-        for (size_t k = 0; k < tg->size; k++) {
-                Type *t = tg->types + k;
-                DBG("type %lu: delta=%d", k, t->delta);
-                unparse_type(oot, tg, t);
-                fputc('\n', oot);
+int act_type_shared(FILE *oot, const Ast *ast, bool compact)
+{
+        AstDag *dag = hash_cons(ast, false);
+        uint32_t size, nnodes;
+        const DagNode *nodes = dag_nodes(dag, &size);
+        const uint32_t *ids = dag_ids(dag, &nnodes);
+        TypeBuffers *bufs = new_type_buffers();
+        build_type_graph(bufs, NULL, nodes, size);
+        Sink sink;
+        sink_open_file(&sink, oot);
+        Unparser unp;
+        init_unparser(&unp, &sink, bufs, compact);
+
+        // Every occurrence of a subterm has the type of the distinct one.
+        for (size_t k = 0; k < nnodes; k++)
+                count_type_line(&unp, ids[k]);
+        for (size_t k = 0; k < nnodes; k++) {
+                print_type_line(&unp, ids[k]);
         }
 
-        free(tg);
-        fflush(oot);
-        return 0;
+        free_unparser(&unp);
+        delete_type_buffers(bufs);
+        delete_dag(dag);
+        return sink_close(&sink);
 }
@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,8 +10,18 @@
 
 #include "untestable.h"
 
-static bool fault_unreadable_bangs = false;
-static const char *dbg_log_list = NULL;
+// Set by init_debugging(), and read by any thread, so atomic in case there
+// are threads already.
+static atomic_bool fault_unreadable_bangs = false;
+static atomic_bool fault_tiny_reads = false;
+static atomic_bool fault_short_writes = false;
+static atomic_bool fault_slow_paths = false;
+static atomic_bool fault_no_avx2 = false;
+static atomic_bool fault_no_simd = false;
+static _Atomic(const char *) dbg_log_list = NULL;
+
+// Where this thread reports errors, if not to stderr.
+static _Thread_local FILE *thread_errors = NULL;
 
 void *realloc_or_die(SrcLoc loc, void *buf, size_t n)
 {
@@ -47,22 +58,76 @@ int file_errnum(FILE *fin, void *buf, size_t n)
         // LCOV_EXCL_STOP
 }
 
+int read_errnum(const void *buf, ssize_t n)
+{
+        if (n < 0) {
+                return errno ? -errno : -1000 * 1000; // LCOV_EXCL_LINE
+        }
+        return check_unreadable_bangs(buf, n);
+}
+
+size_t read_size(size_t n) { return fault_tiny_reads && n > 1 ? 1 : n; }
+
+size_t write_size(size_t n) { return fault_short_writes ? (n + 1) / 2 : n; }
+
+bool use_fast_paths(void) { return !fault_slow_paths; }
+
+bool may_use_isa(const char *isa)
+{
+        if (fault_no_simd)
+                return false;
+        return !(fault_no_avx2 && !strcmp(isa, "avx2"));
+}
+
+static bool is_fault(const char *z, size_t n, const char *zname)
+{
+        return n == strlen(zname) && !strncmp(z, zname, n);
+}
+
 // Parse `faults` to activate any fault-injects defined there.  `faults` is a
 // comma-separated list of fault names, you are not allowed to supply the same
 // fault name more than once, or to use an unknown name.  The currently defined
 // faults are
 //
 // unreadable-bangs: file_errnum will fake an I/O error if it sees '!'.
+// tiny-reads: read_size says to read a byte at a time.
+// short-writes: write_size says to write half at a time.
+// slow-paths: use_fast_paths says not to.
+// no-avx2: may_use_isa says not to use AVX2.
+// no-simd: may_use_isa says not to use any SIMD.
 static void set_injected_faults(const char *faults)
 {
         if (!faults) {
                 return;
         }
-        if (!strcmp(faults, "unreadable-bangs")) {
-                fault_unreadable_bangs = true;
+        while (*faults) {
+                size_t n = strcspn(faults, ",");
+                if (is_fault(faults, n, "unreadable-bangs")) {
+                        fault_unreadable_bangs = true;
+                }
+                if (is_fault(faults, n, "tiny-reads")) {
+                        fault_tiny_reads = true;
+                }
+                if (is_fault(faults, n, "short-writes")) {
+                        fault_short_writes = true;
+                }
+                if (is_fault(faults, n, "slow-paths")) {
+                        fault_slow_paths = true;
+                }
+                if (is_fault(faults, n, "no-avx2")) {
+                        fault_no_avx2 = true;
+                }
+                if (is_fault(faults, n, "no-simd")) {
+                        fault_no_simd = true;
+                }
+                faults += n + (faults[n] == ',');
         }
 }
 
+FILE *error_stream(void) { return thread_errors ? thread_errors : stderr; }
+
+void set_error_stream(FILE *err) { thread_errors = err; }
+
 void init_debugging(void)
 {
         set_injected_faults(secure_getenv("INJECTED_FAULTS"));
@@ -72,6 +137,8 @@ void init_debugging(void)
 // LCOV_EXCL_START
 static int die_va(SrcLoc loc, const char *prefix, const char *zfmt, va_list va)
 {
+        // Held until the end, so no other thread's message gets in.
+        flockfile(stderr);
         fprintf(stderr, "%s:%d: error in `%s`", loc.file, loc.line, loc.func);
         if (prefix) {
                 fprintf(stderr, " (%s)", prefix);
@@ -103,25 +170,28 @@ int die_if(SrcLoc loc, const char *cond, const char *zfmt, ...)
 
 static bool ignore_dbg(SrcLoc loc)
 {
-        if (!dbg_log_list)
+        const char *zlist = dbg_log_list;
+        if (!zlist)
                 return true;
 
         // LCOV_EXCL_START
-        size_t n = strlen(dbg_log_list);
-        if (n == 1 && dbg_log_list[0] == '*')
+        size_t n = strlen(zlist);
+        if (n == 1 && zlist[0] == '*')
                 return false;
 
-        return 0 != strncmp(loc.file, dbg_log_list, n);
+        return 0 != strncmp(loc.file, zlist, n);
         // LCOV_EXCL_STOP
 }
 
 // LCOV_EXCL_START
 static void dbg_va(SrcLoc loc, const char *zfmt, va_list va)
 {
+        flockfile(stderr);
         fprintf(stderr, "DBG: %s:%d: in `%s`: ", loc.file, loc.line, loc.func);
         vfprintf(stderr, zfmt, va);
         fputc('\n', stderr);
         fflush(stderr);
+        funlockfile(stderr);
         va_end(va);
 }
 
@@ -1,7 +1,9 @@
 #ifndef UNTESTABLE_2018_03_03_H
 #define UNTESTABLE_2018_03_03_H
 
+#include <stdbool.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 typedef struct {
         int line;
@@ -22,6 +24,33 @@ extern void *realloc_or_die(SrcLoc loc, void *buf, size_t n);
 // be errors depending on fault-injection settings and contents of buf[0:n].
 extern int file_errnum(FILE *fin, void *buf, size_t n);
 
+// The same for `n`, what read(2) returned after reading into buf.
+extern int read_errnum(const void *buf, ssize_t n);
+
+// How much to ask read(2) for, given room for `n` bytes (which is `n`, unless
+// fault-injection makes it less).
+extern size_t read_size(size_t n);
+
+// How much of `n` bytes to ask write(2) to write (all of them, unless
+// fault-injection makes it less).
+extern size_t write_size(size_t n);
+
+// Whether a JIT should compile fast paths, which it should unless
+// fault-injection says every instruction is to take its slow path.
+extern bool use_fast_paths(void);
+
+// Whether to use the CPU's `isa` ("avx2" or "sse2") if it has it, which it
+// should unless fault-injection says to do without.
+extern bool may_use_isa(const char *isa);
+
+// Where to report errors that don't stop the program: stderr, unless this
+// thread has been given a stream of its own with set_error_stream(), so that
+// threads working on different programs can keep their errors apart.
+extern FILE *error_stream(void);
+
+// Report this thread's errors to `err` from now on (or to stderr, if NULL).
+extern void set_error_stream(FILE *err);
+
 // Exactly the same as die(HERE, ...) except coverage doesn't count the line.
 // Used this for code you expect to be unreachable.
 #define DIE_LCOV_EXCL_LINE(...) die(HERE, __VA_ARGS__)
@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eval.h"
+#include "lambda.h"
+#include "machine.h"
+#include "untestable.h"
+#include "vm.h"
+
+static const EvalBudget default_budget = {
+    .max_steps = 1u << 26,
+    .max_bytes = 64u << 20,
+};
+
+#define NONE UINT32_MAX
+
+static const char *const op_names[NOPCODES] = {
+    [OP_HALT] = "HALT",
+    [OP_PUSH_VAR] = "PUSH_VAR",
+    [OP_ACCESS] = "ACCESS",
+    [OP_SHARE] = "SHARE",
+    [OP_CLOSURE] = "CLOSURE",
+    [OP_THUNK] = "THUNK",
+    [OP_APPLY] = "APPLY",
+    [OP_TAIL_APPLY] = "TAIL_APPLY",
+    [OP_RETURN] = "RETURN",
+};
+
+uint32_t bytecode_width(const int32_t *code, uint32_t pc)
+{
+        switch ((OpCode)code[pc]) {
+        case OP_PUSH_VAR:
+        case OP_ACCESS:
+        case OP_SHARE:
+        case OP_CLOSURE:
+        case OP_THUNK:
+                return 2;
+        case OP_HALT:
+        case OP_APPLY:
+        case OP_TAIL_APPLY:
+        case OP_RETURN:
+        case NOPCODES:
+                break;
+        }
+        return 1;
+}
+
+// ------------------------------------------------------------------
+
+typedef struct {
+        Bytecode code;
+        uint32_t last_op; // Where the most recent instruction starts.
+} Compiler;
+
+static void emit_op(Compiler *c, OpCode op, int32_t operand)
+{
+        Bytecode *code = &c->code;
+        if (code->size + 2 > code->alloced) {
+                code->alloced = code->alloced ? 2 * code->alloced : 64;
+                code->words = realloc_or_die(HERE, code->words,
+                                             sizeof(int32_t) * code->alloced);
+        }
+        c->last_op = code->size;
+        code->words[code->size++] = op;
+        if (bytecode_width(code->words, c->last_op) == 2)
+                code->words[code->size++] = operand;
+}
+
+// End the CLOSURE or THUNK whose length operand is at code[patch].
+static void emit_return(Compiler *c, uint32_t patch)
+{
+        int32_t *words = c->code.words;
+        if (words[c->last_op] == OP_APPLY)
+                words[c->last_op] = OP_TAIL_APPLY;
+        emit_op(c, OP_RETURN, 0);
+        words = c->code.words;
+        words[patch] = c->code.size - patch - 1;
+}
+
+// An argument is the node just before its CALL.
+static bool is_arg(const AstNode *nodes, uint32_t size, uint32_t k)
+{
+        return k + 1 < size && ast_type(nodes[k + 1]) == ANT_CALL;
+}
+
+// The code is emitted in one forward pass over the post-fix nodes, which is
+// the order in which it runs, except that the CLOSURE or THUNK wrapping a
+// subtree has to be emitted before the subtree's first node.  So each node
+// that needs one is first put on an "opener" list for the node its subtree
+// starts at.  Nodes are added in increasing order, so the head of a list is
+// the outermost subtree, which is the one whose opener must come first.
+Bytecode compile_bytecode(const AstNode *nodes, uint32_t size)
+{
+        uint32_t *first =
+            realloc_or_die(HERE, NULL, 4 * sizeof(uint32_t) * size);
+        uint32_t *opener_head = first + size, *opener_next = opener_head + size;
+        uint32_t *patch = opener_next + size;
+        find_subtree_starts(nodes, size, first);
+        memset(opener_head, 0xff, sizeof(uint32_t) * size);
+        for (uint32_t k = 0; k < size; k++) {
+                if (ast_type(nodes[k]) == ANT_LAMBDA ||
+                    ast_type(nodes[k]) == ANT_CALL && is_arg(nodes, size, k)) {
+                        opener_next[k] = opener_head[first[k]];
+                        opener_head[first[k]] = k;
+                }
+        }
+
+        Compiler c = {0};
+        emit_op(&c, OP_HALT, 0);
+        for (uint32_t p = 0; p < size; p++) {
+                uint32_t k = opener_head[p];
+                for (; k != NONE; k = opener_next[k]) {
+                        bool lambda = ast_type(nodes[k]) == ANT_LAMBDA;
+                        emit_op(&c, lambda ? OP_CLOSURE : OP_THUNK, 0);
+                        patch[k] = c.code.size - 1;
+                }
+
+                AstVal val;
+                switch (ast_unpack(nodes, p, &val)) {
+                case ANT_VAR:
+                        // A lambda's parameter slot is not code.
+                        if (p + 1 < size &&
+                            ast_type(nodes[p + 1]) == ANT_LAMBDA)
+                                continue;
+                        emit_op(&c, OP_PUSH_VAR, val);
+                        continue;
+                case ANT_BOUND:
+                        emit_op(&c,
+                                is_arg(nodes, size, p) ? OP_SHARE : OP_ACCESS,
+                                val);
+                        continue;
+                case ANT_LAMBDA:
+                        emit_return(&c, patch[p]);
+                        continue;
+                case ANT_CALL:
+                        if (ast_type(nodes[p - 1]) == ANT_CALL)
+                                emit_return(&c, patch[p - 1]);
+                        emit_op(&c, OP_APPLY, 0);
+                        continue;
+                }
+        }
+        emit_op(&c, OP_HALT, 0);
+
+        free(first);
+        return c.code;
+}
+
+// ------------------------------------------------------------------
+
+bool vm_reserve_slow(Vm *vm)
+{
+        return heap_reserve_cells(&vm->heap, 2) &&
+               heap_reserve_vec(&vm->heap, (void **)&vm->vals,
+                                &vm->vals_alloced, sizeof(Thunk *),
+                                vm->nvals + 1) &&
+               heap_reserve_vec(&vm->heap, (void **)&vm->frames,
+                                &vm->frames_alloced, sizeof(VmFrame),
+                                vm->nframes + 1);
+}
+
+// Threaded dispatch: each instruction ends by jumping straight to the next
+// one's handler, rather than going back around a loop to a switch.
+EvalStatus vm_interpret(Vm *vm)
+{
+        static const void *const handlers[NOPCODES] = {
+            [OP_HALT] = &&halt,
+            [OP_PUSH_VAR] = &&push_var,
+            [OP_ACCESS] = &&access,
+            [OP_SHARE] = &&share,
+            [OP_CLOSURE] = &&closure,
+            [OP_THUNK] = &&thunk,
+            [OP_APPLY] = &&apply,
+            [OP_TAIL_APPLY] = &&tail_apply,
+            [OP_RETURN] = &&return_,
+        };
+        const int32_t *code = vm->code;
+        uint32_t pc;
+
+#define DISPATCH()                                                             \
+        do {                                                                   \
+                if (!vm_reserve(vm))                                           \
+                        return EVAL_OUT_OF_MEMORY;                             \
+                if (vm->steps >= vm->max_steps)                                \
+                        return EVAL_OUT_OF_STEPS;                              \
+                vm->steps++;                                                   \
+                pc = vm->pc;                                                   \
+                goto *handlers[code[pc]];                                      \
+        } while (0)
+
+        DISPATCH();
+push_var:
+        vm_push_var(vm, code[pc + 1], pc + 2);
+        DISPATCH();
+access:
+        vm_access(vm, code[pc + 1], pc + 2);
+        DISPATCH();
+share:
+        vm_share(vm, code[pc + 1], pc + 2);
+        DISPATCH();
+closure:
+        vm_closure(vm, code[pc + 1], pc + 2);
+        DISPATCH();
+thunk:
+        vm_thunk(vm, code[pc + 1], pc + 2);
+        DISPATCH();
+apply:
+        vm_apply(vm, false, pc + 1);
+        DISPATCH();
+tail_apply:
+        vm_apply(vm, true, pc + 1);
+        DISPATCH();
+return_:
+        vm_return(vm);
+        DISPATCH();
+halt:
+        return EVAL_NORMAL_FORM;
+#undef DISPATCH
+}
+
+// ------------------------------------------------------------------
+// Readback works as in lazy.c, with the same frames, except that evaluation
+// is done by calling `run` on the vm, which returns to the HALT at pc 0.
+
+typedef struct {
+        Vm *vm;
+        VmRunner run;
+        Stack frames;
+        NodeVec *out;
+        uint32_t level;
+} Reader;
+
+// Evaluate the code at `pc` in `env`, then pop the value it returns into *pv.
+static EvalStatus run_to_halt(Reader *r, uint32_t pc, Env *env, Thunk **pv)
+{
+        Vm *vm = r->vm;
+        vm->frames[vm->nframes++] = (VmFrame){VM_HALT, NULL, NULL};
+        vm->pc = pc;
+        vm->env = env;
+        EvalStatus status = r->run(vm);
+        if (status == EVAL_NORMAL_FORM)
+                *pv = vm_pop(vm);
+        return status;
+}
+
+// Read back the value `v`.  Leaves *pv set to the value of a closure's body
+// (which then has to be read back in turn), or to NULL.
+static EvalStatus read_value(Reader *r, Thunk *v, Thunk **pv)
+{
+        Vm *vm = r->vm;
+        uint32_t nargs = 0;
+        *pv = NULL;
+        switch ((ThunkState)v->state) {
+        case THUNK_CLOSURE:
+                push(&r->frames, FRAME_LAMBDA, -1, NULL);
+                Thunk *var =
+                    new_thunk(&vm->heap, THUNK_LEVEL, r->level++, NULL);
+                Env *env = new_env(&vm->heap, var, v->env);
+                return run_to_halt(r, v->n, env, pv);
+        case THUNK_APP:
+                for (Thunk *h = v; h->state == THUNK_APP; h = h->app.fun)
+                        nargs++;
+                if (!reserve_frames(&vm->heap, &r->frames, nargs))
+                        return EVAL_OUT_OF_MEMORY;
+                for (; v->state == THUNK_APP; v = v->app.fun)
+                        push(&r->frames, FRAME_READ, 0, v->app.arg);
+                break;
+        case THUNK_FREE:
+        case THUNK_LEVEL:
+                break;
+        // LCOV_EXCL_START
+        case THUNK_DELAYED:
+        case THUNK_BLACKHOLE:
+                DIE_LCOV_EXCL_LINE("Reading back unevaluated thunk.");
+        case THUNK_NUM:
+                DIE_LCOV_EXCL_LINE("Native number outside --church.");
+                // LCOV_EXCL_STOP
+        }
+
+        if (v->state == THUNK_FREE)
+                emit(r->out, ANT_VAR, v->n);
+        else
+                emit(r->out, ANT_BOUND, r->level - v->n - 1);
+        return EVAL_NORMAL_FORM;
+}
+
+// Pop a readback frame, setting *pv to the next value to read back (if any).
+static EvalStatus read_next(Reader *r, Thunk **pv)
+{
+        Vm *vm = r->vm;
+        Frame f = pop(&r->frames);
+        switch ((FrameKind)f.kind) {
+        case FRAME_LAMBDA:
+                emit(r->out, ANT_VAR, f.n);
+                emit(r->out, ANT_LAMBDA, 0);
+                r->level--;
+                return EVAL_NORMAL_FORM;
+        case FRAME_CALL:
+                emit(r->out, ANT_CALL, r->out->size - f.n);
+                return EVAL_NORMAL_FORM;
+        case FRAME_READ:
+                push(&r->frames, FRAME_CALL, r->out->size, NULL);
+                *pv = f.thunk;
+                if (f.thunk->state != THUNK_DELAYED)
+                        return EVAL_NORMAL_FORM;
+                // Evaluate it, with an update frame returning to the HALT.
+                vm_enter(vm, f.thunk, VM_HALT);
+                EvalStatus status = r->run(vm);
+                if (status == EVAL_NORMAL_FORM)
+                        *pv = vm_pop(vm);
+                return status;
+        // LCOV_EXCL_START
+        case FRAME_ARG:
+        case FRAME_UPDATE:
+        case FRAME_RESUME:
+                break;
+        }
+        return DIE_LCOV_EXCL_LINE("Eval frame %u on the readback stack.",
+                                  f.kind);
+        // LCOV_EXCL_STOP
+}
+
+EvalStatus vm_normalize(Vm *vm, VmRunner run, NodeVec *out)
+{
+        Reader r = {.vm = vm, .run = run, .out = out};
+        Thunk *v = NULL;
+        vm->pc = VM_ENTRY;
+        EvalStatus status = run(vm);
+        if (status == EVAL_NORMAL_FORM)
+                v = vm_pop(vm);
+
+        while (status == EVAL_NORMAL_FORM && (v || r.frames.depth)) {
+                if (!vm_reserve(vm) ||
+                    !reserve_frames(&vm->heap, &r.frames, 2) ||
+                    !reserve_nodes(&vm->heap, out, 2)) {
+                        status = EVAL_OUT_OF_MEMORY;
+                        break;
+                }
+                if (vm->steps >= vm->max_steps) {
+                        status = EVAL_OUT_OF_STEPS;
+                        break;
+                }
+                vm->steps++;
+                status = v ? read_value(&r, v, &v) : read_next(&r, &v);
+        }
+        free(r.frames.frames);
+        return status;
+}
+
+void vm_free(Vm *vm)
+{
+        heap_free(&vm->heap);
+        free(vm->vals);
+        free(vm->frames);
+}
+
+// ------------------------------------------------------------------
+
+int act_eval_vm(FILE *oot, const Ast *ast, const EvalBudget *budget)
+{
+        EvalBudget b = eval_budget_or_default(budget, default_budget);
+        AstIdx size;
+        const AstNode *nodes = ast_postfix(ast, &size);
+        Bytecode code = compile_bytecode(nodes, size);
+        Vm vm = {
+            .code = code.words,
+            .heap = {.max_bytes = b.max_bytes},
+            .max_steps = b.max_steps,
+        };
+        NodeVec out = {0};
+
+        EvalStatus status = EVAL_OUT_OF_MEMORY;
+        if (free_index_env(&vm.heap, nodes, size, &vm.env))
+                status = vm_normalize(&vm, vm_interpret, &out);
+        if (status == EVAL_NORMAL_FORM)
+                unparse_postfix(oot, out.nodes, out.size);
+        int nerr = report_eval_failure(status, &b, vm.steps);
+
+        free(out.nodes);
+        vm_free(&vm);
+        free(code.words);
+        return nerr;
+}
+
+int act_dump_bytecode(FILE *oot, const Ast *ast)
+{
+        AstIdx size;
+        const AstNode *nodes = ast_postfix(ast, &size);
+        Bytecode code = compile_bytecode(nodes, size);
+        for (uint32_t pc = 0; pc < code.size;
+             pc += bytecode_width(code.words, pc)) {
+                int32_t op = code.words[pc], operand = 0;
+                if (bytecode_width(code.words, pc) == 2)
+                        operand = code.words[pc + 1];
+                fprintf(oot, "%04u %s", pc, op_names[op]);
+                switch ((OpCode)op) {
+                case OP_PUSH_VAR:
+                        fprintf(oot, " %c", 'a' + operand);
+                        break;
+                case OP_ACCESS:
+                case OP_SHARE:
+                        fprintf(oot, " %d", operand + 1);
+                        break;
+                case OP_CLOSURE:
+                case OP_THUNK:
+                        fprintf(oot, " %d", operand);
+                        break;
+                case OP_HALT:
+                case OP_APPLY:
+                case OP_TAIL_APPLY:
+                case OP_RETURN:
+                case NOPCODES:
+                        break;
+                }
+                fputc('\n', oot);
+        }
+        free(code.words);
+        return 0;
+}
@@ -0,0 +1,181 @@
+#ifndef VM_2026_10_16_H
+#define VM_2026_10_16_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "eval.h"
+#include "machine.h"
+
+// A bytecode version of the call-by-need machine in lazy.c.  The program is
+// compiled from its post-fix AstNode array, which is already almost a stack
+// machine program:
+//
+//        VAR x       ->  PUSH_VAR x
+//        BOUND n     ->  ACCESS n      (or SHARE n when it is an argument)
+//        [x]BODY     ->  CLOSURE len  BODY  RETURN
+//        (FUN ARG)   ->  FUN  THUNK len  ARG  RETURN  APPLY
+//
+// except that arguments which are already values (variables and lambdas) are
+// pushed directly, rather than being wrapped in a THUNK.  An APPLY followed by
+// a RETURN becomes a TAIL_APPLY, which doesn't push a frame.
+//
+// Code is an array of int32_t words, an opcode followed by its operand (if it
+// has one).  Word 0 is always a HALT, so that a frame returning to pc 0 stops
+// the machine, and the program itself starts at VM_ENTRY.
+
+typedef enum
+{
+        OP_HALT,       // Stop: the top of the stack is a value in WHNF.
+        OP_PUSH_VAR,   // tok: Push the free variable `tok`.
+        OP_ACCESS,     // n: Push the value of de Bruijn var n (forcing it).
+        OP_SHARE,      // n: Push de Bruijn var n, unforced, as an argument.
+        OP_CLOSURE,    // len: Push a closure of the next len words, skip them.
+        OP_THUNK,      // len: Push a thunk of the next len words, skip them.
+        OP_APPLY,      // Pop an argument and a function, and call it.
+        OP_TAIL_APPLY, // APPLY, but the caller's frame is re-used.
+        OP_RETURN,     // Pop a frame and return to it, updating its thunk.
+        NOPCODES,
+} OpCode;
+
+#define VM_HALT 0
+#define VM_ENTRY 1
+
+typedef struct {
+        int32_t *words;
+        uint32_t size;
+        uint32_t alloced;
+} Bytecode;
+
+// Compile `nodes[0:size]`, an Ast in post-fix order.  The result must be
+// released with free(code.words).
+extern Bytecode compile_bytecode(const AstNode *nodes, uint32_t size);
+
+// Returns the number of words in the instruction at code[pc].
+extern uint32_t bytecode_width(const int32_t *code, uint32_t pc);
+
+// ------------------------------------------------------------------
+
+typedef struct {
+        uint32_t pc;
+        Env *env;
+        Thunk *update;
+} VmFrame;
+
+typedef struct Vm Vm;
+struct Vm {
+        const int32_t *code;
+        uint32_t pc;
+        Env *env;
+
+        Thunk **vals;
+        uint32_t nvals;
+        uint32_t vals_alloced;
+
+        VmFrame *frames;
+        uint32_t nframes;
+        uint32_t frames_alloced;
+
+        Heap heap;
+        uint64_t steps;
+        uint64_t max_steps;
+};
+
+// Something that runs `vm` from vm->pc until it reaches a HALT (returning
+// EVAL_NORMAL_FORM) or the budget runs out.
+typedef EvalStatus (*VmRunner)(Vm *vm);
+
+// The bytecode interpreter.
+extern EvalStatus vm_interpret(Vm *vm);
+
+// Use `run` to find the normal form of the program in vm->code, by evaluating
+// it and then reading back the result into `out`.
+extern EvalStatus vm_normalize(Vm *vm, VmRunner run, NodeVec *out);
+
+extern void vm_free(Vm *vm);
+
+// Make sure there is room for any one instruction to run.
+extern bool vm_reserve_slow(Vm *vm);
+static inline bool vm_reserve(Vm *vm)
+{
+        if (vm->heap.nfree >= 2 && vm->nvals < vm->vals_alloced &&
+            vm->nframes < vm->frames_alloced)
+                return true;
+        return vm_reserve_slow(vm);
+}
+
+// ------------------------------------------------------------------
+// The instructions.  Each takes its operand (if any) and the pc of the next
+// instruction, and sets vm->pc to wherever execution continues.
+
+static inline void vm_push(Vm *vm, Thunk *t) { vm->vals[vm->nvals++] = t; }
+
+static inline Thunk *vm_pop(Vm *vm) { return vm->vals[--vm->nvals]; }
+
+static inline void vm_enter(Vm *vm, Thunk *t, uint32_t next)
+{
+        vm->frames[vm->nframes++] = (VmFrame){next, vm->env, t};
+        t->state = THUNK_BLACKHOLE;
+        vm->env = t->env;
+        vm->pc = t->n;
+}
+
+static inline void vm_push_var(Vm *vm, int32_t tok, uint32_t next)
+{
+        vm_push(vm, new_thunk(&vm->heap, THUNK_FREE, tok, NULL));
+        vm->pc = next;
+}
+
+static inline void vm_access(Vm *vm, int32_t n, uint32_t next)
+{
+        Thunk *t = env_lookup(vm->env, n);
+        vm->pc = next;
+        if (t->state == THUNK_DELAYED)
+                return vm_enter(vm, t, next);
+        DIE_IF(t->state == THUNK_BLACKHOLE, "Re-entered a thunk.");
+        vm_push(vm, t);
+}
+
+static inline void vm_share(Vm *vm, int32_t n, uint32_t next)
+{
+        vm_push(vm, env_lookup(vm->env, n));
+        vm->pc = next;
+}
+
+static inline void vm_closure(Vm *vm, int32_t len, uint32_t next)
+{
+        vm_push(vm, new_thunk(&vm->heap, THUNK_CLOSURE, next, vm->env));
+        vm->pc = next + len;
+}
+
+static inline void vm_thunk(Vm *vm, int32_t len, uint32_t next)
+{
+        vm_push(vm, new_thunk(&vm->heap, THUNK_DELAYED, next, vm->env));
+        vm->pc = next + len;
+}
+
+static inline void vm_apply(Vm *vm, bool tail, uint32_t next)
+{
+        Thunk *arg = vm_pop(vm);
+        Thunk *fun = vm_pop(vm);
+        vm->pc = next;
+        if (fun->state != THUNK_CLOSURE) {
+                vm_push(vm, new_app(&vm->heap, fun, arg));
+                return;
+        }
+        if (!tail)
+                vm->frames[vm->nframes++] = (VmFrame){next, vm->env, NULL};
+        vm->env = new_env(&vm->heap, arg, fun->env);
+        vm->pc = fun->n;
+}
+
+static inline void vm_return(Vm *vm)
+{
+        VmFrame f = vm->frames[--vm->nframes];
+        if (f.update)
+                *f.update = *vm->vals[vm->nvals - 1];
+        vm->pc = f.pc;
+        vm->env = f.env;
+}
+
+#endif // VM_2026_10_16_H